@@ -25,6 +25,12 @@ pushd busybox
 	chmod +x ../filesystem/sbin/reboot
 popd
 
+# Build the installer, its media finder goes into the initrd
+
+pushd installer
+	./build.sh
+popd
+
 # Prepare initrd
 
 pushd filesystem
@@ -36,6 +42,7 @@ pushd filesystem
 	cp ../supplement/rc ./etc/init.d/rc
 	cp ../supplement/findcd.sh ./
 	cp ../supplement/setenv.sh ./
+	cp ../installer/findcd ./bin/
 	cp "$PREFIX/share/terminfo/l/linux" ./usr/lib/terminfo/l/linux
 	cp -r ../supplement/firmware/* ./lib/firmware
 	ln -s sbin/init init
@@ -51,6 +58,11 @@ popd
 pushd linux
 	rm -f .config && cp ../buildscripts/linux_config.flp .config && make -j8 bzImage
    	cp arch/x86/boot/bzImage ../bzImage.flp
+	# The floppy kernel carries the initrd. It has to fit on the disk after the boot sector.
+	if [ $(stat -c %s ../bzImage.flp) -gt $((1474560 - 512)) ]; then
+		echo "bzImage.flp is $(stat -c %s ../bzImage.flp) bytes, too big for a 1.44M floppy"
+		exit 1
+	fi
 	rm -f .config && cp ../buildscripts/linux_config.cd .config && make -j8 bzImage
 	cp arch/x86/boot/bzImage ../bzImage.cd
 	rm -f .config && cp ../buildscripts/linux_config.efi .config && make -j8 bzImage
@@ -74,10 +86,6 @@ pushd tiny-floppy-bootloader
 	./build.sh ../bzImage.cd cdrom.img 2949120		# CD-ROM / 2.88M boot
 popd
 
-pushd installer
-	./build.sh
-popd
-
 pushd dosflop
 	./build.sh
 popd
@@ -6,6 +6,9 @@ set -e 1
 
 ANBUI_FILES=$(anbui/get_build_files.sh)
 
-$CC -DMAPPEDFILE_MULTITHREAD -Os -s -g0 --static -Wall -Wextra -pedantic -Werror -pthread $ANBUI_FILES install.c install_disk.c install_util.c install_hwquirks.c util.c util_disk.c mappedfile_mt.c main.c -lpthread -olunmercy
+$CC -DMAPPEDFILE_MULTITHREAD -Os -s -g0 --static -Wall -Wextra -pedantic -Werror -pthread $ANBUI_FILES install.c install_answer.c install_chunks.c install_disk.c install_drivers.c install_util.c install_hwquirks.c install_manifest.c install_media.c install_patch.c install_probe.c install_progress.c install_steps.c install_trace.c install_verify.c install_writer.c util.c util_disk.c util_parttable.c mappedfile_mt.c main.c -lpthread -olunmercy
 
-ls -l lunmercy*
+# Media finder for the floppy initrd, no UI so it stays small
+$CC -DQI_NO_UI -Os -s -g0 --static -ffunction-sections -fdata-sections -Wl,--gc-sections -Wall -Wextra -pedantic -Werror -pthread findcd.c install_media.c util.c util_disk.c util_parttable.c -lpthread -ofindcd
+
+ls -l lunmercy* findcd
@@ -0,0 +1,31 @@
+/*
+ * LUNMERCY - Install media finder for the initrd
+ *
+ * Used by findcd.sh at boot: finds & mounts the install media, prints its device.
+ * Only the media discovery and the disk utilities are built in, no UI, so it stays small
+ * enough for the floppy kernel. The installer itself comes from the media.
+ *
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include "install.h"
+
+int main(int argc, char *argv[]) {
+    char sourceDev[PATH_MAX];
+
+    if (argc != 2) {
+        printf("Usage: %s <mount path>\n", argv[0]);
+        return -1;
+    }
+
+    if (!inst_findSourceMedia(argv[1], sourceDev, sizeof(sourceDev))) {
+        return -1;
+    }
+
+    printf("%s\n", sourceDev);
+    return 0;
+}
@@ -21,6 +21,8 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <locale.h>
+#include <inttypes.h>
+#include <linux/msdos_fs.h>
 
 #include "qi_assert.h"
 #include "mappedfile.h"
@@ -37,24 +39,76 @@
 #define MERCYPAK_FILE_DESCRIPTOR_SIZE (sizeof(inst_MercyPakFileDescriptor) - sizeof(int))
 // -sizeof(uint32_t) because the filesize is not part of the descriptor read from the mercypak v2 file
 #define MERCYPAK_V2_FILE_DESCRIPTOR_SIZE ((MERCYPAK_FILE_DESCRIPTOR_SIZE) - sizeof(uint32_t))
-#define MERCYPAK_V2_MAX_IDENTICAL_FILES (16)
 #define MERCYPAK_STRING_MAX (256)
 
 #define MERCYPAK_V1_MAGIC "ZIEG"
 #define MERCYPAK_V2_MAGIC "MRCY"
+#define MERCYPAK_V3_MAGIC "MRC3"        // V2 with an extended header, see qi_unpackReadExtendedHeader
+
+#define MERCYPAK_DATA_INLINE (0)        // File data locations of V3 files
+#define MERCYPAK_DATA_POOL   (1)
+#define MERCYPAK_CHUNKED_ENTRY (0x80)   // Flag in the identical file count of chunked V3 entries, see install_chunks.c
 
 
 #define INST_SYSROOT_FILE "FULL.866"
 #define INST_CREGFIX_FILE "CREGFIX.866"
 #define INST_LBA64_FILE   "LBA64.866"
 #define INST_DRIVER_FILE  "DRIVER.866"
-#define INST_SLOWPNP_FILE "SLOWPNP.866"
+#define INST_DRIVER_INDEX "DRIVER.IDX"
+#define INST_SLOWPNP_FILE "SLOWPNP.DIF"    // Patch for the registry in INST_FASTPNP_FILE
 #define INST_FASTPNP_FILE "FASTPNP.866"
+#define INST_POOL_FILE    "osroots/POOL.866" // File data shared by the variants of multi-variant media
+
+#define INST_LOG_FILE     "QI_INST.LOG"
+#define INST_PERF_FILE    "QI_PERF.LOG"
+#define INST_PERF_ECHO_ENV "QI_PERF_ECHO"  // If set, the performance trace is also printed when the installer exits
+#define INST_ANSWER_FILE  "QIANSWER.INI"
+#define INST_LAST_VARIANT_FILE "QILAST.TXT" // Variant picked last time, kept on writable install media
+#define INST_ANSWER_CMDLINE "/proc/cmdline"
+
+// Parts of the target that install steps read & write, so the scheduler knows what may run side by side
+#define QI_RES_SYSTEM               (1 << 0)    // Root and WINDOWS directories: OS files, registry & patches
+#define QI_RES_DRIVERS              (1 << 1)    // Integrated driver INFs and the cabinet directory
+#define QI_RES_DRIVERS_EXTRA        (1 << 2)    // DRIVER.EX tree
+#define QI_RES_EXTRAS               (1 << 3)    // EXTRAS tree
+#define QI_RES_EFI                  (1 << 4)    // EFI boot files
+
+#define QI_MAX_CONCURRENT_STEPS     (3)
+#define QI_STEP_MIN_READAHEAD       (16 __MB)   // Per running step, below that steps run one by one
+
+#define QI_UNATTENDED_READ_RETRIES  (8)         // Read errors retried at one position before an unattended installation gives up
+#define QI_READ_ERROR_SLOTS         (8)         // Files whose failing read position is tracked at the same time
+#define QI_UNATTENDED_MAX_PARTITION (128 __GB)  // Largest partition created for "partition=wholedisk"
 
 typedef bool (*qi_OptionFunc)(size_t progressBarIndex);
 
 static qi_InstallContext qi_wizData;
 
+// Where an unattended read keeps failing, so retries are counted per position and not per installation
+typedef struct {
+    MappedFile *file;                       // File with the failing read, NULL if the slot is free
+    size_t position;                        // Read position the error occurred at
+    size_t retries;                         // Retries at that position so far
+    uint64_t lastUse;                       // For reusing the least recently failing slot
+} qi_ReadErrorSlot;
+
+static pthread_mutex_t qi_readErrorLock = PTHREAD_MUTEX_INITIALIZER;
+static qi_ReadErrorSlot qi_readErrorSlots[QI_READ_ERROR_SLOTS];
+static uint64_t qi_readErrorCounter = 0;
+
+static inline bool qi_isUnattended(void) {
+    return qi_wizData.answers != NULL;
+}
+
+// Reports why an unattended installation can't go on
+static qi_WizardAction qi_unattendedFail(const char *reason) {
+    inst_statusPrintf("state=failed reason=\"%s\"", reason);
+    return WIZ_EXIT_ERROR;
+}
+
+// Progress bars other than the preparation one count kilobytes, so the progress display can show throughput
+#define QI_PROGRESS_KB(bytes)       ((uint32_t) (((uint64_t) (bytes) + 1023) / 1024))
+#define QI_PROGRESS_FIRST_DATA_BAR  (1)
 
 /* Gets a MercyPak string (8 bit length + n chars) into dst. Must be a buffer of >= 256 bytes size. */
 static inline bool inst_getMercyPakString(MappedFile *file, char *dst) {
@@ -82,17 +136,40 @@ static bool qi_unpackCreateDirectories(MappedFile *file, uint32_t dirCount, char
     return success;
 }
 
+// Reads past file data that isn't going to be written
+static bool qi_unpackSkipData(MappedFile *file, size_t len) {
+    uint8_t *buf = malloc(UTIL_FILE_COPY_BUFFER_SIZE);
+    QI_FATAL(buf != NULL, "Failed to allocate skip buffer");
+
+    bool success = true;
+
+    while (success && len > 0) {
+        size_t toRead = MIN(len, UTIL_FILE_COPY_BUFFER_SIZE);
+        success = mappedFile_read(file, buf, toRead);
+        len -= toRead;
+    }
+
+    free(buf);
+    return success;
+}
+
+// Gets how much of a MercyPak file and the content pool part with its file data has been read
+static size_t qi_unpackGetPosition(MappedFile *file, MappedFile *data) {
+    return mappedFile_getPosition(file) + (data != file ? mappedFile_getPosition(data) : 0);
+}
+
 // Unpacks all files from an opened and header-parsed MercyPak V1 file
 // destPath is a buffer to hold the destination path name
 // destPathAppend is a pointer to within that buffer where the mount point path stops and the target file name starts
 // The buffer size starting at the append pointer needs to be MERCYPAK_STRING_MAX + 1 bytes
-static bool qi_unpackExtractAllFilesV1(MappedFile *file, uint32_t fileCount, char *destPath, char *destPathAppend, size_t progressBarIndex) {
+// Files the filter doesn't want are skipped, the file the patch is for is patched while it's unpacked
+static bool qi_unpackExtractAllFilesV1(MappedFile *file, inst_Writer *writer, inst_DriverFilter *filter, inst_Patch *patch, uint32_t fileCount, char *destPath, char *destPathAppend, size_t progressBarIndex) {
     inst_MercyPakFileDescriptor fileToWrite;
     bool success = true;
 
-    for (uint32_t f = 0; f < fileCount; f++) {
+    for (uint32_t f = 0; success && f < fileCount; f++) {
 
-        ad_progressBoxMultiUpdate(qi_wizData.progress, progressBarIndex, mappedFile_getPosition(file));
+        inst_progressUpdateFiles(progressBarIndex, QI_PROGRESS_KB(mappedFile_getPosition(file)), f);
 
         /* Mercypak file metadata (see mercypak.txt) */
 
@@ -101,15 +178,33 @@ static bool qi_unpackExtractAllFilesV1(MappedFile *file, uint32_t fileCount, cha
 
         success &= mappedFile_read(file, &fileToWrite, MERCYPAK_FILE_DESCRIPTOR_SIZE);
 
+        if (!inst_driverFilterWants(filter, destPathAppend)) {
+            success &= qi_unpackSkipData(file, fileToWrite.fileSize);
+            continue;
+        }
+
         int outfd = open(destPath,  O_WRONLY | O_CREAT | O_TRUNC);
         QI_ASSERT(outfd >= 0);
 
-        success &= mappedFile_copyToFiles(file, 1, &outfd, fileToWrite.fileSize);
+        char *outPath = strdup(destPath);
+        QI_ASSERT(outPath != NULL);
+
+        bool patched = inst_patchAppliesTo(patch, destPathAppend, fileToWrite.fileSize);
+        uint32_t packedSize = fileToWrite.fileSize;
+
+        if (patched) {
+            fileToWrite.fileSize = (uint32_t) inst_patchGetResultSize(patch);
+        }
+
+        inst_WriterFile *out = inst_writerFileCreate(writer, 1, &outfd, &fileToWrite, &outPath, fileToWrite.fileSize);
 
-        success &= util_setDosFileTime(outfd, fileToWrite.fileDate, fileToWrite.fileTime);
-        success &= util_setDosFileAttributes(outfd, fileToWrite.fileFlags);
+        if (patched) {
+            success &= inst_patchApply(patch, writer, out, file);
+        } else {
+            success &= inst_writerCopyFromMappedFile(writer, out, file, packedSize);
+        }
 
-        close(outfd);
+        inst_writerFileFinish(writer, out);
     }
 
     return success;
@@ -119,11 +214,15 @@ static bool qi_unpackExtractAllFilesV1(MappedFile *file, uint32_t fileCount, cha
 // destPath is a buffer to hold the destination path name
 // destPathAppend is a pointer to within that buffer where the mount point path stops and the target file name starts
 // The buffer size starting at the append pointer needs to be MERCYPAK_STRING_MAX + 1 bytes
-static bool qi_unpackExtractAllFilesV2(MappedFile *file, uint32_t fileCount, char *destPath, char *destPathAppend, size_t progressBarIndex) {
+// Files the filter doesn't want are skipped, the file the patch is for is patched while it's unpacked
+// The file data is read from 'data', which is either the file itself or the content pool part with its file data
+// Chunked entries are always in the file itself, chunkCache is needed for them (NULL if the file has none)
+static bool qi_unpackExtractAllFilesV2(MappedFile *file, MappedFile *data, inst_ChunkCache *chunkCache, inst_Writer *writer, inst_DriverFilter *filter, inst_Patch *patch, uint32_t fileCount, char *destPath, char *destPathAppend, size_t progressBarIndex) {
     /* Handle mercypak v2 pack file with redundant files optimized out */
 
     inst_MercyPakFileDescriptor    *filesToWrite            = calloc(MERCYPAK_V2_MAX_IDENTICAL_FILES, sizeof(inst_MercyPakFileDescriptor));
     int                            *fileDescriptorsToWrite  = calloc(MERCYPAK_V2_MAX_IDENTICAL_FILES, sizeof(int));
+    char                           *pathsToWrite[MERCYPAK_V2_MAX_IDENTICAL_FILES];
     uint8_t                         identicalFileCount      = 0;
     bool                            success                 = true;
 
@@ -131,44 +230,76 @@ static bool qi_unpackExtractAllFilesV2(MappedFile *file, uint32_t fileCount, cha
     QI_FATAL(fileDescriptorsToWrite != NULL,    "Error allocating MercyPak V2 file descriptors.");
 
     for (uint32_t f = 0; f < fileCount;) {
-        ad_progressBoxMultiUpdate(qi_wizData.progress, progressBarIndex, mappedFile_getPosition(file));
+        inst_progressUpdateFiles(progressBarIndex, QI_PROGRESS_KB(qi_unpackGetPosition(file, data)), f);
 
         success &= mappedFile_getUInt8(file, &identicalFileCount);
 
+        bool chunked = (identicalFileCount & MERCYPAK_CHUNKED_ENTRY) != 0;
+        identicalFileCount &= (uint8_t) ~MERCYPAK_CHUNKED_ENTRY;
+
         QI_ASSERT(identicalFileCount <= MERCYPAK_V2_MAX_IDENTICAL_FILES);
+        success &= !chunked || chunkCache != NULL;
 
-        // For every output file for this input file, open a write file descriptor
+        // For every wanted output file for this input file, open a write file descriptor
+        uint32_t openedCount = 0;
         for (uint32_t subFile = 0; success && subFile < identicalFileCount; subFile++) {
+            inst_MercyPakFileDescriptor descriptor;
+
             success &= inst_getMercyPakString(file, destPathAppend);
             util_stringReplaceChar(destPathAppend, '\\', '/');
+            success &= mappedFile_read(file, &descriptor, MERCYPAK_V2_FILE_DESCRIPTOR_SIZE);
+
+            if (!success || !inst_driverFilterWants(filter, destPathAppend)) {
+                continue;
+            }
 
-            fileDescriptorsToWrite[subFile] = open(destPath,  O_WRONLY | O_CREAT | O_TRUNC);
+            fileDescriptorsToWrite[openedCount] = open(destPath,  O_WRONLY | O_CREAT | O_TRUNC);
 
-            success &= (fileDescriptorsToWrite[subFile] > 0);
-            success &= mappedFile_read(file, &filesToWrite[subFile], MERCYPAK_V2_FILE_DESCRIPTOR_SIZE);
+            success &= (fileDescriptorsToWrite[openedCount] > 0);
+            if (fileDescriptorsToWrite[openedCount] > 0) {
+                filesToWrite[openedCount] = descriptor;
+                pathsToWrite[openedCount] = strdup(destPath);
+                QI_ASSERT(pathsToWrite[openedCount] != NULL);
+                openedCount++;
+            }
         }
 
-        if (!success) break;
+        if (!success) {
+            // Just in case
+            for (uint32_t subFile = 0; subFile < openedCount; subFile++) {
+                close(fileDescriptorsToWrite[subFile]);
+                free(pathsToWrite[subFile]);
+            }
+            break;
+        }
         
         uint32_t fileSize = 0;
         success &= mappedFile_getUInt32(file, &fileSize);
 
-        success &= mappedFile_copyToFiles(file, identicalFileCount, fileDescriptorsToWrite, fileSize);
+        f += identicalFileCount;
 
-        for (uint32_t subFile = 0; success && subFile < identicalFileCount; subFile++) {
-            success &= util_setDosFileTime(fileDescriptorsToWrite[subFile], filesToWrite[subFile].fileDate, filesToWrite[subFile].fileTime);
-            success &= util_setDosFileAttributes(fileDescriptorsToWrite[subFile], filesToWrite[subFile].fileFlags);
-            close(fileDescriptorsToWrite[subFile]);
+        // None of the copies are wanted
+        if (openedCount == 0) {
+            success &= chunked ? inst_chunkCacheSkip(chunkCache, file) : qi_unpackSkipData(data, fileSize);
+            if (!success) break;
+            continue;
         }
 
-        f += identicalFileCount;
-    }
+        bool patched = !chunked && inst_patchAppliesTo(patch, destPathAppend, fileSize);
 
-    // Just in case
-    if (!success) {
-        for (uint32_t subFile = 0; subFile < MERCYPAK_V2_MAX_IDENTICAL_FILES; subFile++) {
-            close(fileDescriptorsToWrite[subFile]);
+        // From here on, the writer owns the file descriptors & paths and applies times & attributes when it's done
+        inst_WriterFile *out = inst_writerFileCreate(writer, openedCount, fileDescriptorsToWrite, filesToWrite, pathsToWrite,
+            patched ? inst_patchGetResultSize(patch) : fileSize);
+
+        if (chunked) {
+            success &= inst_chunkCacheUnpack(chunkCache, writer, out, file, fileSize);
+        } else if (patched) {
+            success &= inst_patchApply(patch, writer, out, data);
+        } else {
+            success &= inst_writerCopyFromMappedFile(writer, out, data, fileSize);
         }
+
+        inst_writerFileFinish(writer, out);
     }
 
     free(filesToWrite);
@@ -176,105 +307,374 @@ static bool qi_unpackExtractAllFilesV2(MappedFile *file, uint32_t fileCount, cha
     return success;
 }
 
-// Unpack an already opened Mercypak File. installPath = destination, progressBarIndex = progress bar in the main box to update
-static bool qi_unpackGeneric(MappedFile *file, const char *installPath, size_t progressBarIndex) {
-    char fileHeader[5] = {0};
-    char *destPath = calloc(1, strlen(installPath) + MERCYPAK_STRING_MAX + 1);   // Full path of destination dir/file, the +256 is because mercypak strings can only be 255 chars max
-    char *destPathAppend = destPath + strlen(installPath) + 1;  // Pointer to first char after the base install path in the destination path + 1 for the extra "/" we're gonna append
+// Gets the memory budget for queued writes, i.e. the part of the readahead memory not given to source data.
+// Steps running side by side share it.
+static size_t qi_getWriteQueueBudget(void) {
+    uint64_t budget = qi_wizData.readahead * (100 - qi_wizData.tuning.readaheadPercent) / 100;
+    // The OS root file was opened with the full readahead amount before the disk was probed, stay safe.
+    budget = MIN(budget, util_getProcSafeFreeMemory() / 4);
+    return (size_t) (budget / MAX(qi_wizData.stepConcurrency, 1));
+}
 
-    sprintf(destPath, "%s/", installPath);
+// Reads the extended header of a MercyPak V3 file, which follows the file count:
+// UINT16 size of the rest, UINT8 entry order policy (0 = as found, 1 = install locality, 2 = content pool order),
+// UINT8 file data location (0 = inline, 1 = content pool), [with the content pool: UINT16 range count, then UINT32
+// offset and UINT32 length per range, the file data is all those ranges of INST_POOL_FILE one after the other],
+// UINT32 chunk cache size, UINT32 chunk cache entries (both 0 without chunked entries), [newer fields]
+// Fields this installer doesn't know about are skipped.
+static bool qi_unpackReadExtendedHeader(MappedFile *file, inst_MercyPakHeader *header) {
+    uint16_t size = 0;
+    uint8_t orderPolicy = 0;
+    uint8_t dataLocation = MERCYPAK_DATA_INLINE;
+    bool success = mappedFile_getUInt16(file, &size);
+
+    if (success && size >= sizeof(orderPolicy)) {
+        success &= mappedFile_getUInt8(file, &orderPolicy);
+        size -= sizeof(orderPolicy);
+    }
+
+    if (success && size >= sizeof(dataLocation)) {
+        success &= mappedFile_getUInt8(file, &dataLocation);
+        size -= sizeof(dataLocation);
+    }
+
+    if (success && dataLocation == MERCYPAK_DATA_POOL) {
+        uint16_t rangeCount = 0;
+
+        success = size >= sizeof(rangeCount)
+            && mappedFile_getUInt16(file, &rangeCount)
+            && rangeCount > 0
+            && size - sizeof(rangeCount) >= (size_t) rangeCount * 2 * sizeof(uint32_t);
+
+        if (!success) {
+            inst_logPrintf("MercyPak V3 file has invalid content pool ranges");
+            return false;
+        }
+
+        size -= sizeof(rangeCount) + rangeCount * 2 * sizeof(uint32_t);
+
+        header->poolRanges = calloc(rangeCount, sizeof(MappedFile_Range));
+        QI_FATAL(header->poolRanges != NULL, "Failed to allocate content pool ranges");
+        header->poolRangeCount = rangeCount;
+
+        for (uint16_t i = 0; success && i < rangeCount; i++) {
+            uint32_t offset = 0;
+            uint32_t length = 0;
+            success &= mappedFile_getUInt32(file, &offset);
+            success &= mappedFile_getUInt32(file, &length);
+            header->poolRanges[i].offset = offset;
+            header->poolRanges[i].length = length;
+        }
+    } else if (success && dataLocation != MERCYPAK_DATA_INLINE) {
+        inst_logPrintf("MercyPak V3 file has unknown file data location %u", (unsigned) dataLocation);
+        return false;
+    }
+
+    if (success && size >= 2 * sizeof(uint32_t)) {
+        success &= mappedFile_getUInt32(file, &header->chunkCacheSize);
+        success &= mappedFile_getUInt32(file, &header->chunkCacheEntries);
+        size -= 2 * sizeof(uint32_t);
+    }
+
+    if (success) {
+        inst_logPrintf("MercyPak V3 file, entry order policy %u, %zu content pool ranges, chunk cache %u bytes",
+            (unsigned) orderPolicy, header->poolRangeCount, (unsigned) header->chunkCacheSize);
+    }
+
+    return success && qi_unpackSkipData(file, size);
+}
 
+// Reads the header of an opened MercyPak file, up to the directories. Free it with qi_unpackFreeHeader.
+static bool qi_unpackReadHeader(MappedFile *file, inst_MercyPakHeader *header) {
+    char fileHeader[5] = {0};
     bool success = true;
-    uint32_t dirCount;
-    uint32_t fileCount;
+
+    memset(header, 0, sizeof(inst_MercyPakHeader));
 
     success &= mappedFile_read(file, (uint8_t*) fileHeader, 4);
-    success &= mappedFile_getUInt32(file, &dirCount);
-    success &= mappedFile_getUInt32(file, &fileCount);
+    success &= mappedFile_getUInt32(file, &header->dirCount);
+    success &= mappedFile_getUInt32(file, &header->fileCount);
 
     if (!success) {
         return false;
     }
 
-    // Check if we're unpacking a V2 file, which does redundancy stuff.
+    // Check if we're unpacking a V2 file, which does redundancy stuff. V3 files are V2 files with more header.
     bool isV1 = util_stringEquals(fileHeader, MERCYPAK_V1_MAGIC);
     bool isV2 = util_stringEquals(fileHeader, MERCYPAK_V2_MAGIC);
+    bool isV3 = util_stringEquals(fileHeader, MERCYPAK_V3_MAGIC);
+
+    QI_FATAL(isV1 || isV2 || isV3, "MercyPak File Version Error");
+
+    header->sharedData = isV2 || isV3;
+
+    return !isV3 || qi_unpackReadExtendedHeader(file, header);
+}
 
-    QI_FATAL(isV1 || isV2, "MercyPak File Version Error");
+static void qi_unpackFreeHeader(inst_MercyPakHeader *header) {
+    free(header->poolRanges);
+    header->poolRanges = NULL;
+    header->poolRangeCount = 0;
+}
+
+// Opens the part of the content pool with the file data of a MercyPak file. Returns NULL if its file data is inline.
+static MappedFile *qi_unpackOpenPool(const inst_MercyPakHeader *header, size_t readahead) {
+    if (header->poolRangeCount == 0) {
+        return NULL;
+    }
+
+    MappedFile *pool = mappedFile_openRanges(inst_getSourceFilePath(0, INST_POOL_FILE), readahead, qi_readErrorHandler,
+        header->poolRanges, header->poolRangeCount);
+
+    QI_FATAL(pool != NULL, "Could not open the content pool for reading");
+    return pool;
+}
+
+// Unpack an already opened and header-parsed Mercypak File. installPath = destination, progressBarIndex = progress bar in the main box to update
+// pool is the content pool part with the file data if the header says so (see qi_unpackOpenPool), else NULL.
+// filter selects the files to unpack, NULL unpacks everything. patch, if not NULL, is applied to the file it is for.
+static bool qi_unpackGeneric(MappedFile *file, const inst_MercyPakHeader *header, MappedFile *pool, const char *installPath, inst_DriverFilter *filter, inst_Patch *patch, size_t progressBarIndex) {
+    char *destPath = calloc(1, strlen(installPath) + MERCYPAK_STRING_MAX + 1);   // Full path of destination dir/file, the +256 is because mercypak strings can only be 255 chars max
+    char *destPathAppend = destPath + strlen(installPath) + 1;  // Pointer to first char after the base install path in the destination path + 1 for the extra "/" we're gonna append
+
+    sprintf(destPath, "%s/", installPath);
+
+    bool success = true;
+    MappedFile *data = (pool != NULL) ? pool : file;
+    size_t startPosition = qi_unpackGetPosition(file, data);
+    uint64_t startStallUs = mappedFile_getStallTimeUs(file) + (pool != NULL ? mappedFile_getStallTimeUs(pool) : 0);
+
+    QI_ASSERT((pool != NULL) == (header->poolRangeCount > 0));
 
     // Create all the directories
-    if (!qi_unpackCreateDirectories(file, dirCount, destPath, destPathAppend)) {
-        msg_directoryWarning();
+    if (!qi_unpackCreateDirectories(file, header->dirCount, destPath, destPathAppend)) {
+        if (qi_isUnattended()) {
+            inst_statusPrintf("warning=directories");
+        } else {
+            inst_uiLock();
+            msg_directoryWarning();
+            inst_uiUnlock();
+        }
+    }
+
+    // Chunked entries repeat chunks of the ones before them, which are kept in memory
+    inst_ChunkCache *chunkCache = NULL;
+
+    if (header->chunkCacheSize > 0) {
+        chunkCache = inst_chunkCacheCreate(header->chunkCacheSize, header->chunkCacheEntries);
+
+        if (chunkCache == NULL) {
+            free(destPath);
+            return false;
+        }
     }
 
     // Unpack all the files
-    ad_progressBoxSetMaxProgress(qi_wizData.progress, progressBarIndex, mappedFile_getFileSize(file));
+    inst_progressSetMax(progressBarIndex,
+        QI_PROGRESS_KB(mappedFile_getFileSize(file) + (pool != NULL ? mappedFile_getFileSize(pool) : 0)));
 
-    if (isV2) {
-        success = qi_unpackExtractAllFilesV2(file, fileCount, destPath, destPathAppend, progressBarIndex);
+    inst_Writer *writer = inst_writerCreate(&qi_wizData.tuning, qi_getWriteQueueBudget(), qi_wizData.verifier);
+
+    if (header->sharedData) {
+        success = qi_unpackExtractAllFilesV2(file, data, chunkCache, writer, filter, patch, header->fileCount, destPath, destPathAppend, progressBarIndex);
     } else {
-        success = qi_unpackExtractAllFilesV1(file, fileCount, destPath, destPathAppend, progressBarIndex);
+        success = qi_unpackExtractAllFilesV1(file, writer, filter, patch, header->fileCount, destPath, destPathAppend, progressBarIndex);
     }
 
-    ad_progressBoxMultiUpdate(qi_wizData.progress, progressBarIndex, mappedFile_getPosition(file));
+    success &= inst_writerDestroy(writer);
+    inst_chunkCacheDestroy(chunkCache);
+
+    inst_progressUpdateFiles(progressBarIndex, QI_PROGRESS_KB(qi_unpackGetPosition(file, data)), header->fileCount);
+    inst_traceAddIo(qi_unpackGetPosition(file, data) - startPosition, 0, 0);
+    inst_traceAddStall(mappedFile_getStallTimeUs(file) + (pool != NULL ? mappedFile_getStallTimeUs(pool) : 0) - startStallUs, 0);
 
     free(destPath);
     return success;
 }
 
-// Copy all files from sourceBase to targetBase.
-// fileCount is updated for every file copied
-// progressBarIndex = progress bar in the main box to update
-static bool qi_copyAllFilesInDirectoryRecursive(const char *sourceBase, const char *targetBase, uint32_t *fileCount, size_t progressBarIndex) {
-    struct dirent *e;
-    DIR *d = opendir(sourceBase);
-    util_returnOnNull(d, false);
+// Size classes for the copy throughput statistics in the install log
+static const struct {
+    const char *label;
+    uint64_t maxSize;
+} qi_copySizeClasses[] = {
+    { "< 64 KB",    64 __KB },
+    { "< 1 MB",     1 __MB },
+    { ">= 1 MB",    UINT64_MAX },
+};
+
+typedef struct {
+    size_t files;
+    uint64_t bytes;
+    uint64_t elapsedUs;
+} qi_CopyStats;
+
+// Queues one file of a tree copy to the writer. The source file's time stamp and, if it comes from FAT, its
+// attributes are carried over. Otherwise it's marked as archive, just like a DOS copy would.
+static bool qi_copyFileToWriter(inst_Writer *writer, const char *source, const char *target, uint64_t *size) {
+    int in = open(source, O_RDONLY);
+    int out = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    struct stat st;
+    bool success = (in >= 0) && (out >= 0) && (fstat(in, &st) == 0);
 
-    bool success = true;
+    if (!success) {
+        if (in >= 0) close(in);
+        if (out >= 0) close(out);
+        return false;
+    }
+
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    inst_MercyPakFileDescriptor descriptor = {0};
+    uint32_t attributes = 0;
+
+    descriptor.fileFlags = util_getDosFileAttributes(in, &attributes) ? (uint8_t) attributes : ATTR_ARCH;
+    descriptor.fileSize = (uint32_t) st.st_size;
+    util_unixTimeToDosTime(st.st_mtime, &descriptor.fileDate, &descriptor.fileTime);
 
-    if (!util_fileExists(targetBase)) {
-        success &= util_mkDir(targetBase, 0);        
+    char *path = strdup(target);
+    QI_ASSERT(path != NULL);
+
+    // From here on, the writer owns the target file descriptor
+    inst_WriterFile *file = inst_writerFileCreate(writer, 1, &out, &descriptor, &path, (size_t) st.st_size);
+    success = inst_writerCopyFromFd(writer, file, in, (size_t) st.st_size);
+    inst_writerFileFinish(writer, file);
+
+    close(in);
+    *size = (uint64_t) st.st_size;
+    return success;
+}
+
+// Copies a file tree from <source media>/source to <destination partition>/subdir, updating progress bar in the process
+// The progress bar counts kilobytes, so big files don't make it stall.
+static bool qi_copyFileTree(const char *source, const char *subdir, size_t progressBarIndex) {
+    char *sourceBase = strdup(inst_getSourceFilePath(0, source));
+    char *targetBase = strdup(inst_getTargetFilePath(qi_wizData.destination, subdir));
+    QI_FATAL(sourceBase != NULL && targetBase != NULL, "Failed to allocate path string");
+
+    inst_Manifest *manifest = inst_manifestCreate(sourceBase);
+    bool success = (manifest != NULL);
+
+    if (success) {
+        inst_progressSetMax(progressBarIndex, QI_PROGRESS_KB(manifest->totalBytes));
+        success = util_fileExists(targetBase) || util_mkDir(targetBase, 0);
     }
 
-    while (success && (e = readdir(d))) {
-        if (util_stringEquals(e->d_name, ".") || util_stringEquals(e->d_name, ".."))
-            continue;
+    for (size_t i = 0; success && i < manifest->dirCount; i++) {
+        char *newTarget = util_pathAppend(targetBase, manifest->dirs[i]);
+        QI_FATAL(newTarget != NULL, "Failed to allocate path string");
+        success = util_fileExists(newTarget) || util_mkDir(newTarget, 0);
+        free(newTarget);
+    }
 
-        char *newSource = util_pathAppend(sourceBase, e->d_name);
-        char *newTarget = util_pathAppend(targetBase, e->d_name);       
+    // Reads happen here in manifest order, the writer threads write in parallel
+    inst_Writer *writer = inst_writerCreate(&qi_wizData.tuning, qi_getWriteQueueBudget(), qi_wizData.verifier);
+    qi_CopyStats stats[util_arraySize(qi_copySizeClasses)] = {0};
+    uint64_t bytesCopied = 0;
+    uint64_t startUs = util_getMonotonicTimeUs();
 
+    for (size_t i = 0; success && i < manifest->fileCount; i++) {
+        char *newSource = util_pathAppend(sourceBase, manifest->files[i].path);
+        char *newTarget = util_pathAppend(targetBase, manifest->files[i].path);
         QI_FATAL(newSource != NULL && newTarget != NULL, "Failed to allocate path string");
 
-        if (util_isFile(newSource)) {
-            success &= util_fileCopy(newSource, newTarget);
-            *fileCount += 1;
-            ad_progressBoxMultiUpdate(qi_wizData.progress, progressBarIndex, *fileCount);
-        } else if (util_isDir(newSource)) {
-            qi_copyAllFilesInDirectoryRecursive(newSource, newTarget, fileCount, progressBarIndex);
-        }
+        uint64_t fileStartUs = util_getMonotonicTimeUs();
+        uint64_t size = 0;
+
+        success = qi_copyFileToWriter(writer, newSource, newTarget, &size);
+
+        size_t sizeClass = 0;
+        while (size >= qi_copySizeClasses[sizeClass].maxSize) sizeClass++;
+
+        stats[sizeClass].files++;
+        stats[sizeClass].bytes += size;
+        stats[sizeClass].elapsedUs += util_getMonotonicTimeUs() - fileStartUs;
+
+        bytesCopied += manifest->files[i].size;
+        inst_progressUpdateFiles(progressBarIndex, QI_PROGRESS_KB(bytesCopied), (uint32_t) (i + 1));
 
         free(newSource);
         free(newTarget);
     }
 
-    closedir(d);
+    success &= inst_writerDestroy(writer);
+    inst_traceAddIo(bytesCopied, 0, 0);
+
+    uint64_t elapsedUs = MAX(util_getMonotonicTimeUs() - startUs, 1);
+    inst_logPrintf("Copy %s: %" PRIu64 " KB in %" PRIu64 " ms, %" PRIu64 " KB/s",
+        source, bytesCopied / 1024, elapsedUs / 1000, (uint64_t) (bytesCopied * 1000000ULL / 1024 / elapsedUs));
+
+    // Per class times are spent reading & queueing, writes overlap with them
+    for (size_t c = 0; c < util_arraySize(qi_copySizeClasses); c++) {
+        if (stats[c].files == 0) continue;
+        inst_logPrintf("Copy %s: files %-8s %6zu files, %8" PRIu64 " KB, %8" PRIu64 " KB/s",
+            source, qi_copySizeClasses[c].label, stats[c].files, stats[c].bytes / 1024,
+            (uint64_t) (stats[c].bytes * 1000000ULL / 1024 / MAX(stats[c].elapsedUs, 1)));
+    }
+
+    inst_manifestDestroy(manifest);
+    free(sourceBase);
+    free(targetBase);
     return success;
 }
 
-// Copies a file tree from <source media>/source to <destination partition>/subdir, updating progress bar in the process
-static bool qi_copyFileTree(const char *source, const char *subdir, size_t progressBarIndex) {
-    const char *sourceBase = inst_getSourceFilePath(0, source);
-    const char *targetBase = inst_getTargetFilePath(qi_wizData.destination, subdir);
-    
-    ad_progressBoxSetMaxProgress(qi_wizData.progress, progressBarIndex, util_getFileCountRecursive(sourceBase));
+// Forgets all failing read positions, done when an installation starts
+static void qi_readErrorsReset(void) {
+    pthread_mutex_lock(&qi_readErrorLock);
+    memset(qi_readErrorSlots, 0, sizeof(qi_readErrorSlots));
+    qi_readErrorCounter = 0;
+    pthread_mutex_unlock(&qi_readErrorLock);
+}
+
+// Counts a retry of the read at the given position of a file and returns how many there were.
+// The reader doesn't move on while the read fails, so a different position means the last one was read fine.
+static size_t qi_readErrorsCount(MappedFile *mf, size_t position) {
+    pthread_mutex_lock(&qi_readErrorLock);
+
+    qi_ReadErrorSlot *slot = NULL;
+
+    for (size_t i = 0; i < QI_READ_ERROR_SLOTS && slot == NULL; i++) {
+        if (qi_readErrorSlots[i].file == mf) {
+            slot = &qi_readErrorSlots[i];
+        }
+    }
+
+    if (slot == NULL) {
+        slot = &qi_readErrorSlots[0];
+
+        for (size_t i = 1; i < QI_READ_ERROR_SLOTS; i++) {
+            if (qi_readErrorSlots[i].lastUse < slot->lastUse) {
+                slot = &qi_readErrorSlots[i];
+            }
+        }
 
-    uint32_t fileCount = 0;
-    return qi_copyAllFilesInDirectoryRecursive(sourceBase, targetBase, &fileCount, progressBarIndex);
+        slot->file = mf;
+        slot->retries = 0;
+    } else if (slot->position != position) {
+        slot->retries = 0;
+    }
+
+    slot->position = position;
+    slot->lastUse = ++qi_readErrorCounter;
+    size_t retries = ++slot->retries;
+
+    pthread_mutex_unlock(&qi_readErrorLock);
+    return retries;
 }
 
 MappedFile_ErrorReaction qi_readErrorHandler(int _errno, MappedFile *mf) {
     const char *errorMenuOptions[] = { "Retry", "Cancel" };
-    
+
+    // Nobody to ask, retry a few times. Optical drives often get it on the second go.
+    if (qi_isUnattended()) {
+        size_t position = mappedFile_getPosition(mf);
+        bool retry = qi_readErrorsCount(mf, position) <= QI_UNATTENDED_READ_RETRIES;
+        inst_statusPrintf("warning=read-error position=%zu errno=%d retry=%s", position, _errno, retry ? "yes" : "no");
+        return retry ? MF_RETRY : MF_CANCEL;
+    }
+
+    // Install steps may run concurrently, only one of them gets to ask
+    inst_uiLock();
+
     ad_screenSaveState();
     ad_restore();
 
@@ -285,17 +685,43 @@ MappedFile_ErrorReaction qi_readErrorHandler(int _errno, MappedFile *mf) {
     
     ad_screenLoadState();
 
+    inst_uiUnlock();
+
     return whatToDo == 0 ? MF_RETRY : MF_CANCEL;
 }
 
-// Does a cleanup of all dynamic resources in the install context
-static void qi_cleanup() {
-    // If OSRoot file is open, close it first.
+// Closes the OS data file and the content pool part with its file data
+static void qi_closeOSRoot(void) {
+    if (qi_wizData.osRootPool != NULL) {
+        mappedFile_close(qi_wizData.osRootPool);
+        qi_wizData.osRootPool = NULL;
+    }
+
     if (qi_wizData.osRootFile != NULL) {
         mappedFile_close(qi_wizData.osRootFile);
         qi_wizData.osRootFile = NULL;
     }
 
+    qi_unpackFreeHeader(&qi_wizData.osRootHeader);
+    qi_wizData.osRootHeaderRead = false;
+    qi_wizData.osRootHeaderValid = false;
+}
+
+// Reads the header of the OS data file and opens the content pool part with its file data.
+// A header that can't be read stays that way, the file is kept open for the install to report it.
+static void qi_readOSRootHeader(size_t readahead) {
+    qi_wizData.osRootHeaderRead = true;
+    qi_wizData.osRootHeaderValid = qi_unpackReadHeader(qi_wizData.osRootFile, &qi_wizData.osRootHeader);
+    qi_wizData.osRootPool = qi_wizData.osRootHeaderValid ? qi_unpackOpenPool(&qi_wizData.osRootHeader, readahead) : NULL;
+}
+
+// Does a cleanup of all dynamic resources in the install context
+static void qi_cleanup() {
+    inst_logClose();
+
+    // If OSRoot file is open, close it first.
+    qi_closeOSRoot();
+
     // if we have a destination partition, make sure it is unmounted.
     if (qi_wizData.destination != NULL) {
         util_unmountPartition(qi_wizData.destination);
@@ -308,6 +734,7 @@ static void qi_cleanup() {
     }
 
     if (qi_wizData.progress != NULL) {
+        inst_progressStop();
         ad_progressBoxDestroy(qi_wizData.progress);
         qi_wizData.progress = NULL;
     }
@@ -316,6 +743,69 @@ static void qi_cleanup() {
     qi_wizData.preparationProgress = 0;
 }
 
+// Guesses the variant that is going to be installed: the answered one, the one picked before (in this session or,
+// if the media is writable, the last one), or the first one.
+static size_t qi_guessVariant(void) {
+    const char *answer = inst_answersGet(qi_wizData.answers, "variant");
+    char last[16];
+    size_t guess = 1;
+
+    if (answer != NULL) {
+        guess = (size_t) atoi(answer);
+    } else if (qi_wizData.variantIndex > 0) {
+        guess = qi_wizData.variantIndex;
+    } else if (util_readFirstLineFromFileIntoBuffer(inst_getSourceFilePath(0, INST_LAST_VARIANT_FILE), last, sizeof(last))) {
+        guess = (size_t) atoi(last);
+    }
+
+    if (guess == 0 || !util_fileExists(inst_getSourceFilePath(guess, "win98qi.inf"))) {
+        guess = 1;
+    }
+
+    return guess;
+}
+
+// Starts prebuffering the OS data of a variant, unless that is already happening. If another variant's data was being
+// prebuffered, it is closed first; the part it read stays in the MappedFile cache, so switching back is cheap.
+// The readahead window is the same for speculative and real reads, so a wrong guess doesn't cost extra memory.
+// On media with a content pool, the OS data file only lists the files and the data comes from the pool, so that is
+// what gets prebuffered. The list is small, so reading its header right away doesn't hold things up. The pool is
+// cached by file offset like any other file, so data the variants share is only read once.
+static void qi_prebufferVariant(size_t variantIndex) {
+    if (qi_wizData.osRootFile != NULL && qi_wizData.osRootVariant == variantIndex) {
+        return;
+    }
+
+    qi_closeOSRoot();
+
+    qi_wizData.readahead = util_getProcSafeFreeMemory() * 6 / 10;
+    qi_wizData.osRootVariant = variantIndex;
+    qi_wizData.osRootFile = inst_openSourceFile(variantIndex, INST_SYSROOT_FILE, qi_wizData.readahead);
+
+    if (qi_wizData.osRootFile == NULL || !util_fileExists(inst_getSourceFilePath(0, INST_POOL_FILE))) {
+        return;
+    }
+
+    qi_readOSRootHeader(qi_wizData.readahead);
+}
+
+// Remembers the picked variant on the install media for the next guess. Read-only media just don't remember.
+static void qi_recordVariant(size_t variantIndex) {
+    char last[16];
+    const char *path = inst_getSourceFilePath(0, INST_LAST_VARIANT_FILE);
+
+    if (inst_isSourceMediaOptical()
+     || (util_readFirstLineFromFileIntoBuffer(path, last, sizeof(last)) && (size_t) atoi(last) == variantIndex)) {
+        return;
+    }
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) return;
+
+    fprintf(f, "%zu\r\n", variantIndex);
+    fclose(f);
+}
+
 static qi_WizardAction qi_variantSelectAndStartPrebuffering() {
     size_t variantCount = 0;
 
@@ -341,8 +831,20 @@ static qi_WizardAction qi_variantSelectAndStartPrebuffering() {
 
     // Don't have to show a menu if we have no choice to do innit.
     int menuResult = 0;
+    const char *answeredVariant = inst_answersGet(qi_wizData.answers, "variant");
+
+    if (answeredVariant != NULL) {
+        // 1-based, like the variant directories on the media
+        menuResult = atoi(answeredVariant) - 1;
 
-    if (variantCount > 1) {
+        if (menuResult < 0 || (size_t) menuResult >= variantCount) {
+            ad_menuDestroy(menu);
+            return qi_unattendedFail("variant");
+        }
+    } else if (qi_isUnattended() && variantCount > 1) {
+        ad_menuDestroy(menu);
+        return qi_unattendedFail("variant");
+    } else if (variantCount > 1) {
         menuResult = ad_menuExecute(menu);
     }
 
@@ -351,12 +853,18 @@ static qi_WizardAction qi_variantSelectAndStartPrebuffering() {
     ad_menuDestroy(menu);
 
     qi_wizData.variantCount = variantCount;
-    qi_wizData.readahead = util_getProcSafeFreeMemory() * 6 / 10;
     qi_wizData.variantIndex = (size_t) menuResult + 1;
-    qi_wizData.osRootFile = inst_openSourceFile(qi_wizData.variantIndex, INST_SYSROOT_FILE, qi_wizData.readahead);
+
+    // Usually the guess from startup was right and this doesn't do anything
+    qi_prebufferVariant(qi_wizData.variantIndex);
+    qi_recordVariant(qi_wizData.variantIndex);
 
     QI_FATAL(qi_wizData.osRootFile != NULL, "Could not open OS data file for reading");
 
+    if (qi_isUnattended()) {
+        inst_statusPrintf("state=prebuffering variant=%zu name=\"%s\"", qi_wizData.variantIndex, qi_wizData.variantName);
+    }
+
     return WIZ_NEXT;
 }
 
@@ -379,6 +887,11 @@ static void qi_findRaids() {
 #endif
 
 static qi_WizardAction qi_mainMenu() {
+    // Whoever wrote the answers has read the disclaimer
+    if (qi_isUnattended()) {
+        return WIZ_SELECT_PARTITION;
+    }
+
     if (!qi_wizData.disclaimerShown) {
         msg_disclaimer();
         qi_wizData.disclaimerShown = true;
@@ -422,7 +935,141 @@ static qi_WizardAction qi_help(void) {
     return WIZ_MAIN_MENU;
 }
 
+// Reasons a partition can't be installed to
+typedef enum {
+    QI_DEST_OK = 0,
+    QI_DEST_IS_SOURCE,
+    QI_DEST_BAD_TABLE,
+    QI_DEST_EXTENDED,
+    QI_DEST_BAD_FILESYSTEM,
+    QI_DEST_LOGICAL,
+} qi_DestinationProblem;
+
+// Names of the above for status lines
+static const char *qi_destinationProblemNames[] = { "ok", "source", "partition-table", "extended", "filesystem", "logical" };
+
+static qi_DestinationProblem qi_destinationCheck(util_Partition *partition) {
+    if (inst_isInstallationSourcePartition(partition))                              return QI_DEST_IS_SOURCE;
+    if (!util_stringEquals(partition->parent->tableType, "dos"))                    return QI_DEST_BAD_TABLE;
+    if (partition->fileSystem == fs_extended)                                       return QI_DEST_EXTENDED;
+    if (partition->fileSystem != fs_fat16 && partition->fileSystem != fs_fat32)     return QI_DEST_BAD_FILESYSTEM;
+    if (partition->isLogical)                                                       return QI_DEST_LOGICAL;
+    return QI_DEST_OK;
+}
+
+static void qi_destinationShowProblem(qi_DestinationProblem problem, util_Partition *partition) {
+    switch (problem) {
+        case QI_DEST_IS_SOURCE:         msg_sourcePartitionError(); break;
+        case QI_DEST_BAD_TABLE:         msg_destinationInvalidPartitionTable(); break;
+        case QI_DEST_EXTENDED:          msg_extendedPartitionError(); break;
+        case QI_DEST_BAD_FILESYSTEM:    msg_unsupportedFileSystemError(partition->fileSystem); break;
+        case QI_DEST_LOGICAL:           msg_logicalPartitionError(); break;
+        default:                        break;
+    }
+}
+
+// Checks if a partition is too big or extends beyond what Windows 9x can handle
+static bool qi_destinationIsOversized(util_Partition *partition) {
+    uint64_t partEnd = partition->start * partition->sectorSize + partition->size;
+    return partition->size >= (128 __GB) || partEnd > (128 __GB);
+}
+
+// Replaces the partition table of the answered disk with one partition covering it. Only for unattended installations.
+static util_Partition *qi_unattendedPartitionWholeDisk(const char *device) {
+    size_t diskIndex = util_getHardDiskArrayIndexFromDevicestring(qi_wizData.hda, device);
+
+    if (diskIndex >= qi_wizData.hda->count || inst_isInstallationSourceDisk(&qi_wizData.hda->disks[diskIndex])) {
+        return NULL;
+    }
+
+    inst_statusPrintf("state=partitioning disk=%s", device);
+
+    if (!util_partitionWholeDisk(&qi_wizData.hda->disks[diskIndex], QI_UNATTENDED_MAX_PARTITION)) {
+        return NULL;
+    }
+
+    // Disk array pointers are invalid after this
+    if (!qi_refreshDisks(&qi_wizData)) {
+        return NULL;
+    }
+
+    diskIndex = util_getHardDiskArrayIndexFromDevicestring(qi_wizData.hda, device);
+
+    if (diskIndex >= qi_wizData.hda->count || qi_wizData.hda->disks[diskIndex].partitionCount == 0) {
+        return NULL;
+    }
+
+    return &qi_wizData.hda->disks[diskIndex].partitions[0];
+}
+
+// Checks an answered destination partition and makes it the destination
+static bool qi_unattendedSetDestination(util_Partition *partition) {
+    qi_DestinationProblem problem = qi_destinationCheck(partition);
+    if (problem != QI_DEST_OK) {
+        inst_statusPrintf("state=failed reason=destination problem=%s", qi_destinationProblemNames[problem]);
+        return false;
+    }
+
+    // The answer file was written for this machine, so a big partition is what was asked for
+    if (qi_destinationIsOversized(partition)) {
+        inst_statusPrintf("warning=oversized-partition");
+    }
+
+    if (util_isPartitionMounted(partition)) {
+        util_unmountPartition(partition);
+    }
+
+    inst_statusPrintf("state=destination partition=%s", partition->device);
+    qi_wizData.destination = partition;
+    return true;
+}
+
+// Picks the destination from the answers ("destination", "partition"). A disk to be partitioned is only
+// recorded here, it is partitioned when the installation starts, after all other answers were checked.
+static qi_WizardAction qi_unattendedDestinationSelect(void) {
+    const char *device = inst_answersGet(qi_wizData.answers, "destination");
+    const char *partitioning = inst_answersGet(qi_wizData.answers, "partition");
+
+    qi_wizData.partitionDisk = NULL;
+
+    if (device == NULL) {
+        return qi_unattendedFail("destination");
+    }
+
+    if (!qi_refreshDisks(&qi_wizData) || qi_wizData.hda->count == 0) {
+        return qi_unattendedFail("no-disks");
+    }
+
+    if (partitioning != NULL && util_stringEquals(partitioning, "wholedisk")) {
+        size_t diskIndex = util_getHardDiskArrayIndexFromDevicestring(qi_wizData.hda, device);
+
+        if (diskIndex >= qi_wizData.hda->count || inst_isInstallationSourceDisk(&qi_wizData.hda->disks[diskIndex])) {
+            return qi_unattendedFail("destination");
+        }
+
+        inst_statusPrintf("state=destination disk=%s partition=wholedisk", device);
+        qi_wizData.partitionDisk = device;
+        return WIZ_NEXT;
+    }
+
+    if (partitioning != NULL && !util_stringEquals(partitioning, "keep")) {
+        return qi_unattendedFail("partition");
+    }
+
+    util_Partition *partition = util_getPartitionFromDevicestring(qi_wizData.hda, device);
+
+    if (partition == NULL) {
+        return qi_unattendedFail("destination");
+    }
+
+    return qi_unattendedSetDestination(partition) ? WIZ_NEXT : WIZ_EXIT_ERROR;
+}
+
 static qi_WizardAction qi_destinationSelect(void) {
+    if (qi_isUnattended()) {
+        return qi_unattendedDestinationSelect();
+    }
+
     if (!qi_refreshDisks(&qi_wizData)) {
         msg_refreshDiskError();
         return WIZ_MAIN_MENU;
@@ -464,34 +1111,14 @@ static qi_WizardAction qi_destinationSelect(void) {
         util_Partition *partition = util_getPartitionFromIndex(qi_wizData.hda, menuResult);
         QI_ASSERT(partition);
 
-        // Is this the installation source? If yes, show menu again.
-        if (inst_isInstallationSourcePartition(partition)) {
-            msg_sourcePartitionError();
-            continue;
-        }
-        // Wrong partition table type? error and show menu again.
-        if (!util_stringEquals(partition->parent->tableType, "dos")) {
-            msg_destinationInvalidPartitionTable();
-            continue;
-        }
-        // Is extended partition? error and show menu again.
-        if (partition->fileSystem == fs_extended) {
-            msg_extendedPartitionError();
-            continue;
-        }
-        // Wrong file system? error and show menu again.
-        if (partition->fileSystem != fs_fat16 && partition->fileSystem != fs_fat32) {
-            msg_unsupportedFileSystemError(partition->fileSystem);
+        // Can't install there? error and show menu again.
+        qi_DestinationProblem problem = qi_destinationCheck(partition);
+        if (problem != QI_DEST_OK) {
+            qi_destinationShowProblem(problem, partition);
             continue;
         }
-        // Logical partition? error and show menu again.
-        if (partition->isLogical) {
-            msg_logicalPartitionError();
-            continue;
-        }
-        uint64_t partEnd = partition->start + partition->size;
         // Partition too big or exceeds boundary?
-        if (partition->size >= (128 __GB) || partEnd > (128 __GB) ) {
+        if (qi_destinationIsOversized(partition)) {
             if (!msg_askOversizePartitionWarning(partition)) {
                 continue;
             }
@@ -556,7 +1183,42 @@ static const char *qi_configGetLabel(qi_OptionIdx index) {
     return cfg->prompt;
 }
 
+// Applies the answered options. Unanswered ones keep their defaults.
+static qi_WizardAction qi_unattendedConfig(void) {
+    for (size_t i = 0; i < QI_OPTION_ARRAY_SIZE; i++) {
+        const char *key = qi_options[i].answerKey;
+        bool value;
+
+        if (key == NULL || inst_answersGet(qi_wizData.answers, key) == NULL) continue;
+
+        if (!inst_answersGetBool(qi_wizData.answers, key, &value)) {
+            return qi_unattendedFail(key);
+        }
+
+        qi_options[i].selected = value ? QI_OPTION_YES : QI_OPTION_NO;
+    }
+
+    // A partition that was just created has no file system yet
+    const char *partitioning = inst_answersGet(qi_wizData.answers, "partition");
+    if (partitioning != NULL && util_stringEquals(partitioning, "wholedisk")) {
+        qi_configSet(o_formatTargetPartition, QI_OPTION_YES);
+    }
+
+    bool ignoreQuirks = false;
+    inst_answersGetBool(qi_wizData.answers, "ignorequirks", &ignoreQuirks);
+
+    if (!ignoreQuirks && inst_doHardwareQuirks(false) == false) {
+        return qi_unattendedFail("hardware-quirk");
+    }
+
+    return WIZ_NEXT;
+}
+
 static qi_WizardAction qi_config(void) {
+    if (qi_isUnattended()) {
+        return qi_unattendedConfig();
+    }
+
     ad_MultiSelector *menu = ad_multiSelectorCreate("Configuration", 
         "Please configure your installation.\n"
         "\n"
@@ -598,7 +1260,7 @@ static qi_WizardAction qi_config(void) {
         return WIZ_DO_NOTHING;
     }
 
-    if (inst_doHardwareQuirks() == false) {
+    if (inst_doHardwareQuirks(true) == false) {
         return WIZ_DO_NOTHING;
     }
  
@@ -614,9 +1276,13 @@ static void qi_installAddToProgressBoxIfEnabled(size_t *pbIndex, qi_OptionIdx op
 }
 
 static bool qi_installWriteMbrSetActive(size_t progressBarIndex) {
-    bool success = util_writeMBRToDrive(qi_wizData.destination->parent, __MBR_WIN98__)
-                && util_setPartitionActive(qi_wizData.destination);
-    ad_progressBoxMultiUpdate(qi_wizData.progress, progressBarIndex, ++qi_wizData.preparationProgress);
+    util_BlockDevice *disk = util_blockDeviceOpenDisk(qi_wizData.destination->parent);
+    bool success = disk != NULL
+                && util_writeMBRToDrive(disk, __MBR_WIN98__)
+                && util_setPartitionActive(disk, qi_wizData.destination)
+                && util_blockDeviceCommit(disk);
+    util_blockDeviceClose(disk);
+    inst_progressUpdate(progressBarIndex, ++qi_wizData.preparationProgress);
     return success;
 }
 
@@ -631,7 +1297,7 @@ static bool qi_installWriteBootSector(size_t progressBarIndex) {
 
     bool success = util_modifyAndwriteBootSectorToPartition(qi_wizData.destination, bsModifierList);
 
-    ad_progressBoxMultiUpdate(qi_wizData.progress, progressBarIndex, ++qi_wizData.preparationProgress);
+    inst_progressUpdate(progressBarIndex, ++qi_wizData.preparationProgress);
     return success;
 }
 
@@ -643,20 +1309,37 @@ static bool qi_installFormat(size_t progressBarIndex) {
     util_CommandOutput *cmd = util_commandOutputCapture(formatCmd);
     QI_FATAL(cmd, "Failed to obtain format command output");
     int result = cmd->returnCode;
-    if (result != 0) {
+    if (result != 0 && !qi_isUnattended()) {
+        inst_uiLock();
         msg_formatFailed(qi_wizData.destination);
+        inst_uiUnlock();
     }
     util_commandOutputDestroy(cmd);
-    ad_progressBoxMultiUpdate(qi_wizData.progress, progressBarIndex, ++qi_wizData.preparationProgress);
+    inst_progressUpdate(progressBarIndex, ++qi_wizData.preparationProgress);
     return result == 0;
 }
 
 static bool qi_installMountPartition(size_t progressBarIndex) {
     bool success = util_mountPartition(qi_wizData.destination);
-    ad_progressBoxMultiUpdate(qi_wizData.progress, progressBarIndex, ++qi_wizData.preparationProgress);
+
+    if (success && inst_logOpen(inst_getTargetFilePath(qi_wizData.destination, INST_LOG_FILE))) {
+        inst_logPrintf("%s", LUNMERCY_BACKTITLE);
+        inst_logPrintf("Variant: %s", qi_wizData.variantName);
+        inst_logPrintf("Target: %s (%s, %s)", qi_wizData.destination->device,
+            qi_wizData.destination->parent->model, util_utilFilesystemToString(qi_wizData.destination->fileSystem));
+    }
+
+    inst_progressUpdate(progressBarIndex, ++qi_wizData.preparationProgress);
     return success;
 }
 
+static bool qi_installProbeDisk(size_t progressBarIndex) {
+    // Failing to measure is not an error, we just use the defaults then.
+    inst_probeTargetDisk(qi_wizData.destination->mountPath, qi_wizData.destination->parent->optIoSize, &qi_wizData.tuning);
+    inst_progressUpdate(progressBarIndex, ++qi_wizData.preparationProgress);
+    return true;
+}
+
 static bool qi_installUefi(size_t progressBarIndex) {
     bool success = true;
 
@@ -664,43 +1347,93 @@ static bool qi_installUefi(size_t progressBarIndex) {
     success &= util_fileCopy(inst_getSourceFilePath(0, "csmwrapx64.efi"), inst_getTargetFilePath(qi_wizData.destination, "EFI/BOOT/BOOTX64.EFI"));
     success &= util_fileCopy(inst_getSourceFilePath(0, "csmwrapia32.efi"), inst_getTargetFilePath(qi_wizData.destination, "EFI/BOOT/BOOTIA32.EFI"));
 
-    ad_progressBoxMultiUpdate(qi_wizData.progress, progressBarIndex, ++qi_wizData.preparationProgress);
+    inst_progressUpdate(progressBarIndex, ++qi_wizData.preparationProgress);
     return success;
 }
 
-static bool qi_installUnpackGeneric(size_t progressBarIndex, const char *fileName) {
+// Gets the readahead amount for a source file of an install step. Steps running side by side share it.
+static size_t qi_getStepReadahead(void) {
+    return (size_t) (qi_wizData.readahead * qi_wizData.tuning.readaheadPercent / 100 / MAX(qi_wizData.stepConcurrency, 1));
+}
+
+static bool qi_installUnpackGeneric(size_t progressBarIndex, const char *fileName, inst_DriverFilter *filter, inst_Patch *patch) {
     MappedFile *file = mappedFile_open(inst_getSourceFilePath(qi_wizData.variantIndex, fileName),
-         qi_wizData.readahead, qi_readErrorHandler);
+         qi_getStepReadahead(), qi_readErrorHandler);
 
     QI_FATAL (file != NULL, "Failed to open MappedFile for opening");
-    
-    bool success = qi_unpackGeneric(file, qi_wizData.destination->mountPath, progressBarIndex);
+
+    inst_MercyPakHeader header;
+    bool success = qi_unpackReadHeader(file, &header);
+    MappedFile *pool = success ? qi_unpackOpenPool(&header, qi_getStepReadahead()) : NULL;
+
+    success = success && qi_unpackGeneric(file, &header, pool, qi_wizData.destination->mountPath, filter, patch, progressBarIndex);
+
+    if (pool != NULL) {
+        mappedFile_close(pool);
+    }
+
+    qi_unpackFreeHeader(&header);
     mappedFile_close(file);
     return success;
 }
 
 static bool qi_installLba64(size_t progressBarIndex) {
-    return qi_installUnpackGeneric(progressBarIndex, INST_LBA64_FILE);
+    return qi_installUnpackGeneric(progressBarIndex, INST_LBA64_FILE, NULL, NULL);
 }
 
 static bool qi_installCregfix(size_t progressBarIndex) {
-    return qi_installUnpackGeneric(progressBarIndex, INST_CREGFIX_FILE);
+    return qi_installUnpackGeneric(progressBarIndex, INST_CREGFIX_FILE, NULL, NULL);
 }
 
 static bool qi_installDriversBase(size_t progressBarIndex) {
-    return qi_installUnpackGeneric(progressBarIndex, INST_DRIVER_FILE);
+    inst_DriverFilter *filter = NULL;
+
+    // Only the INFs & CABs for the PCI devices in this machine, plus the generic ones
+    if (QI_OPTION_YES == qi_configGet(o_driversDetectedOnly)) {
+        filter = inst_driverFilterCreate(inst_getSourceFilePath(qi_wizData.variantIndex, INST_DRIVER_INDEX));
+    }
+
+    bool success = qi_installUnpackGeneric(progressBarIndex, INST_DRIVER_FILE, filter, NULL);
+    inst_driverFilterDestroy(filter);
+    return success;
 }
 
+// Unpacks the registry. With the legacy hardware detection, the patch for it is applied on the way.
 static bool qi_installRegistry(size_t progressBarIndex) {
-    bool skipLegacy = (QI_OPTION_YES == qi_configGet(o_skipLegacyDetection));
-    const char *filename = skipLegacy ? INST_FASTPNP_FILE : INST_SLOWPNP_FILE;
-    return qi_installUnpackGeneric(progressBarIndex, filename);
+    if (QI_OPTION_YES == qi_configGet(o_skipLegacyDetection)) {
+        return qi_installUnpackGeneric(progressBarIndex, INST_FASTPNP_FILE, NULL, NULL);
+    }
+
+    MappedFile *patchFile = mappedFile_open(inst_getSourceFilePath(qi_wizData.variantIndex, INST_SLOWPNP_FILE),
+        qi_getStepReadahead(), qi_readErrorHandler);
+
+    QI_FATAL (patchFile != NULL, "Failed to open MappedFile for opening");
+
+    inst_Patch *patch = inst_patchCreate(patchFile);
+    bool success = (patch != NULL) && qi_installUnpackGeneric(progressBarIndex, INST_FASTPNP_FILE, NULL, patch);
+
+    // Installing the registry without the patch would skip the legacy hardware detection
+    success = success && inst_patchWasApplied(patch);
+
+    inst_patchDestroy(patch);
+    mappedFile_close(patchFile);
+    return success;
 }
 
 static bool qi_installCopyOSRoot(size_t progressBarIndex) {
-    bool success = qi_unpackGeneric(qi_wizData.osRootFile, qi_wizData.destination->mountPath, progressBarIndex);
-    mappedFile_close(qi_wizData.osRootFile);
-    qi_wizData.osRootFile = NULL;
+    if (!qi_wizData.osRootHeaderRead) {
+        qi_readOSRootHeader(qi_getStepReadahead());
+    }
+
+    if (!qi_wizData.osRootHeaderValid) {
+        inst_logPrintf("The header of %s could not be read", INST_SYSROOT_FILE);
+    }
+
+    bool success = qi_wizData.osRootHeaderValid
+        && qi_unpackGeneric(qi_wizData.osRootFile, &qi_wizData.osRootHeader, qi_wizData.osRootPool,
+            qi_wizData.destination->mountPath, NULL, NULL, progressBarIndex);
+
+    qi_closeOSRoot();
     return success;
 }
 
@@ -717,17 +1450,139 @@ static void qi_installExecuteIfEnabled(qi_OptionIdx index, qi_OptionFunc func, c
         return;
     }
 
-    ad_setFooterText(footerText);
-    if (!func(qi_configGetProgressBarIndex(index))) {
+    inst_progressSetStep(footerText, qi_configGetProgressBarIndex(index));
+    inst_TracePhase *phase = inst_tracePhaseBegin(footerText);
+    inst_statusPrintf("state=step step=\"%s\"", footerText);
+
+    bool success = func(qi_configGetProgressBarIndex(index));
+
+    inst_tracePhaseEnd(phase, success);
+    if (!success) {
         qi_wizData.error = true;
         qi_wizData.errorIndex = index;
     }
-    ad_clearFooter();
+    inst_progressSetStep(NULL, 0);
+}
+
+typedef struct {
+    qi_OptionIdx index;
+    qi_OptionFunc func;
+    const char *footerText;
+    uint32_t reads;             // QI_RES_* the step reads
+    uint32_t writes;            // QI_RES_* the step writes
+} qi_InstallStep;
+
+// The file copy steps, in the order they ran in before they were scheduled. Steps that don't
+// touch the same parts of the target may run side by side.
+// sysprep/imagelayout.py puts the source files on the install media in this order, keep it in sync.
+static const qi_InstallStep qi_copySteps[] = {
+    { o_uefi,                   qi_installUefi,             "Installing UEFI support",
+        0,                      QI_RES_EFI },
+    { o_baseOS,                 qi_installCopyOSRoot,       "Copying operating system files...",
+        0,                      QI_RES_SYSTEM | QI_RES_DRIVERS },
+    { o_registry,               qi_installRegistry,         "Copying system registry...",
+        QI_RES_SYSTEM,          QI_RES_SYSTEM },
+    { o_cregfix,                qi_installCregfix,          "Installing CREGFIX patch...",
+        QI_RES_SYSTEM,          QI_RES_SYSTEM },
+    { o_lba64,                  qi_installLba64,            "Installing LBA64/GPT Disk support driver...",
+        QI_RES_SYSTEM,          QI_RES_SYSTEM },
+    { o_installDriversBase,     qi_installDriversBase,      "Copying base driver library files...",
+        0,                      QI_RES_DRIVERS },
+    { o_installDriversExtra,    qi_installDriversExtra,     "Copying extended driver library files...",
+        0,                      QI_RES_DRIVERS_EXTRA },
+    { o_copyExtras,             qi_installCopyExtras,       "Copying extras folder (tools, drivers, updates)...",
+        0,                      QI_RES_EXTRAS },
+};
+
+// Decides how many install steps may run side by side
+static size_t qi_getStepConcurrency(void) {
+    // Seek bound targets and optical sources lose more to head movement than they gain
+    if (qi_wizData.tuning.coalesceSmallFiles || inst_isSourceMediaOptical()) {
+        return 1;
+    }
+
+    size_t byMemory = (size_t) (qi_wizData.readahead / QI_STEP_MIN_READAHEAD);
+    size_t concurrency = MIN(MIN(qi_wizData.tuning.writerThreads, QI_MAX_CONCURRENT_STEPS), byMemory);
+    return MAX(concurrency, 1);
+}
+
+// Shows the oldest running step in the footer while install steps run
+static void qi_installStepsIdle(const inst_Step *oldestRunning) {
+    if (oldestRunning != NULL) {
+        inst_progressSetStep(oldestRunning->footerText, oldestRunning->progressBarIndex);
+    } else {
+        inst_progressSetStep(NULL, 0);
+    }
+}
+
+// Runs a list of install steps through the scheduler. Like qi_installExecuteIfEnabled, nothing is started
+// after an error and the first failing step (in list order) is the one that gets reported.
+static void qi_installExecuteSteps(const qi_InstallStep *list, size_t count) {
+    if (qi_wizData.error) {
+        return;
+    }
+
+    inst_Step *steps = calloc(count, sizeof(inst_Step));
+    QI_ASSERT(steps != NULL);
+
+    for (size_t i = 0; i < count; i++) {
+        steps[i].enabled = (QI_OPTION_YES == qi_configGet(list[i].index));
+        steps[i].func = list[i].func;
+        steps[i].progressBarIndex = qi_configGetProgressBarIndex(list[i].index);
+        steps[i].footerText = list[i].footerText;
+        steps[i].reads = list[i].reads;
+        steps[i].writes = list[i].writes;
+    }
+
+    qi_wizData.stepConcurrency = qi_getStepConcurrency();
+    inst_logPrintf("Install steps: up to %zu at a time", qi_wizData.stepConcurrency);
+
+    char concurrency[16];
+    snprintf(concurrency, sizeof(concurrency), "%zu", qi_wizData.stepConcurrency);
+    inst_traceSetInfo("stepConcurrency", concurrency);
+
+    bool success = inst_stepsRun(steps, count, qi_wizData.stepConcurrency, qi_installStepsIdle);
+
+    qi_wizData.stepConcurrency = 1;
+
+    for (size_t i = 0; !success && i < count; i++) {
+        if (steps[i].started && !steps[i].success) {
+            qi_wizData.error = true;
+            qi_wizData.errorIndex = list[i].index;
+            break;
+        }
+    }
+
+    free(steps);
 }
 
 static qi_WizardAction qi_install(void) {
     // Start error-less
     qi_wizData.error = false;
+    qi_readErrorsReset();
+
+    // An unattended whole disk installation partitions the disk first, nothing is touched before that
+    if (qi_wizData.partitionDisk != NULL) {
+        util_Partition *partition = qi_unattendedPartitionWholeDisk(qi_wizData.partitionDisk);
+        qi_wizData.partitionDisk = NULL;
+
+        if (partition == NULL) {
+            return qi_unattendedFail("partition");
+        }
+
+        if (!qi_unattendedSetDestination(partition)) {
+            return WIZ_EXIT_ERROR;
+        }
+    }
+
+    inst_traceReset();
+    inst_traceSetInfo("variant", qi_wizData.variantName);
+    inst_traceSetInfo("target", qi_wizData.destination->device);
+    inst_traceSetInfo("targetModel", qi_wizData.destination->parent->model);
+    inst_traceSetInfo("targetFs", util_utilFilesystemToString(qi_wizData.destination->fileSystem));
+    inst_traceSetInfo("sourceOptical", inst_isSourceMediaOptical() ? "yes" : "no");
+    inst_diskTuningSetDefaults(&qi_wizData.tuning);
+    qi_wizData.verifier = (QI_OPTION_YES == qi_configGet(o_verify)) ? inst_verifierCreate() : NULL;
 
     // Make the progress bars
     qi_wizData.progress = ad_progressBoxMultiCreate("Installing...",
@@ -750,8 +1605,11 @@ static qi_WizardAction qi_install(void) {
 
     ad_progressBoxPaint(qi_wizData.progress);
 
+    // From here on, only the progress display thread draws
+    inst_progressStart(qi_wizData.progress, progressBarIndex, QI_PROGRESS_FIRST_DATA_BAR);
+
     // The topmost progress bar must be updated with the maximum value, which is the amount of steps in the preparation
-    ad_progressBoxSetMaxProgress(qi_wizData.progress, 0, qi_configGetPreparationStepCount());
+    inst_progressSetMax(0, qi_configGetPreparationStepCount());
 
     // Execute preparation steps
     qi_wizData.preparationProgress = 0;
@@ -759,21 +1617,58 @@ static qi_WizardAction qi_install(void) {
     qi_installExecuteIfEnabled(o_formatTargetPartition, qi_installFormat,               "Formatting Target Partition");
     qi_installExecuteIfEnabled(o_bootSector,            qi_installWriteBootSector,      "Writing Boot Sector");
     qi_installExecuteIfEnabled(o_mount,                 qi_installMountPartition,       "Mounting Target Partition");
+    qi_installExecuteIfEnabled(o_probe,                 qi_installProbeDisk,            "Measuring Target Disk Speed");
 
     // Execute file copies
-    qi_installExecuteIfEnabled(o_uefi,                  qi_installUefi,                 "Installing UEFI support");
-    qi_installExecuteIfEnabled(o_baseOS,                qi_installCopyOSRoot,           "Copying operating system files...");
-    qi_installExecuteIfEnabled(o_registry,              qi_installRegistry,             "Copying system registry...");
-    qi_installExecuteIfEnabled(o_cregfix,               qi_installCregfix,              "Installing CREGFIX patch...");
-    qi_installExecuteIfEnabled(o_lba64,                 qi_installLba64,                "Installing LBA64/GPT Disk support driver...");
-    qi_installExecuteIfEnabled(o_installDriversBase,    qi_installDriversBase,          "Copying base driver library files...");
-    qi_installExecuteIfEnabled(o_installDriversExtra,   qi_installDriversExtra,         "Copying extended driver library files...");
-    qi_installExecuteIfEnabled(o_copyExtras,            qi_installCopyExtras,           "Copying extras folder (tools, drivers, updates)...");
+    qi_installExecuteSteps(qi_copySteps, util_arraySize(qi_copySteps));
 
+    inst_progressStop();
     ad_progressBoxDestroy(qi_wizData.progress);
     qi_wizData.progress = NULL;
 
+    // Whatever hasn't been verified during the installation is done now
+    if (qi_wizData.verifier != NULL) {
+        ad_setFooterText("Verifying written files...");
+        inst_TracePhase *phase = inst_tracePhaseBegin("Verifying written files...");
+        size_t mismatches = inst_verifierFinish(qi_wizData.verifier);
+        inst_tracePhaseEnd(phase, mismatches == 0);
+        qi_wizData.verifier = NULL;
+        ad_clearFooter();
+
+        if (mismatches > 0 && !qi_wizData.error) {
+            if (!qi_isUnattended()) msg_verifyMismatch(mismatches, INST_LOG_FILE);
+            qi_wizData.error = true;
+            qi_wizData.errorIndex = o_verify;
+        }
+    }
+
+    if (qi_wizData.error) {
+        inst_logPrintf("Installation FAILED: %s", qi_configGetLabel(qi_wizData.errorIndex));
+    } else {
+        inst_logPrintf("Installation finished");
+    }
+
+    if (qi_isUnattended()) {
+        if (qi_wizData.error) {
+            inst_statusPrintf("state=failed reason=install step=\"%s\"", qi_configGetLabel(qi_wizData.errorIndex));
+        } else {
+            inst_statusPrintf("state=done");
+        }
+    }
+
+    inst_traceFinish(&qi_wizData.tuning, !qi_wizData.error);
+
+    if (qi_wizData.destination != NULL && qi_wizData.destination->mountPath != NULL) {
+        inst_traceWrite(inst_getTargetFilePath(qi_wizData.destination, INST_PERF_FILE));
+    }
+
+    inst_logClose();
+
     // Any failing module here will cause the installation to be canceled completely, regardless of state. 
+    if (qi_wizData.error && qi_isUnattended()) {
+        return WIZ_EXIT_ERROR;
+    }
+
     if (qi_wizData.error) {
         msg_installError(qi_configGetLabel(qi_wizData.errorIndex));
         return WIZ_REDO_FROM_START;
@@ -785,6 +1680,12 @@ static qi_WizardAction qi_install(void) {
 static qi_WizardAction qi_thisIsTheEnd() {
     const char *postInstallOptions[] = { "Reboot", "Return to Main Menu", "Exit to Linux Shell" };
 
+    // Unattended installations go to the shell unless asked otherwise, so the result stays on screen
+    if (qi_isUnattended()) {
+        const char *after = inst_answersGet(qi_wizData.answers, "after");
+        return (after != NULL && util_stringEquals(after, "reboot")) ? WIZ_REBOOT : WIZ_EXIT_TO_SHELL;
+    }
+
     int selection = ad_menuExecuteDirectly("Windows 9x QuickInstall: Success",  false,
         3, postInstallOptions,
         "The installation was successful!\n"
@@ -804,6 +1705,17 @@ static void qi_exit(bool doReboot) {
     sync();
     system("clear");
     ad_deinit();
+
+    if (getenv(INST_PERF_ECHO_ENV) != NULL) {
+        inst_tracePrint(stdout);
+    }
+
+    // The final state of an unattended installation, for whatever watches the console
+    if (qi_isUnattended()) {
+        inst_statusPrintLast(stdout);
+        fflush(stdout);
+        inst_statusClose();
+    }
     if (doReboot) {
         reboot(RB_AUTOBOOT);
     }
@@ -832,6 +1744,7 @@ bool qi_wizard() {
                 result = qi_thisIsTheEnd(); break;
             case WIZ_REDO_FROM_START:
                 qi_cleanup();
+                qi_prebufferVariant(qi_guessVariant());
                 result = WIZ_VARIANT_SELECT;
                 break;
             case WIZ_REBOOT:
@@ -839,7 +1752,7 @@ bool qi_wizard() {
                 QI_FATAL(false, "Failed to initiate reboot!");
                 break;
             case WIZ_EXIT_TO_SHELL:
-                msg_exitToShellInfo();
+                if (!qi_isUnattended()) msg_exitToShellInfo();
                 return true;
             case WIZ_EXIT_ERROR:
                 return false;
@@ -871,11 +1784,15 @@ bool qi_main(int argc, char *argv[]) {
         return false;
     }
 
-    // If we have commandline parameters use them, otherwise use the environment.
+    char sourceDev[PATH_MAX];
+
+    // If we have commandline parameters use them, otherwise use the environment, otherwise go look for it.
     if (argc == 3) {
         inst_setSourceMedia(argv[1], argv[2]);
     } else if (getenv("CDROM") && getenv("CDDEV")) {
         inst_setSourceMedia(getenv("CDROM"), getenv("CDDEV"));
+    } else if (inst_findSourceMedia(INST_SOURCE_MOUNT_PATH, sourceDev, sizeof(sourceDev))) {
+        inst_setSourceMedia(INST_SOURCE_MOUNT_PATH, sourceDev);
     } else {
         msg_environmentError();
         ad_deinit();
@@ -884,6 +1801,26 @@ bool qi_main(int argc, char *argv[]) {
 
     memset(&qi_wizData, 0, sizeof(qi_wizData));
 
+    // Answers on the media or the kernel command line make this an unattended installation
+    qi_wizData.answers = inst_answersLoad(inst_getSourceFilePath(0, INST_ANSWER_FILE), INST_ANSWER_CMDLINE);
+
+    if (qi_isUnattended()) {
+        const char *statusDevice = inst_answersGet(qi_wizData.answers, "status");
+
+        if (!inst_statusOpen(statusDevice)) {
+            inst_logPrintf("Cannot open status device %s", statusDevice);
+        }
+
+        inst_statusPrintf("state=started version=%s", LUNMERCY_VERSION);
+    }
+
+    // Keep payload data in memory across wizard restarts, so installing to several disks in a row
+    // only reads the source media once. The 60% readahead leaves enough room for this quarter.
+    mappedFile_setCacheBudget(util_getProcSafeFreeMemory() / 4);
+
+    // The disclaimer and menus take a while to read, start on the OS data in the meantime
+    qi_prebufferVariant(qi_guessVariant());
+
     bool success = qi_wizard();
 
     qi_exit(false);
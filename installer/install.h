@@ -8,6 +8,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "mappedfile.h"
@@ -33,6 +34,9 @@ typedef enum {
     WIZ_DO_NOTHING
 } qi_WizardAction;
 
+// Maximum amount of identical files sharing one data block in MercyPak V2 files
+#define MERCYPAK_V2_MAX_IDENTICAL_FILES (16)
+
 #pragma pack(1)
 
 typedef struct {
@@ -45,21 +49,35 @@ typedef struct {
 
 #pragma pack()
 
+// What the unpacker needs from the header of a MercyPak file
+typedef struct {
+    uint32_t dirCount;
+    uint32_t fileCount;
+    bool sharedData;                        // V2 and newer: identical files share one data block
+    size_t poolRangeCount;                  // The file data is in these ranges of the content pool, none if it's inline
+    MappedFile_Range *poolRanges;
+    uint32_t chunkCacheSize;                // Chunk cache the chunked entries need, 0 if there are none
+    uint32_t chunkCacheEntries;
+} inst_MercyPakHeader;
+
 typedef enum {
     o_writeMBRAndSetActive = 0,
     o_formatTargetPartition,
     o_bootSector,
     o_skipLegacyDetection,
     o_installDriversBase,
+    o_driversDetectedOnly,
     o_installDriversExtra,
     o_copyExtras,
     o_cregfix,
     o_lba64,
     o_uefi,
+    o_verify,
     QI_OPTIONIDX_MAX,
     o_baseOS, // Base OS copy, this is always enabled and this is just a hack to make the install code a bit nicer
     o_mount, // Mounting partition, ditto
     o_registry, // copy system registry, ditto
+    o_probe, // Target disk speed probe, ditto
 } qi_OptionIdx;
 
 #define QI_OPTION_YES               (0)
@@ -74,13 +92,50 @@ typedef struct {
     size_t selected;
     size_t progressBarIdx;
     bool partOfPreparation;
+    const char *answerKey;                  // Key for unattended installations, NULL if it can't be answered
 } qi_Option;
 
+// Target disk speed measurements and the unpacker settings derived from them
+typedef struct {
+    bool probed;                            // Measurements below are valid
+    uint32_t seqWriteKBs;                   // Sequential write throughput, KB/s
+    uint32_t seqReadKBs;                    // Sequential read throughput (page cache dropped), KB/s
+    uint32_t randWriteIops;                 // Synchronous 4K random writes per second
+    size_t writeChunkSize;                  // Size of a single write request issued by the unpacker
+    size_t writerThreads;                   // Amount of writer threads for the unpacker
+    bool coalesceSmallFiles;                // Pack small files into shared write jobs to keep them in order
+    uint32_t readaheadPercent;              // Share of readahead memory for source data, rest goes to the write queue
+} inst_DiskTuning;
+
+typedef struct inst_Verifier inst_Verifier;
+
+typedef struct inst_Answers inst_Answers;
+
+typedef struct {
+    char *path;                 // Relative to the tree root
+    uint64_t size;
+    uint64_t location;          // Physical block on the source media if known, for sorting
+} inst_ManifestFile;
+
+// Directories and files of a file tree to be copied
+typedef struct {
+    size_t dirCount;
+    char **dirs;                // Relative to the tree root, parents come before their children
+    size_t fileCount;
+    inst_ManifestFile *files;   // In the order they should be copied
+    uint64_t totalBytes;
+} inst_Manifest;
+
 // Structure depicting all the static state needed for the wizard / installers
 #define QI_VARIANT_NAME_SIZE (70)
 typedef struct {
     bool disclaimerShown;                   // Indicates disclaimer was shown
     MappedFile *osRootFile;                 // The main OS data file, opened early for prebuffering
+    size_t osRootVariant;                   // Variant osRootFile belongs to, may be a guess until a variant is picked
+    inst_MercyPakHeader osRootHeader;       // Header of osRootFile, valid if osRootHeaderValid
+    bool osRootHeaderRead;                  // The header was read, or reading it failed
+    bool osRootHeaderValid;
+    MappedFile *osRootPool;                 // Content pool part with the file data of osRootFile, NULL if not open
     uint64_t readahead;                     // Maximum safe readahead memory size
     ad_ProgressBox *progress;               // Multi-progress-bar-box ui element
     util_HardDiskArray *hda;                // Hard Disk Array of all disks in the system
@@ -91,6 +146,11 @@ typedef struct {
     bool error;                             // an error occurred in the installation
     qi_OptionIdx errorIndex;
     uint32_t preparationProgress;
+    inst_DiskTuning tuning;                 // Unpacker settings for the destination disk
+    inst_Verifier *verifier;                // Read-back verification of written files, NULL if disabled
+    size_t stepConcurrency;                 // Install steps currently allowed to run side by side, they share the memory budget
+    inst_Answers *answers;                  // Answers for an unattended installation, NULL if interactive
+    const char *partitionDisk;              // Unattended: disk to partition as a whole when the installation starts
 } qi_InstallContext;
 
 bool qi_main(int argc, char *argv[]);
@@ -128,6 +188,9 @@ bool inst_isInstallationSourceDisk(util_HardDisk *disk);
 /* Checks if given partition is the installation source */
 bool inst_isInstallationSourcePartition(util_Partition *part);
 
+/* Checks if the installation source is an optical drive */
+bool inst_isSourceMediaOptical(void);
+
 /* Get string for a disk's partition table, the difference between the raw value and
    what you get here is that "dos" is replaced with the more expressive "mbr"...*/
 const char *inst_getTableTypeString(util_HardDisk *disk);
@@ -149,12 +212,251 @@ const char *inst_getDiskMenuHeader(void);
 /* Get a nicely formatted string for the partitioning disk selector menu */
 const char *inst_getDiskMenuString(util_HardDisk *disk);
 
+/* Opens (creates) the install log file. Log lines written while no log is open are dropped. */
+bool inst_logOpen(const char *path);
+
+/* Writes a printf-style line to the install log. Thread safe. */
+void inst_logPrintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* Closes the install log file */
+void inst_logClose(void);
+
+/************ INSTALL_PROBE.C ************/
+
+/* Sets the unpacker settings used when the target disk could not be measured */
+void inst_diskTuningSetDefaults(inst_DiskTuning *tuning);
+
+/* Measures write/read speed of the mounted partition with a temporary file and derives unpacker settings.
+   Non-destructive, the file is deleted afterwards. optIoSize is the disk's optimal I/O size, 0 if unknown.
+   On failure, the defaults are set and false is returned. */
+bool inst_probeTargetDisk(const char *mountPath, uint32_t optIoSize, inst_DiskTuning *tuning);
+
+/************ INSTALL_WRITER.C ************/
+
+typedef struct inst_Writer inst_Writer;
+typedef struct inst_WriterFile inst_WriterFile;
+
+/* Creates an asynchronous file writer with settings from 'tuning'. queueBudget is the maximum amount of
+   memory held by queued writes, the producer blocks when it is exhausted.
+   If verifier is not NULL, every finished file is queued there for read-back verification. */
+inst_Writer *inst_writerCreate(const inst_DiskTuning *tuning, size_t queueBudget, inst_Verifier *verifier);
+
+/* Registers a set of open files that receive identical contents. The writer takes ownership of the file
+   descriptors and of the malloc'd path strings (paths may be NULL, so may single entries).
+   Time and attributes of each descriptor are applied when the file is finished.
+   expectedSize is used to decide whether the file is small enough to coalesce. */
+inst_WriterFile *inst_writerFileCreate(inst_Writer *w, size_t fdCount, const int *fds, const inst_MercyPakFileDescriptor *descriptors, char **paths, size_t expectedSize);
+
+/* Reads 'len' bytes from 'src' and queues them to be appended to 'file'. */
+bool inst_writerCopyFromMappedFile(inst_Writer *w, inst_WriterFile *file, MappedFile *src, size_t len);
+
+/* Reads 'len' bytes from the file descriptor 'fd' and queues them to be appended to 'file'. */
+bool inst_writerCopyFromFd(inst_Writer *w, inst_WriterFile *file, int fd, size_t len);
+
+/* Source of file data for inst_writerCopyFromReader. Must produce exactly 'len' bytes or fail. */
+typedef bool (*inst_WriterReadFunc)(void *src, uint8_t *dst, size_t len);
+
+/* Queues 'len' bytes produced by readFunc to be appended to 'file'. */
+bool inst_writerCopyFromReader(inst_Writer *w, inst_WriterFile *file, inst_WriterReadFunc readFunc, void *src, size_t len);
+
+/* Marks a file as complete. Time & attributes are applied and descriptors closed after its last write. */
+void inst_writerFileFinish(inst_Writer *w, inst_WriterFile *file);
+
+/* Waits for all queued writes, stops the writer threads and frees the writer.
+   Returns false if any write or attribute change failed. */
+bool inst_writerDestroy(inst_Writer *w);
+
+/************ INSTALL_PATCH.C ************/
+
+typedef struct inst_Patch inst_Patch;
+
+/* Reads the header of a patch from 'file'. The file stays open as long as the patch is used,
+   it is read along with the base file when the patch is applied. NULL if it's not a valid patch. */
+inst_Patch *inst_patchCreate(MappedFile *file);
+
+/* Checks if a file from a MercyPak file (path with '/' separators) is the one to patch. patch may be NULL. */
+bool inst_patchAppliesTo(const inst_Patch *patch, const char *name, size_t size);
+
+/* Size of the file after patching */
+size_t inst_patchGetResultSize(const inst_Patch *patch);
+
+/* Reads the base file from 'base' and queues the patched file to 'file'. Fails if the base file isn't
+   the one the patch was made for. */
+bool inst_patchApply(inst_Patch *patch, inst_Writer *w, inst_WriterFile *file, MappedFile *base);
+
+/* Checks if the patch was applied to a file */
+bool inst_patchWasApplied(const inst_Patch *patch);
+
+/* Frees a patch. Its file is not closed. */
+void inst_patchDestroy(inst_Patch *patch);
+
+/************ INSTALL_CHUNKS.C ************/
+
+typedef struct inst_ChunkCache inst_ChunkCache;
+
+/* Creates the chunk cache for the chunked entries of a MercyPak file, with the size and chunk count from its
+   header. NULL if there isn't enough memory. */
+inst_ChunkCache *inst_chunkCacheCreate(uint32_t size, uint32_t maxChunks);
+
+/* Reads the chunks of a chunked entry from 'file' and queues the file they make up to 'out' */
+bool inst_chunkCacheUnpack(inst_ChunkCache *cache, inst_Writer *w, inst_WriterFile *out, MappedFile *file, uint32_t fileSize);
+
+/* Reads past the chunks of a chunked entry that isn't going to be written. Its new chunks are still cached. */
+bool inst_chunkCacheSkip(inst_ChunkCache *cache, MappedFile *file);
+
+/* Frees a chunk cache, NULL is ignored */
+void inst_chunkCacheDestroy(inst_ChunkCache *cache);
+
+/************ INSTALL_MANIFEST.C ************/
+
+/* Gets the manifest of a file tree on the source media. Uses <sourceBase>.lst if it was shipped,
+   otherwise scans the tree once and sorts the files by their location on the media. NULL on error. */
+inst_Manifest *inst_manifestCreate(const char *sourceBase);
+
+/* Frees a manifest */
+void inst_manifestDestroy(inst_Manifest *m);
+
+/************ INSTALL_MEDIA.C ************/
+
+#define INST_SOURCE_MOUNT_PATH "/install"
+
+/* Searches all optical, hard & flash disks concurrently for the install media and mounts it at mountPath.
+   The block device of the media is written to deviceOut. */
+bool inst_findSourceMedia(const char *mountPath, char *deviceOut, size_t deviceOutSize);
+
+/************ INSTALL_VERIFY.C ************/
+
+/* Creates a verifier and starts its low priority verification thread */
+inst_Verifier *inst_verifierCreate(void);
+
+/* Queues a written file for verification against its expected size and CRC-32. The path is copied. */
+void inst_verifierAdd(inst_Verifier *v, const char *path, size_t size, uint32_t crc);
+
+/* Allows verification of everything queued so far, i.e. the payload that was just unpacked */
+void inst_verifierRelease(inst_Verifier *v);
+
+/* Waits until all queued files are verified, then frees the verifier. Returns the number of mismatching files. */
+size_t inst_verifierFinish(inst_Verifier *v);
+
+/************ INSTALL_DRIVERS.C ************/
+
+typedef struct inst_DriverFilter inst_DriverFilter;
+
+/* Reads the driver index at indexPath and matches it against the PCI devices in this system.
+   Returns NULL if there is no usable index, which means every driver is to be installed. */
+inst_DriverFilter *inst_driverFilterCreate(const char *indexPath);
+
+/* Checks if a file from the driver package (path with '/' separators) is to be installed. f may be NULL. */
+bool inst_driverFilterWants(inst_DriverFilter *f, const char *path);
+
+/* Frees a driver filter */
+void inst_driverFilterDestroy(inst_DriverFilter *f);
+
+/************ INSTALL_PROGRESS.C ************/
+
+/* Starts the thread that paints the progress box a few times per second. Bars from firstDataBar on count
+   kilobytes and are used for the throughput and time estimates in the footer. */
+void inst_progressStart(ad_ProgressBox *box, size_t barCount, size_t firstDataBar);
+
+/* Paints the final state and stops the progress thread. Must be called before the box is destroyed. */
+void inst_progressStop(void);
+
+/* Progress updates for install steps. These only store the values, they can be called from any thread. */
+void inst_progressSetMax(size_t bar, uint32_t max);
+void inst_progressUpdate(size_t bar, uint32_t value);
+void inst_progressUpdateFiles(size_t bar, uint32_t value, uint32_t files);
+
+/* Sets the step that is shown in the footer, with the bar its time estimate is based on. NULL clears the footer. */
+void inst_progressSetStep(const char *text, size_t bar);
+
+/* Serializes dialogs popping up during the installation with the progress thread */
+void inst_uiLock(void);
+void inst_uiUnlock(void);
+
+/************ INSTALL_STEPS.C ************/
+
+typedef struct {
+    bool enabled;
+    bool (*func)(size_t progressBarIndex);
+    size_t progressBarIndex;
+    const char *footerText;
+    uint32_t reads;                         // Parts of the target the step reads, bit mask
+    uint32_t writes;                        // Parts of the target the step writes, bit mask
+    bool started;                           // Filled in by the scheduler
+    bool done;
+    bool success;
+} inst_Step;
+
+/* Called regularly on the scheduling thread while steps run, with the oldest running step (NULL when done) */
+typedef void (*inst_StepIdleFunc)(const inst_Step *oldestRunning);
+
+/* Runs the enabled steps, up to maxConcurrent at a time, each one after all earlier steps it conflicts with.
+   Nothing new is started after a step fails. Returns false if any step failed. */
+bool inst_stepsRun(inst_Step *steps, size_t count, size_t maxConcurrent, inst_StepIdleFunc idle);
+
+/************ INSTALL_TRACE.C ************/
+
+typedef struct inst_TracePhase inst_TracePhase;
+
+/* Clears all trace data and starts the clock for a new installation */
+void inst_traceReset(void);
+
+/* Adds (or replaces) a key/value pair for the system section of the trace, e.g. the target disk */
+void inst_traceSetInfo(const char *key, const char *value);
+
+/* Starts a phase on the calling thread. Counters added by this thread go to it until it ends.
+   name must stay valid until the trace is written. Returns NULL if there's no room, which the other functions accept. */
+inst_TracePhase *inst_tracePhaseBegin(const char *name);
+void inst_tracePhaseEnd(inst_TracePhase *phase, bool success);
+
+/* Adds to the counters of the calling thread's phase */
+void inst_traceAddIo(uint64_t bytesRead, uint64_t bytesWritten, uint64_t files);
+void inst_traceAddStall(uint64_t readStallUs, uint64_t writeStallUs);
+
+/* Reports the time a file took from being queued until it was closed, only the slowest ones are kept. Any thread. */
+void inst_traceFile(const char *path, uint64_t size, uint64_t us);
+
+/* Takes the totals and the memory high-water mark at the end of an installation. Phases still running show as failed. */
+void inst_traceFinish(const inst_DiskTuning *tuning, bool success);
+
+/* Prints the finished trace as one line of JSON. Returns false if no installation was finished since the last reset. */
+bool inst_tracePrint(FILE *out);
+
+/* Writes the finished trace to a file */
+bool inst_traceWrite(const char *path);
+
+/************ INSTALL_ANSWER.C ************/
+
+/* Loads answers from an answer file and/or the kernel command line (either may be NULL).
+   Returns NULL if neither has any, i.e. the installation is interactive. */
+inst_Answers *inst_answersLoad(const char *filePath, const char *cmdlinePath);
+
+/* Gets an answer. Returns NULL if the key is not answered. a may be NULL. */
+const char *inst_answersGet(const inst_Answers *a, const char *key);
+
+/* Gets a yes/no answer. Returns false if the key is not answered or not a yes/no value. */
+bool inst_answersGetBool(const inst_Answers *a, const char *key, bool *value);
+
+void inst_answersDestroy(inst_Answers *a);
+
+/* Starts printing status lines, to the install log and a device or file (NULL for none).
+   Before this, status lines are ignored. Returns false if the device can't be opened. */
+bool inst_statusOpen(const char *device);
+
+/* Prints a status line ("key=value key=value ...") to the status device and the install log. Any thread. */
+void inst_statusPrintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* Prints the last status line again, e.g. on the console once the UI is gone */
+void inst_statusPrintLast(FILE *out);
+
+void inst_statusClose(void);
+
 /************ INSTALL_HWQUIRKS.C ************/
 
 /* Tests the system for all the potential hardware quirks and if one is found,
    he is asked if he wants to continue. If NOT, the function returns FALSE.
    Else it returns TRUE, even if the system has quirks but the user wants
-   to continue. */
-bool inst_doHardwareQuirks(void);
+   to continue. Without askUser, any quirk found makes it return FALSE. */
+bool inst_doHardwareQuirks(bool askUser);
 
 #endif
\ No newline at end of file
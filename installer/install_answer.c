@@ -0,0 +1,257 @@
+/*
+ * LUNMERCY - Unattended installation answers
+ *
+ * Answers come from an INI style file on the install media and from "qi.<key>=<value>" parameters
+ * on the kernel command line, the latter overriding the former. Keys are case insensitive.
+ * Sections in the file are only there for readability, all keys share one namespace:
+ *
+ *      [install]
+ *      variant=1
+ *      destination=/dev/sda1
+ *
+ *      [options]
+ *      format=yes
+ *
+ * Everything after a ';' or '#' is a comment.
+ *
+ * Status lines for unattended installations look like this, one per line:
+ *      QI-STATUS state=step step="Copying operating system files..."
+ *
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "install.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <pthread.h>
+
+#include "qi_assert.h"
+#include "util.h"
+
+#define ANSWER_LINE_LENGTH          (1024)
+#define ANSWER_CMDLINE_PREFIX       "qi."
+#define STATUS_PREFIX               "QI-STATUS "
+#define STATUS_LINE_LENGTH          (512)
+
+typedef struct {
+    char *key;
+    char *value;
+} inst_Answer;
+
+struct inst_Answers {
+    size_t count;
+    inst_Answer *answers;
+};
+
+static pthread_mutex_t statusLock = PTHREAD_MUTEX_INITIALIZER;
+static bool statusActive = false;                   // Status lines are only printed for unattended installations
+static FILE *statusOut = NULL;
+static char statusLast[STATUS_LINE_LENGTH] = "";
+
+// Removes leading and trailing white space in place
+static char *inst_answerTrim(char *str) {
+    while (isspace((unsigned char) *str)) str++;
+
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char) end[-1])) end--;
+    *end = '\0';
+
+    return str;
+}
+
+// Adds an answer, replacing an earlier one with the same key
+static void inst_answersSet(inst_Answers *a, const char *key, const char *value) {
+    for (size_t i = 0; i < a->count; i++) {
+        if (strcasecmp(a->answers[i].key, key) == 0) {
+            free(a->answers[i].value);
+            a->answers[i].value = strdup(value);
+            QI_ASSERT(a->answers[i].value != NULL);
+            return;
+        }
+    }
+
+    a->answers = realloc(a->answers, (a->count + 1) * sizeof(inst_Answer));
+    QI_ASSERT(a->answers != NULL);
+
+    a->answers[a->count].key = strdup(key);
+    a->answers[a->count].value = strdup(value);
+    QI_ASSERT(a->answers[a->count].key != NULL && a->answers[a->count].value != NULL);
+    a->count++;
+}
+
+// Reads "key=value" lines from the answer file
+static void inst_answersReadFile(inst_Answers *a, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return;
+
+    char *line = malloc(ANSWER_LINE_LENGTH);
+    QI_ASSERT(line != NULL);
+
+    while (fgets(line, ANSWER_LINE_LENGTH, f) != NULL) {
+        line[strcspn(line, ";#")] = '\0';
+
+        char *trimmed = inst_answerTrim(line);
+        char *equals = strchr(trimmed, '=');
+
+        if (trimmed[0] == '[' || equals == NULL) {
+            continue;
+        }
+
+        *equals = '\0';
+        inst_answersSet(a, inst_answerTrim(trimmed), inst_answerTrim(equals + 1));
+    }
+
+    free(line);
+    fclose(f);
+}
+
+// Reads "qi.key=value" parameters from the kernel command line
+static void inst_answersReadCmdline(inst_Answers *a, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return;
+
+    char *line = malloc(ANSWER_LINE_LENGTH);
+    QI_ASSERT(line != NULL);
+
+    if (fgets(line, ANSWER_LINE_LENGTH, f) != NULL) {
+        char *save = NULL;
+
+        for (char *param = strtok_r(line, " \t\r\n", &save); param != NULL; param = strtok_r(NULL, " \t\r\n", &save)) {
+            char *equals = strchr(param, '=');
+
+            if (!util_stringStartsWith(param, ANSWER_CMDLINE_PREFIX) || equals == NULL) {
+                continue;
+            }
+
+            *equals = '\0';
+            inst_answersSet(a, param + strlen(ANSWER_CMDLINE_PREFIX), equals + 1);
+        }
+    }
+
+    free(line);
+    fclose(f);
+}
+
+inst_Answers *inst_answersLoad(const char *filePath, const char *cmdlinePath) {
+    inst_Answers *a = calloc(1, sizeof(inst_Answers));
+    QI_ASSERT(a != NULL);
+
+    if (filePath != NULL) inst_answersReadFile(a, filePath);
+    if (cmdlinePath != NULL) inst_answersReadCmdline(a, cmdlinePath);
+
+    if (a->count == 0) {
+        inst_answersDestroy(a);
+        return NULL;
+    }
+
+    return a;
+}
+
+const char *inst_answersGet(const inst_Answers *a, const char *key) {
+    if (a == NULL) return NULL;
+
+    for (size_t i = 0; i < a->count; i++) {
+        if (strcasecmp(a->answers[i].key, key) == 0) {
+            return a->answers[i].value;
+        }
+    }
+
+    return NULL;
+}
+
+bool inst_answersGetBool(const inst_Answers *a, const char *key, bool *value) {
+    const char *str = inst_answersGet(a, key);
+
+    if (str == NULL) return false;
+
+    if (strcasecmp(str, "yes") == 0 || strcasecmp(str, "true") == 0 || strcmp(str, "1") == 0) {
+        *value = true;
+    } else if (strcasecmp(str, "no") == 0 || strcasecmp(str, "false") == 0 || strcmp(str, "0") == 0) {
+        *value = false;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+void inst_answersDestroy(inst_Answers *a) {
+    if (a == NULL) return;
+
+    for (size_t i = 0; i < a->count; i++) {
+        free(a->answers[i].key);
+        free(a->answers[i].value);
+    }
+
+    free(a->answers);
+    free(a);
+}
+
+bool inst_statusOpen(const char *device) {
+    inst_statusClose();
+
+    FILE *out = NULL;
+
+    if (device != NULL) {
+        out = fopen(device, "w");
+        if (out != NULL) setvbuf(out, NULL, _IOLBF, 0);
+    }
+
+    pthread_mutex_lock(&statusLock);
+    statusActive = true;
+    statusOut = out;
+    pthread_mutex_unlock(&statusLock);
+
+    return device == NULL || out != NULL;
+}
+
+void inst_statusPrintf(const char *fmt, ...) {
+    char line[STATUS_LINE_LENGTH];
+    va_list args;
+
+    if (!__atomic_load_n(&statusActive, __ATOMIC_RELAXED)) return;
+
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+
+    pthread_mutex_lock(&statusLock);
+
+    memcpy(statusLast, line, sizeof(statusLast));
+
+    if (statusOut != NULL) {
+        fprintf(statusOut, STATUS_PREFIX "%s\n", line);
+    }
+
+    pthread_mutex_unlock(&statusLock);
+
+    inst_logPrintf("Status: %s", line);
+}
+
+void inst_statusPrintLast(FILE *out) {
+    pthread_mutex_lock(&statusLock);
+
+    if (statusLast[0] != '\0') {
+        fprintf(out, STATUS_PREFIX "%s\n", statusLast);
+    }
+
+    pthread_mutex_unlock(&statusLock);
+}
+
+void inst_statusClose(void) {
+    pthread_mutex_lock(&statusLock);
+
+    if (statusOut != NULL) {
+        fclose(statusOut);
+        statusOut = NULL;
+    }
+
+    statusActive = false;
+
+    pthread_mutex_unlock(&statusLock);
+}
@@ -0,0 +1,199 @@
+/*
+ * LUNMERCY - Chunked entries
+ *
+ * Chunked entries of MercyPak V3 files (see sysprep/mercypak.py for the format) are lists of
+ * chunks. New chunks are in the file, the others repeat a chunk from earlier in the same file.
+ * The installer can't go back in its source files, so the chunk data is kept in a cache of a
+ * fixed size, which the packer simulates to only repeat chunks the cache still has.
+ *
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "install.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "qi_assert.h"
+#include "util.h"
+#include "mappedfile.h"
+
+#define CHUNK_CACHED (0x80000000UL)
+
+typedef struct {
+    uint32_t pos;                   // Position of the chunk data in the ring buffer
+    uint32_t length;
+} inst_CachedChunk;
+
+struct inst_ChunkCache {
+    uint8_t *data;                  // Ring buffer with the chunk data, oldest chunk first
+    uint32_t size;
+    uint32_t dataFirst;             // Position of the oldest chunk's data
+    uint32_t dataUsed;
+
+    inst_CachedChunk *chunks;       // Ring of the cached chunks, oldest first
+    uint32_t maxChunks;
+    uint32_t chunkFirst;
+    uint32_t chunkCount;
+    uint32_t firstNumber;           // Number of the oldest cached chunk
+
+    // State while an entry is unpacked
+    MappedFile *file;
+    uint32_t chunksLeft;
+    uint32_t copyPos;               // Position in the ring buffer of the chunk data to copy next
+    uint32_t copyLeft;
+};
+
+inst_ChunkCache *inst_chunkCacheCreate(uint32_t size, uint32_t maxChunks) {
+    if (size == 0 || maxChunks == 0) {
+        return NULL;
+    }
+
+    inst_ChunkCache *cache = calloc(1, sizeof(inst_ChunkCache));
+    QI_FATAL(cache != NULL, "Failed to allocate chunk cache");
+
+    cache->data = malloc(size);
+    cache->chunks = calloc(maxChunks, sizeof(inst_CachedChunk));
+
+    if (cache->data == NULL || cache->chunks == NULL) {
+        inst_logPrintf("Not enough memory for a chunk cache of %u bytes", (unsigned) size);
+        inst_chunkCacheDestroy(cache);
+        return NULL;
+    }
+
+    cache->size = size;
+    cache->maxChunks = maxChunks;
+    return cache;
+}
+
+// Drops the oldest chunk
+static void inst_chunkCacheEvict(inst_ChunkCache *cache) {
+    inst_CachedChunk *oldest = &cache->chunks[cache->chunkFirst];
+
+    cache->dataFirst = (cache->dataFirst + oldest->length) % cache->size;
+    cache->dataUsed -= oldest->length;
+    cache->chunkFirst = (cache->chunkFirst + 1) % cache->maxChunks;
+    cache->chunkCount--;
+    cache->firstNumber++;
+}
+
+// Reads a new chunk from the file into the cache, making room for it the same way the packer does
+static bool inst_chunkCacheAdd(inst_ChunkCache *cache, uint32_t length, inst_CachedChunk *added) {
+    if (length == 0 || length > cache->size) {
+        return false;
+    }
+
+    while (cache->chunkCount > 0 && (cache->dataUsed + length > cache->size || cache->chunkCount >= cache->maxChunks)) {
+        inst_chunkCacheEvict(cache);
+    }
+
+    uint32_t pos = (cache->dataFirst + cache->dataUsed) % cache->size;
+    uint32_t firstPart = MIN(length, cache->size - pos);
+
+    if (!mappedFile_read(cache->file, cache->data + pos, firstPart)
+     || !mappedFile_read(cache->file, cache->data, length - firstPart)) {
+        return false;
+    }
+
+    added->pos = pos;
+    added->length = length;
+    cache->chunks[(cache->chunkFirst + cache->chunkCount) % cache->maxChunks] = *added;
+    cache->chunkCount++;
+    cache->dataUsed += length;
+    return true;
+}
+
+// Reads the next chunk of the entry and sets it up to be copied
+static bool inst_chunkCacheNextChunk(inst_ChunkCache *cache) {
+    uint32_t chunk = 0;
+    inst_CachedChunk next;
+
+    if (cache->chunksLeft == 0 || !mappedFile_getUInt32(cache->file, &chunk)) {
+        return false;
+    }
+
+    cache->chunksLeft--;
+
+    if (chunk & CHUNK_CACHED) {
+        uint32_t index = (chunk & ~CHUNK_CACHED) - cache->firstNumber;
+
+        // Also catches chunk numbers older than the oldest cached one, through the unsigned wrap
+        if (index >= cache->chunkCount) {
+            inst_logPrintf("Chunk %u is not in the chunk cache", (unsigned) (chunk & ~CHUNK_CACHED));
+            return false;
+        }
+
+        next = cache->chunks[(cache->chunkFirst + index) % cache->maxChunks];
+    } else if (!inst_chunkCacheAdd(cache, chunk, &next)) {
+        return false;
+    }
+
+    cache->copyPos = next.pos;
+    cache->copyLeft = next.length;
+    return true;
+}
+
+// Produces the file of a chunked entry, for inst_writerCopyFromReader
+static bool inst_chunkCacheRead(void *src, uint8_t *dst, size_t len) {
+    inst_ChunkCache *cache = (inst_ChunkCache *) src;
+
+    while (len > 0) {
+        if (cache->copyLeft == 0) {
+            if (!inst_chunkCacheNextChunk(cache)) return false;
+            continue;
+        }
+
+        uint32_t toCopy = (uint32_t) MIN(len, MIN(cache->copyLeft, cache->size - cache->copyPos));
+        memcpy(dst, cache->data + cache->copyPos, toCopy);
+        cache->copyPos = (cache->copyPos + toCopy) % cache->size;
+        cache->copyLeft -= toCopy;
+        dst += toCopy;
+        len -= toCopy;
+    }
+
+    return true;
+}
+
+// Reads the chunk count of an entry
+static bool inst_chunkCacheBeginEntry(inst_ChunkCache *cache, MappedFile *file) {
+    cache->file = file;
+    cache->copyLeft = 0;
+    return mappedFile_getUInt32(file, &cache->chunksLeft);
+}
+
+bool inst_chunkCacheUnpack(inst_ChunkCache *cache, inst_Writer *w, inst_WriterFile *out, MappedFile *file, uint32_t fileSize) {
+    QI_ASSERT(cache != NULL && file != NULL);
+
+    bool success = inst_chunkCacheBeginEntry(cache, file)
+        && inst_writerCopyFromReader(w, out, inst_chunkCacheRead, cache, fileSize);
+
+    // The chunks have to add up to the file size exactly
+    success = success && cache->copyLeft == 0 && cache->chunksLeft == 0;
+
+    cache->file = NULL;
+    return success;
+}
+
+bool inst_chunkCacheSkip(inst_ChunkCache *cache, MappedFile *file) {
+    QI_ASSERT(cache != NULL && file != NULL);
+
+    // New chunks still have to go into the cache, later entries may repeat them
+    bool success = inst_chunkCacheBeginEntry(cache, file);
+
+    while (success && cache->chunksLeft > 0) {
+        success = inst_chunkCacheNextChunk(cache);
+    }
+
+    cache->copyLeft = 0;
+    cache->file = NULL;
+    return success;
+}
+
+void inst_chunkCacheDestroy(inst_ChunkCache *cache) {
+    if (cache == NULL) return;
+
+    free(cache->data);
+    free(cache->chunks);
+    free(cache);
+}
@@ -167,6 +167,9 @@ qi_WizardAction qi_diskMgmtMenu(qi_InstallContext *ctx) {
 
         system(cfdiskCmd);
 
+        // cfdisk may have changed anything on this disk
+        util_partitionTableInvalidate(selectedDisk);
+
         ad_restore();
     }
 
@@ -182,6 +185,7 @@ bool qi_refreshDisks(qi_InstallContext *ctx) {
     if (ctx->hda != NULL) {
         util_hardDiskArrayDestroy(ctx->hda);
     }
+    util_mountTableInvalidate();
     ctx->hda = util_getSystemHardDisks();
     ctx->destination = NULL;
     ad_clearFooter();
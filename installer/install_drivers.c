@@ -0,0 +1,216 @@
+/*
+ * LUNMERCY - Hardware-targeted base driver selection
+ *
+ * sysprep ships DRIVER.IDX next to DRIVER.866. It maps the PCI IDs every driver INF supports
+ * to the INF and the CAB holding its files. One entry per line:
+ *      <vendor> <device> <inf> <cab>
+ * IDs are 4 hex digits, '*' matches any device (or, with "* *", any system: generic drivers).
+ * Lines starting with '#' are comments.
+ *
+ * An INF/CAB is extracted if at least one of its entries matches a PCI device in this system.
+ * Files the index doesn't mention are always extracted.
+ *
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "install.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "qi_assert.h"
+#include "util.h"
+
+#define DRIVER_INDEX_LINE_LENGTH    (1024)
+#define DRIVER_PCI_WILDCARD         (0xFFFFFFFF)
+
+typedef struct {
+    char *name;
+    bool wanted;
+} inst_DriverIndexFile;
+
+struct inst_DriverFilter {
+    size_t pciIdCount;
+    uint32_t *pciIds;               // (vendor << 16) | device of every device in the system
+    size_t fileCount;
+    inst_DriverIndexFile *files;
+    size_t kept;
+    size_t skipped;
+};
+
+// Reads the vendor/device IDs of all PCI devices in the system. No PCI bus (VLB/ISA only system) is not an error.
+static void inst_driverFilterReadPciIds(inst_DriverFilter *f) {
+    char line[1024];
+    FILE *pci = fopen("/proc/bus/pci/devices", "r");
+
+    if (pci == NULL) return;
+
+    while (fgets(line, sizeof(line), pci)) {
+        unsigned int busDevfn, vendorDevice;
+
+        if (sscanf(line, "%x %x", &busDevfn, &vendorDevice) != 2) {
+            continue;
+        }
+
+        f->pciIds = realloc(f->pciIds, (f->pciIdCount + 1) * sizeof(uint32_t));
+        QI_ASSERT(f->pciIds != NULL);
+        f->pciIds[f->pciIdCount++] = (uint32_t) vendorDevice;
+    }
+
+    fclose(pci);
+}
+
+// Parses a 4 digit hex ID or the '*' wildcard. Returns false if it's neither.
+static bool inst_driverFilterParseId(const char *str, uint32_t *id) {
+    if (util_stringEquals(str, "*")) {
+        *id = DRIVER_PCI_WILDCARD;
+        return true;
+    }
+
+    char *end = NULL;
+    unsigned long value = strtoul(str, &end, 16);
+
+    if (end == str || *end != '\0' || value > 0xFFFF) return false;
+
+    *id = (uint32_t) value;
+    return true;
+}
+
+// Checks if a vendor/device pair from the index matches any device in this system
+static bool inst_driverFilterMatches(const inst_DriverFilter *f, uint32_t vendor, uint32_t device) {
+    if (vendor == DRIVER_PCI_WILDCARD) return true;
+
+    for (size_t i = 0; i < f->pciIdCount; i++) {
+        if ((f->pciIds[i] >> 16) == vendor && (device == DRIVER_PCI_WILDCARD || (f->pciIds[i] & 0xFFFF) == device)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static inst_DriverIndexFile *inst_driverFilterFind(const inst_DriverFilter *f, const char *name) {
+    for (size_t i = 0; i < f->fileCount; i++) {
+        if (strcasecmp(f->files[i].name, name) == 0) {
+            return &f->files[i];
+        }
+    }
+    return NULL;
+}
+
+// Adds a file name from the index, or updates it if it's already known (CABs are shared by INFs from the same directory)
+static void inst_driverFilterAddFile(inst_DriverFilter *f, const char *name, bool wanted) {
+    inst_DriverIndexFile *file = inst_driverFilterFind(f, name);
+
+    if (file == NULL) {
+        f->files = realloc(f->files, (f->fileCount + 1) * sizeof(inst_DriverIndexFile));
+        QI_ASSERT(f->files != NULL);
+
+        file = &f->files[f->fileCount++];
+        file->name = strdup(name);
+        file->wanted = false;
+        QI_ASSERT(file->name != NULL);
+    }
+
+    file->wanted |= wanted;
+}
+
+static bool inst_driverFilterReadIndex(inst_DriverFilter *f, FILE *idx) {
+    char *line = malloc(DRIVER_INDEX_LINE_LENGTH);
+    QI_ASSERT(line != NULL);
+
+    bool success = true;
+
+    while (success && fgets(line, DRIVER_INDEX_LINE_LENGTH, idx) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (line[0] == '\0' || line[0] == '#') continue;
+
+        char *save = NULL;
+        char *vendorStr = strtok_r(line, " \t", &save);
+        char *deviceStr = strtok_r(NULL, " \t", &save);
+        char *inf = strtok_r(NULL, " \t", &save);
+        char *cab = strtok_r(NULL, " \t", &save);
+        uint32_t vendor, device;
+
+        success = (cab != NULL)
+               && inst_driverFilterParseId(vendorStr, &vendor)
+               && inst_driverFilterParseId(deviceStr, &device);
+
+        if (success) {
+            bool wanted = inst_driverFilterMatches(f, vendor, device);
+            inst_driverFilterAddFile(f, inf, wanted);
+            inst_driverFilterAddFile(f, cab, wanted);
+        }
+    }
+
+    free(line);
+    return success;
+}
+
+inst_DriverFilter *inst_driverFilterCreate(const char *indexPath) {
+    QI_ASSERT(indexPath != NULL);
+
+    FILE *idx = fopen(indexPath, "r");
+
+    if (idx == NULL) {
+        inst_logPrintf("Driver filter: no index at %s, installing all drivers", indexPath);
+        return NULL;
+    }
+
+    inst_DriverFilter *f = calloc(1, sizeof(inst_DriverFilter));
+    QI_ASSERT(f != NULL);
+
+    inst_driverFilterReadPciIds(f);
+
+    bool success = inst_driverFilterReadIndex(f, idx);
+    fclose(idx);
+
+    if (!success) {
+        inst_logPrintf("Driver filter: %s is broken, installing all drivers", indexPath);
+        inst_driverFilterDestroy(f);
+        return NULL;
+    }
+
+    size_t wanted = 0;
+    for (size_t i = 0; i < f->fileCount; i++) {
+        wanted += f->files[i].wanted ? 1 : 0;
+    }
+
+    inst_logPrintf("Driver filter: %zu PCI device(s), %zu of %zu indexed file(s) selected", f->pciIdCount, wanted, f->fileCount);
+    return f;
+}
+
+bool inst_driverFilterWants(inst_DriverFilter *f, const char *path) {
+    if (f == NULL) return true;
+
+    QI_ASSERT(path != NULL);
+
+    const char *name = strrchr(path, '/');
+    name = (name != NULL) ? name + 1 : path;
+
+    const inst_DriverIndexFile *file = inst_driverFilterFind(f, name);
+    bool wanted = (file == NULL) || file->wanted;
+
+    f->kept += wanted ? 1 : 0;
+    f->skipped += wanted ? 0 : 1;
+    return wanted;
+}
+
+void inst_driverFilterDestroy(inst_DriverFilter *f) {
+    if (f == NULL) return;
+
+    if (f->kept > 0 || f->skipped > 0) {
+        inst_logPrintf("Driver filter: %zu file(s) extracted, %zu skipped", f->kept, f->skipped);
+    }
+
+    for (size_t i = 0; i < f->fileCount; i++) {
+        free(f->files[i].name);
+    }
+
+    free(f->files);
+    free(f->pciIds);
+    free(f);
+}
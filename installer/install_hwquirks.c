@@ -134,12 +134,12 @@ static const qi_HwQuirk quirks[] = {
                         "or disable the USB Controller." },
 };
 
-bool inst_doHardwareQuirks(void) {
+bool inst_doHardwareQuirks(bool askUser) {
     qi_PciDeviceList devices = {0};
 
     if (!qi_pciDeviceListPopulate(&devices)) {
         qi_pciDeviceListDestroy(&devices);
-        ad_okBox("ERROR", false, "Failed to obtain PCI device list.");
+        if (askUser) ad_okBox("ERROR", false, "Failed to obtain PCI device list.");
         return false;
     }
 
@@ -149,6 +149,12 @@ bool inst_doHardwareQuirks(void) {
 
     for (size_t i = 0; i < util_arraySize(quirks); i++) {
         if (quirks[i].check(&devices) == false) {
+            if (!askUser) {
+                inst_logPrintf("Hardware quirk found: %s", quirks[i].info);
+                ret = false;
+                break;
+            }
+
             int32_t action = ad_yesNoBox("Known Hardware Conflict Detected!", true,
                 "Found a hardware combination with a known problem:\n\n"
                 "%s\n\n"
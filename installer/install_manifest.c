@@ -0,0 +1,194 @@
+/*
+ * LUNMERCY - File tree manifests for plain file copies (driver.ex, extras)
+ *
+ * A manifest lists all directories and files of a tree with their sizes, so the copy needs no
+ * separate counting pass and gets byte-accurate progress. sysprep ships one per tree on the media
+ * (<tree>.lst next to the tree), already in the order the files are laid out on the image.
+ * Without it, the tree is scanned once and the files are sorted by their physical location.
+ *
+ * Manifest file format, one entry per line, paths relative to the tree root with '/' separators:
+ *      D <path>
+ *      F <size in bytes> <path>
+ * Lines starting with '#' are comments.
+ *
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "install.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "qi_assert.h"
+#include "util.h"
+
+#define MANIFEST_LINE_LENGTH    (PATH_MAX + 32)
+
+static void inst_manifestAddDir(inst_Manifest *m, const char *path) {
+    m->dirs = realloc(m->dirs, (m->dirCount + 1) * sizeof(char *));
+    QI_ASSERT(m->dirs != NULL);
+    m->dirs[m->dirCount] = strdup(path);
+    QI_ASSERT(m->dirs[m->dirCount] != NULL);
+    m->dirCount++;
+}
+
+static void inst_manifestAddFile(inst_Manifest *m, const char *path, uint64_t size, uint64_t location) {
+    m->files = realloc(m->files, (m->fileCount + 1) * sizeof(inst_ManifestFile));
+    QI_ASSERT(m->files != NULL);
+
+    inst_ManifestFile *file = &m->files[m->fileCount++];
+    file->path = strdup(path);
+    file->size = size;
+    file->location = location;
+    QI_ASSERT(file->path != NULL);
+
+    m->totalBytes += size;
+}
+
+// Reads a manifest shipped on the media. Returns false if the file is broken.
+static bool inst_manifestRead(inst_Manifest *m, FILE *f) {
+    char *line = malloc(MANIFEST_LINE_LENGTH);
+    QI_ASSERT(line != NULL);
+
+    bool success = true;
+
+    while (success && fgets(line, MANIFEST_LINE_LENGTH, f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (line[0] == '\0' || line[0] == '#') continue;
+
+        if (line[0] == 'D' && line[1] == ' ') {
+            inst_manifestAddDir(m, &line[2]);
+        } else if (line[0] == 'F' && line[1] == ' ') {
+            char *path = NULL;
+            uint64_t size = strtoull(&line[2], &path, 10);
+            success = (path != &line[2] && *path == ' ');
+            if (success) inst_manifestAddFile(m, path + 1, size, 0);
+        } else {
+            success = false;
+        }
+    }
+
+    free(line);
+    return success;
+}
+
+// Gets the physical location of a file's first block on its file system, 0 if unknown
+static uint64_t inst_manifestGetLocation(int fd) {
+    int block = 0;
+    if (ioctl(fd, FIBMAP, &block) != 0 || block < 0) return 0;
+    return (uint64_t) block;
+}
+
+// Scans a tree once. Entry types come from readdir, files are opened once for their size and location.
+static bool inst_manifestScan(inst_Manifest *m, const char *basePath, const char *relPath) {
+    char *dirPath = (relPath[0] != '\0') ? util_pathAppend(basePath, relPath) : strdup(basePath);
+    QI_FATAL(dirPath != NULL, "Failed to allocate path string");
+
+    DIR *d = opendir(dirPath);
+    free(dirPath);
+    util_returnOnNull(d, false);
+
+    bool success = true;
+    struct dirent *e;
+
+    while (success && (e = readdir(d))) {
+        if (util_stringEquals(e->d_name, ".") || util_stringEquals(e->d_name, ".."))
+            continue;
+
+        char *entryPath = (relPath[0] != '\0') ? util_pathAppend(relPath, e->d_name) : strdup(e->d_name);
+        QI_FATAL(entryPath != NULL, "Failed to allocate path string");
+
+        unsigned char type = e->d_type;
+        struct stat st;
+
+        // Not every file system fills in d_type
+        if (type == DT_UNKNOWN && fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type == DT_DIR) {
+            inst_manifestAddDir(m, entryPath);
+            success = inst_manifestScan(m, basePath, entryPath);
+        } else if (type == DT_REG) {
+            int fd = openat(dirfd(d), e->d_name, O_RDONLY);
+            success = (fd >= 0) && (fstat(fd, &st) == 0);
+            if (success) inst_manifestAddFile(m, entryPath, (uint64_t) st.st_size, inst_manifestGetLocation(fd));
+            if (fd >= 0) close(fd);
+        }
+
+        free(entryPath);
+    }
+
+    closedir(d);
+    return success;
+}
+
+static int inst_manifestCompareLocation(const void *a, const void *b) {
+    const inst_ManifestFile *fa = (const inst_ManifestFile *) a;
+    const inst_ManifestFile *fb = (const inst_ManifestFile *) b;
+    if (fa->location != fb->location) return (fa->location > fb->location) ? 1 : -1;
+    return strcmp(fa->path, fb->path);
+}
+
+inst_Manifest *inst_manifestCreate(const char *sourceBase) {
+    QI_ASSERT(sourceBase != NULL);
+
+    inst_Manifest *m = calloc(1, sizeof(inst_Manifest));
+    QI_ASSERT(m != NULL);
+
+    char listPath[PATH_MAX];
+    snprintf(listPath, sizeof(listPath), "%s.lst", sourceBase);
+
+    FILE *f = fopen(listPath, "r");
+
+    if (f != NULL) {
+        bool success = inst_manifestRead(m, f);
+        fclose(f);
+
+        if (success) {
+            inst_logPrintf("Manifest: %s, %zu files, %" PRIu64 " bytes", listPath, m->fileCount, m->totalBytes);
+            return m;
+        }
+
+        // Broken manifest, scan instead
+        inst_manifestDestroy(m);
+        m = calloc(1, sizeof(inst_Manifest));
+        QI_ASSERT(m != NULL);
+    }
+
+    if (!inst_manifestScan(m, sourceBase, "")) {
+        inst_manifestDestroy(m);
+        return NULL;
+    }
+
+    // Copy in the order the data is on the source media, so a slow optical drive doesn't have to seek around
+    qsort(m->files, m->fileCount, sizeof(inst_ManifestFile), inst_manifestCompareLocation);
+
+    inst_logPrintf("Manifest: scanned %s, %zu files, %" PRIu64 " bytes", sourceBase, m->fileCount, m->totalBytes);
+    return m;
+}
+
+void inst_manifestDestroy(inst_Manifest *m) {
+    if (m == NULL) return;
+
+    for (size_t i = 0; i < m->dirCount; i++) {
+        free(m->dirs[i]);
+    }
+
+    for (size_t i = 0; i < m->fileCount; i++) {
+        free(m->files[i].path);
+    }
+
+    free(m->dirs);
+    free(m->files);
+    free(m);
+}
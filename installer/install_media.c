@@ -0,0 +1,398 @@
+/*
+ * LUNMERCY - Install media discovery
+ *
+ * Every candidate block device is probed in its own thread by reading only the ISO9660 primary
+ * volume descriptor or the FAT boot sector and root directory, looking for the kernel file that
+ * marks our install media. Only the winning device gets mounted. A slow or empty drive thus only
+ * delays the result if it could still beat a device that was already found.
+ *
+ * There is no UI in here, it is also built into the findcd helper of the initrd (see findcd.c).
+ *
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "install.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+
+#include "qi_assert.h"
+#include "util.h"
+
+#define MEDIA_MARKER_FILE       "bzImage.cd"
+#define MEDIA_MARKER_ISO        "BZIMAGE.CD"
+#define MEDIA_MARKER_FAT        "BZIMAGE CD "
+
+#define MEDIA_MAX_CANDIDATES    (64)
+#define MEDIA_ISO_SECTOR        (2048)
+#define MEDIA_ISO_PVD_SECTOR    (16)
+#define MEDIA_ISO_MAX_ROOT_SIZE (64 __KB)
+#define MEDIA_FAT_MAX_ROOT_SIZE (64 __KB)
+#define MEDIA_FAT_MAX_CLUSTERS  (64)
+
+typedef enum {
+    MEDIA_FS_NONE = 0,
+    MEDIA_FS_ISO9660,
+    MEDIA_FS_VFAT,
+} inst_MediaFs;
+
+// Search order, same as the old findcd.sh. Lower index wins if media is found on several devices.
+static const struct {
+    const char *prefix;
+    inst_MediaFs fs;
+} inst_mediaSearchOrder[] = {
+    { "sr",  MEDIA_FS_ISO9660 },    // CD-ROM
+    { "cd",  MEDIA_FS_ISO9660 },    // CD-ROM (alternate)
+    { "ide", MEDIA_FS_ISO9660 },    // CD-ROM (alternate)
+    { "sd",  MEDIA_FS_ISO9660 },    // Flash drives can be in ISO
+    { "hd",  MEDIA_FS_ISO9660 },    // Flash drives can be in ISO
+    { "sd",  MEDIA_FS_VFAT },       // Flash drive or hard drive in FAT32
+    { "hd",  MEDIA_FS_VFAT },       // Flash drive or hard drive in FAT32
+    { "nv",  MEDIA_FS_VFAT },       // NVME (lol?)
+};
+
+#define MEDIA_RANK_NONE         (util_arraySize(inst_mediaSearchOrder))
+
+typedef struct {
+    char device[32];
+    size_t bestRank;        // Best rank this device could possibly get
+    size_t rank;            // Rank of what was actually found, MEDIA_RANK_NONE if nothing
+    inst_MediaFs fs;
+    bool done;
+} inst_MediaCandidate;
+
+// Shared between the caller and the probe threads. Whoever drops the last reference frees it,
+// so the caller doesn't have to wait for drives that can't win anymore.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    size_t references;
+    size_t count;
+    inst_MediaCandidate candidates[MEDIA_MAX_CANDIDATES];
+} inst_MediaSearch;
+
+typedef struct {
+    inst_MediaSearch *search;
+    inst_MediaCandidate *candidate;
+} inst_MediaProbeParam;
+
+static bool inst_mediaReadAt(int fd, uint8_t *buf, size_t size, uint64_t offset) {
+    return pread(fd, buf, size, (off_t) offset) == (ssize_t) size;
+}
+
+// Compares an ISO9660 file identifier, ignoring the ";1" version suffix and case
+static bool inst_mediaIsoNameEquals(const uint8_t *name, size_t len, const char *wanted) {
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] == ';') {
+            len = i;
+            break;
+        }
+    }
+
+    return len == strlen(wanted) && strncasecmp((const char *) name, wanted, len) == 0;
+}
+
+// Checks for the marker file in the root directory of an ISO9660 file system
+static bool inst_mediaProbeIso9660(int fd, uint8_t *buf) {
+    if (!inst_mediaReadAt(fd, buf, MEDIA_ISO_SECTOR, MEDIA_ISO_PVD_SECTOR * MEDIA_ISO_SECTOR)) return false;
+    if (buf[0] != 0x01 || memcmp(&buf[1], "CD001", 5) != 0) return false;
+
+    // Root directory record is embedded in the PVD
+    uint32_t rootLba = util_getUInt32fromBuffer(buf, 156 + 2);
+    uint32_t rootSize = MIN(util_getUInt32fromBuffer(buf, 156 + 10), MEDIA_ISO_MAX_ROOT_SIZE);
+
+    if (rootSize == 0 || !inst_mediaReadAt(fd, buf, rootSize, (uint64_t) rootLba * MEDIA_ISO_SECTOR)) return false;
+
+    for (size_t pos = 0; pos < rootSize;) {
+        uint8_t recordLen = buf[pos];
+
+        if (recordLen == 0) {
+            // Records don't cross sector boundaries, the rest of this sector is padding
+            pos = (pos / MEDIA_ISO_SECTOR + 1) * MEDIA_ISO_SECTOR;
+            continue;
+        }
+
+        if (pos + recordLen > rootSize || recordLen < 34) break;
+
+        uint8_t nameLen = buf[pos + 32];
+        if (33 + (size_t) nameLen <= recordLen && inst_mediaIsoNameEquals(&buf[pos + 33], nameLen, MEDIA_MARKER_ISO)) {
+            return true;
+        }
+
+        pos += recordLen;
+    }
+
+    return false;
+}
+
+// Looks for the marker file in a block of FAT directory entries.
+// Returns 1 if found, 0 if not, -1 if the end of the directory was reached.
+static int inst_mediaFatScanEntries(const uint8_t *entries, size_t size) {
+    for (size_t pos = 0; pos + 32 <= size; pos += 32) {
+        const uint8_t *entry = &entries[pos];
+        uint8_t attributes = entry[11];
+
+        if (entry[0] == 0x00) return -1;
+        if (entry[0] == 0xE5 || (attributes & 0x08)) continue; // Deleted, volume label or LFN entry
+
+        if (memcmp(entry, MEDIA_MARKER_FAT, 11) == 0) return 1;
+    }
+
+    return 0;
+}
+
+// Checks for the marker file in the root directory of a FAT12/16/32 file system
+static bool inst_mediaProbeFat(int fd, uint8_t *buf) {
+    if (!inst_mediaReadAt(fd, buf, 512, 0)) return false;
+    if (buf[510] != 0x55 || buf[511] != 0xAA) return false;
+
+    uint32_t bytesPerSector     = util_getUInt16fromBuffer(buf, 11);
+    uint32_t sectorsPerCluster  = buf[13];
+    uint32_t reservedSectors    = util_getUInt16fromBuffer(buf, 14);
+    uint32_t fatCount           = buf[16];
+    uint32_t rootEntries        = util_getUInt16fromBuffer(buf, 17);
+    uint32_t sectorsPerFat      = util_getUInt16fromBuffer(buf, 22);
+    uint32_t rootCluster        = 0;
+
+    // Sanity check the BPB, MBRs and other junk fail here
+    bool validSectorSize = bytesPerSector >= 512 && bytesPerSector <= 4096 && (bytesPerSector & (bytesPerSector - 1)) == 0;
+    bool validClusterSize = sectorsPerCluster != 0 && (sectorsPerCluster & (sectorsPerCluster - 1)) == 0;
+
+    if (!validSectorSize || !validClusterSize || reservedSectors == 0 || fatCount == 0 || fatCount > 2) return false;
+
+    if (sectorsPerFat == 0) {
+        // FAT32
+        sectorsPerFat = util_getUInt32fromBuffer(buf, 36);
+        rootCluster = util_getUInt32fromBuffer(buf, 44);
+        if (sectorsPerFat == 0 || rootCluster < 2 || rootEntries != 0) return false;
+    }
+
+    uint64_t fatOffset = (uint64_t) reservedSectors * bytesPerSector;
+    uint64_t rootOffset = fatOffset + (uint64_t) fatCount * sectorsPerFat * bytesPerSector;
+
+    if (rootCluster == 0) {
+        // FAT12/16: Fixed size root directory right after the FATs
+        size_t rootSize = MIN((size_t) rootEntries * 32, MEDIA_FAT_MAX_ROOT_SIZE);
+        if (rootSize == 0 || !inst_mediaReadAt(fd, buf, rootSize, rootOffset)) return false;
+        return inst_mediaFatScanEntries(buf, rootSize) == 1;
+    }
+
+    // FAT32: Root directory is a cluster chain, the data area starts right after the FATs
+    size_t clusterSize = (size_t) sectorsPerCluster * bytesPerSector;
+    if (clusterSize > MEDIA_FAT_MAX_ROOT_SIZE) return false;
+
+    uint32_t cluster = rootCluster;
+
+    for (size_t i = 0; i < MEDIA_FAT_MAX_CLUSTERS && cluster >= 2 && cluster < 0x0FFFFFF7; i++) {
+        if (!inst_mediaReadAt(fd, buf, clusterSize, rootOffset + (uint64_t) (cluster - 2) * clusterSize)) return false;
+
+        int result = inst_mediaFatScanEntries(buf, clusterSize);
+        if (result != 0) return result == 1;
+
+        uint8_t next[4];
+        if (!inst_mediaReadAt(fd, next, sizeof(next), fatOffset + (uint64_t) cluster * 4)) return false;
+        cluster = util_getUInt32fromBuffer(next, 0) & 0x0FFFFFFF;
+    }
+
+    return false;
+}
+
+// Gets the search rank for a device name and file system, MEDIA_RANK_NONE if it isn't searched for
+static size_t inst_mediaGetRank(const char *device, inst_MediaFs fs) {
+    for (size_t i = 0; i < util_arraySize(inst_mediaSearchOrder); i++) {
+        if ((fs == MEDIA_FS_NONE || fs == inst_mediaSearchOrder[i].fs) && util_stringStartsWith(device, inst_mediaSearchOrder[i].prefix)) {
+            return i;
+        }
+    }
+
+    return MEDIA_RANK_NONE;
+}
+
+static void inst_mediaSearchRelease(inst_MediaSearch *search) {
+    pthread_mutex_lock(&search->lock);
+    bool last = (--search->references == 0);
+    pthread_mutex_unlock(&search->lock);
+
+    if (last) {
+        pthread_mutex_destroy(&search->lock);
+        pthread_cond_destroy(&search->changed);
+        free(search);
+    }
+}
+
+static void *inst_mediaProbeThreadFunc(void *p) {
+    inst_MediaProbeParam *param = (inst_MediaProbeParam *) p;
+    inst_MediaSearch *search = param->search;
+    inst_MediaCandidate *candidate = param->candidate;
+    free(param);
+
+    char path[40];
+    snprintf(path, sizeof(path), "/dev/%s", candidate->device);
+
+    inst_MediaFs found = MEDIA_FS_NONE;
+    uint8_t *buf = malloc(MAX(MEDIA_ISO_MAX_ROOT_SIZE, MEDIA_FAT_MAX_ROOT_SIZE));
+
+    // O_NONBLOCK so that opening an empty optical drive doesn't wait for the tray
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+
+    if (buf != NULL && fd >= 0) {
+        if (inst_mediaGetRank(candidate->device, MEDIA_FS_ISO9660) != MEDIA_RANK_NONE && inst_mediaProbeIso9660(fd, buf)) {
+            found = MEDIA_FS_ISO9660;
+        } else if (inst_mediaGetRank(candidate->device, MEDIA_FS_VFAT) != MEDIA_RANK_NONE && inst_mediaProbeFat(fd, buf)) {
+            found = MEDIA_FS_VFAT;
+        }
+    }
+
+    if (fd >= 0) close(fd);
+    free(buf);
+
+    pthread_mutex_lock(&search->lock);
+    candidate->fs = found;
+    candidate->rank = (found != MEDIA_FS_NONE) ? inst_mediaGetRank(candidate->device, found) : MEDIA_RANK_NONE;
+    candidate->done = true;
+    pthread_cond_broadcast(&search->changed);
+    pthread_mutex_unlock(&search->lock);
+
+    inst_mediaSearchRelease(search);
+    return NULL;
+}
+
+// Collects all block devices (including partitions) that match the search order
+static void inst_mediaCollectCandidates(inst_MediaSearch *search) {
+    DIR *dir = opendir("/sys/class/block");
+    if (dir == NULL) return;
+
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL && search->count < MEDIA_MAX_CANDIDATES) {
+        if (entry->d_name[0] == '.' || strlen(entry->d_name) >= sizeof(search->candidates[0].device)) continue;
+
+        size_t rank = inst_mediaGetRank(entry->d_name, MEDIA_FS_NONE);
+        if (rank == MEDIA_RANK_NONE) continue;
+
+        inst_MediaCandidate *candidate = &search->candidates[search->count++];
+        strcpy(candidate->device, entry->d_name);
+        candidate->bestRank = rank;
+        candidate->rank = MEDIA_RANK_NONE;
+    }
+
+    closedir(dir);
+}
+
+// Whether media with the given rank on a device beats what was found on another one. On a tie, the device
+// name decides, so the same media set always ends up with the same winner no matter which drive answers first.
+static bool inst_mediaBeats(size_t rank, const char *device, const inst_MediaCandidate *other) {
+    return rank < other->rank || (rank == other->rank && strcmp(device, other->device) < 0);
+}
+
+// Gets the index of the winning candidate, once it can't be beaten anymore by a device that's still being probed.
+// Returns -1 if there's no winner yet, -2 if everything is done and nothing was found. Call with the lock held.
+static int inst_mediaGetWinner(const inst_MediaSearch *search) {
+    int best = -1;
+    bool allDone = true;
+
+    for (size_t i = 0; i < search->count; i++) {
+        const inst_MediaCandidate *c = &search->candidates[i];
+        allDone &= c->done;
+        if (c->done && c->rank != MEDIA_RANK_NONE && (best < 0 || inst_mediaBeats(c->rank, c->device, &search->candidates[best]))) {
+            best = (int) i;
+        }
+    }
+
+    if (best < 0) {
+        return allDone ? -2 : -1;
+    }
+
+    for (size_t i = 0; i < search->count; i++) {
+        const inst_MediaCandidate *c = &search->candidates[i];
+        if (!c->done && inst_mediaBeats(c->bestRank, c->device, &search->candidates[best])) {
+            return -1;
+        }
+    }
+
+    return best;
+}
+
+bool inst_findSourceMedia(const char *mountPath, char *deviceOut, size_t deviceOutSize) {
+    QI_ASSERT(mountPath != NULL);
+    QI_ASSERT(deviceOut != NULL);
+
+    inst_MediaSearch *search = calloc(1, sizeof(inst_MediaSearch));
+    QI_ASSERT(search != NULL);
+    QI_ASSERT(0 == pthread_mutex_init(&search->lock, NULL));
+    QI_ASSERT(0 == pthread_cond_init(&search->changed, NULL));
+
+    inst_mediaCollectCandidates(search);
+
+    search->references = 1;
+
+    pthread_mutex_lock(&search->lock);
+
+    for (size_t i = 0; i < search->count; i++) {
+        inst_MediaProbeParam *param = malloc(sizeof(inst_MediaProbeParam));
+        QI_ASSERT(param != NULL);
+        param->search = search;
+        param->candidate = &search->candidates[i];
+
+        pthread_t thread;
+        search->references++;
+
+        if (pthread_create(&thread, NULL, inst_mediaProbeThreadFunc, param) == 0) {
+            pthread_detach(thread);
+        } else {
+            // Can't happen in practice, treat it like a device without media
+            search->references--;
+            search->candidates[i].done = true;
+            free(param);
+        }
+    }
+
+    int winner;
+
+    while ((winner = inst_mediaGetWinner(search)) == -1) {
+        pthread_cond_wait(&search->changed, &search->lock);
+    }
+
+    inst_MediaCandidate result = {0};
+    if (winner >= 0) result = search->candidates[winner];
+
+    pthread_mutex_unlock(&search->lock);
+    inst_mediaSearchRelease(search);
+
+    if (winner < 0) {
+        return false;
+    }
+
+    snprintf(deviceOut, deviceOutSize, "/dev/%s", result.device);
+    mkdir(mountPath, 0777);
+
+    const char *fsType = (result.fs == MEDIA_FS_ISO9660) ? "iso9660" : "vfat";
+    unsigned long flags = (result.fs == MEDIA_FS_ISO9660) ? MS_RDONLY : 0;
+
+    if (mount(deviceOut, mountPath, fsType, flags, NULL) != 0) {
+        return false;
+    }
+
+    util_mountTableInvalidate();
+
+    // The metadata looked right, but make sure the file system driver agrees
+    char *marker = util_pathAppend(mountPath, MEDIA_MARKER_FILE);
+    bool found = marker != NULL && util_fileExists(marker);
+    free(marker);
+
+    if (!found) {
+        umount2(mountPath, MNT_DETACH);
+        util_mountTableInvalidate();
+    }
+
+    return found;
+}
@@ -0,0 +1,199 @@
+/*
+ * LUNMERCY - Binary patches
+ *
+ * A patch describes a file as the changes to a file from a MercyPak file (see sysprep/blockdiff.py
+ * for the format). It is applied while that file is unpacked: the instructions only ever go forward
+ * in the base data, so the base and the patch are both read once, in order, and neither of them
+ * has to be held in memory.
+ *
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "install.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "qi_assert.h"
+#include "util.h"
+#include "mappedfile.h"
+
+#define PATCH_MAGIC             "QIDF"
+#define PATCH_NAME_MAX          (255)
+#define PATCH_SKIP_BUFFER_SIZE  (64 * 1024)
+
+struct inst_Patch {
+    MappedFile *file;
+    char name[PATCH_NAME_MAX + 1];  // Name of the patched file, with '/' separators
+    uint32_t baseSize;
+    uint32_t baseCrc;
+    uint32_t resultSize;
+    uint32_t instructionCount;
+    bool applied;
+
+    // State while the patch is applied
+    MappedFile *base;
+    uint32_t instructionsLeft;
+    uint32_t literalLeft;
+    uint32_t skipLeft;
+    uint32_t copyLeft;
+    uint32_t baseRead;              // Base bytes skipped or copied so far
+    uint32_t crc;                   // CRC-32 of the base data read so far
+    uint8_t *skipBuffer;
+};
+
+inst_Patch *inst_patchCreate(MappedFile *file) {
+    QI_ASSERT(file != NULL);
+
+    inst_Patch *patch = calloc(1, sizeof(inst_Patch));
+    QI_FATAL(patch != NULL, "Failed to allocate patch");
+
+    char magic[5] = {0};
+    uint8_t nameLength = 0;
+    bool success = true;
+
+    success &= mappedFile_read(file, magic, 4);
+    success &= util_stringEquals(magic, PATCH_MAGIC);
+    success &= mappedFile_getUInt8(file, &nameLength);
+    success &= mappedFile_read(file, patch->name, nameLength);
+    success &= mappedFile_getUInt32(file, &patch->baseSize);
+    success &= mappedFile_getUInt32(file, &patch->baseCrc);
+    success &= mappedFile_getUInt32(file, &patch->resultSize);
+    success &= mappedFile_getUInt32(file, &patch->instructionCount);
+
+    if (!success) {
+        inst_logPrintf("Patch file is invalid");
+        free(patch);
+        return NULL;
+    }
+
+    util_stringReplaceChar(patch->name, '\\', '/');
+    patch->file = file;
+
+    inst_logPrintf("Patch for %s: %u bytes -> %u bytes, %u instructions",
+        patch->name, (unsigned) patch->baseSize, (unsigned) patch->resultSize, (unsigned) patch->instructionCount);
+
+    return patch;
+}
+
+bool inst_patchAppliesTo(const inst_Patch *patch, const char *name, size_t size) {
+    if (patch == NULL) return false;
+
+    QI_ASSERT(name != NULL);
+    return !patch->applied && size == patch->baseSize && strcasecmp(name, patch->name) == 0;
+}
+
+size_t inst_patchGetResultSize(const inst_Patch *patch) {
+    QI_ASSERT(patch != NULL);
+    return patch->resultSize;
+}
+
+// Reads the next instruction header. Instructions must not read past the end of the base file.
+static bool inst_patchNextInstruction(inst_Patch *patch) {
+    if (patch->instructionsLeft == 0) {
+        return false;
+    }
+
+    bool success = true;
+    success &= mappedFile_getUInt32(patch->file, &patch->literalLeft);
+    success &= mappedFile_getUInt32(patch->file, &patch->skipLeft);
+    success &= mappedFile_getUInt32(patch->file, &patch->copyLeft);
+    patch->instructionsLeft--;
+
+    return success && (uint64_t) patch->baseRead + patch->skipLeft + patch->copyLeft <= patch->baseSize;
+}
+
+// Reads from the base file, keeping track of the CRC
+static bool inst_patchReadBase(inst_Patch *patch, uint8_t *dst, uint32_t len) {
+    if (!mappedFile_read(patch->base, dst, len)) {
+        return false;
+    }
+
+    patch->crc = util_crc32(patch->crc, dst, len);
+    patch->baseRead += len;
+    return true;
+}
+
+// Skips base data that isn't part of the result
+static bool inst_patchSkipBase(inst_Patch *patch, uint32_t len) {
+    while (len > 0) {
+        uint32_t toSkip = MIN(len, PATCH_SKIP_BUFFER_SIZE);
+        if (!inst_patchReadBase(patch, patch->skipBuffer, toSkip)) {
+            return false;
+        }
+        len -= toSkip;
+    }
+
+    return true;
+}
+
+// Produces the patched file, for inst_writerCopyFromReader
+static bool inst_patchRead(void *src, uint8_t *dst, size_t len) {
+    inst_Patch *patch = (inst_Patch *) src;
+
+    while (len > 0) {
+        if (patch->literalLeft > 0) {
+            uint32_t toCopy = (uint32_t) MIN(len, patch->literalLeft);
+            if (!mappedFile_read(patch->file, dst, toCopy)) return false;
+            patch->literalLeft -= toCopy;
+            dst += toCopy;
+            len -= toCopy;
+        } else if (patch->skipLeft > 0) {
+            if (!inst_patchSkipBase(patch, patch->skipLeft)) return false;
+            patch->skipLeft = 0;
+        } else if (patch->copyLeft > 0) {
+            uint32_t toCopy = (uint32_t) MIN(len, patch->copyLeft);
+            if (!inst_patchReadBase(patch, dst, toCopy)) return false;
+            patch->copyLeft -= toCopy;
+            dst += toCopy;
+            len -= toCopy;
+        } else if (!inst_patchNextInstruction(patch)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool inst_patchApply(inst_Patch *patch, inst_Writer *w, inst_WriterFile *file, MappedFile *base) {
+    QI_ASSERT(patch != NULL && base != NULL);
+
+    patch->base = base;
+    patch->instructionsLeft = patch->instructionCount;
+    patch->literalLeft = patch->skipLeft = patch->copyLeft = 0;
+    patch->baseRead = 0;
+    patch->crc = 0;
+    patch->skipBuffer = malloc(PATCH_SKIP_BUFFER_SIZE);
+    QI_FATAL(patch->skipBuffer != NULL, "Failed to allocate patch skip buffer");
+
+    bool success = inst_writerCopyFromReader(w, file, inst_patchRead, patch, patch->resultSize);
+
+    // All of the patch and all of the base have to be used up, the rest of the base is skipped
+    success = success
+        && patch->literalLeft == 0 && patch->copyLeft == 0 && patch->instructionsLeft == 0
+        && inst_patchSkipBase(patch, patch->baseSize - patch->baseRead);
+
+    free(patch->skipBuffer);
+    patch->skipBuffer = NULL;
+    patch->base = NULL;
+
+    if (success && patch->crc != patch->baseCrc) {
+        inst_logPrintf("Patch for %s does not match the base file (CRC %08x, expected %08x)",
+            patch->name, (unsigned) patch->crc, (unsigned) patch->baseCrc);
+        success = false;
+    }
+
+    patch->applied = success;
+    return success;
+}
+
+bool inst_patchWasApplied(const inst_Patch *patch) {
+    QI_ASSERT(patch != NULL);
+    return patch->applied;
+}
+
+void inst_patchDestroy(inst_Patch *patch) {
+    free(patch);
+}
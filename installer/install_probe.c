@@ -0,0 +1,157 @@
+/*
+ * LUNMERCY - Target disk speed probe
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "install.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "qi_assert.h"
+#include "util.h"
+
+#define PROBE_FILE_NAME         "QIPROBE.TMP"
+#define PROBE_SEQ_SIZE          (4 __MB)    // Keep this short, the slowest targets do ~1 MB/s
+#define PROBE_SEQ_BLOCK         (256 __KB)
+#define PROBE_RANDOM_BLOCK      (4 __KB)
+#define PROBE_RANDOM_COUNT      (64)
+
+// Thresholds for the tuning decisions below
+#define PROBE_FAST_SEQ_KBS      (20 * 1024)     // Modern disks and good CF cards
+#define PROBE_SLOW_SEQ_KBS      (4 * 1024)      // Old IDE disks, PIO mode
+#define PROBE_FLASH_IOPS        (500)           // No seek penalty, parallel writers pay off
+#define PROBE_SEEKING_IOPS      (150)           // Rotating media, keep writes in order
+
+// Gets a throughput in KB/s from bytes and elapsed microseconds
+static uint32_t inst_probeKBs(uint64_t bytes, uint64_t elapsedUs) {
+    if (elapsedUs == 0) elapsedUs = 1;
+    return (uint32_t) MIN((bytes * 1000000ULL / 1024ULL) / elapsedUs, UINT32_MAX);
+}
+
+void inst_diskTuningSetDefaults(inst_DiskTuning *tuning) {
+    QI_ASSERT(tuning != NULL);
+    memset(tuning, 0, sizeof(inst_DiskTuning));
+    tuning->writeChunkSize = 256 __KB;
+    tuning->writerThreads = 1;
+    tuning->coalesceSmallFiles = true;
+    tuning->readaheadPercent = 75;
+}
+
+// Derives unpacker settings from the measurements
+static void inst_probeDeriveTuning(inst_DiskTuning *tuning, uint32_t optIoSize) {
+    if (tuning->seqWriteKBs >= PROBE_FAST_SEQ_KBS) {
+        tuning->writeChunkSize = 1 __MB;
+    } else if (tuning->seqWriteKBs >= PROBE_SLOW_SEQ_KBS) {
+        tuning->writeChunkSize = 256 __KB;
+    } else {
+        tuning->writeChunkSize = 64 __KB;
+    }
+
+    // Some RAID controllers & SSDs report what they like, round up to a multiple of that
+    if (optIoSize >= 4 __KB && optIoSize <= 4 __MB) {
+        tuning->writeChunkSize = (tuning->writeChunkSize + optIoSize - 1) / optIoSize * optIoSize;
+    }
+
+    if (tuning->randWriteIops >= PROBE_FLASH_IOPS) {
+        tuning->writerThreads = 4;
+    } else if (tuning->randWriteIops >= PROBE_SEEKING_IOPS) {
+        tuning->writerThreads = 2;
+    } else {
+        tuning->writerThreads = 1;
+    }
+
+    // On seek bound disks, small files must hit the disk in pack order
+    tuning->coalesceSmallFiles = tuning->randWriteIops < PROBE_SEEKING_IOPS;
+
+    // A slow target needs a deeper write queue to ride out stalls, a fast one is starved by the source instead
+    tuning->readaheadPercent = tuning->seqWriteKBs < PROBE_SLOW_SEQ_KBS ? 50 : 75;
+}
+
+// Runs the actual measurements on an open, empty file
+static bool inst_probeMeasure(int fd, uint8_t *buf, inst_DiskTuning *tuning) {
+    bool success = true;
+
+    // Sequential write, including the flush
+    uint64_t start = util_getMonotonicTimeUs();
+
+    for (size_t offset = 0; success && offset < PROBE_SEQ_SIZE; offset += PROBE_SEQ_BLOCK) {
+        success = (pwrite(fd, buf, PROBE_SEQ_BLOCK, (off_t) offset) == (ssize_t) PROBE_SEQ_BLOCK);
+    }
+
+    success = success && (fdatasync(fd) == 0);
+    tuning->seqWriteKBs = inst_probeKBs(PROBE_SEQ_SIZE, util_getMonotonicTimeUs() - start);
+
+    // Small synchronous writes scattered over the file. This is what lots of small files look like to the disk.
+    uint32_t seed = 0x866;
+    start = util_getMonotonicTimeUs();
+
+    for (size_t i = 0; success && i < PROBE_RANDOM_COUNT; i++) {
+        seed = seed * 1103515245 + 12345;
+        off_t offset = (off_t) ((seed >> 8) % (PROBE_SEQ_SIZE / PROBE_RANDOM_BLOCK)) * PROBE_RANDOM_BLOCK;
+        success = (pwrite(fd, buf, PROBE_RANDOM_BLOCK, offset) == (ssize_t) PROBE_RANDOM_BLOCK)
+               && (fdatasync(fd) == 0);
+    }
+
+    uint64_t elapsed = MAX(util_getMonotonicTimeUs() - start, 1);
+    tuning->randWriteIops = (uint32_t) (PROBE_RANDOM_COUNT * 1000000ULL / elapsed);
+
+    // Sequential read with the page cache dropped, so it actually comes from the disk
+    posix_fadvise(fd, 0, PROBE_SEQ_SIZE, POSIX_FADV_DONTNEED);
+    start = util_getMonotonicTimeUs();
+
+    for (size_t offset = 0; success && offset < PROBE_SEQ_SIZE; offset += PROBE_SEQ_BLOCK) {
+        success = (pread(fd, buf, PROBE_SEQ_BLOCK, (off_t) offset) == (ssize_t) PROBE_SEQ_BLOCK);
+    }
+
+    tuning->seqReadKBs = inst_probeKBs(PROBE_SEQ_SIZE, util_getMonotonicTimeUs() - start);
+
+    return success;
+}
+
+bool inst_probeTargetDisk(const char *mountPath, uint32_t optIoSize, inst_DiskTuning *tuning) {
+    QI_ASSERT(mountPath != NULL);
+    QI_ASSERT(tuning != NULL);
+
+    inst_diskTuningSetDefaults(tuning);
+
+    char *probePath = util_pathAppend(mountPath, PROBE_FILE_NAME);
+    QI_FATAL(probePath != NULL, "Failed to allocate path string");
+
+    uint8_t *buf = malloc(PROBE_SEQ_BLOCK);
+    QI_FATAL(buf != NULL, "Failed to allocate probe buffer");
+    memset(buf, 0xF6, PROBE_SEQ_BLOCK);
+
+    bool success = false;
+    int fd = open(probePath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+    if (fd >= 0) {
+        success = inst_probeMeasure(fd, buf, tuning);
+        close(fd);
+        unlink(probePath);
+    }
+
+    free(buf);
+    free(probePath);
+
+    if (!success) {
+        inst_diskTuningSetDefaults(tuning);
+        inst_logPrintf("Disk probe: FAILED, using defaults");
+    } else {
+        tuning->probed = true;
+        inst_probeDeriveTuning(tuning, optIoSize);
+        inst_logPrintf("Disk probe: seq write %u KB/s, seq read %u KB/s, 4K sync write %u IOPS, opt-io %u",
+            tuning->seqWriteKBs, tuning->seqReadKBs, tuning->randWriteIops, optIoSize);
+    }
+
+    inst_logPrintf("Disk tuning: chunk %zu KB, %zu writer thread(s), coalesce small files: %s, readahead %u%%",
+        tuning->writeChunkSize / 1024, tuning->writerThreads, tuning->coalesceSmallFiles ? "yes" : "no",
+        tuning->readaheadPercent);
+
+    return success;
+}
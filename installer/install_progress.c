@@ -0,0 +1,231 @@
+/*
+ * LUNMERCY - Install progress display
+ *
+ * Install steps only store their progress in counters. A UI thread samples them at a fixed rate
+ * and repaints what changed, so extracting thousands of small files doesn't mean thousands of
+ * screen updates. It also shows throughput and the estimated time left in the footer.
+ *
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "install.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "qi_assert.h"
+#include "util.h"
+
+#define PROGRESS_BAR_MAX            (16)
+#define PROGRESS_INTERVAL_US        (200000)    // 5 Hz
+#define PROGRESS_FOOTER_SIZE        (160)
+
+typedef struct {
+    uint32_t value;     // Bar units. Written by install steps, read by the UI thread, both atomically
+    uint32_t max;
+    uint32_t files;     // Files processed so far, data bars only
+} inst_ProgressCounter;
+
+typedef struct {
+    uint32_t value;
+    uint32_t max;
+} inst_ProgressShown;
+
+static inst_ProgressCounter progressCounters[PROGRESS_BAR_MAX];
+
+static pthread_mutex_t uiLock = PTHREAD_MUTEX_INITIALIZER;          // Held while anything is drawn
+static pthread_mutex_t stepLock = PTHREAD_MUTEX_INITIALIZER;
+static const char *stepText = NULL;                                 // Text for the footer, NULL for none
+static size_t stepBar = 0;                                          // Bar of the step shown in the footer
+
+static pthread_t progressThread;
+static bool progressRunning = false;
+static bool progressStopping = false;
+static ad_ProgressBox *progressBox = NULL;
+static size_t progressBarCount = 0;
+static size_t progressFirstDataBar = 0;
+
+static char progressFooter[PROGRESS_FOOTER_SIZE];
+
+typedef struct {
+    inst_ProgressShown shown[PROGRESS_BAR_MAX];
+    uint64_t lastUs;
+    uint32_t lastKB;
+    uint32_t lastFiles;
+    uint32_t rateKBs;           // Smoothed over the last few samples
+    uint32_t rateFiles;
+    const char *lastText;
+} inst_ProgressUiState;
+
+// Formats a number of seconds as m:ss (or h:mm:ss)
+static void inst_progressFormatTime(char *dst, size_t size, uint32_t seconds) {
+    if (seconds >= 3600) {
+        snprintf(dst, size, "%u:%02u:%02u", seconds / 3600, (seconds / 60) % 60, seconds % 60);
+    } else {
+        snprintf(dst, size, "%u:%02u", seconds / 60, seconds % 60);
+    }
+}
+
+// Paints changed bars and the footer. Call with the UI lock held.
+static void inst_progressPaint(inst_ProgressUiState *ui) {
+    uint32_t doneKB = 0;
+    uint32_t totalKB = 0;
+    uint32_t files = 0;
+
+    for (size_t i = 0; i < progressBarCount; i++) {
+        uint32_t max = __atomic_load_n(&progressCounters[i].max, __ATOMIC_RELAXED);
+        uint32_t value = __atomic_load_n(&progressCounters[i].value, __ATOMIC_RELAXED);
+
+        if (max != ui->shown[i].max) {
+            ad_progressBoxSetMaxProgress(progressBox, i, max);
+            ui->shown[i].max = max;
+        }
+
+        if (value != ui->shown[i].value) {
+            ad_progressBoxMultiUpdate(progressBox, i, value);
+            ui->shown[i].value = value;
+        }
+
+        if (i >= progressFirstDataBar) {
+            doneKB += MIN(value, max);
+            totalKB += max;
+            files += __atomic_load_n(&progressCounters[i].files, __ATOMIC_RELAXED);
+        }
+    }
+
+    uint64_t nowUs = util_getMonotonicTimeUs();
+    uint64_t elapsedUs = nowUs - ui->lastUs;
+
+    if (elapsedUs > 0) {
+        uint32_t kbs = (uint32_t) ((uint64_t) (doneKB - ui->lastKB) * 1000000ULL / elapsedUs);
+        uint32_t fps = (uint32_t) ((uint64_t) (files - ui->lastFiles) * 1000000ULL / elapsedUs);
+        ui->rateKBs = (ui->rateKBs * 3 + kbs) / 4;
+        ui->rateFiles = (ui->rateFiles * 3 + fps) / 4;
+    }
+
+    ui->lastUs = nowUs;
+    ui->lastKB = doneKB;
+    ui->lastFiles = files;
+
+    pthread_mutex_lock(&stepLock);
+    const char *text = stepText;
+    size_t bar = stepBar;
+    pthread_mutex_unlock(&stepLock);
+
+    if (text == NULL) {
+        if (ui->lastText != NULL) ad_clearFooter();
+        ui->lastText = NULL;
+        return;
+    }
+
+    char footer[PROGRESS_FOOTER_SIZE];
+
+    if (bar >= progressFirstDataBar && bar < progressBarCount && ui->rateKBs > 0) {
+        uint32_t stepLeftKB = ui->shown[bar].max - MIN(ui->shown[bar].value, ui->shown[bar].max);
+        char stepEta[16];
+        char totalEta[16];
+
+        inst_progressFormatTime(stepEta, sizeof(stepEta), stepLeftKB / ui->rateKBs);
+        inst_progressFormatTime(totalEta, sizeof(totalEta), (totalKB - doneKB) / ui->rateKBs);
+
+        snprintf(footer, sizeof(footer), "%s %u.%u MB/s, %u files/s, ETA %s (all: %s)",
+            text, ui->rateKBs / 1024, (ui->rateKBs % 1024) * 10 / 1024, ui->rateFiles, stepEta, totalEta);
+    } else {
+        snprintf(footer, sizeof(footer), "%s", text);
+    }
+
+    if (text != ui->lastText || strcmp(footer, progressFooter) != 0) {
+        memcpy(progressFooter, footer, sizeof(progressFooter));
+        ad_setFooterText(progressFooter);
+        ui->lastText = text;
+    }
+}
+
+static void *inst_progressThreadFunc(void *param) {
+    inst_ProgressUiState *ui = (inst_ProgressUiState *) param;
+
+    while (!__atomic_load_n(&progressStopping, __ATOMIC_ACQUIRE)) {
+        usleep(PROGRESS_INTERVAL_US);
+
+        pthread_mutex_lock(&uiLock);
+        inst_progressPaint(ui);
+        pthread_mutex_unlock(&uiLock);
+    }
+
+    // Handed back for the final paint
+    return ui;
+}
+
+void inst_progressStart(ad_ProgressBox *box, size_t barCount, size_t firstDataBar) {
+    QI_ASSERT(box != NULL && barCount <= PROGRESS_BAR_MAX);
+    QI_ASSERT(!progressRunning);
+
+    memset(progressCounters, 0, sizeof(progressCounters));
+    progressBox = box;
+    progressBarCount = barCount;
+    progressFirstDataBar = firstDataBar;
+    progressFooter[0] = '\0';
+    inst_progressSetStep(NULL, 0);
+
+    inst_ProgressUiState *ui = calloc(1, sizeof(inst_ProgressUiState));
+    QI_ASSERT(ui != NULL);
+    ui->lastUs = util_getMonotonicTimeUs();
+
+    progressStopping = false;
+    QI_ASSERT(0 == pthread_create(&progressThread, NULL, inst_progressThreadFunc, ui));
+    progressRunning = true;
+}
+
+void inst_progressStop(void) {
+    if (!progressRunning) return;
+
+    __atomic_store_n(&progressStopping, true, __ATOMIC_RELEASE);
+
+    void *ui = NULL;
+    pthread_join(progressThread, &ui);
+
+    // Show the final state
+    inst_progressSetStep(NULL, 0);
+    pthread_mutex_lock(&uiLock);
+    inst_progressPaint((inst_ProgressUiState *) ui);
+    pthread_mutex_unlock(&uiLock);
+
+    free(ui);
+    progressRunning = false;
+    progressBox = NULL;
+    progressBarCount = 0;
+}
+
+void inst_progressSetMax(size_t bar, uint32_t max) {
+    QI_ASSERT(bar < PROGRESS_BAR_MAX);
+    __atomic_store_n(&progressCounters[bar].max, max, __ATOMIC_RELAXED);
+}
+
+void inst_progressUpdate(size_t bar, uint32_t value) {
+    QI_ASSERT(bar < PROGRESS_BAR_MAX);
+    __atomic_store_n(&progressCounters[bar].value, value, __ATOMIC_RELAXED);
+}
+
+void inst_progressUpdateFiles(size_t bar, uint32_t value, uint32_t files) {
+    QI_ASSERT(bar < PROGRESS_BAR_MAX);
+    __atomic_store_n(&progressCounters[bar].value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&progressCounters[bar].files, files, __ATOMIC_RELAXED);
+}
+
+void inst_progressSetStep(const char *text, size_t bar) {
+    pthread_mutex_lock(&stepLock);
+    stepText = text;
+    stepBar = bar;
+    pthread_mutex_unlock(&stepLock);
+}
+
+void inst_uiLock(void) {
+    pthread_mutex_lock(&uiLock);
+}
+
+void inst_uiUnlock(void) {
+    pthread_mutex_unlock(&uiLock);
+}
@@ -0,0 +1,157 @@
+/*
+ * LUNMERCY - Install step scheduler
+ *
+ * Each step declares which parts of the target it reads and writes. A step may start once every
+ * enabled step before it that touches the same parts has finished, so steps with disjoint file
+ * sets run side by side while the declared order is kept for everything that overlaps.
+ * With a concurrency of 1 this is exactly the old serial behaviour.
+ *
+ * Like before, no new step is started once a step has failed. Steps that are already running
+ * are allowed to finish.
+ *
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "install.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "qi_assert.h"
+#include "util.h"
+
+#define STEP_THREAD_STACK_SIZE  (512 __KB)
+#define STEP_IDLE_INTERVAL_MS   (100)
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    size_t running;
+    bool failed;
+} inst_StepContext;
+
+typedef struct {
+    inst_StepContext *ctx;
+    inst_Step *step;
+} inst_StepThreadParam;
+
+static void *inst_stepThreadFunc(void *param) {
+    inst_StepThreadParam *p = (inst_StepThreadParam *) param;
+
+    inst_TracePhase *phase = inst_tracePhaseBegin(p->step->footerText);
+    bool success = p->step->func(p->step->progressBarIndex);
+    inst_tracePhaseEnd(phase, success);
+
+    pthread_mutex_lock(&p->ctx->lock);
+    p->step->success = success;
+    p->step->done = true;
+    p->ctx->failed |= !success;
+    p->ctx->running--;
+    pthread_cond_signal(&p->ctx->finished);
+    pthread_mutex_unlock(&p->ctx->lock);
+
+    return NULL;
+}
+
+// Checks if two steps touch the same part of the target in a way that needs ordering
+static bool inst_stepsConflict(const inst_Step *a, const inst_Step *b) {
+    return (a->writes & (b->reads | b->writes)) || (b->writes & a->reads);
+}
+
+// Checks if all earlier enabled steps that conflict with steps[index] have finished. Call with the lock held.
+static bool inst_stepIsReady(const inst_Step *steps, size_t index) {
+    for (size_t i = 0; i < index; i++) {
+        if (steps[i].enabled && !steps[i].done && inst_stepsConflict(&steps[i], &steps[index])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Gets the oldest running step. Call with the lock held.
+static const inst_Step *inst_stepsGetOldestRunning(const inst_Step *steps, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (steps[i].started && !steps[i].done) {
+            return &steps[i];
+        }
+    }
+    return NULL;
+}
+
+bool inst_stepsRun(inst_Step *steps, size_t count, size_t maxConcurrent, inst_StepIdleFunc idle) {
+    QI_ASSERT(steps != NULL);
+    QI_ASSERT(maxConcurrent > 0);
+
+    inst_StepContext ctx = { .running = 0, .failed = false };
+    QI_ASSERT(0 == pthread_mutex_init(&ctx.lock, NULL));
+    QI_ASSERT(0 == pthread_cond_init(&ctx.finished, NULL));
+
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    inst_StepThreadParam *params = calloc(count, sizeof(inst_StepThreadParam));
+    QI_ASSERT(threads != NULL && params != NULL);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, STEP_THREAD_STACK_SIZE);
+
+    for (size_t i = 0; i < count; i++) {
+        steps[i].started = false;
+        steps[i].done = !steps[i].enabled;
+        steps[i].success = true;
+    }
+
+    pthread_mutex_lock(&ctx.lock);
+
+    while (true) {
+        // Start everything that may run now, in declaration order
+        for (size_t i = 0; !ctx.failed && ctx.running < maxConcurrent && i < count; i++) {
+            if (steps[i].started || steps[i].done || !inst_stepIsReady(steps, i)) continue;
+
+            inst_logPrintf("Step started: %s", steps[i].footerText);
+            inst_statusPrintf("state=step step=\"%s\"", steps[i].footerText);
+
+            steps[i].started = true;
+            params[i].ctx = &ctx;
+            params[i].step = &steps[i];
+            ctx.running++;
+            QI_ASSERT(0 == pthread_create(&threads[i], &attr, inst_stepThreadFunc, &params[i]));
+        }
+
+        if (ctx.running == 0) break;
+
+        const inst_Step *oldestRunning = inst_stepsGetOldestRunning(steps, count);
+
+        pthread_mutex_unlock(&ctx.lock);
+        if (idle != NULL) idle(oldestRunning);
+        pthread_mutex_lock(&ctx.lock);
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += STEP_IDLE_INTERVAL_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000L;
+        until.tv_nsec %= 1000000000L;
+
+        pthread_cond_timedwait(&ctx.finished, &ctx.lock, &until);
+    }
+
+    bool success = !ctx.failed;
+    pthread_mutex_unlock(&ctx.lock);
+
+    for (size_t i = 0; i < count; i++) {
+        if (steps[i].started) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    if (idle != NULL) idle(NULL);
+
+    pthread_attr_destroy(&attr);
+    free(threads);
+    free(params);
+    pthread_mutex_destroy(&ctx.lock);
+    pthread_cond_destroy(&ctx.finished);
+    return success;
+}
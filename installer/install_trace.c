@@ -0,0 +1,413 @@
+/*
+ * LUNMERCY - Install performance trace
+ *
+ * Collects timings and I/O counters of an installation and writes them to the target as one line of JSON,
+ * so slow installs on odd hardware can be looked at afterwards.
+ *
+ * Every install step runs as a phase. Counters are added to the phase of the calling thread, so steps that run
+ * side by side don't mix up their numbers. CPU time is that of the whole process while the phase ran,
+ * including the reader & writer threads. Per file times go from handing the file to the writer until
+ * it is closed on the target.
+ *
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "install.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+
+#include "qi_assert.h"
+#include "util.h"
+#include "version.h"
+
+#define TRACE_MAX_PHASES        (32)
+#define TRACE_MAX_INFO          (16)
+#define TRACE_SLOWEST_FILES     (16)
+#define TRACE_LINE_LENGTH       (1024)
+
+struct inst_TracePhase {
+    const char *name;
+    bool done;
+    bool success;
+    uint64_t startUs;
+    uint64_t wallUs;
+    uint64_t cpuStartUs;
+    uint64_t cpuUs;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t files;
+    uint64_t readStallUs;
+    uint64_t writeStallUs;
+};
+
+typedef struct {
+    char *key;
+    char *value;
+} inst_TraceInfo;
+
+typedef struct {
+    char *path;
+    uint64_t size;
+    uint64_t us;
+} inst_TraceFile;
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static inst_TracePhase tracePhases[TRACE_MAX_PHASES];
+static size_t tracePhaseCount = 0;
+static inst_TraceInfo traceInfo[TRACE_MAX_INFO];
+static size_t traceInfoCount = 0;
+static inst_TraceFile traceSlowest[TRACE_SLOWEST_FILES];
+static size_t traceSlowestCount = 0;
+static uint64_t traceStartUs = 0;
+
+static bool traceFinished = false;                      // Everything below is valid
+static bool traceSuccess = false;
+static inst_DiskTuning traceTuning;
+static uint64_t traceTotalUs = 0;
+static uint64_t traceUserUs = 0;
+static uint64_t traceSysUs = 0;
+static uint64_t traceMemHwmKB = 0;
+
+static __thread inst_TracePhase *traceCurrent = NULL;   // Phase of the calling thread
+
+static uint64_t inst_traceGetCpuTimeUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+void inst_traceReset(void) {
+    pthread_mutex_lock(&traceLock);
+
+    for (size_t i = 0; i < traceInfoCount; i++) {
+        free(traceInfo[i].key);
+        free(traceInfo[i].value);
+    }
+
+    for (size_t i = 0; i < traceSlowestCount; i++) {
+        free(traceSlowest[i].path);
+    }
+
+    memset(tracePhases, 0, sizeof(tracePhases));
+    tracePhaseCount = 0;
+    traceInfoCount = 0;
+    traceSlowestCount = 0;
+    traceStartUs = util_getMonotonicTimeUs();
+    traceFinished = false;
+
+    pthread_mutex_unlock(&traceLock);
+}
+
+void inst_traceSetInfo(const char *key, const char *value) {
+    QI_ASSERT(key != NULL);
+
+    pthread_mutex_lock(&traceLock);
+
+    size_t i = 0;
+    while (i < traceInfoCount && !util_stringEquals(traceInfo[i].key, key)) i++;
+
+    if (i < TRACE_MAX_INFO) {
+        if (i == traceInfoCount) {
+            traceInfo[i].key = strdup(key);
+            QI_ASSERT(traceInfo[i].key != NULL);
+            traceInfoCount++;
+        } else {
+            free(traceInfo[i].value);
+        }
+
+        traceInfo[i].value = strdup(value != NULL ? value : "");
+        QI_ASSERT(traceInfo[i].value != NULL);
+    }
+
+    pthread_mutex_unlock(&traceLock);
+}
+
+inst_TracePhase *inst_tracePhaseBegin(const char *name) {
+    QI_ASSERT(name != NULL);
+
+    inst_TracePhase *phase = NULL;
+
+    pthread_mutex_lock(&traceLock);
+
+    // Phases past the limit just aren't traced
+    if (tracePhaseCount < TRACE_MAX_PHASES) {
+        phase = &tracePhases[tracePhaseCount++];
+        memset(phase, 0, sizeof(inst_TracePhase));
+        phase->name = name;
+        phase->startUs = util_getMonotonicTimeUs();
+        phase->cpuStartUs = inst_traceGetCpuTimeUs();
+    }
+
+    pthread_mutex_unlock(&traceLock);
+
+    traceCurrent = phase;
+    return phase;
+}
+
+void inst_tracePhaseEnd(inst_TracePhase *phase, bool success) {
+    if (phase == NULL) return;
+
+    pthread_mutex_lock(&traceLock);
+    phase->wallUs = util_getMonotonicTimeUs() - phase->startUs;
+    phase->cpuUs = inst_traceGetCpuTimeUs() - phase->cpuStartUs;
+    phase->success = success;
+    phase->done = true;
+    pthread_mutex_unlock(&traceLock);
+
+    if (traceCurrent == phase) traceCurrent = NULL;
+}
+
+void inst_traceAddIo(uint64_t bytesRead, uint64_t bytesWritten, uint64_t files) {
+    if (traceCurrent == NULL) return;
+
+    pthread_mutex_lock(&traceLock);
+    traceCurrent->bytesRead += bytesRead;
+    traceCurrent->bytesWritten += bytesWritten;
+    traceCurrent->files += files;
+    pthread_mutex_unlock(&traceLock);
+}
+
+void inst_traceAddStall(uint64_t readStallUs, uint64_t writeStallUs) {
+    if (traceCurrent == NULL) return;
+
+    pthread_mutex_lock(&traceLock);
+    traceCurrent->readStallUs += readStallUs;
+    traceCurrent->writeStallUs += writeStallUs;
+    pthread_mutex_unlock(&traceLock);
+}
+
+void inst_traceFile(const char *path, uint64_t size, uint64_t us) {
+    if (path == NULL) return;
+
+    pthread_mutex_lock(&traceLock);
+
+    // Find the fastest of the kept files, it gets replaced once the list is full
+    size_t slot = traceSlowestCount;
+
+    if (traceSlowestCount == TRACE_SLOWEST_FILES) {
+        slot = 0;
+        for (size_t i = 1; i < traceSlowestCount; i++) {
+            if (traceSlowest[i].us < traceSlowest[slot].us) slot = i;
+        }
+
+        if (traceSlowest[slot].us >= us) slot = TRACE_SLOWEST_FILES;
+    }
+
+    if (slot < TRACE_SLOWEST_FILES) {
+        char *copy = strdup(path);
+        QI_ASSERT(copy != NULL);
+
+        if (slot == traceSlowestCount) {
+            traceSlowestCount++;
+        } else {
+            free(traceSlowest[slot].path);
+        }
+
+        traceSlowest[slot].path = copy;
+        traceSlowest[slot].size = size;
+        traceSlowest[slot].us = us;
+    }
+
+    pthread_mutex_unlock(&traceLock);
+}
+
+// Writes a JSON string, escaping what needs it
+static void inst_tracePrintString(FILE *out, const char *str) {
+    fputc('"', out);
+
+    for (const unsigned char *c = (const unsigned char *) str; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20 || *c >= 0x7F) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+
+    fputc('"', out);
+}
+
+// Gets the value of a "Key: value" line from a /proc file, with leading blanks removed. Returns false if it's not there.
+static bool inst_traceGetProcValue(const char *file, const char *key, char *dst, size_t size) {
+    char line[TRACE_LINE_LENGTH];
+    FILE *f = fopen(file, "r");
+    bool found = false;
+    size_t keyLen = strlen(key);
+
+    if (f == NULL) return false;
+
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, key, keyLen) != 0) continue;
+
+        char *value = line + keyLen;
+        while (*value == ' ' || *value == '\t') value++;
+        if (*value != ':') continue;
+        value++;
+        while (*value == ' ' || *value == '\t') value++;
+
+        value[strcspn(value, "\r\n")] = '\0';
+        snprintf(dst, size, "%s", value);
+        found = true;
+    }
+
+    fclose(f);
+    return found;
+}
+
+static void inst_tracePrintSystem(FILE *out) {
+    char value[TRACE_LINE_LENGTH];
+
+    fprintf(out, "\"system\":{\"cpu\":");
+
+    // 486s have no model name, just the family & model numbers
+    if (inst_traceGetProcValue("/proc/cpuinfo", "model name", value, sizeof(value))
+     || inst_traceGetProcValue("/proc/cpuinfo", "cpu family", value, sizeof(value))) {
+        inst_tracePrintString(out, value);
+    } else {
+        fprintf(out, "null");
+    }
+
+    fprintf(out, ",\"memKB\":%" PRIu64 ",\"pci\":[", util_getProcMeminfoValue("MemTotal"));
+
+    FILE *pci = fopen("/proc/bus/pci/devices", "r");
+    bool first = true;
+
+    while (pci != NULL && fgets(value, sizeof(value), pci) != NULL) {
+        unsigned int busDevfn, vendorDevice;
+
+        if (sscanf(value, "%x %x", &busDevfn, &vendorDevice) != 2) continue;
+
+        fprintf(out, "%s\"%04x:%04x\"", first ? "" : ",", vendorDevice >> 16, vendorDevice & 0xFFFF);
+        first = false;
+    }
+
+    if (pci != NULL) fclose(pci);
+
+    fprintf(out, "]");
+
+    for (size_t i = 0; i < traceInfoCount; i++) {
+        fputc(',', out);
+        inst_tracePrintString(out, traceInfo[i].key);
+        fputc(':', out);
+        inst_tracePrintString(out, traceInfo[i].value);
+    }
+
+    fprintf(out, "}");
+}
+
+static void inst_tracePrintTuning(FILE *out, const inst_DiskTuning *tuning) {
+    fprintf(out, "\"tuning\":{\"probed\":%s,\"seqWriteKBs\":%u,\"seqReadKBs\":%u,\"randWriteIops\":%u,"
+        "\"chunkKB\":%zu,\"writerThreads\":%zu,\"coalesce\":%s,\"readaheadPercent\":%u}",
+        tuning->probed ? "true" : "false", tuning->seqWriteKBs, tuning->seqReadKBs, tuning->randWriteIops,
+        tuning->writeChunkSize / 1024, tuning->writerThreads, tuning->coalesceSmallFiles ? "true" : "false",
+        tuning->readaheadPercent);
+}
+
+static void inst_tracePrintPhases(FILE *out) {
+    fprintf(out, "\"phases\":[");
+
+    for (size_t i = 0; i < tracePhaseCount; i++) {
+        const inst_TracePhase *p = &tracePhases[i];
+
+        fprintf(out, "%s{\"name\":", i > 0 ? "," : "");
+        inst_tracePrintString(out, p->name);
+        fprintf(out, ",\"ok\":%s,\"startMs\":%" PRIu64 ",\"wallMs\":%" PRIu64 ",\"cpuMs\":%" PRIu64
+            ",\"readKB\":%" PRIu64 ",\"writtenKB\":%" PRIu64 ",\"files\":%" PRIu64
+            ",\"readStallMs\":%" PRIu64 ",\"writeStallMs\":%" PRIu64 "}",
+            (p->done && p->success) ? "true" : "false", (p->startUs - traceStartUs) / 1000, p->wallUs / 1000,
+            p->cpuUs / 1000, p->bytesRead / 1024, p->bytesWritten / 1024, p->files,
+            p->readStallUs / 1000, p->writeStallUs / 1000);
+    }
+
+    fprintf(out, "]");
+}
+
+static int inst_traceCompareFiles(const void *a, const void *b) {
+    const inst_TraceFile *fa = (const inst_TraceFile *) a;
+    const inst_TraceFile *fb = (const inst_TraceFile *) b;
+    return (fa->us < fb->us) - (fa->us > fb->us);
+}
+
+static void inst_tracePrintSlowest(FILE *out) {
+    qsort(traceSlowest, traceSlowestCount, sizeof(inst_TraceFile), inst_traceCompareFiles);
+
+    fprintf(out, "\"slowestFiles\":[");
+
+    for (size_t i = 0; i < traceSlowestCount; i++) {
+        fprintf(out, "%s{\"path\":", i > 0 ? "," : "");
+        inst_tracePrintString(out, traceSlowest[i].path);
+        fprintf(out, ",\"KB\":%" PRIu64 ",\"ms\":%" PRIu64 "}", traceSlowest[i].size / 1024, traceSlowest[i].us / 1000);
+    }
+
+    fprintf(out, "]");
+}
+
+void inst_traceFinish(const inst_DiskTuning *tuning, bool success) {
+    QI_ASSERT(tuning != NULL);
+
+    char hwm[64] = "0";
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    inst_traceGetProcValue("/proc/self/status", "VmHWM", hwm, sizeof(hwm));
+
+    pthread_mutex_lock(&traceLock);
+    traceTuning = *tuning;
+    traceSuccess = success;
+    traceTotalUs = util_getMonotonicTimeUs() - traceStartUs;
+    traceUserUs = (uint64_t) usage.ru_utime.tv_sec * 1000000ULL + (uint64_t) usage.ru_utime.tv_usec;
+    traceSysUs = (uint64_t) usage.ru_stime.tv_sec * 1000000ULL + (uint64_t) usage.ru_stime.tv_usec;
+    traceMemHwmKB = strtoull(hwm, NULL, 10);
+    traceFinished = true;
+    pthread_mutex_unlock(&traceLock);
+}
+
+bool inst_tracePrint(FILE *out) {
+    QI_ASSERT(out != NULL);
+
+    pthread_mutex_lock(&traceLock);
+
+    if (!traceFinished) {
+        pthread_mutex_unlock(&traceLock);
+        return false;
+    }
+
+    fprintf(out, "{\"version\":\"%s\",\"ok\":%s,\"totalMs\":%" PRIu64 ",\"cpuUserMs\":%" PRIu64 ",\"cpuSysMs\":%" PRIu64
+        ",\"memHwmKB\":%" PRIu64 ",",
+        LUNMERCY_VERSION, traceSuccess ? "true" : "false", traceTotalUs / 1000, traceUserUs / 1000, traceSysUs / 1000,
+        traceMemHwmKB);
+
+    inst_tracePrintSystem(out);
+    fputc(',', out);
+    inst_tracePrintTuning(out, &traceTuning);
+    fputc(',', out);
+    inst_tracePrintPhases(out);
+    fputc(',', out);
+    inst_tracePrintSlowest(out);
+    fprintf(out, "}\n");
+
+    pthread_mutex_unlock(&traceLock);
+    return true;
+}
+
+bool inst_traceWrite(const char *path) {
+    QI_ASSERT(path != NULL);
+
+    FILE *out = fopen(path, "w");
+
+    if (out == NULL) {
+        inst_logPrintf("Performance trace: cannot write %s", path);
+        return false;
+    }
+
+    bool written = inst_tracePrint(out);
+    written &= !ferror(out);
+    written &= (fclose(out) == 0);
+    return written;
+}
@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
 
 #include "install.h"
 #include "qi_assert.h"
@@ -10,8 +12,12 @@ static char cdrompath[PATH_MAX+1] = {0};    // Path to install source media
 static char cdromdev[PATH_MAX+1] = {0};     // Block device for install source media
                                             // ^ initialized in setSourceMedia, called by inst_main
 
-static char staticSourceBuf[PATH_MAX+1] = {0};
-static char staticTargetBuf[PATH_MAX+1] = {0};
+static FILE *logFile = NULL;                // Install log on the target partition
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Per thread, install steps may run concurrently
+static __thread char staticSourceBuf[PATH_MAX+1] = {0};
+static __thread char staticTargetBuf[PATH_MAX+1] = {0};
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-truncation"
@@ -55,6 +61,12 @@ bool inst_isInstallationSourcePartition(util_Partition *part) {
     return (util_stringEquals(cdromdev, part->device));
 }
 
+bool inst_isSourceMediaOptical(void) {
+    const char *name = strrchr(cdromdev, '/');
+    name = (name != NULL) ? name + 1 : cdromdev;
+    return util_stringStartsWith(name, "sr");
+}
+
 const char *inst_getSizeString(uint64_t size) {
     static const char *suffixes[] = { " B", "KB", "MB", "GB", "TB", "PB" };
     static char sizeString[32] = "";
@@ -206,3 +218,41 @@ const char *inst_getDiskMenuString(util_HardDisk *disk) {
     ret[0] = inst_isInstallationSourceDisk(disk) ? '*' : ' ';
     return ret;
 }
+
+/********************************* Install log  */
+
+bool inst_logOpen(const char *path) {
+    inst_logClose();
+
+    pthread_mutex_lock(&logLock);
+    logFile = fopen(path, "w");
+    pthread_mutex_unlock(&logLock);
+
+    return logFile != NULL;
+}
+
+void inst_logPrintf(const char *fmt, ...) {
+    pthread_mutex_lock(&logLock);
+
+    if (logFile != NULL) {
+        va_list args;
+        va_start(args, fmt);
+        vfprintf(logFile, fmt, args);
+        va_end(args);
+        // DOS line endings, this file is meant to be read from the installed OS
+        fputs("\r\n", logFile);
+    }
+
+    pthread_mutex_unlock(&logLock);
+}
+
+void inst_logClose(void) {
+    pthread_mutex_lock(&logLock);
+
+    if (logFile != NULL) {
+        fclose(logFile);
+        logFile = NULL;
+    }
+
+    pthread_mutex_unlock(&logLock);
+}
@@ -0,0 +1,177 @@
+/*
+ * LUNMERCY - Read-back verification of written files
+ *
+ * Files are queued with the CRC-32 of the data that was handed to the disk. A low priority thread
+ * flushes each file, drops it from the page cache and reads it back from the disk to compare.
+ * Verification of a payload is released once it has been completely unpacked, so it runs while
+ * the next payload is being extracted.
+ *
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "install.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "qi_assert.h"
+#include "util.h"
+
+#define VERIFY_READ_BUFFER_SIZE     (64 __KB)
+#define VERIFY_NICE_LEVEL           (19)
+#define VERIFY_IOPRIO_WHO_PROCESS   (1)
+#define VERIFY_IOPRIO_IDLE          (3 << 13)
+
+typedef struct {
+    char *path;
+    size_t size;
+    uint32_t crc;
+} inst_VerifyEntry;
+
+struct inst_Verifier {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    bool stopping;
+    size_t count;               // Entries queued
+    size_t releasedCount;       // Entries that may be verified
+    size_t capacity;
+    inst_VerifyEntry *entries;
+    size_t mismatches;
+};
+
+// Re-reads a file from disk and checks size and checksum
+static bool inst_verifyFile(const inst_VerifyEntry *entry, uint8_t *buf) {
+    int fd = open(entry->path, O_RDONLY);
+    if (fd < 0) return false;
+
+    // Make sure it's on the disk, then throw it out of the cache so we really read what the disk has
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    uint32_t crc = 0;
+    size_t total = 0;
+    ssize_t bytesRead;
+
+    while ((bytesRead = read(fd, buf, VERIFY_READ_BUFFER_SIZE)) > 0) {
+        crc = util_crc32(crc, buf, (size_t) bytesRead);
+        total += (size_t) bytesRead;
+    }
+
+    close(fd);
+    return bytesRead == 0 && total == entry->size && crc == entry->crc;
+}
+
+static void *inst_verifierThreadFunc(void *param) {
+    inst_Verifier *v = (inst_Verifier *) param;
+
+    // Stay out of the unpacker's way, both for CPU and (if the I/O scheduler cares) disk time
+    pid_t tid = (pid_t) syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, (id_t) tid, VERIFY_NICE_LEVEL);
+#ifdef SYS_ioprio_set
+    syscall(SYS_ioprio_set, VERIFY_IOPRIO_WHO_PROCESS, tid, VERIFY_IOPRIO_IDLE);
+#endif
+
+    uint8_t *buf = malloc(VERIFY_READ_BUFFER_SIZE);
+    QI_FATAL(buf != NULL, "Failed to allocate verification buffer");
+
+    size_t next = 0;
+
+    pthread_mutex_lock(&v->lock);
+
+    while (true) {
+        while (next >= v->releasedCount && !v->stopping) {
+            pthread_cond_wait(&v->released, &v->lock);
+        }
+
+        if (next >= v->releasedCount) break; // stopping and nothing left
+
+        // The array may be reallocated by the producer, so work on a copy of the entry
+        inst_VerifyEntry entry = v->entries[next++];
+        pthread_mutex_unlock(&v->lock);
+
+        bool ok = inst_verifyFile(&entry, buf);
+
+        if (!ok) {
+            inst_logPrintf("Verify: MISMATCH %s", entry.path);
+        }
+
+        pthread_mutex_lock(&v->lock);
+        v->mismatches += ok ? 0 : 1;
+    }
+
+    pthread_mutex_unlock(&v->lock);
+    free(buf);
+    return NULL;
+}
+
+inst_Verifier *inst_verifierCreate(void) {
+    inst_Verifier *v = calloc(1, sizeof(inst_Verifier));
+    QI_ASSERT(v != NULL);
+
+    QI_ASSERT(0 == pthread_mutex_init(&v->lock, NULL));
+    QI_ASSERT(0 == pthread_cond_init(&v->released, NULL));
+    QI_ASSERT(0 == pthread_create(&v->thread, NULL, inst_verifierThreadFunc, v));
+
+    return v;
+}
+
+void inst_verifierAdd(inst_Verifier *v, const char *path, size_t size, uint32_t crc) {
+    QI_ASSERT(v != NULL && path != NULL);
+
+    pthread_mutex_lock(&v->lock);
+
+    if (v->count == v->capacity) {
+        v->capacity = v->capacity ? v->capacity * 2 : 256;
+        v->entries = realloc(v->entries, v->capacity * sizeof(inst_VerifyEntry));
+        QI_ASSERT(v->entries != NULL);
+    }
+
+    inst_VerifyEntry *entry = &v->entries[v->count++];
+    entry->path = strdup(path);
+    entry->size = size;
+    entry->crc = crc;
+    QI_ASSERT(entry->path != NULL);
+
+    pthread_mutex_unlock(&v->lock);
+}
+
+void inst_verifierRelease(inst_Verifier *v) {
+    QI_ASSERT(v != NULL);
+
+    pthread_mutex_lock(&v->lock);
+    v->releasedCount = v->count;
+    pthread_cond_signal(&v->released);
+    pthread_mutex_unlock(&v->lock);
+}
+
+size_t inst_verifierFinish(inst_Verifier *v) {
+    if (v == NULL) return 0;
+
+    pthread_mutex_lock(&v->lock);
+    v->releasedCount = v->count;
+    v->stopping = true;
+    pthread_cond_signal(&v->released);
+    pthread_mutex_unlock(&v->lock);
+
+    pthread_join(v->thread, NULL);
+
+    size_t mismatches = v->mismatches;
+    inst_logPrintf("Verify: %zu file(s) checked, %zu mismatch(es)", v->count, mismatches);
+
+    for (size_t i = 0; i < v->count; i++) {
+        free(v->entries[i].path);
+    }
+
+    free(v->entries);
+    pthread_mutex_destroy(&v->lock);
+    pthread_cond_destroy(&v->released);
+    free(v);
+    return mismatches;
+}
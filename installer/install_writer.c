@@ -0,0 +1,446 @@
+/*
+ * LUNMERCY - Asynchronous file writer for the unpacker
+ *
+ * The unpacker reads file data from the source into write jobs, writer threads write them out.
+ * Every job belongs to one writer thread, so all pieces of a file that spans multiple jobs are
+ * written in order by the same thread (vfat cannot do sparse files and would zero-fill any gap).
+ * When small files are coalesced, several of them share a job, which keeps them in pack order
+ * even with more than one writer.
+ *
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "install.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "qi_assert.h"
+#include "util.h"
+#include "mappedfile.h"
+
+#define WRITER_MAX_THREADS          (8)
+#define WRITER_MAX_SEGMENTS         (64)    // Max. amount of (small) files in a single job
+
+struct inst_WriterFile {
+    size_t fdCount;
+    int fds[MERCYPAK_V2_MAX_IDENTICAL_FILES];
+    inst_MercyPakFileDescriptor descriptors[MERCYPAK_V2_MAX_IDENTICAL_FILES];
+    char *paths[MERCYPAK_V2_MAX_IDENTICAL_FILES];
+    uint32_t crc;               // CRC-32 of the data written so far, only kept when verifying
+    size_t queuedBytes;         // Bytes handed to the writer so far, i.e. the file offset of the next segment
+    size_t pendingSegments;     // Segments queued but not written yet
+    size_t thread;              // Writer thread for jobs of this file
+    bool coalesce;              // Whether data of this file goes into the shared batch job
+    bool finished;              // Producer is done with this file
+    uint64_t createdUs;         // For the performance trace
+};
+
+typedef struct {
+    inst_WriterFile *file;
+    size_t fileOffset;
+    size_t bufferOffset;
+    size_t length;
+} inst_WriterSegment;
+
+typedef struct inst_WriterJob {
+    uint8_t *buffer;
+    size_t used;
+    size_t segmentCount;
+    inst_WriterSegment segments[WRITER_MAX_SEGMENTS];
+    struct inst_WriterJob *next;
+} inst_WriterJob;
+
+typedef struct {
+    inst_Writer *writer;
+    pthread_t thread;
+    inst_WriterJob *first;
+    inst_WriterJob *last;
+} inst_WriterThread;
+
+struct inst_Writer {
+    pthread_mutex_t lock;
+    pthread_cond_t jobAvailable;
+    pthread_cond_t budgetAvailable;
+    size_t chunkSize;
+    size_t queueBudget;
+    size_t queuedBytes;         // Memory held by jobs, submitted or not
+    bool coalesce;
+    bool stopping;
+    bool failed;
+    inst_Verifier *verifier;    // Receives finished files if set
+    uint64_t stallUs;           // Time the producer waited for queue budget or the final writes
+    uint64_t bytesWritten;      // Finished files, counting every copy
+    size_t filesWritten;
+    size_t nextThread;          // Round robin thread assignment
+    size_t threadCount;
+    inst_WriterThread threads[WRITER_MAX_THREADS];
+    inst_WriterJob *batch;      // Open job collecting small files
+    inst_WriterJob *current;    // Open job of the current large file
+    inst_WriterJob *freeJobs;   // Finished jobs, their buffers are reused instead of allocating new ones
+};
+
+// Applies times & attributes and closes all descriptors of a file. Called once all of its data is written.
+static bool inst_writerFileFinalize(inst_Writer *w, inst_WriterFile *file) {
+    bool success = true;
+
+    inst_traceFile(file->paths[0], file->queuedBytes, util_getMonotonicTimeUs() - file->createdUs);
+
+    pthread_mutex_lock(&w->lock);
+    w->bytesWritten += (uint64_t) file->queuedBytes * file->fdCount;
+    w->filesWritten += file->fdCount;
+    pthread_mutex_unlock(&w->lock);
+
+    for (size_t i = 0; i < file->fdCount; i++) {
+        success &= util_setDosFileTime(file->fds[i], file->descriptors[i].fileDate, file->descriptors[i].fileTime);
+        success &= util_setDosFileAttributes(file->fds[i], file->descriptors[i].fileFlags);
+        close(file->fds[i]);
+
+        if (w->verifier != NULL && file->paths[i] != NULL) {
+            inst_verifierAdd(w->verifier, file->paths[i], file->queuedBytes, file->crc);
+        }
+
+        free(file->paths[i]);
+    }
+
+    free(file);
+    return success;
+}
+
+static bool inst_writerWriteSegment(const inst_Writer *w, const inst_WriterJob *job, const inst_WriterSegment *seg) {
+    // Segments of a file are always written in order, so the checksum can be built up here
+    if (w->verifier != NULL) {
+        seg->file->crc = util_crc32(seg->file->crc, job->buffer + seg->bufferOffset, seg->length);
+    }
+
+    for (size_t i = 0; i < seg->file->fdCount; i++) {
+        const uint8_t *data = job->buffer + seg->bufferOffset;
+        size_t left = seg->length;
+        off_t offset = (off_t) seg->fileOffset;
+
+        while (left) {
+            ssize_t written = pwrite(seg->file->fds[i], data, left, offset);
+            if (written <= 0) return false;
+            data += written;
+            left -= (size_t) written;
+            offset += written;
+        }
+    }
+
+    return true;
+}
+
+static void *inst_writerThreadFunc(void *param) {
+    inst_WriterThread *self = (inst_WriterThread *) param;
+    inst_Writer *w = self->writer;
+
+    pthread_mutex_lock(&w->lock);
+
+    while (true) {
+        while (self->first == NULL && !w->stopping) {
+            pthread_cond_wait(&w->jobAvailable, &w->lock);
+        }
+
+        inst_WriterJob *job = self->first;
+
+        if (job == NULL) break; // stopping and nothing left
+
+        self->first = job->next;
+        if (self->first == NULL) self->last = NULL;
+
+        pthread_mutex_unlock(&w->lock);
+
+        bool success = true;
+
+        for (size_t s = 0; s < job->segmentCount; s++) {
+            success &= inst_writerWriteSegment(w, job, &job->segments[s]);
+        }
+
+        pthread_mutex_lock(&w->lock);
+
+        w->failed |= !success;
+
+        for (size_t s = 0; s < job->segmentCount; s++) {
+            inst_WriterFile *file = job->segments[s].file;
+            file->pendingSegments--;
+
+            if (file->finished && file->pendingSegments == 0) {
+                pthread_mutex_unlock(&w->lock);
+                bool finalized = inst_writerFileFinalize(w, file);
+                pthread_mutex_lock(&w->lock);
+                w->failed |= !finalized;
+            }
+        }
+
+        w->queuedBytes -= w->chunkSize;
+
+        job->next = w->freeJobs;
+        w->freeJobs = job;
+
+        pthread_cond_broadcast(&w->budgetAvailable);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+inst_Writer *inst_writerCreate(const inst_DiskTuning *tuning, size_t queueBudget, inst_Verifier *verifier) {
+    QI_ASSERT(tuning != NULL);
+
+    inst_Writer *w = calloc(1, sizeof(inst_Writer));
+    QI_ASSERT(w != NULL);
+
+    w->verifier = verifier;
+
+    w->chunkSize = MAX(tuning->writeChunkSize, 4 __KB);
+    w->threadCount = MIN(MAX(tuning->writerThreads, 1), WRITER_MAX_THREADS);
+    w->coalesce = tuning->coalesceSmallFiles;
+    // Every thread must be able to hold a job plus the two open ones, otherwise we'd just stall
+    w->queueBudget = MAX(queueBudget, w->chunkSize * (w->threadCount + 2));
+
+    QI_ASSERT(0 == pthread_mutex_init(&w->lock, NULL));
+    QI_ASSERT(0 == pthread_cond_init(&w->jobAvailable, NULL));
+    QI_ASSERT(0 == pthread_cond_init(&w->budgetAvailable, NULL));
+
+    for (size_t i = 0; i < w->threadCount; i++) {
+        w->threads[i].writer = w;
+        QI_ASSERT(0 == pthread_create(&w->threads[i].thread, NULL, inst_writerThreadFunc, &w->threads[i]));
+    }
+
+    return w;
+}
+
+// Allocates a new job, blocking while the queue budget is exhausted
+static inst_WriterJob *inst_writerJobCreate(inst_Writer *w) {
+    pthread_mutex_lock(&w->lock);
+
+    if (w->queuedBytes + w->chunkSize > w->queueBudget) {
+        uint64_t stallStart = util_getMonotonicTimeUs();
+
+        while (w->queuedBytes + w->chunkSize > w->queueBudget) {
+            pthread_cond_wait(&w->budgetAvailable, &w->lock);
+        }
+
+        w->stallUs += util_getMonotonicTimeUs() - stallStart;
+    }
+
+    w->queuedBytes += w->chunkSize;
+
+    inst_WriterJob *job = w->freeJobs;
+    if (job != NULL) w->freeJobs = job->next;
+
+    pthread_mutex_unlock(&w->lock);
+
+    if (job != NULL) {
+        job->used = 0;
+        job->segmentCount = 0;
+        job->next = NULL;
+        return job;
+    }
+
+    job = calloc(1, sizeof(inst_WriterJob));
+    QI_ASSERT(job != NULL);
+    job->buffer = malloc(w->chunkSize);
+    QI_FATAL(job->buffer != NULL, "Failed to allocate write buffer");
+    return job;
+}
+
+// Hands a job over to a writer thread
+static void inst_writerJobSubmit(inst_Writer *w, inst_WriterJob *job, size_t thread) {
+    pthread_mutex_lock(&w->lock);
+
+    inst_WriterThread *t = &w->threads[thread];
+    job->next = NULL;
+
+    if (t->last != NULL) t->last->next = job;
+    else t->first = job;
+    t->last = job;
+
+    pthread_cond_broadcast(&w->jobAvailable);
+    pthread_mutex_unlock(&w->lock);
+}
+
+// Submits the open batch job of small files, if there is one
+static void inst_writerFlushBatch(inst_Writer *w) {
+    if (w->batch == NULL) return;
+
+    // Small files are completely contained in one batch, so any thread can take it
+    inst_writerJobSubmit(w, w->batch, w->nextThread);
+    w->nextThread = (w->nextThread + 1) % w->threadCount;
+    w->batch = NULL;
+}
+
+inst_WriterFile *inst_writerFileCreate(inst_Writer *w, size_t fdCount, const int *fds, const inst_MercyPakFileDescriptor *descriptors, char **paths, size_t expectedSize) {
+    QI_ASSERT(w != NULL);
+    QI_ASSERT(fdCount > 0 && fdCount <= MERCYPAK_V2_MAX_IDENTICAL_FILES);
+
+    inst_WriterFile *file = calloc(1, sizeof(inst_WriterFile));
+    QI_ASSERT(file != NULL);
+
+    file->fdCount = fdCount;
+    memcpy(file->fds, fds, fdCount * sizeof(int));
+    memcpy(file->descriptors, descriptors, fdCount * sizeof(inst_MercyPakFileDescriptor));
+
+    if (paths != NULL) {
+        memcpy(file->paths, paths, fdCount * sizeof(char *));
+    }
+
+    file->coalesce = w->coalesce && expectedSize <= w->chunkSize / 2;
+    file->createdUs = util_getMonotonicTimeUs();
+
+    if (!file->coalesce) {
+        file->thread = w->nextThread;
+        w->nextThread = (w->nextThread + 1) % w->threadCount;
+    }
+
+    return file;
+}
+
+// Reads from a MappedFile, for inst_writerCopy
+static bool inst_writerReadMappedFile(void *src, uint8_t *dst, size_t len) {
+    return mappedFile_read((MappedFile *) src, dst, len);
+}
+
+// Reads from a file descriptor, for inst_writerCopy
+static bool inst_writerReadFd(void *src, uint8_t *dst, size_t len) {
+    int fd = *(int *) src;
+
+    while (len) {
+        ssize_t bytesRead = read(fd, dst, len);
+        if (bytesRead <= 0) return false;
+        dst += bytesRead;
+        len -= (size_t) bytesRead;
+    }
+
+    return true;
+}
+
+// Queues len bytes from a source for a file. readFunc must read exactly the requested amount or fail.
+static bool inst_writerCopy(inst_Writer *w, inst_WriterFile *file, inst_WriterReadFunc readFunc, void *src, size_t len) {
+
+    // A small file must end up in one single batch job, start a new one if it doesn't fit anymore
+    if (file->coalesce && w->batch != NULL
+        && (w->batch->used + len > w->chunkSize || w->batch->segmentCount == WRITER_MAX_SEGMENTS)) {
+        inst_writerFlushBatch(w);
+    }
+
+    while (len) {
+        inst_WriterJob **open = file->coalesce ? &w->batch : &w->current;
+
+        if (*open == NULL) {
+            *open = inst_writerJobCreate(w);
+        }
+
+        inst_WriterJob *job = *open;
+        size_t toCopy = MIN(len, w->chunkSize - job->used);
+
+        if (!readFunc(src, job->buffer + job->used, toCopy)) {
+            return false;
+        }
+
+        inst_WriterSegment *seg = &job->segments[job->segmentCount++];
+        seg->file = file;
+        seg->fileOffset = file->queuedBytes;
+        seg->bufferOffset = job->used;
+        seg->length = toCopy;
+
+        pthread_mutex_lock(&w->lock);
+        file->pendingSegments++;
+        pthread_mutex_unlock(&w->lock);
+
+        file->queuedBytes += toCopy;
+        job->used += toCopy;
+        len -= toCopy;
+
+        // Large files get one job per chunk, on the file's own thread
+        if (!file->coalesce && (job->used == w->chunkSize || len == 0)) {
+            inst_writerJobSubmit(w, job, file->thread);
+            w->current = NULL;
+        }
+    }
+
+    return true;
+}
+
+bool inst_writerCopyFromMappedFile(inst_Writer *w, inst_WriterFile *file, MappedFile *src, size_t len) {
+    QI_ASSERT(w != NULL && file != NULL && src != NULL);
+    return inst_writerCopy(w, file, inst_writerReadMappedFile, src, len);
+}
+
+bool inst_writerCopyFromFd(inst_Writer *w, inst_WriterFile *file, int fd, size_t len) {
+    QI_ASSERT(w != NULL && file != NULL && fd >= 0);
+    return inst_writerCopy(w, file, inst_writerReadFd, &fd, len);
+}
+
+bool inst_writerCopyFromReader(inst_Writer *w, inst_WriterFile *file, inst_WriterReadFunc readFunc, void *src, size_t len) {
+    QI_ASSERT(w != NULL && file != NULL && readFunc != NULL);
+    return inst_writerCopy(w, file, readFunc, src, len);
+}
+
+void inst_writerFileFinish(inst_Writer *w, inst_WriterFile *file) {
+    QI_ASSERT(w != NULL && file != NULL);
+
+    pthread_mutex_lock(&w->lock);
+    file->finished = true;
+    bool finalizeNow = file->pendingSegments == 0;
+    pthread_mutex_unlock(&w->lock);
+
+    // Empty files never reach a writer thread
+    if (finalizeNow) {
+        bool finalized = inst_writerFileFinalize(w, file);
+        pthread_mutex_lock(&w->lock);
+        w->failed |= !finalized;
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+bool inst_writerDestroy(inst_Writer *w) {
+    if (w == NULL) return false;
+
+    inst_writerFlushBatch(w);
+
+    // An unfinished large file job can only be left over if reading from the source failed
+    if (w->current != NULL) {
+        inst_writerJobSubmit(w, w->current, 0);
+        w->current = NULL;
+    }
+
+    uint64_t drainStart = util_getMonotonicTimeUs();
+
+    pthread_mutex_lock(&w->lock);
+    w->stopping = true;
+    pthread_cond_broadcast(&w->jobAvailable);
+    pthread_mutex_unlock(&w->lock);
+
+    for (size_t i = 0; i < w->threadCount; i++) {
+        pthread_join(w->threads[i].thread, NULL);
+    }
+
+    // Called on the producer thread, so this ends up in its trace phase
+    w->stallUs += util_getMonotonicTimeUs() - drainStart;
+    inst_traceAddIo(0, w->bytesWritten, w->filesWritten);
+    inst_traceAddStall(0, w->stallUs);
+
+    // Everything of this payload is on its way to the disk now, it can be checked
+    if (w->verifier != NULL) {
+        inst_verifierRelease(w->verifier);
+    }
+
+    bool success = !w->failed;
+
+    while (w->freeJobs != NULL) {
+        inst_WriterJob *job = w->freeJobs;
+        w->freeJobs = job->next;
+        free(job->buffer);
+        free(job);
+    }
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->jobAvailable);
+    pthread_cond_destroy(&w->budgetAvailable);
+    free(w);
+    return success;
+}
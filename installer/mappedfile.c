@@ -32,8 +32,35 @@ typedef struct MappedFile {
     size_t size;
     size_t pos;
     uint8_t *mem;
+    size_t mapSize;
+    MappedFile_Range *ranges;   // Parts of the file that make up its contents, NULL for the whole file
+    size_t rangeCount;
 } MappedFile;
 
+// Gets the memory at the read position and how much of it follows without a gap
+static uint8_t *mappedFile_current(MappedFile *file, size_t *contiguous) {
+    if (file->ranges == NULL) {
+        *contiguous = file->size - file->pos;
+        return file->mem + file->pos;
+    }
+
+    size_t rangeStart = 0;
+
+    for (size_t i = 0; i < file->rangeCount; i++) {
+        size_t rangeEnd = rangeStart + file->ranges[i].length;
+
+        if (file->pos < rangeEnd) {
+            *contiguous = rangeEnd - file->pos;
+            return file->mem + file->ranges[i].offset + (file->pos - rangeStart);
+        }
+
+        rangeStart = rangeEnd;
+    }
+
+    *contiguous = 0;
+    return NULL;
+}
+
 static inline void mappedFile_advancePosAndReadAhead(MappedFile *file, size_t len) {
     size_t oldPage = file->pos & BITMASK_PAGE;
     size_t newPage = (file->pos + len) & BITMASK_PAGE;
@@ -41,7 +68,8 @@ static inline void mappedFile_advancePosAndReadAhead(MappedFile *file, size_t le
 
     file->pos += len;
 
-    if ((oldPage != newPage) && ((file->pos + adviseLen ) <= file->size)) {
+    // Ranged files are left to the kernel's own readahead
+    if ((file->ranges == NULL) && (oldPage != newPage) && ((file->pos + adviseLen ) <= file->size)) {
         if (madvise(file->mem + newPage, adviseLen, MADV_SEQUENTIAL | MADV_WILLNEED) != 0) {
             perror(__func__);
             assert(false && "madvise failed");
@@ -49,7 +77,12 @@ static inline void mappedFile_advancePosAndReadAhead(MappedFile *file, size_t le
     }
 }
 
-MappedFile *mappedFile_open(const char *filename, size_t readahead, MappedFile_ErrorCallback callback) {
+void mappedFile_setCacheBudget(size_t budget) {
+    (void) budget; // The page cache takes care of this in the mmap version.
+}
+
+static MappedFile *mappedFile_openInternal(const char *filename, size_t readahead, MappedFile_ErrorCallback callback,
+                                           const MappedFile_Range *ranges, size_t rangeCount) {
     MappedFile *file = calloc(1, sizeof(MappedFile));
 
     (void) callback; // Callback is unused in this version of the mapped file.
@@ -69,6 +102,29 @@ MappedFile *mappedFile_open(const char *filename, size_t readahead, MappedFile_E
     assert (fileSize > 0);
 
     file->size = fileSize;
+    file->mapSize = fileSize;
+
+    if (ranges != NULL) {
+        size_t end = 0;
+        file->size = 0;
+
+        for (size_t i = 0; i < rangeCount; i++) {
+            if (ranges[i].offset < end || ranges[i].length > (size_t) fileSize - ranges[i].offset) {
+                printf("Invalid range %zu in file %s \n", i, filename);
+                close(file->fd);
+                free(file);
+                return NULL;
+            }
+
+            end = ranges[i].offset + ranges[i].length;
+            file->size += ranges[i].length;
+        }
+
+        file->ranges = malloc(rangeCount * sizeof(MappedFile_Range));
+        assert(file->ranges != NULL);
+        memcpy(file->ranges, ranges, rangeCount * sizeof(MappedFile_Range));
+        file->rangeCount = rangeCount;
+    }
 
     lseek(file->fd, 0, SEEK_SET);
 
@@ -76,7 +132,7 @@ MappedFile *mappedFile_open(const char *filename, size_t readahead, MappedFile_E
 
     assert (file->mem);
 
-    if (file->size > MEM_PAGE_SIZE) {
+    if (file->ranges == NULL && file->size > MEM_PAGE_SIZE) {
         if (madvise(file->mem, MIN(readahead, file->size), MADV_SEQUENTIAL | MADV_WILLNEED) != 0) {
             perror(__func__);
             assert(false && "madvise failed");
@@ -91,26 +147,48 @@ MappedFile *mappedFile_open(const char *filename, size_t readahead, MappedFile_E
     return file;
 }
 
+MappedFile *mappedFile_open(const char *filename, size_t readahead, MappedFile_ErrorCallback callback) {
+    return mappedFile_openInternal(filename, readahead, callback, NULL, 0);
+}
+
+MappedFile *mappedFile_openRanges(const char *filename, size_t readahead, MappedFile_ErrorCallback callback,
+                                  const MappedFile_Range *ranges, size_t rangeCount) {
+    assert(ranges != NULL && rangeCount > 0);
+    return mappedFile_openInternal(filename, readahead, callback, ranges, rangeCount);
+}
+
 void mappedFile_close(MappedFile *file) {
-    munmap(file->mem, file->size);
+    munmap(file->mem, file->mapSize);
     close(file->fd);
+    free(file->ranges);
     free(file);
 }
 
 bool mappedFile_copyToFiles(MappedFile *file, size_t FileCount, int *outfds, size_t len) {
-    for (size_t i = 0; i < FileCount; i++) {
-        ssize_t written = write(outfds[i], file->mem+file->pos, len);
+    while (len > 0) {
+        size_t contiguous;
+        uint8_t *mem = mappedFile_current(file, &contiguous);
+        size_t toCopy = MIN(len, contiguous);
 
-        if (written < 0 || (size_t)written != len) {
-            printf("IO Error!\n");
-            perror(__func__);
-            assert(false);
+        if (toCopy == 0) {
             return false;
         }
 
-    }
+        for (size_t i = 0; i < FileCount; i++) {
+            ssize_t written = write(outfds[i], mem, toCopy);
+
+            if (written < 0 || (size_t)written != toCopy) {
+                printf("IO Error!\n");
+                perror(__func__);
+                assert(false);
+                return false;
+            }
+
+        }
 
-    mappedFile_advancePosAndReadAhead(file, len);
+        mappedFile_advancePosAndReadAhead(file, toCopy);
+        len -= toCopy;
+    }
 
     return true;
 }
@@ -120,13 +198,22 @@ static __INLINE__ size_t mappedFile_available(MappedFile *file) {
 }
 
 bool mappedFile_read(MappedFile *file, void *dst, size_t len) {
-    if (mappedFile_available(file) >= len) {
-        memcpy(dst, file->mem+file->pos, len);
-        mappedFile_advancePosAndReadAhead(file, len);
-        return true;
-    } else {
+    if (mappedFile_available(file) < len) {
         return false;
     }
+
+    while (len > 0) {
+        size_t contiguous;
+        uint8_t *mem = mappedFile_current(file, &contiguous);
+        size_t toCopy = MIN(len, contiguous);
+
+        memcpy(dst, mem, toCopy);
+        dst = (uint8_t *) dst + toCopy;
+        mappedFile_advancePosAndReadAhead(file, toCopy);
+        len -= toCopy;
+    }
+
+    return true;
 }
 
 __INLINE__ bool mappedFile_eof(MappedFile *file) {
@@ -147,3 +234,8 @@ __INLINE__ size_t mappedFile_getFileSize(MappedFile *file) {
 __INLINE__ size_t mappedFile_getPosition(MappedFile *file) {
     return file->pos;
 }
+// Page faults can't be told apart from regular reads here
+uint64_t mappedFile_getStallTimeUs(MappedFile *file) {
+    (void) file;
+    return 0;
+}
@@ -34,11 +34,25 @@ typedef enum {
 // Callback type for read errors. _errno is the errno value after the read attempt was made.
 typedef MappedFile_ErrorReaction (*MappedFile_ErrorCallback)(int _errno, MappedFile *file);
 
+// A part of a file, see mappedFile_openRanges
+typedef struct {
+    size_t offset;
+    size_t length;
+} MappedFile_Range;
+
 // Open the mapped File. Readahead is a parameter indicating how much RAM the system can spare to read ahead.
 // errorCallback will be called on any read error, can be NULL (then it will just retry forever)
 MappedFile *mappedFile_open(const char *filename, size_t readahead, MappedFile_ErrorCallback errorCallback);
+// Same as mappedFile_open, but only the given parts of the file are read, one after the other, as if they were the whole
+// file. Sizes and positions refer to that. There must be at least one range, in ascending order and not overlapping.
+// The ranges are copied.
+MappedFile *mappedFile_openRanges(const char *filename, size_t readahead, MappedFile_ErrorCallback errorCallback,
+                                  const MappedFile_Range *ranges, size_t rangeCount);
 // Closes the file and releases all resources associated with it
 void        mappedFile_close(MappedFile *file);
+// Lets up to 'budget' bytes of file data stay in memory after files are closed, so re-opening the same
+// file path, whole or in ranges, is served from memory. 0 (the default) disables caching and frees what isn't in use.
+void        mappedFile_setCacheBudget(size_t budget);
 
 // File read operations - these all advance the internal read position.
 
@@ -57,5 +71,7 @@ bool        mappedFile_getUInt32(MappedFile *file, uint32_t *dst);
 size_t      mappedFile_getFileSize(MappedFile *file);
 // Obtains the current read position of the opened file
 size_t      mappedFile_getPosition(MappedFile *file);
+// Obtains the time the reader spent waiting for data that wasn't read from the media yet, in microseconds
+uint64_t    mappedFile_getStallTimeUs(MappedFile *file);
 
 #endif
\ No newline at end of file
@@ -9,6 +9,14 @@
  * Files are created with a readahead parameter that contains the amount of bytes that can safely be held in memory.
  *
  * It's up to the caller to figure this out.
+ *
+ * Optionally, blocks can stay resident after a file is closed (see mappedFile_setCacheBudget).
+ * They are kept per file path and block of the file (by absolute offset), so re-opening the same file later
+ * (i.e. a second installation) or reading other ranges of it is served from memory.
+ * One reader of the whole file queues the cached blocks themselves, everyone else copies from them.
+ *
+ * A file can also be opened with only some ranges of it (see mappedFile_openRanges). The reader thread
+ * then seeks to each range in turn, the consumer just sees one file made of all of them.
  * 
  * (C) 2024 Eric Voirin (oerg866@googlemail.com)
  */
@@ -25,6 +33,8 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #define MEM_BLOCK_SIZE (1 * 1024 * 1024)
 
@@ -33,8 +43,25 @@
 typedef struct mappedFile_MemBlock {
     uint8_t mem[MEM_BLOCK_SIZE];
     struct mappedFile_MemBlock *next;
+    bool cached;                            // Owned by the cache, must not be freed when consumed
 } mappedFile_MemBlock;
 
+typedef struct mappedFile_CacheEntry {
+    char *path;
+    size_t size;                            // Size of the whole file
+    time_t mtime;
+    size_t users;                           // Open files using the entry, it is only flushed when there are none
+    bool queued;                            // A whole file reader queues the cached blocks themselves
+    size_t blockCount;
+    mappedFile_MemBlock **blocks;           // By absolute file offset / MEM_BLOCK_SIZE, NULL if not cached
+    struct mappedFile_CacheEntry *next;
+} mappedFile_CacheEntry;
+
+static pthread_mutex_t mappedFile_cacheLock = PTHREAD_MUTEX_INITIALIZER;
+static mappedFile_CacheEntry *mappedFile_cache = NULL;
+static size_t mappedFile_cacheBudget = 0;
+static size_t mappedFile_cacheUsed = 0;
+
 typedef struct MappedFile {
     int fd;
     size_t size;
@@ -58,6 +85,14 @@ typedef struct MappedFile {
     mappedFile_MemBlock *memFirst;
     mappedFile_MemBlock *memLast;
 
+    mappedFile_CacheEntry *cache;           // NULL if this file isn't cached
+    bool cacheQueued;                       // This file queues cached blocks instead of copying them
+
+    MappedFile_Range *ranges;               // Parts of the file that make up its contents, NULL for the whole file
+    size_t rangeCount;
+
+    uint64_t stallUs;                       // Time the consumer spent waiting for the reader thread
+
 } MappedFile;
 
 static __INLINE__ void mappedFile_lock(MappedFile *mf) {
@@ -85,7 +120,9 @@ static __INLINE__ void mappedFile_disposeBlock(MappedFile *mf) {
     // Not doing NULL check here, because this function is only called internally when there's a valid block to dispose
 
     mf->memFirst = mf->memFirst->next;
-    free(toDispose);
+    if (!toDispose->cached) {
+        free(toDispose);
+    }
     mf->blockCount -= 1;
     if (mf->blockCount == 0) {
         mf->memLast = NULL;
@@ -100,12 +137,19 @@ static __INLINE__ mappedFile_MemBlock *mappedFile_getCurrentBlock(MappedFile *fi
     return block;
 }
 
+static uint64_t mappedFile_getTimeUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
 static __INLINE__ mappedFile_MemBlock *mappedFile_waitForValidBlockAndGet(MappedFile *file) {
     if (file->blockCount > 0) {
         return mappedFile_getCurrentBlock(file);
     }
 
     size_t blockThreshold = MIN(file->maxBlocks / 2, 8);
+    uint64_t stallStart = mappedFile_getTimeUs();
 
     while (file->blockCount < blockThreshold && file->readaheadComplete == false) {
 
@@ -126,37 +170,185 @@ static __INLINE__ mappedFile_MemBlock *mappedFile_waitForValidBlockAndGet(Mapped
         }
         sched_yield();
     }
+
+    file->stallUs += mappedFile_getTimeUs() - stallStart;
     return mappedFile_getCurrentBlock(file);
 }
 
-static __INLINE__ bool mappedFile_readInternal(int fd, uint8_t *mem, size_t toRead) {
+static __INLINE__ bool mappedFile_readInternal(int fd, uint8_t *mem, size_t offset, size_t toRead) {
     while (toRead) {
-        ssize_t bytesRead = read(fd, mem, toRead);
+        ssize_t bytesRead = pread(fd, mem, toRead, (off_t) offset);
         if (bytesRead <= 0) {            
             return false;
         }
 
         toRead -= (size_t) bytesRead;
         mem    += (size_t) bytesRead;
+        offset += (size_t) bytesRead;
+    }
+    return true;
+}
+
+// Gets a cached block of the file, by absolute file offset / MEM_BLOCK_SIZE. NULL if it isn't cached.
+static mappedFile_MemBlock *mappedFile_cacheGetBlock(MappedFile *mf, size_t blockIndex) {
+    if (mf->cache == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mappedFile_cacheLock);
+    mappedFile_MemBlock *block = mf->cache->blocks[blockIndex];
+    pthread_mutex_unlock(&mappedFile_cacheLock);
+
+    return block;
+}
+
+// Takes room for one more block from the cache budget. Returns false if there is none.
+static bool mappedFile_cacheReserve(MappedFile *mf) {
+    bool reserved = false;
+
+    if (mf->cache == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&mappedFile_cacheLock);
+
+    if (mappedFile_cacheUsed + sizeof(mappedFile_MemBlock) <= mappedFile_cacheBudget) {
+        mappedFile_cacheUsed += sizeof(mappedFile_MemBlock);
+        reserved = true;
+    }
+
+    pthread_mutex_unlock(&mappedFile_cacheLock);
+    return reserved;
+}
+
+// Gives back the room taken by mappedFile_cacheReserve
+static void mappedFile_cacheRelease(void) {
+    pthread_mutex_lock(&mappedFile_cacheLock);
+    mappedFile_cacheUsed -= sizeof(mappedFile_MemBlock);
+    pthread_mutex_unlock(&mappedFile_cacheLock);
+}
+
+// Hands a freshly read block, with room reserved for it, to the cache. Returns the block that is cached at its place,
+// which is another one if a different reader got there first. Ours is freed then.
+static mappedFile_MemBlock *mappedFile_cachePutBlock(MappedFile *mf, size_t blockIndex, mappedFile_MemBlock *block) {
+    pthread_mutex_lock(&mappedFile_cacheLock);
+
+    mappedFile_MemBlock *cached = mf->cache->blocks[blockIndex];
+
+    if (cached == NULL) {
+        block->cached = true;
+        mf->cache->blocks[blockIndex] = block;
+        cached = block;
+    } else {
+        mappedFile_cacheUsed -= sizeof(mappedFile_MemBlock);
+        free(block);
+    }
+
+    pthread_mutex_unlock(&mappedFile_cacheLock);
+    return cached;
+}
+
+// Gets the cached block of the file at blockIndex. If it isn't cached yet, it is read and cached if the budget allows.
+// Returns NULL if it can't be cached or reading it failed, then only the part that is needed should be read.
+static mappedFile_MemBlock *mappedFile_cacheFetchBlock(MappedFile *mf, size_t blockIndex) {
+    mappedFile_MemBlock *block = mappedFile_cacheGetBlock(mf, blockIndex);
+
+    if (block != NULL || !mappedFile_cacheReserve(mf)) {
+        return block;
+    }
+
+    size_t offset = blockIndex * MEM_BLOCK_SIZE;
+    block = malloc(sizeof(mappedFile_MemBlock));
+
+    if (block == NULL || !mappedFile_readInternal(mf->fd, block->mem, offset, MIN(mf->cache->size - offset, MEM_BLOCK_SIZE))) {
+        free(block);
+        mappedFile_cacheRelease();
+        return NULL;
     }
+
+    block->next = NULL;
+    return mappedFile_cachePutBlock(mf, blockIndex, block);
+}
+
+// Reads data at an absolute file offset, copying what is cached and caching what isn't yet, if the budget allows.
+static bool mappedFile_readPiece(MappedFile *mf, uint8_t *mem, size_t offset, size_t toRead) {
+    while (toRead > 0) {
+        size_t positionInBlock = offset % MEM_BLOCK_SIZE;
+        size_t piece = MIN(toRead, MEM_BLOCK_SIZE - positionInBlock);
+        mappedFile_MemBlock *cached = mappedFile_cacheFetchBlock(mf, offset / MEM_BLOCK_SIZE);
+
+        if (cached != NULL) {
+            memcpy(mem, cached->mem + positionInBlock, piece);
+        } else if (!mappedFile_readInternal(mf->fd, mem, offset, piece)) {
+            return false;
+        }
+
+        mem += piece;
+        offset += piece;
+        toRead -= piece;
+    }
+
     return true;
 }
 
+// Reads file data at the readahead position. With ranges, every range that is touched is read in turn.
+static bool mappedFile_readData(MappedFile *mf, uint8_t *mem, size_t toRead) {
+    if (mf->ranges == NULL) {
+        return mappedFile_readPiece(mf, mem, mf->readaheadPos, toRead);
+    }
+
+    size_t pos = mf->readaheadPos;
+    size_t rangeStart = 0;
+
+    for (size_t i = 0; i < mf->rangeCount && toRead > 0; i++) {
+        size_t rangeEnd = rangeStart + mf->ranges[i].length;
+
+        if (pos < rangeEnd) {
+            size_t piece = MIN(toRead, rangeEnd - pos);
+
+            if (!mappedFile_readPiece(mf, mem, mf->ranges[i].offset + pos - rangeStart, piece)) {
+                return false;
+            }
+
+            mem += piece;
+            pos += piece;
+            toRead -= piece;
+        }
+
+        rangeStart = rangeEnd;
+    }
+
+    return toRead == 0;
+}
+
 static __INLINE__ bool mappedFile_readAhead1Block(MappedFile *mf) {
     size_t toRead = mf->size - mf->readaheadPos;
     toRead = MIN(toRead, MEM_BLOCK_SIZE);
 
     if (toRead == 0) return true;
-    mappedFile_MemBlock *block = malloc(sizeof(mappedFile_MemBlock));
-    block->next = NULL;
 
-    // Catch read errors
-    if (!mappedFile_readInternal(mf->fd, block->mem, toRead)) {
-        // No memleaks please
-        free(block);
-        return false;
+    mappedFile_MemBlock *block = NULL;
+
+    // The blocks of a whole file reader line up with the cached ones, so they can be queued as they are
+    if (mf->cacheQueued) {
+        block = mappedFile_cacheFetchBlock(mf, mf->readaheadPos / MEM_BLOCK_SIZE);
+    }
+
+    if (block == NULL) {
+        block = malloc(sizeof(mappedFile_MemBlock));
+        if (block == NULL) return false;
+        block->cached = false;
+
+        // Catch read errors
+        if (!mappedFile_readData(mf, block->mem, toRead)) {
+            // No memleaks please
+            free(block);
+            return false;
+        }
     }
 
+    block->next = NULL;
+
     mappedFile_lock(mf);
     mf->readaheadPos += toRead;
     mf->blockCount += 1;
@@ -207,8 +399,7 @@ static void *mappedFile_threadFunc(void *param) {
             if (action == MF_CANCEL) {
                 break;
             }
-            // Else, we retry... Reset the position and seek backwards.
-            lseek(mf->fd, mf->readaheadPos, SEEK_SET);
+            // Else, we retry. The readahead position only moves on after a successful read.
         }
     }
 
@@ -216,7 +407,102 @@ static void *mappedFile_threadFunc(void *param) {
     pthread_exit(param);
 }
 
-MappedFile *mappedFile_open(const char *filename, size_t readahead, MappedFile_ErrorCallback errorCallback) {
+// Frees all blocks of a cache entry. Call with the cache lock held.
+static void mappedFile_cacheEntryFlush(mappedFile_CacheEntry *entry) {
+    for (size_t i = 0; i < entry->blockCount; i++) {
+        if (entry->blocks[i] != NULL) {
+            free(entry->blocks[i]);
+            mappedFile_cacheUsed -= sizeof(mappedFile_MemBlock);
+        }
+    }
+
+    free(entry->blocks);
+    entry->blocks = NULL;
+    entry->blockCount = 0;
+}
+
+// Finds or creates the cache entry for a file that is being opened. size is the size of the whole file.
+// Returns NULL if caching is off, or the file changed while others are still reading it.
+static mappedFile_CacheEntry *mappedFile_cacheAttach(const char *filename, int fd, size_t size) {
+    struct stat st;
+    mappedFile_CacheEntry *entry = NULL;
+
+    if (fstat(fd, &st) != 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mappedFile_cacheLock);
+
+    if (mappedFile_cacheBudget > 0) {
+        for (entry = mappedFile_cache; entry != NULL; entry = entry->next) {
+            if (strcmp(entry->path, filename) == 0) break;
+        }
+
+        if (entry == NULL) {
+            entry = calloc(1, sizeof(mappedFile_CacheEntry));
+            if (entry != NULL) {
+                entry->path = strdup(filename);
+                assert(entry->path != NULL);
+                entry->next = mappedFile_cache;
+                mappedFile_cache = entry;
+            }
+        }
+
+        // The media may have been swapped in the meantime
+        if (entry != NULL && entry->blocks != NULL && (entry->size != size || entry->mtime != st.st_mtime)) {
+            if (entry->users > 0) {
+                entry = NULL;
+            } else {
+                mappedFile_cacheEntryFlush(entry);
+            }
+        }
+
+        if (entry != NULL && entry->blocks == NULL) {
+            entry->blockCount = (size + MEM_BLOCK_SIZE - 1) / MEM_BLOCK_SIZE;
+            entry->blocks = calloc(entry->blockCount, sizeof(mappedFile_MemBlock *));
+            entry->size = size;
+            entry->mtime = st.st_mtime;
+            assert(entry->blocks != NULL);
+        }
+
+        if (entry != NULL) {
+            entry->users++;
+        }
+    }
+
+    pthread_mutex_unlock(&mappedFile_cacheLock);
+    return entry;
+}
+
+void mappedFile_setCacheBudget(size_t budget) {
+    pthread_mutex_lock(&mappedFile_cacheLock);
+
+    mappedFile_cacheBudget = budget;
+
+    if (budget == 0) {
+        // Drop everything that isn't in use right now
+        mappedFile_CacheEntry **link = &mappedFile_cache;
+
+        while (*link != NULL) {
+            mappedFile_CacheEntry *entry = *link;
+
+            if (entry->users > 0) {
+                link = &entry->next;
+                continue;
+            }
+
+            mappedFile_cacheEntryFlush(entry);
+            *link = entry->next;
+            free(entry->path);
+            free(entry);
+        }
+    }
+
+    pthread_mutex_unlock(&mappedFile_cacheLock);
+}
+
+static MappedFile *mappedFile_openInternal(const char *filename, size_t readahead, MappedFile_ErrorCallback errorCallback,
+                                           const MappedFile_Range *ranges, size_t rangeCount) {
     MappedFile *file = calloc(1, sizeof(MappedFile));
 
     assert(file != NULL);
@@ -234,6 +520,38 @@ MappedFile *mappedFile_open(const char *filename, size_t readahead, MappedFile_E
     lseek(file->fd, 0, SEEK_SET);
     
     file->size = fileSize;
+
+    if (ranges != NULL) {
+        size_t end = 0;
+        file->size = 0;
+
+        for (size_t i = 0; i < rangeCount; i++) {
+            if (ranges[i].offset < end || ranges[i].length > (size_t) fileSize - ranges[i].offset) {
+                printf("Invalid range %zu in file %s \n", i, filename);
+                close(file->fd);
+                free(file);
+                return NULL;
+            }
+
+            end = ranges[i].offset + ranges[i].length;
+            file->size += ranges[i].length;
+        }
+
+        file->ranges = malloc(rangeCount * sizeof(MappedFile_Range));
+        assert(file->ranges != NULL);
+        memcpy(file->ranges, ranges, rangeCount * sizeof(MappedFile_Range));
+        file->rangeCount = rangeCount;
+    }
+
+    file->cache = mappedFile_cacheAttach(filename, file->fd, (size_t) fileSize);
+
+    if (file->cache != NULL && ranges == NULL) {
+        pthread_mutex_lock(&mappedFile_cacheLock);
+        file->cacheQueued = !file->cache->queued;
+        file->cache->queued = true;
+        pthread_mutex_unlock(&mappedFile_cacheLock);
+    }
+
     file->maxBlocks = readahead / MEM_BLOCK_SIZE;
     file->errorCallback = errorCallback;
 
@@ -245,6 +563,16 @@ MappedFile *mappedFile_open(const char *filename, size_t readahead, MappedFile_E
     return file;
 }
 
+MappedFile *mappedFile_open(const char *filename, size_t readahead, MappedFile_ErrorCallback errorCallback) {
+    return mappedFile_openInternal(filename, readahead, errorCallback, NULL, 0);
+}
+
+MappedFile *mappedFile_openRanges(const char *filename, size_t readahead, MappedFile_ErrorCallback errorCallback,
+                                  const MappedFile_Range *ranges, size_t rangeCount) {
+    assert(ranges != NULL && rangeCount > 0);
+    return mappedFile_openInternal(filename, readahead, errorCallback, ranges, rangeCount);
+}
+
 void mappedFile_close(MappedFile *file) {
     file->closing = true;
 
@@ -253,10 +581,18 @@ void mappedFile_close(MappedFile *file) {
         mappedFile_disposeBlock(file); 
     };
 
+    if (file->cache != NULL) {
+        pthread_mutex_lock(&mappedFile_cacheLock);
+        file->cache->users--;
+        if (file->cacheQueued) file->cache->queued = false;
+        pthread_mutex_unlock(&mappedFile_cacheLock);
+    }
+
     pthread_mutex_destroy(&file->lock);
     pthread_mutex_destroy(&file->errorLock);
     pthread_cond_destroy(&file->errorLockCondition);
     close(file->fd);
+    free(file->ranges);
     free(file);
 }
 
@@ -280,6 +616,7 @@ bool mappedFile_read(MappedFile *file, void *dst, size_t len) {
         }
 
         memcpy(dst, currentBlock->mem + positionInBlock, toCopy);
+        dst = (uint8_t *) dst + toCopy;
 
         leftInBlock -= toCopy;
         len -= toCopy;
@@ -352,3 +689,6 @@ __INLINE__ size_t mappedFile_getFileSize(MappedFile *file) {
 __INLINE__ size_t mappedFile_getPosition(MappedFile *file) {
     return file->pos;
 }
+uint64_t mappedFile_getStallTimeUs(MappedFile *file) {
+    return file->stallUs;
+}
@@ -5,20 +5,28 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+// QI_NO_UI builds (the findcd helper) just print the message, there is no UI to tear down or show it in
+#ifndef QI_NO_UI
 #include "anbui/anbui.h"
+#endif
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-result"
 
 static inline void __qi__assert(const char * assertion, const char * file, unsigned int line, const char * func) {
+#ifndef QI_NO_UI
     ad_deinit();
     system("clear");
+#endif
     printf("GURU MEDITATION!\n\nFile '%s' | Line %u | Function '%s'\n\nCondition '%s' failed!\n\nExiting to shell.\n", file, line, func, assertion);
     sync();
     abort();
 }
 
 static inline void __qi__fatal_error(const char *msg, const char * assertion, const char * file, unsigned int line, const char * func) {
+#ifdef QI_NO_UI
+    printf("ERROR: %s\n\nAssertion '%s' failed in function '%s' (%s:%u)\n", msg, assertion, func, file, line);
+#else
     ad_okBox("Fatal Error", false,
         "ERROR:\n"
         "%s\n"
@@ -30,6 +38,7 @@ static inline void __qi__fatal_error(const char *msg, const char * assertion, co
         msg, assertion, func, file, line);
     ad_deinit();
     system("clear");
+#endif
     sync();
     abort();
 }
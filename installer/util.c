@@ -22,6 +22,7 @@
 #include <fcntl.h>
 #include <sys/sendfile.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "qi_assert.h"
 
@@ -169,6 +170,34 @@ uint32_t util_getUInt32fromBuffer(const uint8_t *buf, size_t offset) {
     return *((uint32_t *) (buf + offset));
 }
 
+uint64_t util_getUInt64fromBuffer(const uint8_t *buf, size_t offset) {
+    return *((uint64_t *) (buf + offset));
+}
+
+// Table for the reflected CRC-32 (IEEE 802.3) polynomial, built on first use
+static uint32_t util_crc32Table[256];
+static pthread_once_t util_crc32TableOnce = PTHREAD_ONCE_INIT;
+
+static void util_crc32TableInit(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (size_t bit = 0; bit < 8; bit++) {
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        }
+        util_crc32Table[i] = c;
+    }
+}
+
+uint32_t util_crc32(uint32_t crc, const uint8_t *buf, size_t length) {
+    pthread_once(&util_crc32TableOnce, util_crc32TableInit);
+
+    crc = ~crc;
+    while (length--) {
+        crc = util_crc32Table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
 // Convet DOS time to Unix Time and return this in a time_t
 time_t util_dosTimeToUnixTime(uint16_t dosDate, uint16_t dosTime) {
     struct tm tmValue;
@@ -192,6 +221,27 @@ bool util_setDosFileTime(int fd, uint16_t dosDate, uint16_t dosTime) {
     return util_setFileTime(fd, util_dosTimeToUnixTime(dosDate, dosTime));
 }
 
+uint64_t util_getMonotonicTimeUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
+void util_unixTimeToDosTime(time_t time, uint16_t *dosDate, uint16_t *dosTime) {
+    struct tm tmValue;
+    localtime_r(&time, &tmValue);
+
+    // DOS can't go before 1980
+    if (tmValue.tm_year < 80) {
+        *dosDate = (1 << 5) | 1;
+        *dosTime = 0;
+        return;
+    }
+
+    *dosDate = (uint16_t) (((tmValue.tm_year - 80) << 9) | ((tmValue.tm_mon + 1) << 5) | tmValue.tm_mday);
+    *dosTime = (uint16_t) ((tmValue.tm_hour << 11) | (tmValue.tm_min << 5) | (tmValue.tm_sec / 2));
+}
+
 bool util_readFirstLineFromFileIntoBuffer(const char *filename, char *dest, size_t bufSize) {
     FILE *fp;
     char *result = NULL;
@@ -220,6 +270,11 @@ bool util_setDosFileAttributes(int fd, uint32_t attributes) {
     return ret == 0;
 }
 
+bool util_getDosFileAttributes(int fd, uint32_t *attributes) {
+    int ret = ioctl(fd, FAT_IOCTL_GET_ATTRIBUTES, attributes);
+    return ret == 0;
+}
+
 mode_t util_dosFileAttributeToUnixMode(uint8_t dosFlags) {
     mode_t ret = 0;
     if (dosFlags & ATTR_DIR)    // The file is a directory
@@ -270,9 +325,10 @@ bool util_mkDir(const char *dirName, uint32_t dosFlags) {
             curDir[0] = 0x00;
 
             // Create the actual directory now
+            // Someone else may create it in the meantime, that's fine too
             if (!util_fileExists(tmp)) {
                 int result = mkdir(tmp, 0777);
-                success &= (result == 0) || (result == EEXIST);
+                success &= (result == 0) || (errno == EEXIST);
             }
             
             // Put the slash back
@@ -288,7 +344,7 @@ bool util_mkDir(const char *dirName, uint32_t dosFlags) {
     int fd = open(dirName, O_RDONLY | O_DIRECTORY);
     success &= fd >= 0;
 
-    if (fd) {
+    if (fd >= 0) {
         success &= 0 == ioctl(fd, FAT_IOCTL_SET_ATTRIBUTES, &dosFlags);
         close(fd);
     }
@@ -315,39 +371,12 @@ char *util_pathAppend(const char *basePath, const char *subPath) {
     return target;
 }
 
-size_t util_getFileCountRecursive(const char *baseDir) {
-    struct dirent *e;
-    DIR *d = opendir(baseDir);
-
-    util_returnOnNull(d, 0);
-    
-    size_t count = 0;
-
-    while ((e = readdir(d))) {
-        if (util_stringEquals(e->d_name, ".") || util_stringEquals(e->d_name, ".."))
-            continue;
-
-        char *newPath = util_pathAppend(baseDir, e->d_name);
-
-        QI_FATAL(newPath != NULL, "Failed to allocate path string");
-
-        if      (util_isDir(newPath))   count += util_getFileCountRecursive(newPath);
-        else if (util_isFile(newPath))  count += 1;
-
-        free (newPath);
-    }
-
-    closedir(d);
-    return count;
-}
-
 static size_t util_getFileSizeFromFd(int fd) {
-    ssize_t fileSize = (ssize_t) lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
+    struct stat st;
 
-    if (fileSize < 0) return 0;
+    if (fstat(fd, &st) != 0 || st.st_size < 0) return 0;
 
-    return (size_t) fileSize;
+    return (size_t) st.st_size;
 }
 
 static inline __always_inline bool util_fileCopyWriteEnsure(int fd, uint8_t *buf, size_t size) {
@@ -373,10 +402,11 @@ static bool util_fileCopyReadWrite(const char *source, const char *dest) {
     if (!success) goto cleanup;
 
     size_t leftToRead = util_getFileSizeFromFd(in);
+    uint8_t *buf = malloc(UTIL_FILE_COPY_BUFFER_SIZE);
+    success = (buf != NULL);
     
     while (success && (leftToRead > 0)) {
-        uint8_t buf[4096];
-        ssize_t hasRead = read(in, buf, sizeof(buf));
+        ssize_t hasRead = read(in, buf, UTIL_FILE_COPY_BUFFER_SIZE);
 
         leftToRead -= hasRead;
 
@@ -387,6 +417,8 @@ static bool util_fileCopyReadWrite(const char *source, const char *dest) {
         }
     }
 
+    free(buf);
+
 cleanup:
     close(in);
     close(out);
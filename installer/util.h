@@ -19,6 +19,7 @@
 #define UTIL_HDD_MODEL_STRING_LENGTH (64+1)
 #define UTIL_TABLE_TYPE_STRING_LENGTH (8)
 #define UTIL_FS_TYPE_STRING_LENGTH (64+1)
+#define UTIL_FILE_COPY_BUFFER_SIZE (64 * 1024)
 #define DISK_MBR_CODE_LENGTH (446)
 
 #define __KB * 1024ULL
@@ -73,6 +74,9 @@ typedef struct {
     util_HardDisk *disks;    
 } util_HardDiskArray;
 
+// An open read/write session on a disk or partition block device. Opaque, see util_disk.c
+typedef struct util_BlockDevice util_BlockDevice;
+
 // This struct models a part of a boot sector that is to be overwritten with parts of data blocks
 // In essence, the sector number 'sectorIndex' will have 'length' bytes at 'offset'
 // overwritten with data from 'replacementData' (offset 0)
@@ -130,10 +134,17 @@ util_HardDiskArray *util_getSystemHardDisks(void);
 // Deallocates a hard disk array including all internal data structures
 void util_hardDiskArrayDestroy(util_HardDiskArray *hdds);
 
+// Parses the partition table of a disk (MBR, extended/logical chain or GPT) into its partition list.
+// Results are cached per device until util_partitionTableInvalidate is called for that disk, or the disk's size or
+// its MBR / GPT header change.
+bool util_partitionTableRead(util_HardDisk *hdd);
+// Invalidates the cached partition table of a disk. Must be called whenever the table or a file system on it is modified.
+void util_partitionTableInvalidate(const util_HardDisk *hdd);
+
 // Converts a MBR patition type byte to a util_FileSystem enum value
 util_FileSystem util_partitionTypeByteToUtilFilesystem(uint8_t partitionType);
-// Converts a GUID + FSTYPE string to a util_FileSystem enum value
-util_FileSystem util_guidToUtilFilesystem(const char *guid, const char *fsType);
+// Converts a raw (on-disk byte order) GPT type GUID + the partition's first sector to a util_FileSystem enum value
+util_FileSystem util_guidToUtilFilesystem(const uint8_t *guid, const uint8_t *bootSector);
 // Converts an util_FileSystem enum value to a string
 const char *util_utilFilesystemToString(util_FileSystem fs);
 // Gets the short version of a device string (after the last /, so /dev/sda1 becomes sda1)
@@ -146,6 +157,8 @@ bool util_unmountPartition(util_Partition *part);
 
 // Checks if a partition is currently mounted.
 bool util_isPartitionMounted(util_Partition *part);
+// Marks the cached mount table as outdated, so it is read again from /proc/self/mounts on next use.
+void util_mountTableInvalidate(void);
 
 // Gets the command to format a partition. Returns false if there was an error, such as unsupported filesystem.
 bool util_getFormatCommand(util_Partition *part, util_FileSystem fs, char *buf, size_t bufSize);
@@ -160,21 +173,29 @@ util_Partition *util_getPartitionFromIndex(util_HardDiskArray *hdds, size_t inde
 
 /* Disk IO functions */
 
-// Reads a sector from a physical disk into an existing buffer
-bool util_readSectorFromDisk(util_HardDisk *hdd, size_t sector, uint8_t *buf);
-// Reads a sector from a partition on a disk into an existing buffer
-bool util_readSectorFromPartition(util_Partition *part, size_t sector, uint8_t *buf);
-// Reads a sector from a physical disk into a newly allocated buffer
-uint8_t *util_readSectorFromDiskAllocate(util_HardDisk *hdd, size_t sector);
-// Reads a sector from a partition on a disk into a newly allocated buffer
-uint8_t *util_readSectorFromPartitionAllocate(util_Partition *part, size_t sector);
+// Opens a session on a physical disk. Sectors that are read are cached, sectors that are written
+// are held back until util_blockDeviceCommit. Returns NULL on error.
+util_BlockDevice *util_blockDeviceOpenDisk(util_HardDisk *hdd);
+// Opens a session on a partition of a disk. See util_blockDeviceOpenDisk.
+util_BlockDevice *util_blockDeviceOpenPartition(util_Partition *part);
+// Reads a sector through a session into an existing buffer
+bool util_blockDeviceRead(util_BlockDevice *bd, uint64_t sector, uint8_t *buf);
+// Stages a sector write in a session. Nothing is written to the device until util_blockDeviceCommit is called.
+bool util_blockDeviceWrite(util_BlockDevice *bd, uint64_t sector, const uint8_t *buf);
+// Writes all staged sectors to the device in ascending order and flushes the device once.
+bool util_blockDeviceCommit(util_BlockDevice *bd);
+// Closes a session. Staged writes that were not committed are discarded.
+void util_blockDeviceClose(util_BlockDevice *bd);
 
 // Wipes the partition table of a given disk.
 bool util_wipePartitionTable(util_HardDisk *hdd);
-// Sets the given partition active. MUST have a valid parent field!
-bool util_setPartitionActive(util_Partition *part);
+// Replaces the partition table of a given disk with a single active FAT32 partition of up to maxSize bytes.
+// It has CHS values and type 0x0B if it ends within the first 1024 cylinders, otherwise type 0x0C (LBA).
+bool util_partitionWholeDisk(util_HardDisk *hdd, uint64_t maxSize);
+// Sets the given partition active. 'disk' must be a session on the partition's parent disk.
+bool util_setPartitionActive(util_BlockDevice *disk, util_Partition *part);
 // Writes new MBR code to a physical disk (FDISK /MBR equivalent). newMBRCode must contain exactly DISK_MBR_CODE_LENGTH bytes.
-bool util_writeMBRToDrive(util_HardDisk *hdd, const uint8_t *newMBRCode);
+bool util_writeMBRToDrive(util_BlockDevice *disk, const uint8_t *newMBRCode);
 // Writes a FAT16/FAT32 Boot Sector to a partition on a disk (SYS.COM equivalent, sans copying system files)
 bool util_modifyAndwriteBootSectorToPartition(util_Partition *part, const util_BootSectorModifier *modifierList);
 
@@ -184,6 +205,8 @@ bool util_modifyAndwriteBootSectorToPartition(util_Partition *part, const util_B
 bool util_setDosFileTime(int fd, uint16_t dosDate, uint16_t dosTime);
 // Sets an open file's attributes
 bool util_setDosFileAttributes(int fd, uint32_t attributes);
+// Gets the DOS attributes of a file on a FAT file system. Returns false for other file systems.
+bool util_getDosFileAttributes(int fd, uint32_t *attributes);
 // Checks if a file exists.
 bool util_fileExists(const char *filename);
 // Creates a directory recursively and sets DOS flags on it
@@ -196,8 +219,6 @@ bool util_isDir(const char *path);
 bool util_fileCopy(const char *source, const char *dest);
 // Allocates a new string which holds "<basePath>/<subPath>""
 char *util_pathAppend(const char *basePath, const char *subPath);
-// Gets the total amount of files in a directory, including all files in all subdirectories
-size_t util_getFileCountRecursive(const char *baseDir);
 
 
 /* String functions */
@@ -228,12 +249,21 @@ void util_hexDump(const uint8_t *buf, size_t offset, size_t length);
 uint16_t util_getUInt16fromBuffer(const uint8_t *buf, size_t offset);
 // Gets an unsigned 32 bit value from a raw buffer
 uint32_t util_getUInt32fromBuffer(const uint8_t *buf, size_t offset);
+// Gets an unsigned 64 bit value from a raw buffer
+uint64_t util_getUInt64fromBuffer(const uint8_t *buf, size_t offset);
+
+// Updates a CRC-32 (IEEE) checksum with the contents of a buffer. Start with crc = 0.
+uint32_t util_crc32(uint32_t crc, const uint8_t *buf, size_t length);
 
 // Reads the first line of a file into a buffer.
 bool util_readFirstLineFromFileIntoBuffer(const char *filename, char *dest, size_t bufSize);
 
 // Converts a DOS date/time to a unix epoch time stamp
 time_t util_dosTimeToUnixTime(uint16_t dosDate, uint16_t dosTime);
+// Gets a monotonic time stamp in microseconds, for measuring durations
+uint64_t util_getMonotonicTimeUs(void);
+// Converts a UNIX time stamp to DOS date & time (local time, 2 second resolution, 1980 at the earliest)
+void util_unixTimeToDosTime(time_t time, uint16_t *dosDate, uint16_t *dosTime);
 // Converts a DOS Flag byte to a mode_t for use with chmod or somesuch
 mode_t util_dosFileAttributeToUnixMode(uint8_t dosFlags);
 
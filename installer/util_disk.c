@@ -15,237 +15,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
-#include <linux/fs.h>
+#include <sys/mount.h>
+#include <limits.h>
+#include <linux/hdreg.h>
 
 #include "qi_assert.h"
 
-#define CMD_SURPRESS_OUTPUT " 2>/dev/null 1>/dev/null"
-
-// Update parents after a reallocation of a hard disk array
-static inline void util_HardDisksUpdatePartitionParents(util_HardDisk *hdds, size_t diskCount) {
-    if (hdds != NULL) {
-        for (size_t h = 0; h < diskCount; h++) {
-            util_HardDisk *hdd = &hdds[h];
-            for (size_t p = 0; p < hdd->partitionCount; p++) {
-                hdd->partitions[p].parent = hdd;
-            }
-        }
-    }
-}
-
-// Appends a HardDisk with given parameters to a HardDiskArray and returns a pointer to the newly created disk.
-static util_HardDisk *util_HardDiskArrayAppend(util_HardDiskArray *hda, const char *device, const char *model, uint64_t size, uint32_t sectorSize, uint32_t optIoSize, const char *tableType) {
-    QI_ASSERT(hda != NULL);
-    QI_ASSERT(device != NULL);
-    QI_ASSERT(model != NULL);
-    QI_ASSERT(tableType != NULL);
-
-    hda->count++;
-    hda->disks = realloc(hda->disks, hda->count * sizeof(util_HardDisk));
-
-    QI_ASSERT(hda->disks != NULL);
-
-    util_HardDisksUpdatePartitionParents(hda->disks, hda->count - 1);
-
-    util_HardDisk *ret = &hda->disks[hda->count - 1];
-
-    memset(ret, 0, sizeof(util_HardDisk));
-
-    strncpy(ret->device, device, sizeof(ret->device));
-    strncpy(ret->model, model, sizeof(ret->model));
-    strncpy(ret->tableType, tableType, sizeof(ret->tableType));
-
-    util_stringRTrim(ret->model); // this field as it comes from lsblk often contains a ton of padding
-
-    ret->size = size;
-    ret->sectorSize = sectorSize;
-    ret->optIoSize = optIoSize;
-
-    return ret;
-}
-
-static size_t util_getPartitionIndexOnParent(util_Partition *part) {
-    // Getting the index reliably is a bit hard
-    // Parse the device string from the end until we find a non-number and then get the number from there
-    char *devStr = part->device;
-    char *parseStart = NULL;
-
-    for (size_t stringIndex = strlen(devStr)-1; stringIndex > 0; stringIndex--) {
-        if (isdigit(devStr[stringIndex])) {
-            parseStart = &devStr[stringIndex];
-        } else {
-            break;
-        }
-
-        if (stringIndex < strlen(part->parent->device)) {
-            // Uh oh, we have not found a non-digit character but are now into the parent device stem.
-            parseStart = NULL;
-            break;
-        }
-    }
-
-    QI_FATAL(parseStart != NULL, "Cannot parse partition device index.");
-
-    return (size_t) atoi(parseStart);;
-}
-
-static util_Partition *util_HardDiskAddPartition(util_HardDisk *hd, const char *device, uint64_t start, uint64_t size, uint32_t sectorSize, util_FileSystem fileSystem) {
-    QI_ASSERT(hd != NULL);
-
-    hd->partitionCount++;
-    hd->partitions = realloc(hd->partitions, hd->partitionCount * sizeof(util_Partition));
-
-    QI_ASSERT(hd->partitions != NULL);
-
-    util_Partition *ret = &hd->partitions[hd->partitionCount - 1];
-
-    memset(ret, 0, sizeof(util_Partition));
-
-    strncpy(ret->device, device, sizeof(ret->device));
-
-    ret->start = start;
-    ret->size = size;
-    ret->sectorSize = sectorSize;
-    ret->fileSystem = fileSystem;
-    ret->parent = hd;
-    ret->indexOnParent = util_getPartitionIndexOnParent(ret);
-    ret->isLogical = ret->indexOnParent > 4;
-
-    return ret;
-}
-
-// Gets a value for a given key from a '<key>="value" <key2>="value2"' esque input string
-static bool util_getValueFromKey(const char *input, const char *key, char *value, size_t valueBufSize) {
-    const char *curPos = input;
-
-    QI_ASSERT(input != NULL);
-    QI_ASSERT(key != NULL);
-    QI_ASSERT(value != NULL);
-
-    size_t keyLen = strlen(key);
-    const char equalsQuote[] = "=\"";
-
-    while (!(util_stringStartsWith(curPos, key) && util_stringStartsWith(curPos + keyLen, equalsQuote))) {
-        if (*curPos == 0x00)
-            return false;
-
-        curPos++;
-    }
-
-    // If we're still here, the string actually matches what we need, skip to the actual value
-    curPos += keyLen + sizeof(equalsQuote) - 1;
-
-    // Find the closing quote for the value
-    const char *valueEnd = strchr(curPos, '\"');
-
-    if (valueEnd == NULL)
-        return false;
-
-    size_t valueLength = valueEnd - curPos;
-    
-    // Cap to buffer size
-    valueLength = MIN(valueLength, valueBufSize - 1);
-    memcpy(value, curPos, valueLength);
-    value[valueLength] = 0x00;
-    
-    return true;
-}
-
-util_HardDiskArray *util_getSystemHardDisks() {
-    util_HardDiskArray *ret = calloc(1, sizeof(util_HardDiskArray));
-
-    QI_ASSERT(ret != NULL);
-
-    // Problem: If we run outside of QuickInstall linux environment, lsblk may not have the START column.
-    #define LSBLK_PARAMS " -I 8,3,259 -n -b -p -P -oTYPE,KNAME,PARTTYPE,SIZE,OPT-IO,MODEL,PTTYPE,FSTYPE"
-
-    const char *lsblkCommand = NULL;
-
-    // Try lsblk.qi
-    if (util_fileExists("/bin/lsblk.qi")) {
-        lsblkCommand = "lsblk.qi " LSBLK_PARAMS ",START";
-    } else {
-        lsblkCommand = "lsblk " LSBLK_PARAMS;
-    }
-
-    // Get disk models
-    util_CommandOutput *lsblkOut = util_commandOutputCapture(lsblkCommand);
-
-    QI_ASSERT(lsblkOut != NULL);
-
-    if (lsblkOut->lineCount == 0) {
-        util_commandOutputDestroy(lsblkOut);
-        return ret;
-    }
-
-    util_HardDisk *currentDisk = NULL;
-
-    for (size_t i = 0; i < lsblkOut->lineCount; ++i) {
-        char tmpType        [4+1] = "";
-        char tmpDevice      [UTIL_HDD_DEVICE_STRING_LENGTH];
-        char tmpModel       [UTIL_HDD_MODEL_STRING_LENGTH];
-        char tmpPtType      [UTIL_TABLE_TYPE_STRING_LENGTH] = "";
-        char tmpFsType      [UTIL_FS_TYPE_STRING_LENGTH];
-        char tmpPartType    [UTIL_FS_TYPE_STRING_LENGTH];
-        char tmpNumStr      [64+1] = "";
-        bool success = true;
-        
-        success &= util_getValueFromKey(lsblkOut->lines[i], "TYPE", tmpType, sizeof(tmpType));
-        
-        success &= util_getValueFromKey(lsblkOut->lines[i], "KNAME", tmpDevice, sizeof(tmpDevice));
-
-        success &= util_getValueFromKey(lsblkOut->lines[i], "MODEL", tmpModel, sizeof(tmpModel));
-
-        success &= util_getValueFromKey(lsblkOut->lines[i], "PTTYPE", tmpPtType, sizeof(tmpPtType));
-        
-        success &= util_getValueFromKey(lsblkOut->lines[i], "PARTTYPE", tmpPartType, sizeof(tmpPartType));
-
-        success &= util_getValueFromKey(lsblkOut->lines[i], "FSTYPE", tmpFsType, sizeof(tmpFsType));
-        bool isGuid = (strlen(tmpPartType) > 4); // 0xFF <- 4 characters, anything bigger should be a guid...
-        util_FileSystem tmpFileSystem = isGuid ? util_guidToUtilFilesystem(tmpPartType, tmpFsType)
-                                               : util_partitionTypeByteToUtilFilesystem(strtoul(tmpPartType, NULL, 16));
-
-        success &= util_getValueFromKey(lsblkOut->lines[i], "SIZE", tmpNumStr, sizeof(tmpNumStr));
-        uint64_t tmpSize = strtoull(tmpNumStr, NULL, 10);
-
-        // START might not be present due to it not being available in lsblk pre-2.37
-        uint64_t tmpStart = 0;
-        // If available, override this value
-        if (util_getValueFromKey(lsblkOut->lines[i], "START", tmpNumStr, sizeof(tmpNumStr))) {
-            tmpStart = strtoull(tmpNumStr, NULL, 10);
-        }
-
-        // This used to read MIN-IO as the sector size - it is NOT. The sector size would be PHY-SEC.
-        // But more importantly - Linux treats a sector as 512 bytes *always*, so it's not even relevant here
-        // And so does int13h translation, which is the point this relates to in this code.
-        // So we hardcode it to 512.
-        // success &= util_getValueFromKey(lsblkOut->lines[i], "MIN-IO", tmpNumStr, sizeof(tmpNumStr));
-        uint32_t tmpSectorSize = 512;
-        
-        success &= util_getValueFromKey(lsblkOut->lines[i], "OPT-IO", tmpNumStr, sizeof(tmpNumStr));
-        uint32_t tmpOptIoSize = strtoull(tmpNumStr, NULL, 10);
-
-        if (util_stringEquals(tmpType, "disk")) {
-            /* This is a hard disk. */
-            currentDisk = util_HardDiskArrayAppend(ret, tmpDevice, tmpModel, tmpSize, tmpSectorSize, tmpOptIoSize, tmpPtType);
-        } else if (util_stringEquals(tmpType, "part")) {
-            /* This is a partition. */
-            QI_ASSERT(currentDisk != NULL);
-            
-            /* The beginning of the device name must match the parent disk's as a child partition of that disk. */
-            QI_ASSERT(util_stringStartsWith(tmpDevice, currentDisk->device) == true);
-
-            util_HardDiskAddPartition(currentDisk,tmpDevice, tmpStart, tmpSize, tmpSectorSize, tmpFileSystem);
-        } else {
-            /* Tape streamer or other weird thing, not of interest for us... */
-            continue;
-        }
-    }
-
-    util_commandOutputDestroy(lsblkOut);
-    return ret;
-}
-
 void util_hardDiskArrayDestroy(util_HardDiskArray *hdds) {
     if (hdds) {
         if (hdds->disks) {
@@ -269,48 +44,6 @@ void util_hardDiskArrayDestroy(util_HardDiskArray *hdds) {
     }
 }
 
-util_FileSystem util_partitionTypeByteToUtilFilesystem(uint8_t partitionType) {
-    switch(partitionType) {
-        case 0x00:  return fs_none;
-        case 0x05:  return fs_extended;     // Extended partition
-        case 0x0f:  return fs_extended;     // Extended partition (LBA)
-        case 0x04:  return fs_fat16;        // FAT16  < 32MB
-        case 0x06:  return fs_fat16;        // FAT16 >= 32MB 
-        case 0x0E:  return fs_fat16;        // FAT16 >= 32MB LBA
-        case 0x14:  return fs_fat16;        // FAT16  < 32MB        HIDDEN
-        case 0x16:  return fs_fat16;        // FAT16 >= 32MB        HIDDEN
-        case 0x1E:  return fs_fat16;        // FAT16 >= 32MB LBA    HIDDEN
-        case 0x0B:  return fs_fat32;        // FAT32
-        case 0x0C:  return fs_fat32;        // FAT32 LBA
-        case 0x1B:  return fs_fat32;        // FAT32        HIDDEN
-        case 0x1C:  return fs_fat32;        // FAT32 LBA    HIDDEN
-        case 0x07:  return fs_ntfs;         // NTFS or exFAT
-        case 0x17:  return fs_ntfs;         // NTFS or exFAT        HIDDEN
-        case 0x27:  return fs_ntfs;         // NTFS or exFAT        HIDDEN (sometimes used for recovery partitions)
-        case 0x83:  return fs_linux;        // Linux native filesystem (ext2, ext3, ext4)
-        case 0x82:  return fs_swap;         // Linux swap
-        case 0xEF:  return fs_efi;          // EFI System Partition (FAT32)
-        default:    return fs_unsupported;
-    }
-}
-
-util_FileSystem util_guidToUtilFilesystem(const char *guid, const char *fsType) {
-    QI_FATAL(guid != NULL && fsType != NULL, "GUID/FSTYPE invalid.");
-
-    if (util_stringEquals(guid,     "c12a7328-f81f-11d2-ba4b-00a0c93ec93b"))    return fs_efi;
-    if (util_stringEquals(guid,     "21686148-6449-6e6f-744e-656564454649"))    return fs_gpt_boot;
-    if (util_stringEquals(fsType,   "vfat"))                                    return fs_gpt_vfat;
-    if (util_stringEquals(fsType,   "ntfs"))                                    return fs_ntfs;
-    if (util_stringEquals(fsType,   "exfat"))                                   return fs_exfat;
-    if (util_stringEquals(fsType,   "ext2"))                                    return fs_linux;
-    if (util_stringEquals(fsType,   "ext3"))                                    return fs_linux;
-    if (util_stringEquals(fsType,   "ext4"))                                    return fs_linux;
-
-    if (strlen(guid) == 0 && strlen(fsType) == 0)                               return fs_none;
-
-    return fs_unsupported;
-}
-
 static const char *UTIL_FS_STRINGS[FS_ENUM_SIZE] = {
     "---",
     "?",
@@ -336,17 +69,80 @@ const char *util_shortDeviceString(const char *str) {
     return strrchr(str, '/') + 1;
 }
 
+// One line of /proc/self/mounts, only the parts we care about
+typedef struct {
+    char device[UTIL_HDD_DEVICE_STRING_LENGTH];
+    char mountPoint[PATH_MAX];
+} util_MountTableEntry;
+
+static util_MountTableEntry *util_mountTable = NULL;
+static size_t util_mountTableCount = 0;
+static bool util_mountTableValid = false;
+
+// Reads /proc/self/mounts into the mount table, if it is not up to date
+static void util_mountTableLoad(void) {
+    if (util_mountTableValid) return;
+
+    util_mountTableCount = 0;
+
+    FILE *mounts = fopen("/proc/self/mounts", "r");
+    QI_ASSERT(mounts != NULL);
+
+    char line[UTIL_CMD_OUTPUT_LINE_LENGTH];
+
+    while (fgets(line, sizeof(line), mounts)) {
+        // We only care about block devices, skip proc, sysfs, tmpfs and friends
+        if (line[0] != '/') continue;
+
+        char *device = strtok(line, " ");
+        char *mountPoint = strtok(NULL, " ");
+
+        if (device == NULL || mountPoint == NULL || strlen(device) >= UTIL_HDD_DEVICE_STRING_LENGTH) continue;
+
+        util_mountTable = realloc(util_mountTable, (util_mountTableCount + 1) * sizeof(util_MountTableEntry));
+        QI_ASSERT(util_mountTable != NULL);
+
+        util_MountTableEntry *entry = &util_mountTable[util_mountTableCount++];
+        strncpy(entry->device, device, sizeof(entry->device) - 1);
+        entry->device[sizeof(entry->device) - 1] = 0x00;
+        strncpy(entry->mountPoint, mountPoint, sizeof(entry->mountPoint) - 1);
+        entry->mountPoint[sizeof(entry->mountPoint) - 1] = 0x00;
+    }
+
+    fclose(mounts);
+    util_mountTableValid = true;
+}
+
+// Gets the mount point of a device from the mount table. Returns NULL if it is not mounted.
+static const char *util_mountTableFind(const char *device) {
+    util_mountTableLoad();
+
+    for (size_t i = 0; i < util_mountTableCount; i++) {
+        if (util_stringEquals(util_mountTable[i].device, device)) {
+            return util_mountTable[i].mountPoint;
+        }
+    }
+
+    return NULL;
+}
+
+void util_mountTableInvalidate(void) {
+    util_mountTableValid = false;
+}
+
 // mounts a disk under a special name, i.e. /dev/sda1 will be mounted at /dev_sda1
 bool util_mountPartition(util_Partition *part) {
     char *mountPath = strdup(part->device);
     assert(mountPath && strlen(mountPath) > 1);
     util_stringReplaceChar(&mountPath[1], '/', '_'); // Ignore initial '/' character
     mkdir(mountPath, 0777);
-    
 
-    char mountCmd[1024];
-    snprintf(mountCmd, sizeof(mountCmd), "mount -t vfat %s %s" CMD_SURPRESS_OUTPUT, part->device, mountPath);
-    if (system(mountCmd) == 0) {
+    // Nobody needs access times during installation, they only cost extra directory writes
+    int result = mount(part->device, mountPath, "vfat", MS_NOATIME | MS_NODIRATIME, NULL);
+
+    util_mountTableInvalidate();
+
+    if (result == 0) {
         part->mountPath = mountPath;
         return true;
     } else {
@@ -359,10 +155,12 @@ bool util_mountPartition(util_Partition *part) {
 bool util_unmountPartition(util_Partition *part) {
     bool success = true;
 
-    if (util_isPartitionMounted(part)) {
-        char umountCmd[1024];
-        snprintf(umountCmd, sizeof(umountCmd), "umount -l %s" CMD_SURPRESS_OUTPUT, part->device);
-        success = (WEXITSTATUS(system(umountCmd)) == 0);
+    const char *mountPoint = util_mountTableFind(part->device);
+
+    if (mountPoint != NULL) {
+        // Lazy unmount, same as umount -l
+        success = (umount2(mountPoint, MNT_DETACH) == 0);
+        util_mountTableInvalidate();
     }
 
     if (part->mountPath != NULL) {
@@ -400,106 +198,190 @@ util_Partition *util_getPartitionFromIndex(util_HardDiskArray *hdds, size_t inde
     return NULL;
 }
 
-// Reads bytes from a file descriptor in a loop until all of them are read
-static bool util_readFromFD(int fd, uint8_t *buf, size_t length) {    
+// A sector held by a block device session, either read from disk or staged for writing
+typedef struct {
+    uint64_t index;
+    bool dirty;
+    uint8_t *data;
+} util_CachedSector;
+
+struct util_BlockDevice {
+    int fd;
+    uint32_t sectorSize;
+    util_HardDisk *disk;            // Set if this is a session on a whole disk, for partition table cache invalidation
+    size_t sectorCount;
+    util_CachedSector *sectors;     // Sorted by sector index
+};
+
+// Reads bytes from a file descriptor at an offset in a loop until all of them are read
+static bool util_readFromFD(int fd, uint8_t *buf, size_t length, off_t offset) {    
     ssize_t bytesRead;
     while (length) {
-        bytesRead = read(fd, buf, length);
-        if (bytesRead < 0) return false;
+        bytesRead = pread(fd, buf, length, offset);
+        if (bytesRead <= 0) return false;
         length -= bytesRead;
         buf += bytesRead;        
+        offset += bytesRead;
     }
     return true;
 }
 
-// Writes bytes to a file descriptor in a loop until all of them are read
-static bool util_writeToFD(int fd, const uint8_t *buf, size_t length) {    
+// Writes bytes to a file descriptor at an offset in a loop until all of them are written
+static bool util_writeToFD(int fd, const uint8_t *buf, size_t length, off_t offset) {    
     ssize_t bytesWritten;
     while (length) {
-        bytesWritten = write(fd, buf, length);
-        if (bytesWritten < 0) return false;
+        bytesWritten = pwrite(fd, buf, length, offset);
+        if (bytesWritten <= 0) return false;
         length -= bytesWritten;
         buf += bytesWritten;        
+        offset += bytesWritten;
     }
     return true;
 }
 
-// Reads a sector from a device into existing buffer
-static bool util_readSector(char *dev, size_t sector, size_t ioSize, uint8_t *buf) {
-    int disk = open(dev, O_RDONLY);
-    if (disk < 0) return false;
+static util_BlockDevice *util_blockDeviceOpen(const char *device, uint32_t sectorSize, util_HardDisk *disk) {
+    int fd = open(device, O_RDWR);
+    if (fd < 0) return NULL;
 
-    size_t offset = ioSize * sector;
-    lseek(disk, offset, SEEK_SET);
-    bool result = util_readFromFD(disk, buf, ioSize);
-    close(disk);
-    return result;
+    util_BlockDevice *bd = calloc(1, sizeof(util_BlockDevice));
+    QI_ASSERT(bd != NULL);
+
+    bd->fd = fd;
+    bd->sectorSize = sectorSize;
+    bd->disk = disk;
+    return bd;
 }
 
-// Allocates and returns a buffer reading a sector from a device
-static uint8_t *util_readSectorAllocate(char *dev, size_t sector, size_t ioSize) {
-    uint8_t *sectorBuf = calloc(ioSize, 1);
-    if (!sectorBuf) return NULL;
-    if (!util_readSector(dev, sector, ioSize, sectorBuf)) {
-        free(sectorBuf);
-        return NULL;
-    }
-    return sectorBuf;
+util_BlockDevice *util_blockDeviceOpenDisk(util_HardDisk *hdd) {
+    util_returnOnNull(hdd, NULL);
+    return util_blockDeviceOpen(hdd->device, hdd->sectorSize, hdd);
 }
 
-// Write a sector to a device
-static bool util_writeSector(char *dev, size_t sector, size_t ioSize, const uint8_t *buf) {
+util_BlockDevice *util_blockDeviceOpenPartition(util_Partition *part) {
+    util_returnOnNull(part, NULL);
+    return util_blockDeviceOpen(part->device, part->sectorSize, NULL);
+}
 
-    int disk = open(dev, O_WRONLY);
-    if (disk < 0) return false;
+// Gets the cache slot for a sector, inserting an empty (data == NULL) one at the sorted position if there is none
+static util_CachedSector *util_blockDeviceGetSlot(util_BlockDevice *bd, uint64_t sector) {
+    size_t pos = 0;
 
-    size_t offset = ioSize * sector;
-    lseek(disk, offset, SEEK_SET);
-    bool result = util_writeToFD(disk, buf, ioSize);
-    fsync(disk);
-    close(disk);
-    return result;
-}
+    while (pos < bd->sectorCount && bd->sectors[pos].index < sector) {
+        pos++;
+    }
 
-bool util_readSectorFromDisk(util_HardDisk *hdd, size_t sector, uint8_t *buf) {
-    util_returnOnNull(hdd, NULL);
-    return util_readSector(hdd->device, sector, hdd->sectorSize, buf);
+    if (pos < bd->sectorCount && bd->sectors[pos].index == sector) {
+        return &bd->sectors[pos];
+    }
+
+    bd->sectors = realloc(bd->sectors, (bd->sectorCount + 1) * sizeof(util_CachedSector));
+    QI_ASSERT(bd->sectors != NULL);
+
+    memmove(&bd->sectors[pos + 1], &bd->sectors[pos], (bd->sectorCount - pos) * sizeof(util_CachedSector));
+    bd->sectorCount++;
+
+    util_CachedSector *slot = &bd->sectors[pos];
+    slot->index = sector;
+    slot->dirty = false;
+    slot->data = NULL;
+    return slot;
 }
 
-bool util_readSectorFromPartition(util_Partition *part, size_t sector, uint8_t *buf) {
-    util_returnOnNull(part, NULL);
-    return util_readSector(part->device, sector, part->sectorSize, buf);
+// Removes a slot that could not be filled
+static void util_blockDeviceDropSlot(util_BlockDevice *bd, util_CachedSector *slot) {
+    size_t pos = (size_t) (slot - bd->sectors);
+    free(slot->data);
+    memmove(&bd->sectors[pos], &bd->sectors[pos + 1], (bd->sectorCount - pos - 1) * sizeof(util_CachedSector));
+    bd->sectorCount--;
 }
 
-bool util_writeSectorToDisk(util_HardDisk *hdd, size_t sector, const uint8_t *buf) {
-    util_returnOnNull(hdd, NULL);
-    return util_writeSector(hdd->device, sector, hdd->sectorSize, buf);
+bool util_blockDeviceRead(util_BlockDevice *bd, uint64_t sector, uint8_t *buf) {
+    util_returnOnNull(bd, false);
+    util_returnOnNull(buf, false);
+
+    util_CachedSector *slot = util_blockDeviceGetSlot(bd, sector);
+
+    if (slot->data == NULL) {
+        slot->data = malloc(bd->sectorSize);
+        QI_ASSERT(slot->data != NULL);
+
+        if (!util_readFromFD(bd->fd, slot->data, bd->sectorSize, (off_t) (sector * bd->sectorSize))) {
+            util_blockDeviceDropSlot(bd, slot);
+            return false;
+        }
+    }
+
+    memcpy(buf, slot->data, bd->sectorSize);
+    return true;
 }
 
-bool util_writeSectorToPartition(util_Partition *part, size_t sector, const uint8_t *buf) {
-    util_returnOnNull(part, NULL);
-    return util_writeSector(part->device, sector, part->sectorSize, buf);
+bool util_blockDeviceWrite(util_BlockDevice *bd, uint64_t sector, const uint8_t *buf) {
+    util_returnOnNull(bd, false);
+    util_returnOnNull(buf, false);
+
+    util_CachedSector *slot = util_blockDeviceGetSlot(bd, sector);
+
+    if (slot->data == NULL) {
+        slot->data = malloc(bd->sectorSize);
+        QI_ASSERT(slot->data != NULL);
+    }
+
+    memcpy(slot->data, buf, bd->sectorSize);
+    slot->dirty = true;
+    return true;
 }
 
-uint8_t *util_readSectorFromDiskAllocate(util_HardDisk *hdd, size_t sector) {
-    util_returnOnNull(hdd, NULL);
-    return util_readSectorAllocate(hdd->device, sector, hdd->sectorSize);
+bool util_blockDeviceCommit(util_BlockDevice *bd) {
+    util_returnOnNull(bd, false);
+
+    bool success = true;
+    bool wroteAnything = false;
+
+    // Sectors are kept sorted, so this goes through the device front to back
+    for (size_t i = 0; i < bd->sectorCount && success; i++) {
+        util_CachedSector *slot = &bd->sectors[i];
+
+        if (!slot->dirty) continue;
+
+        success = util_writeToFD(bd->fd, slot->data, bd->sectorSize, (off_t) (slot->index * bd->sectorSize));
+        slot->dirty = !success;
+        wroteAnything = true;
+    }
+
+    if (wroteAnything) {
+        success &= (fsync(bd->fd) == 0);
+
+        if (bd->disk != NULL) {
+            util_partitionTableInvalidate(bd->disk);
+        }
+    }
+
+    return success;
 }
 
-uint8_t *util_readSectorFromPartitionAllocate(util_Partition *part, size_t sector) {
-    util_returnOnNull(part, NULL);
-    return util_readSectorAllocate(part->device, sector, part->sectorSize);
+void util_blockDeviceClose(util_BlockDevice *bd) {
+    if (bd == NULL) return;
+
+    for (size_t i = 0; i < bd->sectorCount; i++) {
+        free(bd->sectors[i].data);
+    }
+
+    free(bd->sectors);
+    close(bd->fd);
+    free(bd);
 }
 
-bool util_setPartitionActive(util_Partition *part) {
+bool util_setPartitionActive(util_BlockDevice *disk, util_Partition *part) {
+    util_returnOnNull(disk, false);
     util_returnOnNull(part, false);
-    util_returnOnNull(part->parent, false);
 
     QI_FATAL(part->indexOnParent > 0 && part->indexOnParent < 5, "Bad partition index.");
 
-    uint8_t *firstSector = util_readSectorFromDiskAllocate(part->parent, 0);
-    
-    util_returnOnNull(firstSector, false);
+    uint8_t firstSector[512];
+
+    if (!util_blockDeviceRead(disk, 0, firstSector)) {
+        return false;
+    }
 
     // Partition table starts at the end of MBR code
     util_PartitionTableEntry *table = (util_PartitionTableEntry *) &firstSector[DISK_MBR_CODE_LENGTH];
@@ -511,17 +393,14 @@ bool util_setPartitionActive(util_Partition *part) {
 
     table[part->indexOnParent - 1].bootFlag = 0x80;
 
-    bool success = util_writeSectorToDisk(part->parent, 0, firstSector);
-
-    free(firstSector);
-
-    return success;
+    return util_blockDeviceWrite(disk, 0, firstSector);
 }
 
-bool util_writeMBRToDrive(util_HardDisk *hdd, const uint8_t *newMBRCode) {
+bool util_writeMBRToDrive(util_BlockDevice *disk, const uint8_t *newMBRCode) {
+    uint8_t existingMBR[512];
+
     // Read existing MBR first
-    uint8_t *existingMBR = util_readSectorFromDiskAllocate(hdd, 0);
-    if (!existingMBR) return false;
+    if (!util_blockDeviceRead(disk, 0, existingMBR)) return false;
 
     QI_ASSERT(newMBRCode != NULL);
 
@@ -529,9 +408,21 @@ bool util_writeMBRToDrive(util_HardDisk *hdd, const uint8_t *newMBRCode) {
     memcpy(existingMBR, newMBRCode, DISK_MBR_CODE_LENGTH);
 
     // write it back to the disk
-    bool result = util_writeSectorToDisk(hdd, 0, existingMBR);
-    free(existingMBR);
-    return result;
+    return util_blockDeviceWrite(disk, 0, existingMBR);
+}
+
+// Commits a session on a whole disk and makes the kernel re-read its partition table
+static bool util_commitPartitionTable(util_BlockDevice *bd) {
+    bool success = true;
+    success &= util_blockDeviceCommit(bd);      // Nasty hacks to ensure
+    success &= ioctl(bd->fd, BLKFLSBUF) >= 0;   // Stuff gets written out 
+    success &= ioctl(bd->fd, BLKRRPART) >= 0;   // refresh partition table
+    util_blockDeviceClose(bd);
+
+    usleep(300000); // finally, sleep for a bit. 
+                    // that's the only way I seem to be able to get it to recognize we've wiped it...
+
+    return success;
 }
 
 bool util_wipePartitionTable(util_HardDisk *hdd) {
@@ -542,117 +433,195 @@ bool util_wipePartitionTable(util_HardDisk *hdd) {
 
     memset(dummySector, 0, sizeof(dummySector));
 
-    int fd = open(hdd->device, O_RDWR | O_SYNC);
+    util_BlockDevice *bd = util_blockDeviceOpenDisk(hdd);
+    if (bd == NULL) return false;
 
     // Wiping the first 34 sectors is enough to make cf not recognize GPT anymore
     for (size_t sectorIndex = 0; sectorIndex < 34; sectorIndex++) {
-        success &= (write(fd, dummySector, sizeof(dummySector)) > 0);
+        success &= util_blockDeviceWrite(bd, sectorIndex, dummySector);
     }
 
-    fsync(fd);                              // Nasty hacks to ensure
-    success &= ioctl(fd, BLKFLSBUF) >= 0;   // Stuff gets written out 
-    success &= ioctl(fd, BLKRRPART) >= 0;   // refresh partition table
-    close(fd);
+    if (!success) {
+        util_blockDeviceClose(bd);
+        return false;
+    }
 
-    usleep(300000); // finally, sleep for a bit. 
-                    // that's the only way I seem to be able to get it to recognize we've wiped it...
+    return util_commitPartitionTable(bd);
+}
 
-    return success;
+// CHS geometry of a disk, as the BIOS is expected to address it
+typedef struct {
+    uint32_t heads;
+    uint32_t sectors;
+} util_DiskGeometry;
+
+typedef struct {
+    uint8_t head;
+    uint16_t sectorAndCylinder;
+} util_Chs;
+
+// Gets the geometry the kernel reports for a disk. Without one, this is the usual BIOS LBA assist translation:
+// 63 sectors per track and as few heads as possible for at most 1024 cylinders.
+static util_DiskGeometry util_getDiskGeometry(util_BlockDevice *bd, uint64_t sectorCount) {
+    struct hd_geometry geo;
+
+    if (ioctl(bd->fd, HDIO_GETGEO, &geo) == 0 && geo.heads > 0 && geo.sectors > 0 && geo.sectors <= 63) {
+        return (util_DiskGeometry) { geo.heads, geo.sectors };
+    }
+
+    uint32_t heads = 16;
+    while (heads < 255 && sectorCount > 1024ULL * heads * 63) {
+        heads = (heads == 128) ? 255 : heads * 2;
+    }
+
+    return (util_DiskGeometry) { heads, 63 };
 }
 
-static bool util_modifyBootSector(util_Partition *part, const util_BootSectorModifier *modifierList) {
-    uint8_t *sector = NULL;
-    size_t oldSectorIndex = 0;
+// Converts a sector number to the CHS fields of a partition table entry
+static util_Chs util_lbaToChs(util_DiskGeometry geo, uint64_t lba) {
+    uint32_t cylinder = (uint32_t) (lba / (geo.heads * geo.sectors));
+    uint32_t sector = (uint32_t) (lba % geo.sectors) + 1;
+
+    return (util_Chs) {
+        .head = (uint8_t) ((lba / geo.sectors) % geo.heads),
+        .sectorAndCylinder = (uint16_t) (sector | ((cylinder >> 2) & 0xC0) | ((cylinder & 0xFF) << 8)),
+    };
+}
+
+bool util_partitionWholeDisk(util_HardDisk *hdd, uint64_t maxSize) {
+    uint8_t sector[512];
     bool success = true;
 
-    QI_ASSERT(part != NULL);
+    QI_ASSERT(hdd != NULL);
+
+    util_BlockDevice *bd = util_blockDeviceOpenDisk(hdd);
+    if (bd == NULL) return false;
+
+    util_DiskGeometry geo = util_getDiskGeometry(bd, hdd->size / 512);
+    const uint64_t cylinderSize = (uint64_t) geo.heads * geo.sectors;
+
+    // Track 0 stays free like DOS FDISK does it, the partition starts at the second head
+    const uint32_t start = geo.sectors;
+    uint64_t end = MIN(MIN(hdd->size, maxSize) / 512, (uint64_t) UINT32_MAX);
+
+    // Within reach of CHS, the partition ends on a cylinder boundary like FDISK makes it
+    const bool chsAddressable = end <= 1024 * cylinderSize;
+    if (chsAddressable && end >= cylinderSize) {
+        end -= end % cylinderSize;
+    }
+
+    if (end <= start + 1) {
+        util_blockDeviceClose(bd);
+        return false;
+    }
+
+    memset(sector, 0, sizeof(sector));
+
+    // Same as wiping, the GPT (if any) must go
+    for (size_t sectorIndex = 1; sectorIndex < 34; sectorIndex++) {
+        success &= util_blockDeviceWrite(bd, sectorIndex, sector);
+    }
+
+    // No boot code, writing the MBR is a separate install step
+    util_PartitionTableEntry *table = (util_PartitionTableEntry *) &sector[DISK_MBR_CODE_LENGTH];
+    table[0].bootFlag = 0x80;
+    table[0].startSectorLBA = start;
+    table[0].totalSectors = (uint32_t) (end - start);
+
+    if (chsAddressable) {
+        // BIOSes without INT13 extensions can only boot this through the CHS values
+        util_Chs first = util_lbaToChs(geo, start);
+        util_Chs last = util_lbaToChs(geo, end - 1);
+        table[0].systemId = 0x0B;                       // FAT32 CHS
+        table[0].startingHead = first.head;
+        table[0].startingSectorAndCylinder = first.sectorAndCylinder;
+        table[0].endingHead = last.head;
+        table[0].endingSectorAndCylinder = last.sectorAndCylinder;
+    } else {
+        table[0].systemId = 0x0C;                       // FAT32 LBA
+        table[0].startingHead = 0xFE;                   // CHS values are all "beyond 8 GB", LBA is what counts
+        table[0].startingSectorAndCylinder = 0xFFFF;
+        table[0].endingHead = 0xFE;
+        table[0].endingSectorAndCylinder = 0xFFFF;
+    }
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+
+    success &= util_blockDeviceWrite(bd, 0, sector);
+
+    if (!success) {
+        util_blockDeviceClose(bd);
+        return false;
+    }
+
+    return util_commitPartitionTable(bd);
+}
+
+static bool util_modifyBootSector(util_BlockDevice *bd, const util_BootSectorModifier *modifierList) {
+    uint8_t sector[512];
+
+    QI_ASSERT(bd != NULL);
     QI_ASSERT(modifierList != NULL);
 
     // ReplacementData == NULL -> End of list marker
     while (modifierList->replacementData != NULL) {
         const util_BootSectorModifier *mod = modifierList;
 
-        // New sector index found in the list = we need to write previous sector and free its databuffer
-        if (sector && (mod->sectorIndex != oldSectorIndex)) {
-            success = util_writeSectorToPartition(part, oldSectorIndex, sector);
-            free (sector);
-            sector = NULL;
-        }
-
-        // If we need to read a new sector
-        if (sector == NULL) {
-            sector = util_readSectorFromPartitionAllocate(part, mod->sectorIndex);
-            oldSectorIndex = mod->sectorIndex;
-            success &= (sector != NULL);
-        }
+        // Sectors come from the session cache after the first read, so modifiers for the same sector stack up
+        bool success = util_blockDeviceRead(bd, mod->sectorIndex, sector);
 
         QI_ASSERT(success && "modifyBootSector failed");
 
         if (!success) {
-            free(sector);
             return false;
         }
 
         // Copy the replacement data therefore injecting the boot sector code
         memcpy(sector + mod->offset, mod->replacementData, mod->length);
 
+        if (!util_blockDeviceWrite(bd, mod->sectorIndex, sector)) {
+            return false;
+        }
+
         // Next modifier
         modifierList++;
     }    
 
-    // If there is a pending sector write left, execute it now
-    if (sector) {
-        success = util_writeSectorToPartition(part, oldSectorIndex, sector);
-        free(sector);
-    }
-
-    return success;
+    return true;
 }
 
 bool util_modifyAndwriteBootSectorToPartition(util_Partition *part, const util_BootSectorModifier *modifierList) {
-    bool result = util_modifyBootSector(part, modifierList);
+    util_BlockDevice *bd = util_blockDeviceOpenPartition(part);
+    if (bd == NULL) return false;
+
+    bool result = util_modifyBootSector(bd, modifierList);
 
     if (result && part->fileSystem == fs_fat32) {
         // Copy sectors to backup now (FAT32 only, FAT16 has no backup it seems, at least not on Win9x)
         size_t backupSectorIndex = 0;
+        uint8_t sector[512];
 
-        for (size_t i = 0; i < 3; i++) {
-            uint8_t *sector = util_readSectorFromPartitionAllocate(part, i);
-            assert(sector);
+        for (size_t i = 0; i < 3 && result; i++) {
+            result &= util_blockDeviceRead(bd, i, sector);
             // Get backup sector index
             if (i == 0) backupSectorIndex = (size_t) util_getUInt16fromBuffer(sector, 0x32);
 
             // Write sector to backup location
-            result &= util_writeSectorToPartition(part, i + backupSectorIndex, sector);
-            free(sector);
+            result &= util_blockDeviceWrite(bd, i + backupSectorIndex, sector);
         }
     }
 
+    // Main and backup boot sectors all go out in one go, or nothing is written at all
+    if (result) {
+        result = util_blockDeviceCommit(bd);
+    }
+
+    util_blockDeviceClose(bd);
     return result;
 }
 
 bool util_isPartitionMounted(util_Partition *part) {
-    // Check if partition is mounted using /proc/self/mounts
-    char devStringToCompare[UTIL_HDD_DEVICE_STRING_LENGTH+1] = "";
-
-    // you could have a lot of logical  partitions so it's best to check for that PLUS a space.
-    sprintf(devStringToCompare, "%s ", part->device);
-
-    util_CommandOutput *mountLines = util_commandOutputCapture("cat /proc/self/mounts");
-    QI_ASSERT(mountLines != NULL);
-
-    bool ret = false;
-
-    for (size_t i = 0; i < mountLines->lineCount; i++) {
-        if (util_stringStartsWith(mountLines->lines[i], devStringToCompare)) {
-            ret = true;
-            break;
-        }
-    }
-
-    util_commandOutputDestroy(mountLines);
-
-    return ret;
+    return util_mountTableFind(part->device) != NULL;
 }
 
 bool util_getFormatCommand(util_Partition *part, util_FileSystem fs, char *buf, size_t bufSize) {
@@ -665,7 +634,8 @@ bool util_getFormatCommand(util_Partition *part, util_FileSystem fs, char *buf,
     } else {
         QI_ASSERT(false && "Wrong file system");
     }
-    // Set partition file system to new file system
-    part->fileSystem = fs;    
+    // Set partition file system to new file system, the cached model of this disk is outdated now
+    part->fileSystem = fs;
+    util_partitionTableInvalidate(part->parent);
     return true;
 }
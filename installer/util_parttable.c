@@ -0,0 +1,572 @@
+/*
+ * LUNMERCY - Partition table parsing & disk enumeration
+ * (C) 2023 Eric Voirin (oerg866@googlemail.com)
+ */
+
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "qi_assert.h"
+
+// Linux treats a sector as 512 bytes *always*, and so does int13h translation. See util_getSystemHardDisks.
+// The LBAs in the partition tables are in logical blocks of the disk though, which are 4096 bytes on 4Kn disks.
+#define UTIL_PT_SECTOR_SIZE         (512)
+#define UTIL_PT_MAX_BLOCK_SIZE      (4096)
+#define UTIL_PT_MBR_SIGNATURE       (0xAA55)
+#define UTIL_PT_MBR_SIGNATURE_OFS   (510)
+#define UTIL_PT_MBR_GPT_PROTECTIVE  (0xEE)
+#define UTIL_PT_MAX_LOGICAL         (128)   // Upper bound for EBR chain walking, protects against loops
+#define UTIL_PT_GPT_MAX_ENTRIES     (1024)
+#define UTIL_PT_GUID_SIZE           (16)
+
+// Block device majors we consider hard disks: SCSI/SATA/USB (8), IDE (3), NVMe & others (259)
+static const unsigned util_ptDiskMajors[] = { 8, 3, 259 };
+
+// GPT partition type GUIDs, in on-disk (mixed endian) byte order
+static const uint8_t UTIL_GUID_EFI_SYSTEM[UTIL_PT_GUID_SIZE] = {    // c12a7328-f81f-11d2-ba4b-00a0c93ec93b
+    0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11, 0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b };
+static const uint8_t UTIL_GUID_BIOS_BOOT[UTIL_PT_GUID_SIZE] = {     // 21686148-6449-6e6f-744e-656564454649
+    0x48, 0x61, 0x68, 0x21, 0x49, 0x64, 0x6f, 0x6e, 0x74, 0x4e, 0x65, 0x65, 0x64, 0x45, 0x46, 0x49 };
+static const uint8_t UTIL_GUID_LINUX_DATA[UTIL_PT_GUID_SIZE] = {    // 0fc63daf-8483-4772-8e79-3d69d8477de4
+    0xaf, 0x3d, 0xc6, 0x0f, 0x83, 0x84, 0x72, 0x47, 0x8e, 0x79, 0x3d, 0x69, 0xd8, 0x47, 0x7d, 0xe4 };
+static const uint8_t UTIL_GUID_LINUX_SWAP[UTIL_PT_GUID_SIZE] = {    // 0657fd6d-a4ab-43c4-84e5-0933c84b4f4f
+    0x6d, 0xfd, 0x57, 0x06, 0xab, 0xa4, 0xc4, 0x43, 0x84, 0xe5, 0x09, 0x33, 0xc8, 0x4b, 0x4f, 0x4f };
+
+// Cached partition table of a single disk. Besides the device, it is keyed by the disk size and the contents of the
+// MBR and GPT header sectors, so a disk that was swapped or repartitioned behind our back is read again.
+typedef struct {
+    char device[UTIL_HDD_DEVICE_STRING_LENGTH];
+    uint64_t size;
+    uint32_t signature;
+    char tableType[UTIL_TABLE_TYPE_STRING_LENGTH];
+    size_t partitionCount;
+    util_Partition *partitions;
+} util_PartitionTableCacheEntry;
+
+static util_PartitionTableCacheEntry *util_ptCache = NULL;
+static size_t util_ptCacheCount = 0;
+
+// Update parents after a reallocation of a hard disk array
+static inline void util_HardDisksUpdatePartitionParents(util_HardDisk *hdds, size_t diskCount) {
+    if (hdds != NULL) {
+        for (size_t h = 0; h < diskCount; h++) {
+            util_HardDisk *hdd = &hdds[h];
+            for (size_t p = 0; p < hdd->partitionCount; p++) {
+                hdd->partitions[p].parent = hdd;
+            }
+        }
+    }
+}
+
+// Appends a HardDisk with given parameters to a HardDiskArray and returns a pointer to the newly created disk.
+static util_HardDisk *util_HardDiskArrayAppend(util_HardDiskArray *hda, const char *device, const char *model, uint64_t size, uint32_t sectorSize, uint32_t optIoSize, const char *tableType) {
+    QI_ASSERT(hda != NULL);
+    QI_ASSERT(device != NULL);
+    QI_ASSERT(model != NULL);
+    QI_ASSERT(tableType != NULL);
+
+    hda->count++;
+    hda->disks = realloc(hda->disks, hda->count * sizeof(util_HardDisk));
+
+    QI_ASSERT(hda->disks != NULL);
+
+    util_HardDisksUpdatePartitionParents(hda->disks, hda->count - 1);
+
+    util_HardDisk *ret = &hda->disks[hda->count - 1];
+
+    memset(ret, 0, sizeof(util_HardDisk));
+
+    strncpy(ret->device, device, sizeof(ret->device) - 1);
+    strncpy(ret->model, model, sizeof(ret->model) - 1);
+    strncpy(ret->tableType, tableType, sizeof(ret->tableType) - 1);
+
+    util_stringRTrim(ret->model); // this field as it comes from sysfs often contains a ton of padding
+
+    ret->size = size;
+    ret->sectorSize = sectorSize;
+    ret->optIoSize = optIoSize;
+
+    return ret;
+}
+
+// Adds a partition to a hard disk. The device string is derived from the disk and the partition index,
+// following the kernel's naming scheme (sda + 1 = sda1, nvme0n1 + 1 = nvme0n1p1)
+static util_Partition *util_HardDiskAddPartition(util_HardDisk *hd, size_t index, uint64_t start, uint64_t size, util_FileSystem fileSystem, bool isLogical) {
+    QI_ASSERT(hd != NULL);
+
+    hd->partitionCount++;
+    hd->partitions = realloc(hd->partitions, hd->partitionCount * sizeof(util_Partition));
+
+    QI_ASSERT(hd->partitions != NULL);
+
+    util_Partition *ret = &hd->partitions[hd->partitionCount - 1];
+
+    memset(ret, 0, sizeof(util_Partition));
+
+    size_t devLen = strlen(hd->device);
+    bool needsSeparator = devLen > 0 && isdigit((unsigned char) hd->device[devLen - 1]);
+    int written = snprintf(ret->device, sizeof(ret->device), "%s%s%zu", hd->device, needsSeparator ? "p" : "", index);
+    QI_FATAL(written > 0 && (size_t) written < sizeof(ret->device), "Partition device string too long.");
+
+    ret->start = start;
+    ret->size = size;
+    ret->sectorSize = hd->sectorSize;
+    ret->fileSystem = fileSystem;
+    ret->parent = hd;
+    ret->indexOnParent = index;
+    ret->isLogical = isLogical;
+
+    return ret;
+}
+
+// Reads 'length' bytes starting at logical block 'lba' from an open device
+static bool util_ptRead(int fd, uint64_t lba, uint32_t blockSize, uint8_t *buf, size_t length) {
+    off_t offset = (off_t) (lba * blockSize);
+
+    while (length) {
+        ssize_t bytesRead = pread(fd, buf, length, offset);
+        if (bytesRead <= 0) return false;
+        length -= bytesRead;
+        buf += bytesRead;
+        offset += bytesRead;
+    }
+
+    return true;
+}
+
+static inline bool util_ptHasMbrSignature(const uint8_t *sector) {
+    return util_getUInt16fromBuffer(sector, UTIL_PT_MBR_SIGNATURE_OFS) == UTIL_PT_MBR_SIGNATURE;
+}
+
+static inline bool util_ptIsExtendedType(uint8_t systemId) {
+    return util_partitionTypeByteToUtilFilesystem(systemId) == fs_extended;
+}
+
+// Probes the file system of a partition by looking at its boot sector (FAT, NTFS & exFAT only)
+static util_FileSystem util_ptProbeBootSector(const uint8_t *bootSector) {
+    if (bootSector == NULL)                                 return fs_unsupported;
+    if (memcmp(&bootSector[0x03], "EXFAT   ", 8) == 0)      return fs_exfat;
+    if (memcmp(&bootSector[0x03], "NTFS    ", 8) == 0)      return fs_ntfs;
+    if (!util_ptHasMbrSignature(bootSector))                return fs_unsupported;
+    if (memcmp(&bootSector[0x52], "FAT32", 5) == 0)         return fs_fat32;
+    if (memcmp(&bootSector[0x36], "FAT1", 4) == 0)          return fs_fat16;
+    return fs_unsupported;
+}
+
+// Gets the file system of an MBR partition entry. Type 0x07 is ambiguous so it requires a look at the boot sector.
+static util_FileSystem util_ptMbrFileSystem(int fd, uint32_t blockSize, uint8_t systemId, uint64_t start) {
+    util_FileSystem fs = util_partitionTypeByteToUtilFilesystem(systemId);
+
+    if (fs == fs_ntfs) {
+        uint8_t bootSector[UTIL_PT_SECTOR_SIZE];
+        if (util_ptRead(fd, start, blockSize, bootSector, sizeof(bootSector)) && util_ptProbeBootSector(bootSector) == fs_exfat) {
+            fs = fs_exfat;
+        }
+    }
+
+    return fs;
+}
+
+// Walks the EBR chain of an extended partition, adding all logical partitions (numbered from 5 onwards)
+static void util_ptParseExtended(util_HardDisk *hdd, int fd, uint32_t blockSize, uint64_t extStart, uint64_t extSectors) {
+    uint8_t sector[UTIL_PT_SECTOR_SIZE];
+    uint64_t ebrLba = extStart;
+    size_t index = 5;
+
+    for (size_t hops = 0; hops < UTIL_PT_MAX_LOGICAL; hops++) {
+        if (!util_ptRead(fd, ebrLba, blockSize, sector, sizeof(sector)) || !util_ptHasMbrSignature(sector)) {
+            break;
+        }
+
+        util_PartitionTableEntry *table = (util_PartitionTableEntry *) &sector[DISK_MBR_CODE_LENGTH];
+
+        // First entry: the logical partition itself, relative to this EBR
+        if (table[0].systemId != 0x00 && table[0].totalSectors != 0) {
+            uint64_t start = ebrLba + table[0].startSectorLBA;
+            util_HardDiskAddPartition(hdd, index++, start * (blockSize / UTIL_PT_SECTOR_SIZE),
+                                      (uint64_t) table[0].totalSectors * blockSize,
+                                      util_ptMbrFileSystem(fd, blockSize, table[0].systemId, start),
+                                      true);
+        }
+
+        // Second entry: link to the next EBR, relative to the start of the extended partition
+        if (!util_ptIsExtendedType(table[1].systemId) || table[1].startSectorLBA == 0) {
+            break;
+        }
+
+        uint64_t next = extStart + table[1].startSectorLBA;
+
+        // Links must move forward and stay inside the container, otherwise the chain is broken or loops
+        if (next <= ebrLba || next >= extStart + extSectors) {
+            break;
+        }
+
+        ebrLba = next;
+    }
+}
+
+// Parses a GPT header + entry array. Returns false if there is no valid GPT on the disk.
+static bool util_ptParseGpt(util_HardDisk *hdd, int fd, uint32_t blockSize) {
+    uint8_t header[UTIL_PT_SECTOR_SIZE];
+
+    if (!util_ptRead(fd, 1, blockSize, header, sizeof(header)) || memcmp(header, "EFI PART", 8) != 0) {
+        return false;
+    }
+
+    uint64_t entryLba   = util_getUInt64fromBuffer(header, 0x48);
+    uint32_t entryCount = util_getUInt32fromBuffer(header, 0x50);
+    uint32_t entrySize  = util_getUInt32fromBuffer(header, 0x54);
+
+    if (entrySize < 128 || entrySize > UTIL_PT_SECTOR_SIZE || entryCount == 0 || entryCount > UTIL_PT_GPT_MAX_ENTRIES) {
+        return false;
+    }
+
+    size_t tableSize = (size_t) entryCount * entrySize;
+    uint8_t *entries = malloc(tableSize);
+    QI_ASSERT(entries != NULL);
+
+    if (!util_ptRead(fd, entryLba, blockSize, entries, tableSize)) {
+        free(entries);
+        return false;
+    }
+
+    static const uint8_t zeroGuid[UTIL_PT_GUID_SIZE] = { 0 };
+    uint8_t bootSector[UTIL_PT_SECTOR_SIZE];
+
+    for (uint32_t i = 0; i < entryCount; i++) {
+        const uint8_t *entry = &entries[(size_t) i * entrySize];
+
+        if (memcmp(entry, zeroGuid, UTIL_PT_GUID_SIZE) == 0) {
+            continue; // Unused entry
+        }
+
+        uint64_t firstLba = util_getUInt64fromBuffer(entry, 0x20);
+        uint64_t lastLba  = util_getUInt64fromBuffer(entry, 0x28);
+
+        if (lastLba < firstLba) {
+            continue;
+        }
+
+        bool haveBootSector = util_ptRead(fd, firstLba, blockSize, bootSector, sizeof(bootSector));
+
+        util_HardDiskAddPartition(hdd, (size_t) i + 1, firstLba * (blockSize / UTIL_PT_SECTOR_SIZE),
+                                  (lastLba - firstLba + 1) * blockSize,
+                                  util_guidToUtilFilesystem(entry, haveBootSector ? bootSector : NULL),
+                                  false);
+    }
+
+    free(entries);
+    return true;
+}
+
+// Parses the partition table straight from the disk's sectors. Sets table type and adds all partitions.
+static void util_ptParseFromDisk(util_HardDisk *hdd, uint32_t blockSize) {
+    uint8_t mbr[UTIL_PT_SECTOR_SIZE];
+
+    int fd = open(hdd->device, O_RDONLY);
+
+    if (fd < 0) {
+        return;
+    }
+
+    if (!util_ptRead(fd, 0, blockSize, mbr, sizeof(mbr)) || !util_ptHasMbrSignature(mbr)) {
+        // No (readable) partition table at all, e.g. a brand new disk or a card reader without media
+        close(fd);
+        return;
+    }
+
+    util_PartitionTableEntry table[4];
+    memcpy(table, &mbr[DISK_MBR_CODE_LENGTH], sizeof(table));
+
+    for (size_t i = 0; i < 4; i++) {
+        if (table[i].systemId == UTIL_PT_MBR_GPT_PROTECTIVE && util_ptParseGpt(hdd, fd, blockSize)) {
+            strncpy(hdd->tableType, "gpt", sizeof(hdd->tableType) - 1);
+            close(fd);
+            return;
+        }
+    }
+
+    strncpy(hdd->tableType, "dos", sizeof(hdd->tableType) - 1);
+
+    // Primary partitions keep their slot number, just like the kernel does it
+    for (size_t i = 0; i < 4; i++) {
+        if (table[i].systemId == 0x00 || table[i].totalSectors == 0) {
+            continue;
+        }
+
+        uint64_t start = table[i].startSectorLBA;
+        util_HardDiskAddPartition(hdd, i + 1, start * (blockSize / UTIL_PT_SECTOR_SIZE),
+                                  (uint64_t) table[i].totalSectors * blockSize,
+                                  util_ptMbrFileSystem(fd, blockSize, table[i].systemId, start),
+                                  false);
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        if (util_ptIsExtendedType(table[i].systemId) && table[i].totalSectors != 0) {
+            util_ptParseExtended(hdd, fd, blockSize, table[i].startSectorLBA, table[i].totalSectors);
+            break; // There can only be one extended partition
+        }
+    }
+
+    close(fd);
+}
+
+// Gets a CRC-32 over the MBR and the GPT header of a disk. Any change to the primary partitions or the GPT changes it.
+// A disk that can't be read gets 0, like one without media.
+static uint32_t util_ptReadSignature(const char *device, uint32_t blockSize) {
+    uint8_t sectors[2 * UTIL_PT_SECTOR_SIZE];
+    uint32_t signature = 0;
+
+    int fd = open(device, O_RDONLY);
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    if (util_ptRead(fd, 0, blockSize, sectors, UTIL_PT_SECTOR_SIZE)
+     && util_ptRead(fd, 1, blockSize, sectors + UTIL_PT_SECTOR_SIZE, UTIL_PT_SECTOR_SIZE)) {
+        signature = util_crc32(0, sectors, sizeof(sectors));
+    }
+
+    close(fd);
+    return signature;
+}
+
+// Reads a single line sysfs attribute of a block device. Returns false if it does not exist.
+static bool util_ptReadSysfsAttribute(const char *blockName, const char *attribute, char *dest, size_t bufSize) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/block/%s/%s", blockName, attribute);
+
+    if (!util_fileExists(path)) {
+        return false;
+    }
+
+    return util_readFirstLineFromFileIntoBuffer(path, dest, bufSize);
+}
+
+// Gets the logical block size of a disk, which the partition table LBAs count in. 512 if it can't be determined.
+static uint32_t util_ptGetLogicalBlockSize(const char *device) {
+    char tmpNumStr[64+1] = "";
+    const char *blockName = strrchr(device, '/');
+    blockName = (blockName != NULL) ? blockName + 1 : device;
+
+    if (!util_ptReadSysfsAttribute(blockName, "queue/logical_block_size", tmpNumStr, sizeof(tmpNumStr))) {
+        return UTIL_PT_SECTOR_SIZE;
+    }
+
+    uint32_t blockSize = (uint32_t) strtoul(tmpNumStr, NULL, 10);
+
+    if (blockSize < UTIL_PT_SECTOR_SIZE || blockSize > UTIL_PT_MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0) {
+        return UTIL_PT_SECTOR_SIZE;
+    }
+
+    return blockSize;
+}
+
+static util_PartitionTableCacheEntry *util_ptCacheFind(const char *device) {
+    for (size_t i = 0; i < util_ptCacheCount; i++) {
+        if (util_stringEquals(util_ptCache[i].device, device)) {
+            return &util_ptCache[i];
+        }
+    }
+    return NULL;
+}
+
+static void util_ptCacheRemove(util_PartitionTableCacheEntry *cached) {
+    free(cached->partitions);
+
+    // Move the last entry into the freed slot
+    *cached = util_ptCache[util_ptCacheCount - 1];
+    util_ptCacheCount--;
+}
+
+bool util_partitionTableRead(util_HardDisk *hdd) {
+    QI_ASSERT(hdd != NULL);
+
+    uint32_t blockSize = util_ptGetLogicalBlockSize(hdd->device);
+    uint32_t signature = util_ptReadSignature(hdd->device, blockSize);
+    util_PartitionTableCacheEntry *cached = util_ptCacheFind(hdd->device);
+
+    if (cached != NULL && (cached->size != hdd->size || cached->signature != signature)) {
+        // The disk was changed by someone else
+        util_ptCacheRemove(cached);
+        cached = NULL;
+    }
+
+    if (cached == NULL) {
+        // Not cached yet, parse the disk and store a copy of the result
+        hdd->partitionCount = 0;
+        free(hdd->partitions);
+        hdd->partitions = NULL;
+        memset(hdd->tableType, 0, sizeof(hdd->tableType));
+
+        util_ptParseFromDisk(hdd, blockSize);
+
+        util_ptCache = realloc(util_ptCache, (util_ptCacheCount + 1) * sizeof(util_PartitionTableCacheEntry));
+        QI_ASSERT(util_ptCache != NULL);
+
+        cached = &util_ptCache[util_ptCacheCount++];
+        memset(cached, 0, sizeof(util_PartitionTableCacheEntry));
+        memcpy(cached->device, hdd->device, sizeof(cached->device));
+        cached->size = hdd->size;
+        cached->signature = signature;
+        memcpy(cached->tableType, hdd->tableType, sizeof(cached->tableType));
+        cached->partitionCount = hdd->partitionCount;
+
+        if (hdd->partitionCount > 0) {
+            cached->partitions = malloc(hdd->partitionCount * sizeof(util_Partition));
+            QI_ASSERT(cached->partitions != NULL);
+            memcpy(cached->partitions, hdd->partitions, hdd->partitionCount * sizeof(util_Partition));
+        }
+
+        return true;
+    }
+
+    // Cache hit, hand out a fresh copy of the cached model
+    free(hdd->partitions);
+    hdd->partitions = NULL;
+    hdd->partitionCount = cached->partitionCount;
+    memcpy(hdd->tableType, cached->tableType, sizeof(hdd->tableType));
+
+    if (cached->partitionCount > 0) {
+        hdd->partitions = malloc(cached->partitionCount * sizeof(util_Partition));
+        QI_ASSERT(hdd->partitions != NULL);
+        memcpy(hdd->partitions, cached->partitions, cached->partitionCount * sizeof(util_Partition));
+    }
+
+    for (size_t p = 0; p < hdd->partitionCount; p++) {
+        hdd->partitions[p].parent = hdd;
+        hdd->partitions[p].mountPath = NULL;
+    }
+
+    return true;
+}
+
+void util_partitionTableInvalidate(const util_HardDisk *hdd) {
+    QI_ASSERT(hdd != NULL);
+
+    util_PartitionTableCacheEntry *cached = util_ptCacheFind(hdd->device);
+
+    if (cached != NULL) {
+        util_ptCacheRemove(cached);
+    }
+}
+
+// Checks if a sysfs block device is a hard disk we are interested in, by its major number
+static bool util_ptIsHardDiskMajor(const char *blockName) {
+    char devNumbers[32];
+
+    if (!util_ptReadSysfsAttribute(blockName, "dev", devNumbers, sizeof(devNumbers))) {
+        return false;
+    }
+
+    unsigned major = (unsigned) strtoul(devNumbers, NULL, 10);
+
+    for (size_t i = 0; i < util_arraySize(util_ptDiskMajors); i++) {
+        if (util_ptDiskMajors[i] == major) return true;
+    }
+
+    return false;
+}
+
+static int util_ptSysBlockFilter(const struct dirent *entry) {
+    return entry->d_name[0] != '.';
+}
+
+util_HardDiskArray *util_getSystemHardDisks() {
+    util_HardDiskArray *ret = calloc(1, sizeof(util_HardDiskArray));
+
+    QI_ASSERT(ret != NULL);
+
+    struct dirent **entries = NULL;
+    int entryCount = scandir("/sys/block", &entries, util_ptSysBlockFilter, alphasort);
+
+    for (int i = 0; i < entryCount; i++) {
+        const char *blockName = entries[i]->d_name;
+
+        if (strlen("/dev/") + strlen(blockName) < UTIL_HDD_DEVICE_STRING_LENGTH && util_ptIsHardDiskMajor(blockName)) {
+            char tmpDevice[PATH_MAX];
+            char tmpModel[UTIL_HDD_MODEL_STRING_LENGTH] = "";
+            char tmpNumStr[64+1] = "";
+
+            snprintf(tmpDevice, sizeof(tmpDevice), "/dev/%s", blockName);
+
+            util_ptReadSysfsAttribute(blockName, "device/model", tmpModel, sizeof(tmpModel));
+
+            // sysfs reports the size in 512 byte units regardless of the actual sector size
+            uint64_t tmpSize = 0;
+            if (util_ptReadSysfsAttribute(blockName, "size", tmpNumStr, sizeof(tmpNumStr))) {
+                tmpSize = strtoull(tmpNumStr, NULL, 10) * 512ULL;
+            }
+
+            uint32_t tmpOptIoSize = 0;
+            if (util_ptReadSysfsAttribute(blockName, "queue/optimal_io_size", tmpNumStr, sizeof(tmpNumStr))) {
+                tmpOptIoSize = (uint32_t) strtoul(tmpNumStr, NULL, 10);
+            }
+
+            // Linux treats a sector as 512 bytes *always*, and so does int13h translation,
+            // which is the point this relates to in this code. So we hardcode it to 512.
+            util_HardDisk *hdd = util_HardDiskArrayAppend(ret, tmpDevice, tmpModel, tmpSize, UTIL_PT_SECTOR_SIZE, tmpOptIoSize, "");
+
+            util_partitionTableRead(hdd);
+        }
+
+        free(entries[i]);
+    }
+
+    free(entries);
+    return ret;
+}
+
+util_FileSystem util_partitionTypeByteToUtilFilesystem(uint8_t partitionType) {
+    switch(partitionType) {
+        case 0x00:  return fs_none;
+        case 0x05:  return fs_extended;     // Extended partition
+        case 0x0f:  return fs_extended;     // Extended partition (LBA)
+        case 0x04:  return fs_fat16;        // FAT16  < 32MB
+        case 0x06:  return fs_fat16;        // FAT16 >= 32MB
+        case 0x0E:  return fs_fat16;        // FAT16 >= 32MB LBA
+        case 0x14:  return fs_fat16;        // FAT16  < 32MB        HIDDEN
+        case 0x16:  return fs_fat16;        // FAT16 >= 32MB        HIDDEN
+        case 0x1E:  return fs_fat16;        // FAT16 >= 32MB LBA    HIDDEN
+        case 0x0B:  return fs_fat32;        // FAT32
+        case 0x0C:  return fs_fat32;        // FAT32 LBA
+        case 0x1B:  return fs_fat32;        // FAT32        HIDDEN
+        case 0x1C:  return fs_fat32;        // FAT32 LBA    HIDDEN
+        case 0x07:  return fs_ntfs;         // NTFS or exFAT
+        case 0x17:  return fs_ntfs;         // NTFS or exFAT        HIDDEN
+        case 0x27:  return fs_ntfs;         // NTFS or exFAT        HIDDEN (sometimes used for recovery partitions)
+        case 0x83:  return fs_linux;        // Linux native filesystem (ext2, ext3, ext4)
+        case 0x82:  return fs_swap;         // Linux swap
+        case 0xEF:  return fs_efi;          // EFI System Partition (FAT32)
+        default:    return fs_unsupported;
+    }
+}
+
+util_FileSystem util_guidToUtilFilesystem(const uint8_t *guid, const uint8_t *bootSector) {
+    QI_FATAL(guid != NULL, "GUID invalid.");
+
+    if (memcmp(guid, UTIL_GUID_EFI_SYSTEM, UTIL_PT_GUID_SIZE) == 0)     return fs_efi;
+    if (memcmp(guid, UTIL_GUID_BIOS_BOOT, UTIL_PT_GUID_SIZE) == 0)      return fs_gpt_boot;
+    if (memcmp(guid, UTIL_GUID_LINUX_DATA, UTIL_PT_GUID_SIZE) == 0)     return fs_linux;
+    if (memcmp(guid, UTIL_GUID_LINUX_SWAP, UTIL_PT_GUID_SIZE) == 0)     return fs_swap;
+
+    // Anything else (Microsoft basic data etc.) is identified by what's actually on it
+    switch (util_ptProbeBootSector(bootSector)) {
+        case fs_fat16:
+        case fs_fat32:  return fs_gpt_vfat;
+        case fs_ntfs:   return fs_ntfs;
+        case fs_exfat:  return fs_exfat;
+        default:        return fs_unsupported;
+    }
+}
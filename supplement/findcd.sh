@@ -32,14 +32,19 @@ cd /dev
 
 while :
 do
-	if tryMountPattern sr iso9660; then break; fi;	# CD-ROM
-	if tryMountPattern cd iso9660; then break; fi;	# CD-ROM (alternate)
-	if tryMountPattern ide iso9660; then break; fi;	# CD-ROM (alternate)
-	if tryMountPattern sd iso9660; then break; fi;	# Flash drives can be in ISO
-	if tryMountPattern hd iso9660; then break; fi;	# Flash drives can be in ISO
-	if tryMountPattern sd vfat; then break; fi;	# Flash drive or hard drive in FAT32
-	if tryMountPattern hd vfat; then break; fi;	# Flash drive or hard drive in FAT32
-	if tryMountPattern nv vfat; then break; fi;	# NVME (lol?)
+	if test -x /bin/findcd ; then
+		# Probes all drives at once without mounting them
+		if DEV=$(/bin/findcd $CD); then break; fi;
+	else
+		if tryMountPattern sr iso9660; then break; fi;	# CD-ROM
+		if tryMountPattern cd iso9660; then break; fi;	# CD-ROM (alternate)
+		if tryMountPattern ide iso9660; then break; fi;	# CD-ROM (alternate)
+		if tryMountPattern sd iso9660; then break; fi;	# Flash drives can be in ISO
+		if tryMountPattern hd iso9660; then break; fi;	# Flash drives can be in ISO
+		if tryMountPattern sd vfat; then break; fi;	# Flash drive or hard drive in FAT32
+		if tryMountPattern hd vfat; then break; fi;	# Flash drive or hard drive in FAT32
+		if tryMountPattern nv vfat; then break; fi;	# NVME (lol?)
+	fi
 
 	echo "Cannot find install media (yet). Retrying in 2 seconds."
 	echo "--- PRESS <ENTER> TO CANCEL AND LAUNCH A LINUX SHELL ---"
@@ -52,7 +57,8 @@ done
 cd /
 
 echo "Install media / CD-ROM found and mounted at $CD"
-# Copy some files to memory for faster execution
+# Copy some files to memory for faster execution. The installer on the media replaces the one in the initrd, so it can
+# be updated without rebuilding the kernels.
 cp $CD/bin/lunmercy /bin
 cp $CD/bin/cfdisk /bin
 cp $CD/bin/lsblk.qi /bin
@@ -0,0 +1,218 @@
+#!/bin/python3
+
+# Binary patches for Windows 98 QuickInstall.
+# Python version.
+# (C) 2026 Eric Voirin (oerg866@googlemail.com)
+
+# Describes a file as the changes to another one, so two nearly identical files only need to be
+# shipped once. The installer applies a patch while it streams the base file from the source media
+# (see installer/install_patch.c), so it never goes back in the base: every instruction only reads
+# base data after the data the instruction before it read.
+#
+# Hives written by creg.py are compacted, and regedit moves records around as well, so a difference
+# in the middle moves everything after it. The base is therefore not compared block by block at fixed positions. Its
+# blocks are looked up anywhere after the current base position, and every match is extended
+# byte by byte in both directions.
+#
+# File format, all values little endian:
+#
+#   CHAR[4]     "QIDF"
+#   UINT8       length of the name of the patched file, as stored in the base MercyPak file
+#   BYTE[]      name, not terminated
+#   UINT32      base file size
+#   UINT32      base file CRC-32
+#   UINT32      patched file size
+#   UINT32      instruction count
+#
+#   Per instruction:
+#   UINT32      literal length
+#   UINT32      base bytes to skip
+#   UINT32      base bytes to copy
+#   BYTE[]      literal data, written before the base data is skipped and copied
+#
+#   Base data after the last instruction is skipped.
+
+import struct
+import zlib
+from bisect import bisect_left
+from collections import Counter
+
+BLOCKDIFF_MAGIC = b'QIDF'
+BLOCKDIFF_BLOCK_SIZE = 16       # Shortest match that is looked up
+BLOCKDIFF_BLOCK_ALIGN = 4       # Base blocks are indexed at this granularity, the hive structures are DWORD aligned
+BLOCKDIFF_MIN_COPY = 16         # A copy costs an instruction, shorter matches go into the literal
+BLOCKDIFF_COMPARE_CHUNK = 256
+
+class BlockDiffError(Exception):
+    pass
+
+# Length of the common prefix of a[a_pos:] and b[b_pos:]
+def match_forward(a: bytes, a_pos: int, b: bytes, b_pos: int) -> int:
+    length = 0
+    limit = min(len(a) - a_pos, len(b) - b_pos)
+
+    # Whole chunks first, the first difference is then searched within the chunk
+    while length < limit:
+        chunk = min(BLOCKDIFF_COMPARE_CHUNK, limit - length)
+        if a[a_pos + length:a_pos + length + chunk] != b[b_pos + length:b_pos + length + chunk]:
+            break
+        length += chunk
+
+    while length < limit and a[a_pos + length] == b[b_pos + length]:
+        length += 1
+
+    return length
+
+# Length of the common suffix of a[:a_pos] and b[:b_pos], going back no further than a_min / b_min
+def match_backward(a: bytes, a_pos: int, a_min: int, b: bytes, b_pos: int, b_min: int) -> int:
+    length = 0
+    limit = min(a_pos - a_min, b_pos - b_min)
+
+    while length < limit and a[a_pos - length - 1] == b[b_pos - length - 1]:
+        length += 1
+
+    return length
+
+# Get matches between base and target that can be trusted, as (target offset, base offset, length) tuples,
+# in target order and going forward in the base as well. They are made of blocks that occur exactly once
+# in both files. Of those, the chain with the most matched bytes that doesn't go back in the base is taken.
+def blockdiff_anchors(base: bytes, target: bytes) -> list[tuple]:
+    unique = dict()
+    for offset in range(0, len(base) - BLOCKDIFF_BLOCK_SIZE + 1, BLOCKDIFF_BLOCK_ALIGN):
+        block = base[offset:offset + BLOCKDIFF_BLOCK_SIZE]
+        unique[block] = None if block in unique else offset
+
+    hits = []
+    seen = Counter()
+    for target_pos in range(len(target) - BLOCKDIFF_BLOCK_SIZE + 1):
+        block = target[target_pos:target_pos + BLOCKDIFF_BLOCK_SIZE]
+        if unique.get(block) is not None:
+            hits.append((target_pos, unique[block], block))
+            seen[block] += 1
+
+    # Hits next to each other at the same distance in both files make up one run
+    runs = []
+    for target_pos, base_pos, block in hits:
+        if seen[block] != 1:
+            continue
+        if runs:
+            run_target, run_base, run_length = runs[-1]
+            if run_base - run_target == base_pos - target_pos and target_pos <= run_target + run_length:
+                runs[-1] = (run_target, run_base, target_pos + BLOCKDIFF_BLOCK_SIZE - run_target)
+                continue
+        runs.append((target_pos, base_pos, BLOCKDIFF_BLOCK_SIZE))
+
+    # Heaviest chain of runs with ascending base offsets, with a Fenwick tree over the base offset ranks
+    ranks = {base_pos: rank for rank, base_pos in enumerate(sorted(set(run[1] for run in runs)), 1)}
+    tree = [(0, -1)] * (len(ranks) + 1)
+    best = []
+
+    for run_index, (target_pos, base_pos, length) in enumerate(runs):
+        weight, previous = 0, -1
+        rank = ranks[base_pos] - 1
+        while rank > 0:
+            weight, previous = max((weight, previous), tree[rank])
+            rank -= rank & -rank
+        best.append((weight + length, previous))
+        rank = ranks[base_pos]
+        while rank < len(tree):
+            tree[rank] = max(tree[rank], (weight + length, run_index))
+            rank += rank & -rank
+
+    chain = []
+    run_index = max(range(len(runs)), key=lambda i: best[i][0], default=-1)
+    while run_index >= 0:
+        chain.append(runs[run_index])
+        run_index = best[run_index][1]
+
+    return chain[::-1]
+
+# Get the instructions that turn base into target, as (literal, skip, copy) tuples.
+# Between the anchors, shorter matches are looked up, but only in the part of the base before the next anchor.
+def blockdiff_create(base: bytes, target: bytes) -> list[tuple]:
+    index = dict()
+    for offset in range(0, len(base) - BLOCKDIFF_BLOCK_SIZE + 1, BLOCKDIFF_BLOCK_ALIGN):
+        index.setdefault(base[offset:offset + BLOCKDIFF_BLOCK_SIZE], []).append(offset)
+
+    anchors = blockdiff_anchors(base, target)
+    anchors.append((len(target), len(base), 0))
+    next_anchor = 0
+
+    instructions = []
+    base_pos = 0            # Everything before this was skipped or copied
+    literal_start = 0       # Target data from here on isn't covered yet
+    target_pos = 0
+
+    while target_pos + BLOCKDIFF_BLOCK_SIZE <= len(target):
+        while anchors[next_anchor][0] + anchors[next_anchor][2] <= target_pos:
+            next_anchor += 1
+
+        anchor_target, anchor_base, anchor_length = anchors[next_anchor]
+        base_limit = anchor_base + max(0, target_pos - anchor_target)
+
+        candidates = index.get(target[target_pos:target_pos + BLOCKDIFF_BLOCK_SIZE])
+        found = bisect_left(candidates, base_pos) if candidates else 0
+
+        # The closest match keeps the rest of the base available for later matches
+        if not candidates or found == len(candidates) or candidates[found] > base_limit:
+            target_pos += 1
+            continue
+
+        base_match = candidates[found]
+        back = match_backward(base, base_match, base_pos, target, target_pos, literal_start)
+        length = back + match_forward(base, base_match, target, target_pos)
+
+        if length < BLOCKDIFF_MIN_COPY:
+            target_pos += 1
+            continue
+
+        base_match -= back
+        target_match = target_pos - back
+
+        instructions.append((target[literal_start:target_match], base_match - base_pos, length))
+        base_pos = base_match + length
+        target_pos = literal_start = target_match + length
+
+    if literal_start < len(target):
+        instructions.append((target[literal_start:], 0, 0))
+
+    return instructions
+
+# Apply instructions to base, the way the installer does it
+def blockdiff_apply(base: bytes, instructions: list[tuple]) -> bytes:
+    result = bytearray()
+    base_pos = 0
+
+    for literal, skip, copy in instructions:
+        result += literal
+        base_pos += skip
+        if base_pos + copy > len(base):
+            raise BlockDiffError('Patch reads past the end of the base file')
+        result += base[base_pos:base_pos + copy]
+        base_pos += copy
+
+    return bytes(result)
+
+# Write a patch that makes target out of base. name is the name of the base file in the MercyPak file it comes from.
+# The patch is checked to reproduce target before it is written. Returns the size of the patch file.
+def blockdiff_write(output_file: str, name: str, base: bytes, target: bytes) -> int:
+    encoded_name = name.encode()
+
+    if len(encoded_name) > 0xFF:
+        raise BlockDiffError(f'File name too long: {name}')
+
+    instructions = blockdiff_create(base, target)
+
+    if blockdiff_apply(base, instructions) != target:
+        raise BlockDiffError(f'Patch for {name} does not reproduce the file')
+
+    with open(output_file, 'wb') as f:
+        f.write(BLOCKDIFF_MAGIC)
+        f.write(struct.pack('<B', len(encoded_name)) + encoded_name)
+        f.write(struct.pack('<IIII', len(base), zlib.crc32(base), len(target), len(instructions)))
+
+        for literal, skip, copy in instructions:
+            f.write(struct.pack('<III', len(literal), skip, copy))
+            f.write(literal)
+
+        return f.tell()
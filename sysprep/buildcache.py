@@ -0,0 +1,167 @@
+#!/bin/python3
+
+# Build cache for Windows 98 QuickInstall sysprep.
+# Python version.
+# (C) 2026 Eric Voirin (oerg866@googlemail.com)
+
+# Every artifact sysprep produces (.866 files, driver CAB directories, ...) is stored in the cache
+# under a key made from the digests of everything it was built from: input images, registry files,
+# drivers, and the sysprep scripts themselves. If the key of an artifact is already in the cache,
+# it is copied from there instead of being built again.
+#
+# Hashing a multi-gigabyte OS root image takes a while, so file digests are remembered along with
+# the file's size and modification time and only computed again when one of them changes.
+
+import os
+import json
+import shutil
+import hashlib
+
+BUILDCACHE_CHUNK_SIZE = 1024 * 1024
+BUILDCACHE_DIGEST_FILE = 'digests.json'
+BUILDCACHE_DONE_FILE = '.complete'
+
+class BuildCache:
+    # cache_dir: directory to keep the cache in
+    # recipe_files: files whose changes invalidate everything (i.e. the build scripts)
+    # enabled: if False, nothing is looked up or stored, everything gets built
+    def __init__(self, cache_dir: str, recipe_files: list[str], enabled: bool = True):
+        self.cache_dir = cache_dir
+        self.enabled = enabled
+        self.hits = 0
+        self.misses = 0
+        self.digests = dict()
+        self.digests_changed = False
+
+        if self.enabled:
+            os.makedirs(self.cache_dir, exist_ok=True)
+            try:
+                with open(os.path.join(self.cache_dir, BUILDCACHE_DIGEST_FILE), 'r') as f:
+                    self.digests = json.load(f)
+            except (OSError, ValueError):
+                self.digests = dict()
+
+        self.recipe = ''
+        self.recipe = self.key('recipe', *[self.file_digest(f) for f in recipe_files])
+
+    # Get the digest of a file's contents, reusing the remembered one if the file hasn't changed
+    def file_digest(self, path: str) -> str:
+        if not self.enabled:
+            return ''
+
+        path = os.path.realpath(path)
+        st = os.stat(path)
+        remembered = self.digests.get(path)
+
+        if remembered and remembered[0] == st.st_size and remembered[1] == st.st_mtime_ns:
+            return remembered[2]
+
+        hash = hashlib.sha256()
+        with open(path, 'rb') as f:
+            while True:
+                chunk = f.read(BUILDCACHE_CHUNK_SIZE)
+                if not chunk:
+                    break
+                hash.update(chunk)
+
+        digest = hash.hexdigest()
+        self.digests[path] = [st.st_size, st.st_mtime_ns, digest]
+        self.digests_changed = True
+        return digest
+
+    # Get a digest of a directory tree: the relative paths and contents of all files in it.
+    # A missing tree has a digest too, so it can take part in keys.
+    def tree_digest(self, path: str) -> str:
+        if not self.enabled:
+            return ''
+
+        hash = hashlib.sha256()
+
+        if not os.path.isdir(path):
+            hash.update(b'missing')
+            return hash.hexdigest()
+
+        for root, dirs, files in os.walk(path):
+            dirs.sort()
+            rel_root = os.path.relpath(root, path)
+            hash.update(f'D {rel_root}\n'.encode())
+            for file_name in sorted(files):
+                digest = self.file_digest(os.path.join(root, file_name))
+                hash.update(f'F {os.path.join(rel_root, file_name)} {digest}\n'.encode())
+
+        return hash.hexdigest()
+
+    # Make a cache key from an artifact name and any number of digests or parameters
+    def key(self, name: str, *parts) -> str:
+        hash = hashlib.sha256()
+        hash.update(name.encode())
+        hash.update(self.recipe.encode())
+        for part in parts:
+            hash.update(b'\0' + str(part).encode())
+        return hash.hexdigest()
+
+    def entry_dir(self, key: str) -> str:
+        return os.path.join(self.cache_dir, key[:2], key)
+
+    # Copy the outputs (files or directories) of an artifact out of the cache.
+    # Returns False if the artifact is not cached, in which case it needs to be built and stored.
+    # Outputs are identified by their base name, so they must be unique within an artifact.
+    def restore(self, label: str, key: str, outputs: list[str]) -> bool:
+        entry = self.entry_dir(key)
+
+        if not self.enabled or not os.path.exists(os.path.join(entry, BUILDCACHE_DONE_FILE)):
+            self.misses += 1
+            return False
+
+        for output in outputs:
+            cached = os.path.join(entry, os.path.basename(output))
+
+            # Optional outputs the build didn't produce are not in the cache either
+            if os.path.isdir(cached):
+                shutil.rmtree(output, ignore_errors=True)
+                shutil.copytree(cached, output)
+            elif os.path.exists(cached):
+                os.makedirs(os.path.dirname(output), exist_ok=True)
+                shutil.copy2(cached, output)
+
+        print(f'Cache hit: {label}')
+        self.hits += 1
+        return True
+
+    # Store the outputs of an artifact that was just built
+    def store(self, key: str, outputs: list[str]):
+        if not self.enabled:
+            return
+
+        entry = self.entry_dir(key)
+        entry_tmp = entry + '.tmp'
+
+        shutil.rmtree(entry_tmp, ignore_errors=True)
+        os.makedirs(entry_tmp)
+
+        for output in outputs:
+            cached = os.path.join(entry_tmp, os.path.basename(output))
+            if os.path.isdir(output):
+                shutil.copytree(output, cached)
+            elif os.path.exists(output):
+                shutil.copy2(output, cached)
+
+        # Marked complete last, so an interrupted store is never used
+        open(os.path.join(entry_tmp, BUILDCACHE_DONE_FILE), 'w').close()
+
+        shutil.rmtree(entry, ignore_errors=True)
+        os.rename(entry_tmp, entry)
+
+    # Remember the file digests for the next run and print statistics
+    def finish(self):
+        if not self.enabled:
+            print('Build cache disabled')
+            return
+
+        if self.digests_changed:
+            digest_file = os.path.join(self.cache_dir, BUILDCACHE_DIGEST_FILE)
+            with open(digest_file + '.tmp', 'w') as f:
+                json.dump(self.digests, f)
+            os.replace(digest_file + '.tmp', digest_file)
+
+        print(f'Build cache: {self.hits} hits, {self.misses} artifacts built')
@@ -0,0 +1,782 @@
+#!/bin/python3
+
+# Registry hive editor for Windows 98 QuickInstall.
+# Python version.
+# (C) 2026 Eric Voirin (oerg866@googlemail.com)
+
+# Reads Windows 9x registry hives (SYSTEM.DAT, USER.DAT), applies REGEDIT4 .reg files to them and
+# writes them back, so sysprep doesn't have to run regedit.exe in an emulator.
+#
+# File layout, all values little endian, missing offsets are 0xFFFFFFFF:
+#
+#   File header (32 bytes)
+#     0x00 "CREG"
+#     0x04 DWORD  version
+#     0x08 DWORD  offset of the first data block (0x20 + key node table size)
+#     0x0C DWORD  checksum
+#     0x10 WORD   number of data blocks
+#     0x12        flags, reserved
+#
+#   Key node table (32 byte header, then 28 byte key nodes, offsets relative to the table)
+#     0x00 "RGKN"
+#     0x04 DWORD  table size
+#     0x08 DWORD  root key node offset
+#     0x0C DWORD  first free key node offset
+#     0x10 DWORD  flags
+#     0x14 DWORD  checksum
+#
+#     Key node:
+#     0x00 DWORD  flags
+#     0x04 DWORD  hash of the key name (sum of its upper case characters)
+#     0x08 DWORD  reserved, in free key nodes the offset of the next free key node
+#     0x0C DWORD  parent key node offset
+#     0x10 DWORD  first sub key node offset
+#     0x14 DWORD  next sibling key node offset
+#     0x18 DWORD  record address: WORD record index, WORD data block index
+#
+#   Data blocks (32 byte header, then key records)
+#     0x00 "RGDB"
+#     0x04 DWORD  block size
+#     0x08 DWORD  free bytes
+#     0x0C WORD   flags
+#     0x0E WORD   block index
+#     0x10 DWORD  first free record offset
+#     0x14 WORD   number of allocated record indices
+#     0x16 WORD   first free record index
+#     0x18 DWORD  reserved
+#     0x1C DWORD  checksum
+#
+#     Key record:
+#     0x00 DWORD  allocated size, the next record follows after this many bytes
+#     0x04 DWORD  record address, 0xFFFFFFFF if the record is free
+#     0x08 DWORD  used size
+#     0x0C WORD   name length
+#     0x0E WORD   number of values
+#     0x10 DWORD  reserved
+#     0x14        name, then the values:
+#                 DWORD type, DWORD reserved, WORD name length, WORD data length, name, data
+#
+# Hives are written back compacted: key nodes and records packed in key order, the rest of the key
+# node table and of each data block free. Details the structures don't pin down (table and block
+# granularity, free key nodes, checksums, the index fields of the data block header, how strings
+# are terminated, the hash of non-ASCII names, ...) are taken over from the hive that was read.
+# Every hive is read back after writing and compared to what should be in it. Whenever something
+# doesn't look as expected, CregError is raised and the caller can fall back to regedit.
+
+import os
+import sys
+import struct
+import argparse
+from collections import Counter
+
+CREG_NONE = 0xFFFFFFFF
+CREG_HEADER_SIZE = 0x20
+CREG_KEYNODE_SIZE = 0x1C
+CREG_RECORD_HEADER_SIZE = 0x14
+CREG_VALUE_HEADER_SIZE = 0x0C
+CREG_FREE_RECORD_MIN_SIZE = 0x0C
+CREG_MAX_BLOCK_SIZE = 0xFFFF
+CREG_ENCODING = 'cp1252'
+
+REG_SZ = 1
+REG_EXPAND_SZ = 2
+REG_BINARY = 3
+REG_DWORD = 4
+
+CREG_CHECKSUMS = ['sum', 'negsum', 'xor']
+
+class CregError(Exception):
+    pass
+
+def u16(data, offset) -> int:
+    return struct.unpack_from('<H', data, offset)[0]
+
+def u32(data, offset) -> int:
+    return struct.unpack_from('<I', data, offset)[0]
+
+def align(size: int, alignment: int) -> int:
+    return (size + alignment - 1) // alignment * alignment
+
+# Key name hash. Windows looks keys up by hash first, so it has to match what Windows computes.
+# upper: characters are upper cased, high: how characters above 0x7F count ('add' or 'skip')
+def creg_hash(name: bytes, upper: bool = True, high: str = 'add') -> int:
+    result = 0
+    for ch in (name.upper() if upper else name):
+        if ch < 0x80 or high == 'add':
+            result += ch
+    return result & 0xFFFFFFFF
+
+def creg_checksum(data: bytes, kind: str) -> int:
+    words = struct.unpack(f'<{len(data) // 4}I', data[:len(data) // 4 * 4])
+    if kind == 'sum':
+        return sum(words) & 0xFFFFFFFF
+    if kind == 'negsum':
+        return -sum(words) & 0xFFFFFFFF
+    result = 0
+    for word in words:
+        result ^= word
+    return result
+
+# Find out how the checksums of a structure were computed from samples of (header, whole structure, checksum),
+# both with the checksum field zeroed. Returns None if they are not used.
+def learn_checksum(samples) -> tuple:
+    if all(stored == 0 for header, whole, stored in samples):
+        return None
+
+    for use_whole in (False, True):
+        for kind in CREG_CHECKSUMS:
+            if all(creg_checksum(whole if use_whole else header, kind) == stored for header, whole, stored in samples):
+                return (kind, use_whole)
+
+    raise CregError('Unknown checksum')
+
+def apply_checksum(data: bytearray, header_size: int, offset: int, method):
+    struct.pack_into('<I', data, offset, 0)
+    if method is not None:
+        kind, use_whole = method
+        struct.pack_into('<I', data, offset, creg_checksum(bytes(data if use_whole else data[:header_size]), kind))
+
+def zeroed(data: bytes, offset: int) -> bytes:
+    return data[:offset] + b'\0\0\0\0' + data[offset + 4:]
+
+# Picks the most common of a list of values, or the default if it's empty
+def most_common(values: list, default):
+    return Counter(values).most_common(1)[0][0] if values else default
+
+class CregValue:
+    def __init__(self, name: bytes, type: int, data: bytes, reserved: int = 0):
+        self.name = name
+        self.type = type
+        self.data = data
+        self.reserved = reserved
+
+class CregKey:
+    def __init__(self, name: bytes):
+        self.name = name
+        self.values = []
+        self.subkeys = []
+        self.has_record = True
+        self.node_flags = None
+        self.node_reserved = None
+        self.node_hash = 0
+        self.record_reserved = 0
+
+    def find_subkey(self, name: bytes):
+        name = name.upper()
+        for subkey in self.subkeys:
+            if subkey.name.upper() == name:
+                return subkey
+        return None
+
+    def find_value(self, name: bytes):
+        name = name.upper()
+        for value in self.values:
+            if value.name.upper() == name:
+                return value
+        return None
+
+    def set_value(self, name: bytes, type: int, data: bytes):
+        value = self.find_value(name)
+        if value is None:
+            self.values.append(CregValue(name, type, data))
+        else:
+            value.type = type
+            value.data = data
+
+    def delete_value(self, name: bytes):
+        self.values = [v for v in self.values if v.name.upper() != name.upper()]
+
+    # Yields (key, parent) for this key and all keys below it, parents first
+    def walk(self, parent=None):
+        pending = [(self, parent)]
+        while pending:
+            key, parent = pending.pop()
+            yield key, parent
+            pending.extend((subkey, key) for subkey in reversed(key.subkeys))
+
+def keys_equal(a: CregKey, b: CregKey) -> bool:
+    if a.name != b.name or len(a.values) != len(b.values) or len(a.subkeys) != len(b.subkeys):
+        return False
+    for va, vb in zip(a.values, b.values):
+        if (va.name, va.type, va.data) != (vb.name, vb.type, vb.data):
+            return False
+    return all(keys_equal(sa, sb) for sa, sb in zip(a.subkeys, b.subkeys))
+
+class CregHive:
+    def __init__(self, data: bytes):
+        self.parse(data)
+
+    @staticmethod
+    def load(path: str) -> 'CregHive':
+        with open(path, 'rb') as f:
+            return CregHive(f.read())
+
+    def parse(self, data: bytes):
+        if len(data) < 2 * CREG_HEADER_SIZE or data[0:4] != b'CREG' or data[0x20:0x24] != b'RGKN':
+            raise CregError('Not a registry hive')
+
+        self.file_header = data[0:CREG_HEADER_SIZE]
+        self.table_header = data[0x20:0x20 + CREG_HEADER_SIZE]
+
+        blocks_offset = u32(data, 0x08)
+        block_count = u16(data, 0x10)
+        table_size = u32(data, 0x24)
+        table = data[0x20:0x20 + table_size]
+
+        if len(table) != table_size or blocks_offset < 0x20 + table_size or blocks_offset > len(data):
+            raise CregError('Bad key node table size')
+
+        records, blocks = self.parse_blocks(data, blocks_offset, block_count)
+        self.root = self.parse_keys(table, records)
+        free_nodes = self.parse_free_nodes(table)
+        self.learn_layout(data, table, blocks, free_nodes)
+
+    # Reads the data blocks, returns the records by address and a description of each block
+    def parse_blocks(self, data: bytes, offset: int, count: int):
+        records = dict()
+        blocks = []
+
+        for index in range(count):
+            if data[offset:offset + 4] != b'RGDB':
+                raise CregError(f'Bad data block {index}')
+
+            size = u32(data, offset + 4)
+            if size < CREG_HEADER_SIZE or offset + size > len(data):
+                raise CregError(f'Bad size of data block {index}')
+
+            block = {'offset': offset, 'size': size, 'indices': [], 'allocated': [], 'free': []}
+            pos = offset + CREG_HEADER_SIZE
+
+            while pos < offset + size:
+                allocated = u32(data, pos) if pos + 8 <= offset + size else 0
+                address = u32(data, pos + 4) if allocated else CREG_NONE
+
+                if allocated < 8 or pos + allocated > offset + size:
+                    raise CregError(f'Bad record at offset {pos}')
+
+                if address == CREG_NONE:
+                    block['free'].append((pos - offset, allocated))
+                elif address in records:
+                    raise CregError(f'Duplicate record address {address:08x}')
+                else:
+                    records[address] = data[pos:pos + allocated]
+                    block['indices'].append(address & 0xFFFF)
+                    block['allocated'].append(allocated)
+
+                pos += allocated
+
+            blocks.append(block)
+            offset += size
+
+        return records, blocks
+
+    # Builds the key tree from the key node table, checking the key names against their hashes
+    def parse_keys(self, table: bytes, records: dict) -> CregKey:
+        self.hashes = []
+        self.node_offsets = visited = set()
+
+        def read_node(offset: int, parent: int):
+            if offset in visited or offset < CREG_HEADER_SIZE or offset + CREG_KEYNODE_SIZE > len(table):
+                raise CregError(f'Bad key node offset {offset:08x}')
+            visited.add(offset)
+
+            flags, hash, reserved, node_parent, child, next, address = struct.unpack_from('<7I', table, offset)
+            if node_parent != parent:
+                raise CregError(f'Key node {offset:08x} has the wrong parent')
+
+            key = self.parse_record(records, address) if address != CREG_NONE else CregKey(b'')
+            key.has_record = address != CREG_NONE
+            key.node_flags = flags
+            key.node_reserved = reserved
+            key.node_hash = hash
+
+            if parent != CREG_NONE:
+                self.hashes.append((key.name, hash))
+
+            return key, child, next
+
+        root, child, next = read_node(u32(table, 0x08), CREG_NONE)
+        pending = [(root, u32(table, 0x08), child)]
+
+        while pending:
+            key, offset, child = pending.pop()
+            while child != CREG_NONE:
+                subkey, grandchild, sibling = read_node(child, offset)
+                key.subkeys.append(subkey)
+                pending.append((subkey, child, grandchild))
+                child = sibling
+
+        return root
+
+    # Follows the chain of free key nodes, returns their contents without the link to the next one
+    def parse_free_nodes(self, table: bytes) -> list:
+        nodes = []
+        visited = set()
+        offset = u32(table, 0x0C)
+
+        while offset != CREG_NONE:
+            if offset in visited or offset in self.node_offsets or offset < CREG_HEADER_SIZE or offset + CREG_KEYNODE_SIZE > len(table):
+                raise CregError(f'Bad free key node offset {offset:08x}')
+            visited.add(offset)
+
+            flags, hash, next, parent, child, sibling, address = struct.unpack_from('<7I', table, offset)
+            nodes.append((flags, hash, parent, child, sibling, address))
+            offset = next
+
+        return nodes
+
+    def parse_record(self, records: dict, address: int) -> CregKey:
+        record = records.get(address)
+        if record is None:
+            raise CregError(f'Missing record {address:08x}')
+
+        used, name_length, value_count, reserved = struct.unpack_from('<IHHI', record, 8)
+        if used > len(record) or CREG_RECORD_HEADER_SIZE + name_length > used:
+            raise CregError(f'Bad record {address:08x}')
+
+        key = CregKey(record[CREG_RECORD_HEADER_SIZE:CREG_RECORD_HEADER_SIZE + name_length])
+        key.record_reserved = reserved
+        pos = CREG_RECORD_HEADER_SIZE + name_length
+
+        for _ in range(value_count):
+            if pos + CREG_VALUE_HEADER_SIZE > used:
+                raise CregError(f'Bad value in record {address:08x}')
+
+            type, value_reserved, value_name_length, data_length = struct.unpack_from('<IIHH', record, pos)
+            pos += CREG_VALUE_HEADER_SIZE
+            name = record[pos:pos + value_name_length]
+            pos += value_name_length
+            key.values.append(CregValue(name, type, record[pos:pos + data_length], value_reserved))
+            pos += data_length
+
+        if pos != used:
+            raise CregError(f'Bad size of record {address:08x}')
+
+        return key
+
+    # Takes over what the structures don't pin down from the hive that was read
+    def learn_layout(self, data: bytes, table: bytes, blocks: list, free_nodes: list):
+        # The hash function has to match for every existing key, new keys get the same
+        self.hash_args = None
+        for upper in (True, False):
+            for high in ('add', 'skip'):
+                if self.hash_args is None and all(creg_hash(name, upper, high) == hash for name, hash in self.hashes):
+                    self.hash_args = (upper, high)
+        if self.hash_args is None:
+            raise CregError('Unknown key name hash')
+
+        self.file_checksum = learn_checksum([(zeroed(self.file_header, 0x0C), zeroed(self.file_header, 0x0C), u32(data, 0x0C))])
+        self.table_checksum = learn_checksum([(zeroed(self.table_header, 0x14), zeroed(table, 0x14), u32(table, 0x14))])
+        self.block_checksum = learn_checksum([(zeroed(data[b['offset']:b['offset'] + CREG_HEADER_SIZE], 0x1C),
+                                               zeroed(data[b['offset']:b['offset'] + b['size']], 0x1C),
+                                               u32(data, b['offset'] + 0x1C)) for b in blocks])
+
+        # The key node table ends on the granularity of the hive that was read, the rest is free key nodes
+        self.table_granularity = 0x1000 if len(table) % 0x1000 == 0 else 1
+        self.free_node = most_common(free_nodes, None)
+        self.free_node_none = u32(table, 0x0C) if not free_nodes else CREG_NONE
+
+        keys = [key for key, parent in self.root.walk()]
+        self.new_node_flags = most_common([k.node_flags for k in keys if k is not self.root], 0)
+        self.new_node_reserved = most_common([k.node_reserved for k in keys if k is not self.root], CREG_NONE)
+
+        strings = [v.data for k in keys for v in k.values if v.type in (REG_SZ, REG_EXPAND_SZ) and v.data]
+        self.terminate_strings = sum(s.endswith(b'\0') for s in strings) * 2 >= len(strings)
+
+        headers = [data[b['offset']:b['offset'] + CREG_HEADER_SIZE] for b in blocks]
+        self.block_flags = most_common([u16(h, 0x0C) for h in headers], 0)
+        self.block_reserved = most_common([u32(h, 0x18) for h in headers], 0)
+        self.block_limit = min(max([b['size'] for b in blocks], default=0x1000), CREG_MAX_BLOCK_SIZE)
+        self.block_granularity = 0x1000 if blocks and all(b['size'] % 0x1000 == 0 for b in blocks) else 1
+        self.record_alignment = 4 if all(a % 4 == 0 for b in blocks for a in b['allocated']) else 1
+
+        # Index fields relative to the number of records, for blocks whose indices have no gaps
+        dense = [(b, h) for b, h in zip(blocks, headers) if sorted(b['indices']) == list(range(len(b['indices'])))]
+        self.max_index_bias = most_common([u16(h, 0x14) - len(b['indices']) for b, h in dense], 0)
+        self.free_index_bias = most_common([u16(h, 0x16) - len(b['indices']) for b, h in dense], 0)
+
+        # Free records: where the first free record offset counts from, and what a block without one has there
+        with_free = [(b, h) for b, h in zip(blocks, headers) if b['free']]
+        bases = [base for base in (0, CREG_HEADER_SIZE) if all(b['free'][0][0] - u32(h, 0x10) == base for b, h in with_free)]
+        if not bases:
+            raise CregError('Unknown free record offsets')
+        self.free_offset_base = bases[0]
+        self.free_offset_none = most_common([u32(h, 0x10) for b, h in zip(blocks, headers) if not b['free']], CREG_NONE)
+        self.free_record_next = most_common([u32(data, b['offset'] + b['free'][-1][0] + 8) for b, h in with_free
+                                             if b['free'][-1][1] >= CREG_FREE_RECORD_MIN_SIZE], CREG_NONE)
+
+    def key_hash(self, name: bytes) -> int:
+        return creg_hash(name, *self.hash_args)
+
+    def build_record(self, key: CregKey) -> bytearray:
+        record = bytearray(struct.pack('<IIIHHI', 0, 0, 0, len(key.name), len(key.values), key.record_reserved)) + key.name
+
+        for value in key.values:
+            if len(value.name) > 0xFFFF or len(value.data) > 0xFFFF:
+                raise CregError('Value too large')
+            record += struct.pack('<IIHH', value.type, value.reserved, len(value.name), len(value.data)) + value.name + value.data
+
+        struct.pack_into('<I', record, 8, len(record))
+        record += bytes(align(len(record), self.record_alignment) - len(record))
+        struct.pack_into('<I', record, 0, len(record))
+        return record
+
+    def build_block(self, index: int, records: list) -> bytearray:
+        block = bytearray(CREG_HEADER_SIZE)
+        for record_index, record in enumerate(records):
+            struct.pack_into('<HH', record, 4, record_index, index)
+            block += record
+
+        # A block ends on the granularity of the hive that was read, the rest is one free record
+        free = align(len(block), self.block_granularity) - len(block)
+        if 0 < free < CREG_FREE_RECORD_MIN_SIZE:
+            free += self.block_granularity
+        free_offset = self.free_offset_none
+        if free:
+            free_offset = len(block) - self.free_offset_base
+            block += struct.pack('<III', free, CREG_NONE, self.free_record_next) + bytes(free - CREG_FREE_RECORD_MIN_SIZE)
+
+        block[0:4] = b'RGDB'
+        struct.pack_into('<IIHHIHHI', block, 4, len(block), free, self.block_flags, index, free_offset,
+                         len(records) + self.max_index_bias, len(records) + self.free_index_bias, self.block_reserved)
+        apply_checksum(block, CREG_HEADER_SIZE, 0x1C, self.block_checksum)
+        return block
+
+    def serialize(self) -> bytes:
+        keys = list(self.root.walk())
+        node_offsets = {id(key): CREG_HEADER_SIZE + i * CREG_KEYNODE_SIZE for i, (key, parent) in enumerate(keys)}
+        next_siblings = {id(a): b for key, parent in keys for a, b in zip(key.subkeys, key.subkeys[1:])}
+
+        # Records go into the data blocks in key order
+        blocks = [[]]
+        block_size = CREG_HEADER_SIZE
+        addresses = dict()
+
+        for key, parent in keys:
+            if key is self.root and not key.has_record and not key.values:
+                continue
+
+            record = self.build_record(key)
+            if block_size + len(record) > self.block_limit and blocks[-1]:
+                blocks.append([])
+                block_size = CREG_HEADER_SIZE
+
+            addresses[id(key)] = (len(blocks[-1]), len(blocks) - 1)
+            blocks[-1].append(record)
+            block_size += len(record)
+
+        if len(blocks) > 0xFFFF or any(len(b) > 0xFFFF for b in blocks):
+            raise CregError('Too many keys')
+
+        table = bytearray(self.table_header) + bytearray(len(keys) * CREG_KEYNODE_SIZE)
+
+        for key, parent in keys:
+            offset = node_offsets[id(key)]
+            sibling = next_siblings.get(id(key))
+            record_index, block_index = addresses.get(id(key), (0xFFFF, 0xFFFF))
+
+            struct.pack_into('<7I', table, offset,
+                             self.new_node_flags if key.node_flags is None else key.node_flags,
+                             key.node_hash if key is self.root else self.key_hash(key.name),
+                             self.new_node_reserved if key.node_reserved is None else key.node_reserved,
+                             node_offsets[id(parent)] if parent is not None else CREG_NONE,
+                             node_offsets[id(key.subkeys[0])] if key.subkeys else CREG_NONE,
+                             node_offsets[id(sibling)] if sibling is not None else CREG_NONE,
+                             record_index | (block_index << 16))
+
+        # Free key nodes fill the table up to its granularity, chained in order
+        used_size = len(table)
+        table += bytes(align(used_size, self.table_granularity) - used_size)
+        free_offsets = list(range(used_size, len(table) - CREG_KEYNODE_SIZE + 1, CREG_KEYNODE_SIZE)) if self.free_node else []
+
+        for offset, next in zip(free_offsets, free_offsets[1:] + [CREG_NONE]):
+            flags, hash, parent, child, sibling, address = self.free_node
+            struct.pack_into('<7I', table, offset, flags, hash, next, parent, child, sibling, address)
+
+        first_free = free_offsets[0] if free_offsets else self.free_node_none
+        struct.pack_into('<III', table, 4, len(table), CREG_HEADER_SIZE, first_free)
+        apply_checksum(table, CREG_HEADER_SIZE, 0x14, self.table_checksum)
+
+        header = bytearray(self.file_header)
+        struct.pack_into('<I', header, 0x08, CREG_HEADER_SIZE + len(table))
+        struct.pack_into('<H', header, 0x10, len(blocks))
+        apply_checksum(header, CREG_HEADER_SIZE, 0x0C, self.file_checksum)
+
+        return bytes(header + table + b''.join(self.build_block(i, b) for i, b in enumerate(blocks)))
+
+    # Writes the hive, after reading the result back and making sure it has exactly our keys and values in it
+    def save(self, path: str):
+        data = self.serialize()
+
+        if not keys_equal(self.root, CregHive(data).root):
+            raise CregError('Written hive does not read back the same')
+
+        with open(path + '.tmp', 'wb') as f:
+            f.write(data)
+        os.replace(path + '.tmp', path)
+
+    def find_key(self, path: list, create: bool = False):
+        key = self.root
+        for name in path:
+            subkey = key.find_subkey(name)
+            if subkey is None:
+                if not create:
+                    return None
+                subkey = CregKey(name)
+                key.subkeys.append(subkey)
+            key = subkey
+        return key
+
+    def delete_key(self, path: list):
+        parent = self.find_key(path[:-1])
+        if parent is not None and path:
+            parent.subkeys = [k for k in parent.subkeys if k.name.upper() != path[-1].upper()]
+
+    def string_data(self, text: str) -> bytes:
+        return text.encode(CREG_ENCODING) + (b'\0' if self.terminate_strings else b'')
+
+    # Applies the contents of a REGEDIT4 file. All keys must be below root_name, the key the hive holds.
+    def apply_reg(self, text: str, root_name: str = 'HKEY_LOCAL_MACHINE'):
+        lines = reg_logical_lines(text)
+
+        if not lines or lines[0].strip() != 'REGEDIT4':
+            raise CregError('Not a REGEDIT4 file')
+
+        key = None
+        for line in lines[1:]:
+            line = line.strip()
+
+            if not line or line.startswith(';'):
+                continue
+
+            if line.startswith('['):
+                if not line.endswith(']'):
+                    raise CregError(f'Bad key line: {line}')
+
+                path = line[1:-1]
+                delete = path.startswith('-')
+                parts = path.lstrip('-').split('\\')
+
+                if parts[0].upper() != root_name.upper():
+                    raise CregError(f'Key not in {root_name}: {path}')
+
+                parts = [p.encode(CREG_ENCODING) for p in parts[1:] if p]
+
+                if delete:
+                    self.delete_key(parts)
+                    key = None
+                else:
+                    key = self.find_key(parts, create=True)
+                continue
+
+            # Like regedit, values of deleted keys are ignored
+            if key is None:
+                continue
+
+            name, type, data = parse_reg_value(line, self.string_data)
+            if type is None:
+                key.delete_value(name)
+            else:
+                key.set_value(name, type, data)
+
+    # Writes the hive contents in REGEDIT4 format
+    def export_reg(self, root_name: str = 'HKEY_LOCAL_MACHINE') -> str:
+        lines = ['REGEDIT4', '']
+        pending = [(self.root, root_name)]
+
+        while pending:
+            key, path = pending.pop()
+            lines.append(f'[{path}]')
+
+            for value in key.values:
+                name = '@' if not value.name else reg_quote(value.name.decode(CREG_ENCODING))
+                text = value.data.rstrip(b'\0')
+                if value.type == REG_SZ and b'\0' not in text:
+                    lines.append(f'{name}={reg_quote(text.decode(CREG_ENCODING))}')
+                elif value.type == REG_DWORD and len(value.data) == 4:
+                    lines.append(f'{name}=dword:{u32(value.data, 0):08x}')
+                else:
+                    prefix = 'hex' if value.type == REG_BINARY else f'hex({value.type:x})'
+                    lines.append(f'{name}={prefix}:{",".join(f"{b:02x}" for b in value.data)}')
+
+            lines.append('')
+            pending.extend((subkey, path + '\\' + subkey.name.decode(CREG_ENCODING)) for subkey in reversed(key.subkeys))
+
+        return '\r\n'.join(lines) + '\r\n'
+
+    # One line per key and value, sorted and upper cased, to compare hives regardless of how they were written
+    def dump(self) -> list[str]:
+        lines = []
+        pending = [(self.root, '')]
+
+        while pending:
+            key, path = pending.pop()
+            lines.append(path)
+            lines.extend(f'{path}\\{value.name.decode(CREG_ENCODING).upper()}={value.type:x}:{value.data.hex()}' for value in key.values)
+            pending.extend((subkey, path + '\\' + subkey.name.decode(CREG_ENCODING).upper()) for subkey in key.subkeys)
+
+        return sorted(lines)
+
+# Lines that are only in one of two hive dumps, prefixed with - or +
+def dump_diff(a: list, b: list) -> list[str]:
+    only_a, only_b = set(a) - set(b), set(b) - set(a)
+    return sorted([f'-{line}' for line in only_a] + [f'+{line}' for line in only_b], key=lambda line: line[1:])
+
+def reg_quote(text: str) -> str:
+    return '"' + text.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+# Joins lines continued with a trailing backslash (long hex values)
+def reg_logical_lines(text: str) -> list[str]:
+    lines = []
+    continued = False
+
+    for line in text.splitlines():
+        if continued:
+            lines[-1] = lines[-1][:-1] + line.strip()
+        else:
+            lines.append(line.rstrip())
+        continued = lines[-1].endswith('\\') and not lines[-1].lstrip().startswith('[')
+
+    return lines
+
+# Reads a quoted string starting at text[0], returns it and the rest of the text
+def reg_unquote(text: str):
+    if not text.startswith('"'):
+        raise CregError(f'Expected a string: {text}')
+
+    result = ''
+    pos = 1
+    while pos < len(text):
+        if text[pos] == '\\' and pos + 1 < len(text):
+            result += text[pos + 1]
+            pos += 2
+        elif text[pos] == '"':
+            return result, text[pos + 1:]
+        else:
+            result += text[pos]
+            pos += 1
+
+    raise CregError(f'Unterminated string: {text}')
+
+# Parses a value line, returns (name, type, data). type is None if the value is to be deleted.
+def parse_reg_value(line: str, string_data) -> tuple:
+    if line.startswith('@'):
+        name, rest = '', line[1:]
+    else:
+        name, rest = reg_unquote(line)
+
+    rest = rest.strip()
+    if not rest.startswith('='):
+        raise CregError(f'Bad value line: {line}')
+
+    name = name.encode(CREG_ENCODING)
+    rest = rest[1:].strip()
+
+    if rest == '-':
+        return name, None, None
+
+    if rest.startswith('"'):
+        text, tail = reg_unquote(rest)
+        return name, REG_SZ, string_data(text)
+
+    if rest.lower().startswith('dword:'):
+        return name, REG_DWORD, struct.pack('<I', int(rest[6:], 16))
+
+    if rest.lower().startswith('hex'):
+        type = REG_BINARY
+        prefix, _, data = rest.partition(':')
+        if prefix.lower().startswith('hex('):
+            type = int(prefix[4:prefix.index(')')], 16)
+        return name, type, bytes(int(b, 16) for b in data.replace(' ', '').split(',') if b)
+
+    raise CregError(f'Bad value line: {line}')
+
+# Checks that a written hive reads back with the same keys and the layout of the hive it came from
+def check_written(hive: CregHive, data: bytes) -> CregHive:
+    again = CregHive(data)
+
+    if not keys_equal(hive.root, again.root):
+        raise CregError('Written hive does not read back the same')
+    if (again.table_granularity, again.block_granularity) != (hive.table_granularity, hive.block_granularity):
+        raise CregError('Written hive has a different granularity')
+    if again.free_node not in (None, hive.free_node):
+        raise CregError('Written hive has different free key nodes')
+
+    return again
+
+# Reads hives, writes them and reads them back. The second write must be identical to the first.
+def check_hive(path: str) -> bool:
+    try:
+        hive = CregHive.load(path)
+        first = hive.serialize()
+        again = check_written(hive, first)
+
+        if again.serialize() != first:
+            raise CregError('Writing the hive again gives a different result')
+
+        keys = sum(1 for _ in hive.root.walk())
+        print(f'{path}: OK, {keys} keys, {os.path.getsize(path)} -> {len(first)} bytes')
+        return True
+    except (CregError, OSError) as e:
+        print(f'{path}: FAILED, {e}')
+        return False
+
+# Checks the sample hives in registry/samples. Next to each hive are the expected exports after applying the .reg
+# files sysprep uses, e.g. SYSTEM.fastpnp.reg is SYSTEM.DAT with registry/fastpnp.reg applied.
+def test_samples(directory: str) -> bool:
+    names = sorted(os.listdir(directory))
+    results = [check_hive(os.path.join(directory, name)) for name in names if name.upper().endswith('.DAT')]
+
+    for name in names:
+        hive_name, _, reg_name = name[:-len('.reg')].partition('.')
+        if not name.endswith('.reg') or not reg_name:
+            continue
+
+        try:
+            hive = CregHive.load(os.path.join(directory, hive_name + '.DAT'))
+            with open(os.path.join(directory, '..', reg_name + '.reg'), 'r', encoding=CREG_ENCODING) as f:
+                hive.apply_reg(f.read())
+            with open(os.path.join(directory, name), 'r', encoding=CREG_ENCODING, newline='') as f:
+                expected = f.read()
+
+            if check_written(hive, hive.serialize()).export_reg() != expected:
+                raise CregError('Contents differ from the expected export')
+
+            print(f'{name}: OK')
+            results.append(True)
+        except (CregError, OSError) as e:
+            print(f'{name}: FAILED, {e}')
+            results.append(False)
+
+    return bool(results) and all(results)
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Windows 98 QuickInstall Registry Hive Editor')
+    parser.add_argument('--check', nargs='+', metavar='HIVE', help='Check that hives read back the same after writing them')
+    parser.add_argument('--test', action='store_true', help='Check the sample hives in registry/samples')
+    parser.add_argument('--apply', nargs=2, metavar=('HIVE', 'REGFILE'), help='Apply a REGEDIT4 file to a hive')
+    parser.add_argument('--out', type=str, help='Output file for --apply (default: the input hive)')
+    parser.add_argument('--diff', nargs=2, metavar=('HIVE', 'HIVE'), help='Print the keys and values that differ between two hives')
+    parser.add_argument('--export', metavar='HIVE', help='Print the contents of a hive in REGEDIT4 format')
+
+    args = parser.parse_args()
+
+    if args.check:
+        sys.exit(0 if all([check_hive(path) for path in args.check]) else 1)
+
+    if args.test:
+        sys.exit(0 if test_samples(os.path.join(os.path.dirname(os.path.abspath(__file__)), 'registry', 'samples')) else 1)
+
+    if args.apply:
+        hive = CregHive.load(args.apply[0])
+        with open(args.apply[1], 'r', encoding=CREG_ENCODING) as f:
+            hive.apply_reg(f.read())
+        hive.save(args.out or args.apply[0])
+
+    if args.diff:
+        differences = dump_diff(CregHive.load(args.diff[0]).dump(), CregHive.load(args.diff[1]).dump())
+        sys.stdout.write(''.join(line + '\n' for line in differences))
+        sys.exit(1 if differences else 0)
+
+    if args.export:
+        sys.stdout.write(CregHive.load(args.export).export_reg())
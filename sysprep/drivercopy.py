@@ -11,13 +11,19 @@
 # It then packs their referenced driver files in a CAB archive and copies that file into the destination folder,
 # along with the modified INF file.
 
+# When asked to, it also writes an index mapping the PCI vendor/device IDs each INF supports to the
+# output INF and CAB file names, so the installer can extract only what the hardware needs.
+
 # History:
+# 2026-10-19: Compress CAB files in parallel when given a process pool
+# 2026-10-19: Write PCI ID index for hardware-targeted driver installation
 # 2026-04-18: Fix cab file name conflict eating up some drivers' files
 # 2026-02-03: Python rewrite, remove all CatalogFile references to prevent missing file popups during HW detection
 # 2025-02-19: Fix CatalogFile entries with nonexistant files causing CAB file creation to fail (fixes ArtX)
 # 2024-10-21: Fix problems with non-unique INF file names causing CAB files to be overwritten and thus missing driver files.
 
 import os
+import re
 import shutil
 import argparse
 from datetime import datetime
@@ -467,8 +473,73 @@ def writeSourceDisksNamesAndFiles(inf: WinINF, knownFiles: list[SourceFile], cab
 
     inf.AddSection(sdfSection)
 
+# Matches a PCI hardware ID with at least a vendor, optionally a device
+PCI_HWID_REGEX = re.compile(r'^PCI\\VEN_([0-9A-F]{4})(?:&DEV_([0-9A-F]{4}))?', re.IGNORECASE)
+
+# Name of the PCI ID index that goes next to DRIVER.866
+DRIVER_INDEX_FILE = 'DRIVER.IDX'
+
+# Wildcard used in the index for "any device" / "any system"
+DRIVER_INDEX_ANY = '*'
+
+# Get all hardware IDs of the models listed in the Manufacturer section
+def getHardwareIds(inf: WinINF) -> list[str]:
+    ids = []
+
+    mfgSection = getSection(inf, 'Manufacturer')
+
+    if mfgSection is None:
+        return ids
+
+    for key, value, comment in mfgSection:
+        # %Mfg%=Models, or just Models
+        modelsName = value if value else key
+        if not modelsName:
+            continue
+
+        modelsSection = getSection(inf, modelsName.split(',')[0].strip())
+
+        if modelsSection is None:
+            continue
+
+        # %DeviceDesc%=InstallSection, HardwareID[, CompatibleID...]
+        for mKey, mValue, mComment in modelsSection:
+            if not mValue:
+                continue
+            for hwid in mValue.split(',')[1:]:
+                hwid = hwid.strip().strip('"')
+                if hwid:
+                    appendIfNew(ids, hwid)
+
+    return ids
+
+# Turn hardware IDs into (vendor, device) index entries.
+# If the driver has any ID we can't match against the PCI bus (ISA PnP, class codes, ...),
+# or no IDs at all (network clients, protocols...), it is generic and always gets installed.
+def getPciIndexEntries(hardwareIds: list[str]) -> list[tuple[str, str]]:
+    entries = []
+
+    for hwid in hardwareIds:
+        match = PCI_HWID_REGEX.match(hwid)
+
+        if not match:
+            return [(DRIVER_INDEX_ANY, DRIVER_INDEX_ANY)]
+
+        vendor = match.group(1).upper()
+        device = match.group(2).upper() if match.group(2) else DRIVER_INDEX_ANY
+
+        # Subsystem / revision specific IDs: the vendor & device pair is enough
+        if (vendor, device) not in entries:
+            entries.append((vendor, device))
+
+    if not entries:
+        return [(DRIVER_INDEX_ANY, DRIVER_INDEX_ANY)]
+
+    return entries
+
 # Scan an inf file, collect all its associated files, modify it according to what the CAB name will be, and save it to output
-def handleInf(filename: str, outInfName: str, localDir: str, cabName: str, filesInDirectory: list[SourceFile], simulate: bool = False) -> bool:
+# The hardware IDs of the INF's models are appended to hardwareIds if given.
+def handleInf(filename: str, outInfName: str, localDir: str, cabName: str, filesInDirectory: list[SourceFile], simulate: bool = False, hardwareIds: list[str] = None) -> bool:
     inf = WinINF()
     inf.ParseFile(filename, codec='cp1252')
 
@@ -487,6 +558,9 @@ def handleInf(filename: str, outInfName: str, localDir: str, cabName: str, files
     # Remove catalog file if present
     removeCatFile(versionSection)
 
+    if hardwareIds is not None:
+        hardwareIds.extend(getHardwareIds(inf))
+
     # All copyfiles sections must be scanned for drivers
     copyFilesSections = getCopyFilesSections(inf, knownFiles, localDir)
 
@@ -568,23 +642,40 @@ def findSubPath(sourceDir: str, subPath: str):
 
     return current
 
-# Takes all known files and compresses them into the CAB file
-def copyFilesAndWriteCab(filesInDirectory: list[SourceFile], outCab: str) -> bool:
+# Compresses files into a CAB file. files is a list of (file name, data, mtime).
+# Runs in a worker process if driverCopy was given a process pool.
+def writeCab(files: list[tuple], outCab: str):
     cabArchive = CabArchive()
 
-    for sfEntry in filesInDirectory:
-        if sfEntry.data:
-            cabArchive[sfEntry.fileName] = CabFile(sfEntry.data, mtime = sfEntry.mtime)
+    for fileName, data, mtime in files:
+        cabArchive[fileName] = CabFile(data, mtime = mtime)
     
     with open(outCab, 'wb') as outFile:
         outFile.write(cabArchive.save(compress = True))
 
-    return True
+    logi(f'---> CAB file written: {outCab} {os.path.getsize(outCab)} Bytes')
+
+# Takes all known files and compresses them into the CAB file.
+# With a process pool, this is done in the background and the future for it is returned.
+def copyFilesAndWriteCab(filesInDirectory: list[SourceFile], outCab: str, pool = None):
+    files = [(sfEntry.fileName, sfEntry.data, sfEntry.mtime) for sfEntry in filesInDirectory if sfEntry.data]
+
+    if pool:
+        # Claim the file name right away, so the drivers after this one get the same unique names as without a pool
+        open(outCab, 'wb').close()
+        return pool.submit(writeCab, files, outCab)
+
+    writeCab(files, outCab)
+    return None
 
 # Scans a sub directory and plugs all its INF files into the INF handler
-def handleDir(localDir: str, outDir: str, simulate: bool = False, deleteWin98Files: bool = False):
+# Returns the driver index lines (vendor, device, INF name, CAB name) for this directory
+# If a process pool is given, the CAB file is compressed in it and the future for that is appended to cabJobs
+def handleDir(localDir: str, outDir: str, simulate: bool = False, deleteWin98Files: bool = False,
+              pool = None, cabJobs: list = None) -> list[tuple[str, str, str, str]]:
     infCount = 0
     infFiles = []
+    outInfs = list[tuple[str, list[str]]]()
 
     filesInThisDir = list[SourceFile]()
     
@@ -603,7 +694,11 @@ def handleDir(localDir: str, outDir: str, simulate: bool = False, deleteWin98Fil
         
             logi(f'---------------------------------------------------------------')
             logi(f'Processing inf: {fullPath} outInf: {outInf} outCab: {outCab}')
-            handleInf(fullPath, outInf, localDir, outCab, filesInThisDir, simulate)
+            hardwareIds = []
+            handleInf(fullPath, outInf, localDir, outCab, filesInThisDir, simulate, hardwareIds)
+            # Invalid INFs are not written out, they have no business in the index
+            if os.path.exists(outInf):
+                outInfs.append((outInf, hardwareIds))
             infCount += 1
             infFiles.append(f)
 
@@ -633,20 +728,43 @@ def handleDir(localDir: str, outDir: str, simulate: bool = False, deleteWin98Fil
     logi(f'---> Sum of all file data (uncompressed): {totalSize} bytes')
 
     if infCount > 0 and not simulate:
-        copyFilesAndWriteCab(filesInThisDir, outCab)
-        outSize = os.path.getsize(outCab)
-        logi(f'---> CAB file written: {outCab} {outSize} Bytes')
+        cabJob = copyFilesAndWriteCab(filesInThisDir, outCab, pool)
+        if cabJob:
+            cabJobs.append(cabJob)
+
+    indexLines = []
+
+    for outInf, hardwareIds in outInfs:
+        for vendor, device in getPciIndexEntries(hardwareIds):
+            indexLines.append((vendor, device, os.path.basename(outInf), os.path.basename(outCab)))
+
+    return indexLines
+
+# Appends driver index lines to an index file. One line per entry:
+# <vendor> <device> <inf> <cab>, '*' matches anything. "* *" marks generic drivers.
+def writeDriverIndex(indexFile: str, indexLines: list[tuple[str, str, str, str]]):
+    isNew = not os.path.exists(indexFile)
+
+    with open(indexFile, 'a', newline='\r\n') as f:
+        if isNew:
+            f.write('# Windows 98 QuickInstall driver index: <vendor> <device> <inf> <cab>\n')
+        for line in indexLines:
+            f.write(' '.join(line) + '\n')
 
 # Performs a INF analysis for one level of subdirectories in inDir
 # Collects and compresses all INF's associated files into CABs
 # Writes output into outDir
 # Deletes existing files in outDir if deleteExisting is True
-def driverCopy(inDir: str, outDir: str, deleteExisting: str = True):
+# If indexName is given, the PCI ID index is written to (or appended to) that file in outDir
+# If pool is given (a concurrent.futures executor), the CAB files are compressed in it. The output is the same.
+def driverCopy(inDir: str, outDir: str, deleteExisting: str = True, indexName: str = None, pool = None):
     if (deleteExisting and os.path.exists(outDir)):
         shutil.rmtree(outDir)
 
     os.makedirs(outDir, exist_ok=True)
 
+    cabJobs = []
+
     # Get all Directories 
     for entry in os.listdir(inDir):
         fullEntry = os.path.join(inDir, entry)
@@ -654,7 +772,14 @@ def driverCopy(inDir: str, outDir: str, deleteExisting: str = True):
         # if this is a directory, we process it
         if os.path.isdir(fullEntry):
             logi(f'Processing directory: {fullEntry}')
-            handleDir(fullEntry, outDir)
+            indexLines = handleDir(fullEntry, outDir, pool=pool, cabJobs=cabJobs)
+
+            if indexName:
+                writeDriverIndex(os.path.join(outDir, indexName), indexLines)
+
+    # Wait for the CAB files, this also passes on any errors
+    for cabJob in cabJobs:
+        cabJob.result()
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(description='Windows 98 QuickInstall Driver Copy Script', formatter_class=argparse.ArgumentDefaultsHelpFormatter)
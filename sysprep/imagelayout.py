@@ -0,0 +1,317 @@
+#!/bin/python3
+
+# Image layout for Windows 98 QuickInstall.
+# Python version.
+# (C) 2026 Eric Voirin (oerg866@googlemail.com)
+
+# The installer reads the payload files of the OS variant it installs one after another, in the
+# order of qi_copySteps in installer/install.c. On a CD every seek between them costs a lot, so the
+# image builders put them next to each other in that order.
+#
+# pycdlib has no way to influence where file data goes, so makeIso writes the image as usual and
+# relayoutIso moves the file data afterwards: the payloads go to the end of the image, which is
+# the outer and fastest part of a CAV disc, everything else keeps its order in front of them.
+# The directory records of both the ISO9660 and the Joliet tree and the El Torito boot catalog are
+# patched to the new locations, then verifyIsoLayout checks the result against the source tree.
+
+import os
+import struct
+
+# The payload files in each osroots/<n> directory, in the order the installer reads them.
+# With the legacy hardware detection, the registry is FASTPNP.866 with the SLOWPNP.DIF patch applied.
+# Both are read side by side, the patch is small enough not to slow down a default installation.
+LAYOUT_INSTALL_READ_ORDER = ['FULL.866', 'FASTPNP.866', 'SLOWPNP.DIF', 'CREGFIX.866', 'LBA64.866', 'DRIVER.IDX', 'DRIVER.866']
+
+# On media with several variants, their FULL.866 files only list the files, the file data is in this
+# content pool (see mercypak_pool). It is what takes longest to read for every variant.
+LAYOUT_POOL_FILE = 'POOL.866'
+
+LAYOUT_CHUNK_SIZE = 1024 * 1024
+
+ISO_SECTOR_SIZE = 2048
+ISO_FIRST_DESCRIPTOR = 16
+ISO_DESCRIPTOR_BOOT = 0
+ISO_DESCRIPTOR_PRIMARY = 1
+ISO_DESCRIPTOR_SUPPLEMENTARY = 2
+ISO_DESCRIPTOR_TERMINATOR = 255
+ISO_ROOT_RECORD_OFFSET = 156
+ISO_BOOT_CATALOG_OFFSET = 71
+ISO_JOLIET_ESCAPES = [b'%/@', b'%/C', b'%/E']
+ISO_FLAG_DIRECTORY = 0x02
+ISO_FLAG_MULTI_EXTENT = 0x80
+ELTORITO_ID = b'EL TORITO SPECIFICATION'
+ELTORITO_INITIAL_ENTRY_RBA = 32 + 8
+
+# Get the payload files in baseDir in the order the installer reads them, as paths relative
+# to baseDir. The content pool comes first, then all variants' payloads, variant by variant.
+def getLayoutOrder(baseDir: str) -> list[str]:
+    osrootsDir = os.path.join(baseDir, 'osroots')
+    if not os.path.isdir(osrootsDir):
+        return []
+
+    variants = sorted((d for d in os.listdir(osrootsDir) if d.isdigit()), key=int)
+    order = []
+
+    if os.path.isfile(os.path.join(osrootsDir, LAYOUT_POOL_FILE)):
+        order.append(f'osroots/{LAYOUT_POOL_FILE}')
+
+    for variant in variants:
+        files = {f.upper(): f for f in os.listdir(os.path.join(osrootsDir, variant))}
+        for name in LAYOUT_INSTALL_READ_ORDER:
+            if name.upper() in files:
+                order.append(f'osroots/{variant}/{files[name.upper()]}')
+
+    return order
+
+class IsoLayoutError(Exception):
+    pass
+
+# A piece of file data in an ISO image, with every directory record that points to it
+class IsoExtent:
+    def __init__(self, sector: int, size: int):
+        self.sector = sector
+        self.size = size
+        self.records = []
+        self.paths = []
+
+    def sectors(self) -> int:
+        return (self.size + ISO_SECTOR_SIZE - 1) // ISO_SECTOR_SIZE
+
+def isoReadSector(f, sector: int) -> bytes:
+    f.seek(sector * ISO_SECTOR_SIZE)
+    data = f.read(ISO_SECTOR_SIZE)
+    if len(data) != ISO_SECTOR_SIZE:
+        raise IsoLayoutError(f'Image ends at sector {sector}')
+    return data
+
+# Get the root directory records of all directory trees (joliet, record) and the sectors of the
+# El Torito boot record descriptors
+def isoReadDescriptors(f):
+    roots = []
+    bootRecords = []
+    sector = ISO_FIRST_DESCRIPTOR
+
+    while True:
+        data = isoReadSector(f, sector)
+        if data[1:6] != b'CD001':
+            raise IsoLayoutError(f'Bad volume descriptor at sector {sector}')
+
+        if data[0] == ISO_DESCRIPTOR_TERMINATOR:
+            break
+        elif data[0] == ISO_DESCRIPTOR_PRIMARY:
+            roots.append((False, data[ISO_ROOT_RECORD_OFFSET:ISO_ROOT_RECORD_OFFSET + 34]))
+        elif data[0] == ISO_DESCRIPTOR_SUPPLEMENTARY:
+            joliet = any(esc in data[88:120] for esc in ISO_JOLIET_ESCAPES)
+            roots.append((joliet, data[ISO_ROOT_RECORD_OFFSET:ISO_ROOT_RECORD_OFFSET + 34]))
+        elif data[0] == ISO_DESCRIPTOR_BOOT and data[7:7 + len(ELTORITO_ID)] == ELTORITO_ID:
+            bootRecords.append(sector)
+
+        sector += 1
+
+    return roots, bootRecords
+
+# Walk a directory tree and collect the data extents of all files in it.
+# Paths are recorded for Joliet trees only, they have the original file names.
+def isoWalkTree(f, rootRecord: bytes, joliet: bool, extents: dict, dirSectors: set):
+    pending = [(struct.unpack_from('<I', rootRecord, 2)[0], struct.unpack_from('<I', rootRecord, 10)[0], '')]
+
+    while pending:
+        dirSector, dirSize, dirPath = pending.pop()
+
+        if dirSector in dirSectors:
+            continue
+        dirSectors.add(dirSector)
+
+        f.seek(dirSector * ISO_SECTOR_SIZE)
+        data = f.read(dirSize)
+        pos = 0
+
+        while pos < len(data):
+            length = data[pos]
+
+            # Records never cross sectors, the rest of a sector is padded with zeroes
+            if length == 0:
+                pos = (pos // ISO_SECTOR_SIZE + 1) * ISO_SECTOR_SIZE
+                continue
+
+            sector, size = struct.unpack_from('<I', data, pos + 2)[0], struct.unpack_from('<I', data, pos + 10)[0]
+            flags = data[pos + 25]
+            nameLen = data[pos + 32]
+            name = data[pos + 33:pos + 33 + nameLen]
+
+            if name in (b'\0', b'\1'):
+                pass
+            elif flags & ISO_FLAG_MULTI_EXTENT:
+                raise IsoLayoutError('Multi-extent files are not supported')
+            else:
+                name = (name.decode('utf-16-be') if joliet else name.decode('ascii')).split(';')[0]
+                path = dirPath + '/' + name
+
+                if flags & ISO_FLAG_DIRECTORY:
+                    pending.append((sector, size, path))
+                else:
+                    extent = extents.setdefault(sector, IsoExtent(sector, size))
+                    extent.size = max(extent.size, size)
+                    extent.records.append(dirSector * ISO_SECTOR_SIZE + pos)
+                    if joliet:
+                        extent.paths.append(path.lstrip('/'))
+
+            pos += length
+
+# Read the file layout of an ISO image.
+# Returns the file extents by sector, the directory sectors, the boot record descriptor sectors and the boot catalog sector.
+def isoReadLayout(f):
+    roots, bootRecords = isoReadDescriptors(f)
+    extents = dict()
+    dirSectors = set()
+
+    for joliet, rootRecord in roots:
+        isoWalkTree(f, rootRecord, joliet, extents, dirSectors)
+
+    catalog = None
+    if bootRecords:
+        catalog = struct.unpack_from('<I', isoReadSector(f, bootRecords[0]), ISO_BOOT_CATALOG_OFFSET)[0]
+
+    return extents, dirSectors, bootRecords, catalog
+
+# Finds the file extents of the payloads, in order
+def isoGetPayloadExtents(extents: dict, order: list[str]) -> list[IsoExtent]:
+    byPath = {p.upper(): e for e in extents.values() for p in e.paths}
+    payloads = []
+
+    for path in order:
+        extent = byPath.get(path.upper())
+        if extent is None:
+            raise IsoLayoutError(f'{path} is not in the image')
+        if extent.size > 0 and extent not in payloads:
+            payloads.append(extent)
+
+    return payloads
+
+def copyRange(fin, fout, offset: int, length: int):
+    fin.seek(offset)
+    while length > 0:
+        chunk = fin.read(min(length, LAYOUT_CHUNK_SIZE))
+        if not chunk:
+            raise IsoLayoutError(f'Image ends at offset {fin.tell()}')
+        fout.write(chunk)
+        length -= len(chunk)
+
+def writeBothEndian32(f, offset: int, value: int):
+    f.seek(offset)
+    f.write(struct.pack('<I', value) + struct.pack('>I', value))
+
+# Move the data of the files listed in order (paths relative to the image root) to the end of the
+# image, contiguous and in that order. The file data from the first payload on must be packed
+# without gaps, which is what pycdlib writes; anything else is left alone and reported.
+def relayoutIso(imageFile: str, order: list[str]) -> bool:
+    with open(imageFile, 'rb') as f:
+        extents, dirSectors, bootRecords, catalog = isoReadLayout(f)
+        payloads = isoGetPayloadExtents(extents, order)
+
+        if not payloads:
+            return True
+
+        blocks = sorted((e for e in extents.values() if e.size > 0), key=lambda e: e.sector)
+        regionStart = min(e.sector for e in payloads)
+        region = [e for e in blocks if e.sector >= regionStart]
+
+        sector = regionStart
+        for extent in region:
+            if extent.sector != sector:
+                print(f'relayoutIso: Unexpected data at sector {sector}, leaving the image as it is')
+                return False
+            sector += extent.sectors()
+
+        if any(s >= regionStart for s in dirSectors) or (catalog is not None and catalog >= regionStart and catalog not in extents):
+            print('relayoutIso: Directories between the file data, leaving the image as it is')
+            return False
+
+        newOrder = [e for e in region if e not in payloads] + payloads
+        newSector = dict()
+        sector = regionStart
+        for extent in newOrder:
+            newSector[extent.sector] = sector
+            sector += extent.sectors()
+
+        f.seek(0, os.SEEK_END)
+        imageSize = f.tell()
+        regionEnd = sector * ISO_SECTOR_SIZE
+
+        with open(imageFile + '.tmp', 'wb') as out:
+            copyRange(f, out, 0, regionStart * ISO_SECTOR_SIZE)
+
+            for extent in newOrder:
+                copyRange(f, out, extent.sector * ISO_SECTOR_SIZE, extent.size)
+                out.write(b'\0' * (extent.sectors() * ISO_SECTOR_SIZE - extent.size))
+
+            copyRange(f, out, regionEnd, imageSize - regionEnd)
+
+    with open(imageFile + '.tmp', 'r+b') as out:
+        for extent in region:
+            for record in extent.records:
+                writeBothEndian32(out, record + 2, newSector[extent.sector])
+
+        # The boot catalog may be one of the moved files, and it points to the boot image which may have moved
+        if catalog is not None:
+            newCatalog = newSector.get(catalog, catalog)
+            for bootRecord in bootRecords:
+                out.seek(bootRecord * ISO_SECTOR_SIZE + ISO_BOOT_CATALOG_OFFSET)
+                out.write(struct.pack('<I', newCatalog))
+
+            out.seek(newCatalog * ISO_SECTOR_SIZE + ELTORITO_INITIAL_ENTRY_RBA)
+            bootImage = struct.unpack('<I', out.read(4))[0]
+            out.seek(newCatalog * ISO_SECTOR_SIZE + ELTORITO_INITIAL_ENTRY_RBA)
+            out.write(struct.pack('<I', newSector.get(bootImage, bootImage)))
+
+    os.replace(imageFile + '.tmp', imageFile)
+    return True
+
+def filesEqual(f, offset: int, sourcePath: str) -> bool:
+    f.seek(offset)
+    with open(sourcePath, 'rb') as src:
+        while True:
+            chunk = src.read(LAYOUT_CHUNK_SIZE)
+            if not chunk:
+                return True
+            if f.read(len(chunk)) != chunk:
+                return False
+
+# Check that every file in inDir is in the image with the right contents, that the boot catalog
+# points to a file and that the payloads are contiguous, in order and at the end of the file data.
+def verifyIsoLayout(imageFile: str, inDir: str, order: list[str]):
+    with open(imageFile, 'rb') as f:
+        extents, dirSectors, bootRecords, catalog = isoReadLayout(f)
+        byPath = {p: e for e in extents.values() for p in e.paths}
+
+        for root, dirs, files in os.walk(inDir):
+            for name in files:
+                path = os.path.relpath(os.path.join(root, name), inDir).replace('\\', '/')
+                extent = byPath.get(path)
+
+                if extent is None:
+                    raise IsoLayoutError(f'{path} is missing from the image')
+                if os.path.getsize(os.path.join(root, name)) == 0:
+                    continue
+                if extent.size != os.path.getsize(os.path.join(root, name)) or not filesEqual(f, extent.sector * ISO_SECTOR_SIZE, os.path.join(root, name)):
+                    raise IsoLayoutError(f'{path} has the wrong contents in the image')
+
+        if catalog is not None:
+            bootImage = struct.unpack_from('<I', isoReadSector(f, catalog), ELTORITO_INITIAL_ENTRY_RBA)[0]
+            if bootImage not in extents:
+                raise IsoLayoutError(f'Boot catalog points to sector {bootImage}, which is not a file')
+
+        payloads = isoGetPayloadExtents(extents, order)
+        if not payloads:
+            return
+
+        sector = payloads[0].sector
+        for extent in payloads:
+            if extent.sector != sector:
+                raise IsoLayoutError(f'{extent.paths[0]} is at sector {extent.sector}, expected {sector}')
+            sector += extent.sectors()
+
+        if any(e.sector >= sector for e in extents.values() if e.size > 0):
+            raise IsoLayoutError('There is file data behind the payload files')
+
+        print(f'verifyIsoLayout: {len(payloads)} payload files contiguous from sector {payloads[0].sector} to {sector}')
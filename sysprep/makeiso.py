@@ -9,6 +9,8 @@ import pycdlib
 
 import os
 
+from imagelayout import relayoutIso, verifyIsoLayout
+
 
 def replaceIsoInvalidChars(path: str) -> str:
     result = ''
@@ -48,7 +50,8 @@ def getIsoPath(path: str, extensionSeparator='.') -> str:
 # Create an ISO image containing all files in inDir.
 # imageFile is the output file, bootFile is relative to inDir the boot floppy image file
 # label is the... label :P
-def makeIso(inDir, imageFile, bootFile, label):
+# order lists files (relative to inDir) to be placed at the end of the image, contiguous and in that order
+def makeIso(inDir, imageFile, bootFile, label, order=None):
 
     if os.path.exists(imageFile):
         os.remove(imageFile)
@@ -89,3 +92,8 @@ def makeIso(inDir, imageFile, bootFile, label):
 
     iso.write(imageFile)
     iso.close()
+
+    if order:
+        print('makeIso: Placing payload files in install order')
+        if relayoutIso(imageFile, order):
+            verifyIsoLayout(imageFile, inDir, order)
@@ -16,7 +16,42 @@ def getDirectorySizeAligned(path, blockSize):
 
 from FATtools import Volume, FAT, partutils, mkfat
 
-def makeUsb(baseDir, outputUsb):
+USB_COPY_CHUNK_SIZE = 1024 * 1024
+
+def copyFileIn(dirTable, sourcePath, name):
+    handle = dirTable.create(name)
+    with open(sourcePath, 'rb') as f:
+        while True:
+            chunk = f.read(USB_COPY_CHUNK_SIZE)
+            if not chunk:
+                break
+            handle.write(chunk)
+    handle.close()
+
+# Copies baseDir into the file system like Volume.copy_tree_in, except that the files in order
+# (relative to baseDir) are copied last, in that order. Clusters on the fresh file system are
+# allocated one after another, so these files end up contiguous in the order the installer reads them.
+def copyTreeOrdered(baseDir, fs, order):
+    orderedFiles = {os.path.normpath(path).upper() for path in order}
+    dirTables = {'.': fs}
+
+    for root, dirs, files in os.walk(baseDir):
+        dirs.sort()
+        rootRelative = os.path.relpath(root, baseDir)
+
+        for d in dirs:
+            dirTables[os.path.join(rootRelative, d) if rootRelative != '.' else d] = dirTables[rootRelative].mkdir(d)
+
+        for f in sorted(files):
+            if os.path.normpath(os.path.join(rootRelative, f)).upper() not in orderedFiles:
+                copyFileIn(dirTables[rootRelative], os.path.join(root, f), f)
+
+    for path in order:
+        path = os.path.normpath(path)
+        copyFileIn(dirTables[os.path.dirname(path) or '.'], os.path.join(baseDir, path), os.path.basename(path))
+
+# order lists files (relative to baseDir) to be copied last, contiguous and in that order
+def makeUsb(baseDir, outputUsb, order=None):
 
     totalSize = getDirectorySizeAligned(baseDir, 4096) # 4K alignment
     totalSize += (32 * 1024 * 1024) # something extra just to make sure
@@ -48,7 +83,10 @@ def makeUsb(baseDir, outputUsb):
 
     # Copy all the files
     print('Copying files into USB image (this may take a while...)')
-    Volume.copy_tree_in(baseDir, fs)
+    if order:
+        copyTreeOrdered(baseDir, fs, order)
+    else:
+        Volume.copy_tree_in(baseDir, fs)
 
     # Copy EFI stuff
     efiDir = fs.mkdir('EFI')
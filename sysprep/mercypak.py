@@ -22,10 +22,36 @@ FILE HEADER:
 
     V1: "ZIEG"
     V2: "MRCY"
+    V3: "MRC3"
 
 * Directory count                           UINT32
 * File count                                UINT32
 
+V3 only, the rest of V3 is the same as V2:
+
+* Extended header size                      UINT16
+  (Size of the fields below. Readers skip fields they don't know.)
+* Entry order policy                        UINT8
+
+    0: As found in the source
+    1: Install locality: files needed for the first boot first, then grouped by directory,
+       small files before big ones within a directory (see mercypak_install_order_key)
+    2: Content pool order: in the order of the file data in the content pool (see mercypak_pool)
+
+* File data location                        UINT8 (0 if the extended header ends before it)
+
+    0: Inline, after each entry, as in V2
+    1: Content pool: the entries have no data after them. The data of all entries, in entry
+       order, is the concatenation of the pool ranges below, read from the content pool file.
+
+* Pool range count                          UINT16 (only with file data location 1, at least 1)
+* Pool ranges (range count times)           UINT32 offset, UINT32 length
+* Chunk cache size                          UINT32 (0 if the extended header ends before it)
+* Chunk cache entries                       UINT32
+
+    Chunked entries (see below) need a chunk cache of this many bytes and chunks. Without
+    chunked entries, both are 0.
+
 Per directory (repeat "directory count"-times):
 
     * Dir attributes (hidden, sys, etc)         BYTE
@@ -90,6 +116,41 @@ For each file:
 
           In V2 this is only once and this one block is used for every identical file (see above)
 
+    V3 chunked entries:
+
+        Files that have parts in common with other files can be stored as a list of content-defined
+        chunks (see cdc_chunk_file). Such an entry is flagged in its amount of identical files:
+
+        * Amount of identical files following       UINT8, ORed with 0x80
+        * The files                                 (same as V2)
+        * File size                                 UINT32
+        * Chunk count                               UINT32
+
+        Per chunk:
+
+            * Chunk                                 UINT32
+
+              Bit 31 clear: a new chunk of this length, its data follows. New chunks are numbered
+              from 0 on, in the order they are in the whole file, and go into the chunk cache.
+              Bit 31 set: bits 0-30 are the number of a chunk in the chunk cache, which is repeated.
+
+            * Chunk data                            BYTE * (chunk length), for new chunks only
+
+        The chunk cache is a FIFO: before a new chunk goes in, the oldest ones are dropped until
+        its data fits into the cache size and there are fewer chunks than the cache entries.
+        Chunks are only repeated while they are still in the cache.
+
+        Chunked entries always have their data inline, even with file data location 1.
+
+
+CONTENT POOL FILE:
+
+Holds the file data of several V3 files that share most of it, e.g. the FULL.866 files of the OS
+variants on one medium. Data that is in more than one of them is in the pool once.
+
+* ASCII File identifier "MPOL"              4 Bytes ASCII
+* File data                                 BYTE[], referenced by the pool ranges of the V3 files
+
 
 And that's it! simplistic as hell
 '''
@@ -101,18 +162,80 @@ import sys
 import subprocess
 import time
 import hashlib
+import fnmatch
+from collections import Counter, deque
+
+try:
+    import resource
+except ImportError:
+    # Not available on Windows, peak memory just isn't reported there
+    resource = None
 
 from FATtools import FAT
 
 MERCYPAK_V1_MAGIC = b'ZIEG'
 MERCYPAK_V2_MAGIC = b'MRCY'
+MERCYPAK_V3_MAGIC = b'MRC3'
+MERCYPAK_POOL_MAGIC = b'MPOL'
+
+# Entry order policies
+MERCYPAK_ORDER_AS_FOUND = 0
+MERCYPAK_ORDER_INSTALL  = 1
+MERCYPAK_ORDER_POOL     = 2
+
+# File data locations (V3)
+MERCYPAK_DATA_INLINE    = 0
+MERCYPAK_DATA_POOL      = 1
+
+# Flag in the amount of identical files of a chunked entry (V3), and in a chunk that repeats a cached one
+MERCYPAK_CHUNKED_ENTRY  = 0x80
+MERCYPAK_CHUNK_CACHED   = 0x80000000
 
 FS_FAT      = 3
 FS_NTFS     = 2
 FS_OTHER    = 1
 FS_UNK      = 0
 
-MAX_FILES_PER_KNOWN_DATA = 8
+# Must match MERCYPAK_V2_MAX_IDENTICAL_FILES in installer/install.h
+MAX_FILES_PER_KNOWN_DATA = 16
+
+# Files are hashed and copied in chunks of this size, so they never have to be in memory as a whole
+MPAK_CHUNK_SIZE = 1024 * 1024
+
+# Content-defined chunking: chunks are cut after a byte where the gear hash of the data up to it has the mask bits
+# clear, but not before the minimum and not after the maximum size. The mask gives 8 KB chunks on average.
+# The gear hash shifts by one bit per byte, so its low mask bits only depend on as many bytes as there are mask bits.
+MPAK_CDC_MIN_SIZE = 2048
+MPAK_CDC_MAX_SIZE = 64 * 1024
+MPAK_CDC_MASK_BITS = 13
+MPAK_CDC_MASK = (1 << MPAK_CDC_MASK_BITS) - 1
+
+# Gear hash values per byte value. Fixed, so the same data is always cut the same way.
+MPAK_CDC_GEAR = [int.from_bytes(hashlib.sha256(bytes([value])).digest()[:4], 'little') for value in range(256)]
+
+# The mask bits of the gear hash values as translation tables, low byte and high byte
+MPAK_CDC_GEAR_LOW = bytes(gear & MPAK_CDC_MASK & 0xff for gear in MPAK_CDC_GEAR)
+MPAK_CDC_GEAR_HIGH = bytes((gear & MPAK_CDC_MASK) >> 8 for gear in MPAK_CDC_GEAR)
+
+# Files smaller than this are not chunked, they would be just one or two chunks
+MPAK_CHUNKED_MIN_FILE_SIZE = 2 * MPAK_CDC_MIN_SIZE
+
+# Chunk cache the installer keeps while unpacking a file with chunked entries
+MPAK_CHUNK_CACHE_SIZE = 4 * 1024 * 1024
+MPAK_CHUNK_CACHE_ENTRIES = 8192
+
+# With the install locality order, files up to this size come before the bigger ones in their directory
+MPAK_ORDER_SMALL_FILE_SIZE = 4096
+
+# With the install locality order, these come first. Lower case, '/' separated, relative to the archive root.
+MPAK_ORDER_FIRST_BOOT = [
+    'io.sys', 'msdos.sys', 'command.com', 'config.sys', 'autoexec.bat',
+    '*/win.com', '*/system.ini', '*/win.ini', '*/system.cb',
+    '*/system/vmm32.vxd', '*/system/vmm32/*', '*/system/iosubsys/*',
+    '*/system/krnl386.exe', '*/system/kernel32.dll', '*/system/user.exe', '*/system/user32.dll',
+    '*/system/gdi.exe', '*/system/gdi32.dll', '*/system/advapi32.dll', '*/system/shell32.dll',
+    '*/system/comctl32.dll', '*/system/*.drv', '*/system/*.fon', '*/explorer.exe',
+]
 
 mpak_fs_type = FS_UNK
 
@@ -189,30 +312,275 @@ class fileInfo:
         self.dos_time = dos_time
 
 
+# A data block and all the files that have it as their contents.
+# The data itself is not kept, only a way to open the first file with it again (open_func), it gets
+# copied into the archive when that is written.
 class fileData:
-    def __init__(self, data: bytearray):
-        self.data = data
-        self.hash = hashlib.sha256()
-        self.hash.update(self.data)
+    def __init__(self, digest: bytes, size: int, open_func):
+        self.digest = digest
+        self.size = size
+        self.open_func = open_func
         self.files_with_this_data = list()
+        # (length, digest) of its content-defined chunks if it's a chunked entry, else None
+        self.chunks = None
     
     def add_file(self, filename: str, attribute, dos_date, dos_time):
         self.files_with_this_data.append(fileInfo(filename, attribute, dos_date, dos_time))
 
-def add_to_known_files(file_data_list: list, data:bytearray, filename, attribute, dos_date, dos_time):
-            
+# Known data blocks in archive order, indexed by their digest
+class knownFiles:
+    def __init__(self):
+        self.file_data_list = list()
+        # Digest -> newest data block with this digest. Older ones with the same digest are full.
+        self.by_digest = dict()
+        self.total_size = 0
+
+    def __len__(self):
+        return len(self.file_data_list)
+
+    def __iter__(self):
+        return iter(self.file_data_list)
+
+# Hashes a file in chunks, returns its digest and size
+def hash_file(open_func):
     hash = hashlib.sha256()
-    hash.update(data)
-    
-    for file_data in file_data_list:
-        if file_data.hash.digest() == hash.digest() and len(file_data.files_with_this_data) < MAX_FILES_PER_KNOWN_DATA:
-            file_data.add_file(filename, attribute, dos_date, dos_time)
-            return
+    size = 0
+
+    f = open_func()
+    try:
+        while True:
+            chunk = f.read(MPAK_CHUNK_SIZE)
+            if not chunk:
+                break
+            hash.update(chunk)
+            size += len(chunk)
+    finally:
+        f.close()
+
+    return hash.digest(), size
+
+# Copies the data of a data block from its source file to the archive
+def copy_file_data(out, file_data: fileData):
+    copied = 0
+
+    f = file_data.open_func()
+    try:
+        while copied < file_data.size:
+            chunk = f.read(min(MPAK_CHUNK_SIZE, file_data.size - copied))
+            if not chunk:
+                break
+            out.write(chunk)
+            copied += len(chunk)
+    finally:
+        f.close()
+
+    if copied != file_data.size:
+        raise RuntimeError(f'File "{file_data.files_with_this_data[0].filename}" changed while packing')
+
+# open_func: function without parameters that opens the file for binary reading
+def add_to_known_files(known: knownFiles, open_func, filename, attribute, dos_date, dos_time):
+    digest, size = hash_file(open_func)
+
+    file_data = known.by_digest.get(digest)
+
+    if file_data == None or len(file_data.files_with_this_data) >= MAX_FILES_PER_KNOWN_DATA:
+        # We don't know any files with this data block yet (or the known block is full), so we add a new one
+        file_data = fileData(digest, size, open_func)
+        known.by_digest[digest] = file_data
+        known.file_data_list.append(file_data)
+        known.total_size += size
+
+    file_data.add_file(filename, attribute, dos_date, dos_time)
+
+# Find the bytes of data after which a chunk can be cut. Returns one byte per byte of data, 0 where the gear hash has
+# the mask bits clear. Hashing byte by byte is far too slow in Python, so all positions are hashed at once with big
+# integers: each byte gets a 32 bit field with the mask bits of its gear value. Adding up copies of that shifted by
+# one field and one bit per earlier byte gives the hash in every field. The sums stay below 2^29, so no field carries
+# into the next one. The first bytes of data are hashed without the bytes before them.
+def cdc_cut_points(data: bytes) -> bytes:
+    fields = bytearray(4 * len(data))
+    fields[0::4] = data.translate(MPAK_CDC_GEAR_LOW)
+    fields[1::4] = data.translate(MPAK_CDC_GEAR_HIGH)
+    gear = int.from_bytes(fields, 'little')
+
+    # The copies are added up by doubling: copies holds the sum of count of them
+    hash, hashed = 0, 0
+    copies, count = gear, 1
+    remaining = MPAK_CDC_MASK_BITS
+
+    while remaining:
+        if remaining & 1:
+            hash += copies << (33 * hashed)
+            hashed += count
+        remaining >>= 1
+        if remaining:
+            copies += copies << (33 * count)
+            count *= 2
+
+    # Mask the fields, then adding the mask sets bit 13 of every field that isn't 0
+    mask = int.from_bytes(MPAK_CDC_MASK.to_bytes(4, 'little') * len(data), 'little')
+    hash = ((hash & mask) + mask) >> MPAK_CDC_MASK_BITS
+
+    return hash.to_bytes(4 * len(data), 'little')[0::4]
+
+# Cuts a file into content-defined chunks and returns their (length, digest) tuples. Where a chunk ends only depends
+# on the data just before that, so data that two files have in common mostly ends up in identical chunks, even if it
+# is at different offsets.
+def cdc_chunk_file(open_func):
+    chunks = []
+    buffer = b''
+    position = 0
+
+    f = open_func()
+    try:
+        while True:
+            data = f.read(MPAK_CHUNK_SIZE)
+            eof = not data
+            buffer = buffer[position:] + data
+            position = 0
+            cut_points = cdc_cut_points(buffer)
+
+            # Until the end of the file, a chunk is only cut once there is enough data for the longest one
+            while len(buffer) - position >= (1 if eof else MPAK_CDC_MAX_SIZE):
+                end = min(position + MPAK_CDC_MAX_SIZE, len(buffer))
+                cut = cut_points.find(0, position + MPAK_CDC_MIN_SIZE - 1, end)
+                length = (cut + 1 if cut >= 0 else end) - position
+                chunks.append((length, hashlib.sha256(buffer[position:position + length]).digest()))
+                position += length
+
+            if eof:
+                break
+    finally:
+        f.close()
+
+    return chunks
+
+# The installer's chunk cache, see the file format. It is simulated while packing, so chunks are only repeated
+# while the installer still has them. Reading chunked entries back, it keeps the chunk data like the installer does.
+class chunkCache:
+    def __init__(self, size: int, entries: int):
+        self.size = size
+        self.entries = entries
+        self.used = 0
+        self.chunks = deque()           # (number, digest, length, data), oldest first
+        self.by_digest = dict()         # Digest -> number of a cached chunk with it
+        self.next_number = 0
+
+    # Number of the cached chunk with this digest, None if there is none
+    def find(self, digest: bytes):
+        return self.by_digest.get(digest)
+
+    # Data of a cached chunk that was added with its data, None if it is not cached
+    def get(self, number: int):
+        index = number - self.chunks[0][0] if self.chunks else -1
+        return self.chunks[index][3] if 0 <= index < len(self.chunks) else None
+
+    # Add a new chunk, returns its number. digest can be None for chunks that are only looked up by number.
+    def add(self, digest: bytes, length: int, data: bytes = None) -> int:
+        while self.chunks and (self.used + length > self.size or len(self.chunks) >= self.entries):
+            number, old_digest, old_length, _ = self.chunks.popleft()
+            self.used -= old_length
+            if old_digest != None and self.by_digest.get(old_digest) == number:
+                del self.by_digest[old_digest]
+
+        number = self.next_number
+        self.next_number += 1
+        self.chunks.append((number, digest, length, data))
+        if digest != None:
+            self.by_digest[digest] = number
+        self.used += length
+        return number
+
+# File name without its directory, lower case, as compared by mercypak_plan_chunks
+def mercypak_base_name(filename: bytes) -> bytes:
+    return filename.replace(b'\\', b'/').rsplit(b'/', 1)[-1].lower()
+
+# Decide which data blocks become chunked entries: those that have chunks in common with other blocks (or repeat
+# chunks themselves) and actually repeat a cached chunk or provide one that is repeated later.
+#
+# Cutting data into chunks is the slow part of packing, so only blocks with a likely relative are cut: another block
+# with a file of the same name, like the revisions of one driver or the copies Windows keeps of some of its files.
+def mercypak_plan_chunks(known: knownFiles, cache_size: int, cache_entries: int):
+    chunk_counts = Counter()
+    block_names = dict()
+    name_counts = Counter()
+
+    for file_data in known:
+        if file_data.size >= MPAK_CHUNKED_MIN_FILE_SIZE:
+            block_names[id(file_data)] = set(mercypak_base_name(file.filename) for file in file_data.files_with_this_data)
+            name_counts.update(block_names[id(file_data)])
+
+    for file_data in known:
+        if any(name_counts[name] > 1 for name in block_names.get(id(file_data), ())):
+            file_data.chunks = cdc_chunk_file(file_data.open_func)
+            chunk_counts.update(digest for _, digest in file_data.chunks)
+
+    candidates = [file_data for file_data in known
+                  if file_data.chunks and any(chunk_counts[digest] > 1 for _, digest in file_data.chunks)]
+
+    # Dry run in archive order
+    cache = chunkCache(cache_size, cache_entries)
+    providers = dict()
+    useful = set()
+
+    for file_data in candidates:
+        for length, digest in file_data.chunks:
+            number = cache.find(digest)
+            if number == None:
+                providers[cache.add(digest, length)] = file_data
+            else:
+                useful.add(id(file_data))
+                useful.add(id(providers[number]))
+
+    for file_data in known:
+        if id(file_data) not in useful:
+            file_data.chunks = None
 
-    # We don't know any files with this data block yet, so we add a new one
-    new_file_data = fileData(data)
-    new_file_data.add_file(filename, attribute, dos_date, dos_time)
-    file_data_list.append(new_file_data)
+# Writes the chunks of a chunked entry, returns the number of bytes repeated from the cache
+def write_chunks(out, file_data: fileData, cache: chunkCache) -> int:
+    repeated = 0
+    out.write(struct.pack('<I', len(file_data.chunks)))
+
+    f = file_data.open_func()
+    try:
+        for length, digest in file_data.chunks:
+            data = f.read(length)
+
+            if hashlib.sha256(data).digest() != digest:
+                raise RuntimeError(f'File "{file_data.files_with_this_data[0].filename}" changed while packing')
+
+            number = cache.find(digest)
+
+            if number == None:
+                cache.add(digest, length)
+                out.write(struct.pack('<I', length))
+                out.write(data)
+            else:
+                out.write(struct.pack('<I', MERCYPAK_CHUNK_CACHED | number))
+                repeated += length
+    finally:
+        f.close()
+
+    return repeated
+
+# Archive path as matched against MPAK_ORDER_FIRST_BOOT
+def mercypak_order_path(filename: bytes) -> str:
+    return filename.decode().replace('\\', '/').lower()
+
+# Sort key for data blocks with the install locality order. Blocks are placed by their first file.
+def mercypak_install_order_key(file_data: fileData):
+    path = mercypak_order_path(file_data.files_with_this_data[0].filename)
+    directory, _, name = path.rpartition('/')
+    first_boot = any(fnmatch.fnmatchcase(path, pattern) for pattern in MPAK_ORDER_FIRST_BOOT)
+    return (not first_boot, directory, file_data.size > MPAK_ORDER_SMALL_FILE_SIZE, name)
+
+# Peak memory usage of this process in MB, None if unknown
+def peak_memory_mb():
+    if resource == None:
+        return None
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    # Bytes on macOS, KB everywhere else
+    return peak // (1024 * 1024) if sys.platform == 'darwin' else peak // 1024
 
 
 
@@ -231,6 +599,8 @@ def fattools_join(root: str, sub: str):
 # fattools_files: list of files in the fat32 image to get
 # fattools_dirs: list of dirs for fat32 image source - can be None, in this case the dirs will be infered from the file system.
 # local_files: optional list of local files to add as well
+# order: entry order policy (MERCYPAK_ORDER_*), anything but "as found" needs mercypak_v2 and makes a V3 file
+# chunked: store files that have parts in common with others as chunked entries, needs mercypak_v2 and makes a V3 file
 def mercypak_pack(
     output_file: str,
     fattools_dirtable: FAT.Dirtable = None, 
@@ -238,13 +608,25 @@ def mercypak_pack(
     fattools_dirs: list[str] = None,
     local_files: str = None,
     mercypak_v2: bool = False,
+    order: int = MERCYPAK_ORDER_AS_FOUND,
+    chunked: bool = False,
 ):
+    if order != MERCYPAK_ORDER_AS_FOUND and not mercypak_v2:
+        raise ValueError('Entry order policies need MercyPak V2')
+
+    if chunked and not mercypak_v2:
+        raise ValueError('Chunked entries need MercyPak V2')
+
+    v3 = order != MERCYPAK_ORDER_AS_FOUND or chunked
+
+    start_time = time.perf_counter()
+
     # Collect directory and file information
     dir_count = 0
     file_count = 0
     dir_info = []
 #    file_info = []
-    known_file_infos = list()
+    known_file_infos = knownFiles()
 
     ####################################
     # IMAGE FILES
@@ -266,10 +648,10 @@ def mercypak_pack(
             file_dos_attr = f.Entry.chDOSPerms
             file_dos_date = f.Entry.wMDate
             file_dos_time = f.Entry.wMTime
-            file_data = f.read()
             f.close()
 
-            add_to_known_files(known_file_infos, file_data, file_name.encode(), file_dos_attr, file_dos_date, file_dos_time)
+            open_func = lambda name=file_name: fattools_dirtable.open(name)
+            add_to_known_files(known_file_infos, open_func, file_name.encode(), file_dos_attr, file_dos_date, file_dos_time)
 
         if fattools_dirs:
             for dir_name in fattools_dirs:
@@ -298,23 +680,46 @@ def mercypak_pack(
                 file_dos_date = dos_date(file_stat.st_mtime)
                 file_dos_time = dos_time(file_stat.st_mtime)
                 file_dos_attr = getfatattr(file_abs_path)
-                with open(file_abs_path, 'rb') as f:
-                    file_data = f.read()
 
-                add_to_known_files(known_file_infos, file_data, file_rel_path.encode(), file_dos_attr, file_dos_date, file_dos_time)
+                open_func = lambda path=file_abs_path: open(path, 'rb')
+                add_to_known_files(known_file_infos, open_func, file_rel_path.encode(), file_dos_attr, file_dos_date, file_dos_time)
 
     print(f'{output_file}: known unique files: {len(known_file_infos)}, total files {file_count}')
 
+    if order == MERCYPAK_ORDER_INSTALL:
+        # Parents sort before their children, so directories can still be created in this order
+        dir_info.sort(key=lambda dir: mercypak_order_path(dir[0]))
+        known_file_infos.file_data_list.sort(key=mercypak_install_order_key)
+
+    # Chunks can only be repeated from the cache in the order the files are written, so this comes after sorting
+    if chunked:
+        mercypak_plan_chunks(known_file_infos, MPAK_CHUNK_CACHE_SIZE, MPAK_CHUNK_CACHE_ENTRIES)
+
+    chunk_cache = chunkCache(MPAK_CHUNK_CACHE_SIZE, MPAK_CHUNK_CACHE_ENTRIES)
+    chunked_count = 0
+    chunk_saved_size = 0
+
+    scan_time = time.perf_counter()
+
     # Write the archive
     with open(output_file, 'wb') as f:
         # Write file header
-        if mercypak_v2:
+        if v3:
+            f.write(MERCYPAK_V3_MAGIC)
+        elif mercypak_v2:
             f.write(MERCYPAK_V2_MAGIC)
         else:
             f.write(MERCYPAK_V1_MAGIC)
 
         f.write(struct.pack('<II', dir_count, file_count))
 
+        if v3:
+            extended_header = struct.pack('B', order)
+            if chunked:
+                extended_header += struct.pack('<BII', MERCYPAK_DATA_INLINE, MPAK_CHUNK_CACHE_SIZE, MPAK_CHUNK_CACHE_ENTRIES)
+            f.write(struct.pack('<H', len(extended_header)))
+            f.write(extended_header)
+
         # Write directory information
         for dir in dir_info:
             dir_rel_path, dir_mode = dir
@@ -324,7 +729,7 @@ def mercypak_pack(
 
         # Write file information
         for file_data in known_file_infos:
-            file_size = len(file_data.data)
+            file_size = file_data.size
 
             if file_size > 0xffffffff:
                 raise ValueError(f'File is too big.')
@@ -338,7 +743,8 @@ def mercypak_pack(
 
                 # MERCYPAK V2: Write redundant files only once. 
 
-                f.write(struct.pack('B', files_with_this_data_count))
+                flags = MERCYPAK_CHUNKED_ENTRY if file_data.chunks else 0
+                f.write(struct.pack('B', files_with_this_data_count | flags))
 
                 for file_info in file_data.files_with_this_data:
                     file_rel_path = file_info.filename
@@ -352,7 +758,13 @@ def mercypak_pack(
                     f.write(struct.pack('<HH', file_info.dos_date, file_info.dos_time))
 
                 f.write(struct.pack('<I', file_size))
-                f.write(file_data.data)
+
+                if file_data.chunks:
+                    # Each chunk costs its UINT32, and so does the chunk count
+                    chunk_saved_size += write_chunks(f, file_data, chunk_cache) - 4 * (len(file_data.chunks) + 1)
+                    chunked_count += 1
+                else:
+                    copy_file_data(f, file_data)
             
             else:
 
@@ -369,8 +781,275 @@ def mercypak_pack(
                     f.write(struct.pack('B', file_info.attribute & 0xff))
                     f.write(struct.pack('<HH', file_info.dos_date, file_info.dos_time))
                     f.write(struct.pack('<I', file_size))
-                    f.write(file_data.data)
+                    copy_file_data(f, file_data)
+
+        archive_size = f.tell()
+
+    end_time = time.perf_counter()
+    peak_mb = peak_memory_mb()
+
+    print(f'{output_file}: {archive_size} bytes ({known_file_infos.total_size} bytes unique data), '
+          f'scanned in {scan_time - start_time:.1f}s, written in {end_time - scan_time:.1f}s'
+          + (f', peak memory {peak_mb} MB' if peak_mb != None else ''))
+
+    if chunked:
+        print(f'{output_file}: {chunked_count} chunked files, {chunk_saved_size} bytes saved by repeating cached chunks')
+
+
+# One entry of a V2 / V3 file as read back by mercypak_read: its raw file records (count byte, names,
+# attributes, dates and times), and the size and position of its data in the file. For chunked entries,
+# offset is where the chunk count and chunks are.
+class packEntry:
+    def __init__(self, records: bytes, size: int, offset: int, chunked: bool):
+        self.records = records
+        self.size = size
+        self.offset = offset
+        self.chunked = chunked
+
+# The contents of a V2 / V3 file, without the file data itself
+class packContents:
+    def __init__(self, dir_count: int, file_count: int, dir_records: bytes, entries: list[packEntry],
+                 chunk_cache_size: int, chunk_cache_entries: int):
+        self.dir_count = dir_count
+        self.file_count = file_count
+        self.dir_records = dir_records
+        self.entries = entries
+        self.chunk_cache_size = chunk_cache_size
+        self.chunk_cache_entries = chunk_cache_entries
+
+# Read back the directories and entries of a V2 or V3 file with inline file data
+def mercypak_read(input_file: str) -> packContents:
+    with open(input_file, 'rb') as f:
+        magic = f.read(4)
+
+        if magic not in (MERCYPAK_V2_MAGIC, MERCYPAK_V3_MAGIC):
+            raise ValueError(f'{input_file} is not a MercyPak V2 / V3 file')
+
+        dir_count, file_count = struct.unpack('<II', f.read(8))
+        chunk_cache_size, chunk_cache_entries = 0, 0
+
+        if magic == MERCYPAK_V3_MAGIC:
+            extended_header_size, = struct.unpack('<H', f.read(2))
+            extended_header = f.read(extended_header_size)
+            if len(extended_header) > 1 and extended_header[1] != MERCYPAK_DATA_INLINE:
+                raise ValueError(f'{input_file} has no inline file data')
+            if len(extended_header) >= 10:
+                chunk_cache_size, chunk_cache_entries = struct.unpack('<II', extended_header[2:10])
+
+        dir_records = bytearray()
+        for _ in range(dir_count):
+            attribute_and_length = f.read(2)
+            dir_records += attribute_and_length + f.read(attribute_and_length[1])
+
+        entries = []
+        files = 0
+        while files < file_count:
+            flags_and_count = f.read(1)[0]
+            count = flags_and_count & ~MERCYPAK_CHUNKED_ENTRY
+            chunked = bool(flags_and_count & MERCYPAK_CHUNKED_ENTRY)
+            records = bytearray([flags_and_count])
+            for _ in range(count):
+                length = f.read(1)[0]
+                # Name, attribute, date, time
+                records += bytes([length]) + f.read(length + 5)
+            size, = struct.unpack('<I', f.read(4))
+            offset = f.tell()
+            if chunked:
+                chunk_count, = struct.unpack('<I', f.read(4))
+                for _ in range(chunk_count):
+                    chunk, = struct.unpack('<I', f.read(4))
+                    if not chunk & MERCYPAK_CHUNK_CACHED:
+                        f.seek(chunk, os.SEEK_CUR)
+            else:
+                f.seek(size, os.SEEK_CUR)
+            entries.append(packEntry(bytes(records), size, offset, chunked))
+            files += count
+
+    return packContents(dir_count, file_count, bytes(dir_records), entries, chunk_cache_size, chunk_cache_entries)
+
+# Hashes size bytes of an open file, starting at offset
+def hash_range(f, offset: int, size: int):
+    hash = hashlib.sha256()
+    f.seek(offset)
+
+    while size > 0:
+        chunk = f.read(min(MPAK_CHUNK_SIZE, size))
+        if not chunk:
+            raise RuntimeError(f'{f.name} is truncated')
+        hash.update(chunk)
+        size -= len(chunk)
+
+    return hash.digest()
+
+# Copies size bytes of an open file, starting at offset, to out
+def copy_range(out, f, offset: int, size: int):
+    f.seek(offset)
+
+    while size > 0:
+        chunk = f.read(min(MPAK_CHUNK_SIZE, size))
+        if not chunk:
+            raise RuntimeError(f'{f.name} is truncated')
+        out.write(chunk)
+        size -= len(chunk)
+
+# Writes the file data of a chunked entry of an open file to out, returns its digest. cache must have seen the chunked
+# entries before it, as the installer's chunk cache would have.
+def unchunk_entry(out, f, entry: packEntry, cache: chunkCache):
+    hash = hashlib.sha256()
+    start = out.tell()
+    f.seek(entry.offset)
+    chunk_count, = struct.unpack('<I', f.read(4))
+
+    for _ in range(chunk_count):
+        chunk, = struct.unpack('<I', f.read(4))
+
+        if chunk & MERCYPAK_CHUNK_CACHED:
+            data = cache.get(chunk & ~MERCYPAK_CHUNK_CACHED)
+            if data == None:
+                raise RuntimeError(f'{f.name} repeats a chunk that is not in the chunk cache')
+        else:
+            data = f.read(chunk)
+            cache.add(None, chunk, data)
+
+        out.write(data)
+        hash.update(data)
+
+    if out.tell() - start != entry.size:
+        raise RuntimeError(f'{f.name} has a chunked entry of the wrong size')
+
+    return hash.digest()
+
+# A piece of file data in the content pool
+class poolBlob:
+    def __init__(self, source: str, offset: int, size: int, first_use: tuple):
+        self.source = source            # File it is copied from, and where in there
+        self.offset = offset
+        self.size = size
+        self.first_use = first_use      # (pack index, entry index) of the first entry with this data
+        self.users = set()              # Indices of the packs with this data
+        self.pool_offset = 0
+
+# Move the file data of several V2 / V3 files into one content pool file. Data that is in more than one of them
+# ends up in the pool once. The files are rewritten as V3 files without file data of their own, with their entries
+# in pool order and the pool ranges with their data in the extended header.
+#
+# The pool is laid out so that each file's data is in as few ranges as possible: data used by all of the files comes
+# first, then data used by fewer and fewer of them, grouped by who uses it. Within a group, the data is in the order
+# of the first file that uses it, so that file keeps its entry order.
+#
+# Chunked entries are put back together and pooled like the others. A file that is chunked in one of the files can
+# be identical to one in the others, and only whole file data can be shared. The pooled files have no chunked entries.
+def mercypak_pool(input_files: list[str], pool_file: str):
+    start_time = time.perf_counter()
+    packs = [mercypak_read(input_file) for input_file in input_files]
+
+    # Entries are matched by their data. A file can have the same data in several entries (more identical files than
+    # fit into one), the n-th of them is matched with the n-th one in the other files.
+    blobs = dict()
+    pack_keys = []
+    total_size = 0
+    unchunked_files = []
+
+    for pack_index, (input_file, pack) in enumerate(zip(input_files, packs)):
+        keys = []
+        seen = Counter()
+        cache = chunkCache(pack.chunk_cache_size, pack.chunk_cache_entries)
+        unchunked_file = input_file + '.unchunked'
+        unchunked_files.append(unchunked_file)
+
+        with open(input_file, 'rb') as f, open(unchunked_file, 'wb') as unchunked:
+            for entry_index, entry in enumerate(pack.entries):
+                # The data of chunked entries is written out whole, the blob is copied from there
+                if entry.chunked:
+                    source, offset = unchunked_file, unchunked.tell()
+                    digest = unchunk_entry(unchunked, f, entry, cache)
+                else:
+                    source, offset = input_file, entry.offset
+                    digest = hash_range(f, entry.offset, entry.size)
+
+                key = (digest, seen[digest])
+                seen[digest] += 1
+
+                if key not in blobs:
+                    blobs[key] = poolBlob(source, offset, entry.size, (pack_index, entry_index))
+
+                blobs[key].users.add(pack_index)
+                keys.append(key)
+                total_size += entry.size
+
+        pack_keys.append(keys)
+
+    pool_order = sorted(blobs.values(), key=lambda blob: (-len(blob.users), sorted(blob.users), blob.first_use))
+
+    with open(pool_file, 'wb') as out:
+        out.write(MERCYPAK_POOL_MAGIC)
+        sources = dict()
+
+        try:
+            for blob in pool_order:
+                if blob.source not in sources:
+                    sources[blob.source] = open(blob.source, 'rb')
+                blob.pool_offset = out.tell()
+                copy_range(out, sources[blob.source], blob.offset, blob.size)
+        finally:
+            for source in sources.values():
+                source.close()
+            for unchunked_file in unchunked_files:
+                os.remove(unchunked_file)
+
+        pool_size = out.tell()
+
+    if pool_size > 0xffffffff:
+        raise ValueError(f'{pool_file} is too big.')
+
+    # Rewrite the files. The originals were only read, so they can be replaced now.
+    for input_file, pack, keys in zip(input_files, packs, pack_keys):
+        entries = sorted(((entry, blobs[key]) for entry, key in zip(pack.entries, keys)),
+                         key=lambda pair: pair[1].pool_offset)
+
+        ranges = []
+        for _, blob in entries:
+            if blob.size == 0:
+                continue
+            if ranges and ranges[-1][0] + ranges[-1][1] == blob.pool_offset:
+                ranges[-1][1] += blob.size
+            else:
+                ranges.append([blob.pool_offset, blob.size])
+
+        if not ranges:
+            # Nothing to put in the pool, the file stays as it is
+            continue
+
+        if len(ranges) > 0xffff:
+            raise ValueError(f'{input_file} needs too many content pool ranges.')
+
+        extended_header = struct.pack('<BBH', MERCYPAK_ORDER_POOL, MERCYPAK_DATA_POOL, len(ranges))
+        extended_header += b''.join(struct.pack('<II', offset, length) for offset, length in ranges)
+
+        temp_file = input_file + '.tmp'
+
+        with open(temp_file, 'wb') as f:
+            f.write(MERCYPAK_V3_MAGIC)
+            f.write(struct.pack('<II', pack.dir_count, pack.file_count))
+            f.write(struct.pack('<H', len(extended_header)))
+            f.write(extended_header)
+            f.write(pack.dir_records)
+
+            for entry, _ in entries:
+                f.write(bytes([entry.records[0] & ~MERCYPAK_CHUNKED_ENTRY]) + entry.records[1:])
+                f.write(struct.pack('<I', entry.size))
+
+            manifest_size = f.tell()
+
+        os.replace(temp_file, input_file)
+
+        print(f'{input_file}: {manifest_size} bytes, {sum(length for _, length in ranges)} bytes of file data '
+              f'in {len(ranges)} content pool ranges')
+
+    end_time = time.perf_counter()
 
+    print(f'{pool_file}: {pool_size} bytes for {total_size} bytes of file data, '
+          f'{total_size - (pool_size - len(MERCYPAK_POOL_MAGIC))} bytes saved, pooled in {end_time - start_time:.1f}s')
 
 
 def dos_date(mtime):
@@ -12,12 +12,18 @@ import platform
 import shutil
 import fnmatch
 import stat
+import time
+from concurrent.futures import ProcessPoolExecutor
 
 from FATtools import Volume, FAT
-from mercypak import mercypak_pack
-from drivercopy import driverCopy
+from mercypak import mercypak_pack, mercypak_pool, MERCYPAK_ORDER_INSTALL
+from drivercopy import driverCopy, DRIVER_INDEX_FILE
 from makeiso import makeIso
 from makeusb import makeUsb
+from imagelayout import getLayoutOrder
+from buildcache import BuildCache
+from creg import CregHive, CregError, CREG_ENCODING, dump_diff
+from blockdiff import blockdiff_write
 
 # Store the current working directory in a global variable
 cwd_stack = [os.getcwd()]
@@ -74,6 +80,31 @@ def append_line_to_file(filename, line):
     with open(filename, "a") as f:
         f.write(line + "\n")
 
+# Write the manifest of a file tree for the installer, so it doesn't have to scan the tree on the install media.
+# Directories are walked breadth first with their entries sorted by name, which is also the order in which
+# the ISO image writer lays out the file data. See installer/install_manifest.c for the format.
+def write_tree_manifest(tree_dir, manifest_file):
+    dir_lines = []
+    file_lines = []
+    pending = ['']
+
+    while pending:
+        relative = pending.pop(0)
+        current = os.path.join(tree_dir, relative)
+
+        for entry in sorted(os.listdir(current), key=str.upper):
+            entry_relative = f'{relative}/{entry}' if relative else entry
+
+            if os.path.isdir(os.path.join(current, entry)):
+                dir_lines.append(f'D {entry_relative}')
+                pending.append(entry_relative)
+            else:
+                file_lines.append(f'F {os.path.getsize(os.path.join(current, entry))} {entry_relative}')
+
+    with open(manifest_file, 'w', newline='\n') as f:
+        f.write('# QuickInstall file manifest\n')
+        f.write('\n'.join(dir_lines + file_lines) + '\n')
+
 def find_recursive_and_get_parent(fs: FAT.Dirtable, to_find):
     result = None
     for root, dirs, files in fs.walk():
@@ -202,12 +233,14 @@ def image_file_exists(fs: FAT.Dirtable, subdir, file):
 
 
 
-# Add registry file to a given windows installation and pack the registry with mercypak
-def registry_add_reg(fs: FAT.Dirtable, windir, reg_file, output_866_file):
+# Add registry file to a given windows installation's SYSTEM.DAT
+# regtmp is the temporary directory to do this in, the edited hive is left there. Returns its path relative to regtmp.
+# editor is 'regedit', 'creg' (edit the hive with creg.py, regedit only if it can't handle it) or 'compare' (both, the
+# build fails if their results differ, regedit's is used).
+def registry_add_reg(fs: FAT.Dirtable, windir, reg_file, regtmp, editor):
 #    osroot_windir_absolute = os.path.join(osroot_base, osroot_windir_relative)
 #    osroot_sysdir_absolute = case_insensitive_to_sensitive(osroot_windir_absolute, 'SYSTEM')
 
-    regtmp = os.path.join(script_base_path, '.regtmp')
     regtmp_windir = os.path.join(regtmp, windir)
 
     print('Processing system registry...')
@@ -232,13 +265,56 @@ def registry_add_reg(fs: FAT.Dirtable, windir, reg_file, output_866_file):
     append_line_to_file(tmp_reg_file, f'[HKEY_LOCAL_MACHINE\\Software\\Microsoft\\Windows\\CurrentVersion\\RunOnce]')
     append_line_to_file(tmp_reg_file, f'"QiSetup"="C:\\\\QISETUP.EXE"\n') # Post-setup handler
 
-    run_regedit(tmp_reg_file)
-    
+    hive = None
+    if editor != 'regedit':
+        try:
+            hive = CregHive.load(system_dat_out)
+            with open(tmp_reg_file, 'r', encoding=CREG_ENCODING) as f:
+                hive.apply_reg(f.read())
+        except CregError as e:
+            if editor == 'compare':
+                raise
+            print(f'Cannot edit {system_dat_in} directly ({e}), using regedit')
+            hive = None
+
+    if hive is None or editor == 'compare':
+        run_regedit(tmp_reg_file)
+
+    if editor == 'compare':
+        differences = dump_diff(CregHive.load(system_dat_out).dump(), CregHive(hive.serialize()).dump())
+        if differences:
+            raise CregError(f'creg.py and regedit give different results for {os.path.basename(reg_file)} '
+                            f'(- regedit, + creg.py):\n' + '\n'.join(differences[:50]))
+        print(f'{os.path.basename(reg_file)}: creg.py gives the same keys and values as regedit')
+    elif hive is not None:
+        hive.save(system_dat_out)
+
     os.remove(tmp_reg_file)
+    popd()
 
-    mercypak_pack(output_866_file, local_files=regtmp)
+    return os.path.relpath(system_dat_out, regtmp)
+
+# Makes the registry files: FASTPNP.866 with the registry for the default installation, which skips the legacy
+# hardware detection, and SLOWPNP.DIF, a patch that makes the registry for the full detection out of it.
+# Both come from the same SYSTEM.DAT, the patch is a lot smaller than a second copy of the registry.
+def produce_registry_files(fs: FAT.Dirtable, windir: str, input_registry: str, output_fastpnp_file: str, output_slowpnp_file: str,
+                           regtmp: str, editor: str):
+    fastpnp_tmp = os.path.join(regtmp, 'fastpnp')
+    slowpnp_tmp = os.path.join(regtmp, 'slowpnp')
+
+    fastpnp_hive = registry_add_reg(fs, windir, os.path.join(input_registry, 'fastpnp.reg'), fastpnp_tmp, editor)
+    slowpnp_hive = registry_add_reg(fs, windir, os.path.join(input_registry, 'slowpnp.reg'), slowpnp_tmp, editor)
+
+    mercypak_pack(output_fastpnp_file, local_files=fastpnp_tmp)
+
+    with open(os.path.join(fastpnp_tmp, fastpnp_hive), 'rb') as f:
+        base = f.read()
+    with open(os.path.join(slowpnp_tmp, slowpnp_hive), 'rb') as f:
+        target = f.read()
+
+    patch_size = blockdiff_write(output_slowpnp_file, fastpnp_hive, base, target)
+    print(f'Registry for the legacy hardware detection: {patch_size} bytes patch for a {len(target)} bytes hive')
 
-    popd()
     delete_recursive(regtmp)
 
 # Write system.ini file injecting CREGFIX device line in the 386enh section
@@ -262,8 +338,7 @@ def write_386enh_cregfix(system_ini_name: str, system_ini_lines: str):
 # Makes a CREGFIX.866 file that the installer can unpack to install CREGFIX
 # VXD for this was provided by SweetLow <3
 # sysdir is the path to the SYSTEM directory in the source image
-def produce_cregfix_files(fs: FAT.Dirtable, windir: str, sysdir: str, output_866_file: str):
-    output_cregfix_temp = '.cregfixtmp'
+def produce_cregfix_files(fs: FAT.Dirtable, windir: str, sysdir: str, output_866_file: str, output_cregfix_temp: str):
     output_system = os.path.join(output_cregfix_temp, sysdir)
 
     input_vxd = os.path.join('cregfix', 'cr0wpoff.vxd')
@@ -291,8 +366,7 @@ def produce_cregfix_files(fs: FAT.Dirtable, windir: str, sysdir: str, output_866
     mercypak_pack(output_866_file, local_files=output_cregfix_temp)
 
 # Creates a .866 file containing the LBA64/GPT support driver for this OSRoot
-def produce_lba64_files(fs: FAT.Dirtable, iosubsysdir: str, output_866_file: str, is_me_not_98: bool): 
-    output_lba64_temp = '.lba64tmp'
+def produce_lba64_files(fs: FAT.Dirtable, iosubsysdir: str, output_866_file: str, is_me_not_98: bool, output_lba64_temp: str): 
     output_iosubsys = os.path.join(output_lba64_temp, iosubsysdir)
 
     input_vxd1 = os.path.join('lba64', 'gpttsdrw.vxd')
@@ -321,20 +395,121 @@ def produce_lba64_files(fs: FAT.Dirtable, iosubsysdir: str, output_866_file: str
     mercypak_pack(output_866_file, local_files=output_lba64_temp)
 
 
+# Makes the FULL.866 file with all of the OS root's files, minus logs, temporary files and the registry,
+# plus the OEM info and the post setup handler
+def produce_full_files(fs: FAT.Dirtable, osroot_windir: str, osroot_infdir: str, osroot_sysdir: str, osroot_vmm32dir: str,
+                       osroot_iosubsysdir: str, input_oeminfo: str, input_postsetup: str, output_oemtmp: str, output_866_file: str):
+    # Get a list of all the files in the image
+    osroot_files, osroot_dirs = get_full_files_and_dirs_list(fs)
+
+    print(osroot_dirs)
+
+    remove_from_file_list_if_present(osroot_files, [osroot_infdir], 'mdm*.inf', ['mdmgen.inf'])
+    remove_from_file_list_if_present(osroot_files, [osroot_infdir], 'wdma_*.inf', ['wdma_usb.inf'])
+
+    remove_from_file_list_if_present(osroot_files, [osroot_windir], 'logow.sys')
+    remove_from_file_list_if_present(osroot_files, [osroot_windir], 'wininit.bak')
+    remove_from_file_list_if_present(osroot_files, [osroot_windir], 'hwinfo.dat')
+
+    remove_from_file_list_if_present(osroot_files, [osroot_windir], 'win386.swp')
+    remove_from_file_list_if_present(osroot_files, [osroot_windir], 'ndislog.txt')
+    remove_from_file_list_if_present(osroot_files, [osroot_windir], '*.log')
+    remove_from_file_list_if_present(osroot_files, [osroot_infdir], 'drv*.bin')
+
+    remove_from_file_list_if_present(osroot_files, [osroot_sysdir], 'license.txt')  # UNICOWS artifact
+    remove_from_file_list_if_present(osroot_files, [osroot_sysdir], 'redist.txt')   # UNICOWS artifact
+    remove_from_file_list_if_present(osroot_files, [osroot_sysdir], 'unicows.pdb')  # UNICOWS artifact
+
+    remove_from_file_list_if_present(osroot_files, [osroot_sysdir], '*.bak')        # Patch artifacts
+    remove_from_file_list_if_present(osroot_files, [osroot_vmm32dir], '*.bak')
+    remove_from_file_list_if_present(osroot_files, [osroot_iosubsysdir], '*.bak')
+    remove_from_file_list_if_present(osroot_files, [osroot_iosubsysdir], '*.b_k')
+    remove_from_file_list_if_present(osroot_files, [osroot_iosubsysdir], '*.bk')
+    
+    remove_from_file_list_if_present(osroot_files, [], 'logo.sys')
+    remove_from_file_list_if_present(osroot_files, [], 'win386.swp')
+    remove_from_file_list_if_present(osroot_files, [], 'bootlog.*')
+    remove_from_file_list_if_present(osroot_files, [], 'frunlog.txt')
+    remove_from_file_list_if_present(osroot_files, [], 'detlog.txt')
+    remove_from_file_list_if_present(osroot_files, [], 'setuplog.txt')
+    remove_from_file_list_if_present(osroot_files, [], 'scandisk.log')
+    remove_from_file_list_if_present(osroot_files, [], 'netlog.txt')
+    remove_from_file_list_if_present(osroot_files, [], 'suhdlog.dat')
+    remove_from_file_list_if_present(osroot_files, [], 'msdos.---')
+    remove_from_file_list_if_present(osroot_files, [], 'config.bak')
+    remove_from_file_list_if_present(osroot_files, [], 'autoexec.bak')
+    remove_from_file_list_if_present(osroot_files, [], 'io.bak')
+    remove_from_file_list_if_present(osroot_files, [], 'command.dos')
+    remove_from_file_list_if_present(osroot_files, [], 'videorom.bin')
+
+    # No need to pack the registry, it's already included in FASTPNP.866
+    remove_from_file_list_if_present(osroot_files, [osroot_windir], 'system.dat')
+
+
+    remove_tree_if_present(osroot_files, None, [osroot_windir, 'recent'])
+    remove_tree_if_present(osroot_files, None, [osroot_windir, 'temp'])
+    remove_tree_if_present(osroot_files, None, [osroot_windir, 'applog'])
+    remove_tree_if_present(osroot_files, None, [osroot_windir, 'sysbckup'])
+    remove_tree_if_present(osroot_files, None, [osroot_windir, 'other'])
+
+    remove_tree_if_present(osroot_files, None, ['recycled'])
+
+    remove_tree_if_present(osroot_files, None, [osroot_windir, 'temporary internet files'])
+    remove_tree_if_present(osroot_files, None, [osroot_windir, 'history'])
+    
+    # in case vhd was mounted in windows
+    remove_tree_if_present(osroot_files, osroot_dirs, ['system volume information'])
+    remove_tree_if_present(osroot_files, osroot_dirs, ['$recycle.bin'])
+
+    # Start from scratch, so nothing from another OS root ends up in here
+    delete_recursive(output_oemtmp)
+    tmp_system_dir = os.path.join(output_oemtmp, osroot_sysdir)
+    mkdir(tmp_system_dir)
+
+    # Copy oeminfo
+    if os.path.exists(input_oeminfo):
+        shutil.copy2(os.path.join(input_oeminfo, 'oeminfo.ini'), tmp_system_dir)
+        shutil.copy2(os.path.join(input_oeminfo, 'oemlogo.bmp'), tmp_system_dir)
+
+    # Copy post setup handler
+    shutil.copy2(os.path.join(input_postsetup, 'qisetup.exe'), output_oemtmp)
+
+    mercypak_pack(output_866_file, fs, osroot_files, osroot_dirs, local_files=output_oemtmp, mercypak_v2=True,
+                  order=MERCYPAK_ORDER_INSTALL, chunked=True)
+    
+    if not os.path.exists(output_866_file):
+        raise Exception('There was an error. The required OSROOT pack file was not created ("FULL.866")')
+
+
 from drivercopy import driverCopy
 
 # Preprocess the slipstream + extra drivers for this sysprep run
-def preprocess_drivers(output_base, input_drivers_base, input_drivers_extra):
+# drivers_base_digest is the digest of the base driver directory tree, for the build cache
+# The CAB files are compressed in the given process pool
+def preprocess_drivers(cache: BuildCache, output_base, input_drivers_base, input_drivers_extra, drivers_base_digest, pool):
     print('Preprocessing drivers...')
 
     # First do the extra drivers
-    print('Preprocessing EXTRA drivers...')
     output_drivers_extra = os.path.join(output_base, 'driver.ex')
-    driverCopy(input_drivers_extra, output_drivers_extra)
+    extra_key = cache.key('driver.ex', cache.tree_digest(input_drivers_extra))
+
+    if not cache.restore('Extra drivers', extra_key, [output_drivers_extra]):
+        print('Preprocessing EXTRA drivers...')
+        driverCopy(input_drivers_extra, output_drivers_extra, pool=pool)
+        cache.store(extra_key, [output_drivers_extra])
 
     # Prepare the base drivers. Later we need to finalize them for each OSRoot.
+    base_outputs = ['.driver_int', '.driver_int_ndis2']
+    base_key = cache.key('driver_int', drivers_base_digest)
+
+    # The NDIS2 drivers may be gone since the last run
+    delete_recursive('.driver_int_ndis2')
+
+    if cache.restore('Slipstreamed drivers', base_key, base_outputs):
+        return
+
     print('Preprocessing SLIPSTREAMED drivers...')
-    driverCopy(input_drivers_base, '.driver_int')
+    driverCopy(input_drivers_base, '.driver_int', indexName=DRIVER_INDEX_FILE, pool=pool)
 
     input_drivers_ndis2 = os.path.join(input_drivers_base, 'NDIS2')
     if os.path.exists(input_drivers_ndis2):
@@ -342,10 +517,12 @@ def preprocess_drivers(output_base, input_drivers_base, input_drivers_extra):
         # Use existing drivers as a base and add NDIS2 drivers to it
         os.makedirs('.driver_int_ndis2', exist_ok = True)
         shutil.copytree('.driver_int', '.driver_int_ndis2', dirs_exist_ok=True)
-        driverCopy(input_drivers_ndis2, '.driver_int_ndis2', deleteExisting=False)
+        driverCopy(input_drivers_ndis2, '.driver_int_ndis2', deleteExisting=False, indexName=DRIVER_INDEX_FILE, pool=pool)
+
+    cache.store(base_key, base_outputs)
 
 # Finalize the slipstream drivers for this sysprep run for a given OSRoot
-def finalize_drivers_for_osroot(output_base, output_osroot, osroot_cabdir_relative, is_win_me):
+def finalize_drivers_for_osroot(output_base, output_osroot, osroot_cabdir_relative, is_win_me, output_driver_temp):
     print('Finalizing drivers for this OSRoot...')
 
     # The problem is that the cab files need to be in the WinCD cabinet directory so
@@ -361,7 +538,6 @@ def finalize_drivers_for_osroot(output_base, output_osroot, osroot_cabdir_relati
         input_directories.append('.driver_int')
 
 
-    output_driver_temp = '.drvtmp_osroot'
     driver_temp_cabdir = os.path.join(output_driver_temp, osroot_cabdir_relative)
     driver_temp_infdir = os.path.join(output_driver_temp, 'DRIVER')
     output_866_file = os.path.join(output_osroot, 'DRIVER.866')
@@ -383,240 +559,326 @@ def finalize_drivers_for_osroot(output_base, output_osroot, osroot_cabdir_relati
                 # Move the file to the CAB directory
                 shutil.copy(full_path, os.path.join(driver_temp_cabdir, file_name))
 
-    mercypak_pack(output_866_file, local_files=output_driver_temp)
+    # Driver packages come in many revisions of the same files
+    mercypak_pack(output_866_file, local_files=output_driver_temp, mercypak_v2=True, chunked=True)
 
-#############################################################################
-#
-# MAIN FUNCTION STARTS HERE!!!
-#
-#############################################################################
-
-# create an argument parser with options, parse and extract them
-parser = argparse.ArgumentParser(description='Windows 98 QuickInstall Image Creation Script', formatter_class=argparse.ArgumentDefaultsHelpFormatter)
-parser.add_argument('--iso', type=str, help='Target filename for output ISO file')
-parser.add_argument('--usb', type=str, help='Target filename for output USB image file')
-parser.add_argument('--osroot',nargs=2, metavar=('PATH', 'LABEL'), action='append', required=True,
-    help='Path to an OS root image and its label (can be specified multiple times)')
-parser.add_argument('--extra', type=str, action='append', help='Path to extra files to be added to the output image\'s "extras" directory (can be specified multiple times)', default=['_EXTRA_CD_FILES_'])
-parser.add_argument('--drivers', type=str, help='Path to base drivers to slipstream.', default='_DRIVER_')
-parser.add_argument('--extradrivers', type=str, help='Path to drivers to be added to the output image\'s "driver.ex" directory. These are *NOT* slipstreamed.', default='_EXTRA_DRIVER_')
-parser.add_argument('--verbose', type=bool, help='Be verbose (show output of subprocesses)', default=False)
-
-args = parser.parse_args()
-
-# extract the values of the command-line options
-output_image_iso = args.iso
-output_image_usb = args.usb
-
-if output_image_iso is not None:
-    output_image_iso = os.path.abspath(output_image_iso)
-
-if output_image_usb is not None:
-    output_image_usb = os.path.abspath(output_image_usb)
-
-input_osroots = args.osroot
-input_extras = args.extra
-input_drivers_base = os.path.abspath(args.drivers)
-input_drivers_extra = os.path.abspath(args.extradrivers)
-
-if args.verbose:
-    global_stdout = None
-
-# add the default value to the extras list if it's not already there
-if '_EXTRA_CD_FILES_' not in input_extras:
-    input_extras.append('_EXTRA_CD_FILES_')
-
-script_dir = os.path.dirname(os.path.abspath(__file__))
-output_base = os.path.join(script_dir, '_OUTPUT_')
-output_osroots_base = os.path.join(output_base, 'osroots')
-output_regtmp = os.path.join(script_dir, '.regtmp')
-output_oemtmp = os.path.join(script_dir, '.oemtmp')
-output_extras = os.path.join(output_base, 'extras')
-input_cdromroot = os.path.join(script_dir, 'cdromroot')
-input_oeminfo = os.path.join(script_dir, '_OEMINFO_')
-input_postsetup = os.path.join(script_dir, 'postsetup')
-
-print('Output root directory: ' + str(output_base))
-print('Output image ISO: ' + str(output_image_iso))
-print('Output image USB: ' + str(output_image_usb))
-print('Input OS roots: ' + str(input_osroots))
-print('Input Extra files: ' + str(input_extras))
-print('Input Base Drivers: ' + str(input_drivers_base))
-print('Input Extra Drivers: ' + str(input_drivers_extra))
-
-shutil.rmtree(output_base, ignore_errors=True)
-
-mkdir(output_base)
-mkdir(output_regtmp)
-mkdir(output_oemtmp)
-
-# Preprocess drivers
-preprocess_drivers(output_base, input_drivers_base, input_drivers_extra)
-
-# Process all OSroots.
-osroot_idx = 1
-
-for osroot, osroot_name in input_osroots:
-
-    osroot = os.path.realpath(osroot)
-    print(f'Processing OS Root image file: "{osroot}"')
-    output_osroot = os.path.join(output_osroots_base, str(osroot_idx))
-    mkdir(output_osroot)
-    
-    # Give the OSRoot a name for the installer menu
-    with open(os.path.join(output_osroot, 'win98qi.inf'), 'w', newline='\n') as labelFile:
-        labelFile.write(f'{osroot_name}\n')
-
-    root = Volume.vopen(osroot, 'r+b', what='partition0')
-    fs = Volume.openvolume(root)
-
-    osroot_windir = get_win_dir(fs)
-    osroot_cabdir = get_cab_dir(fs)
-
-    print(osroot_windir)
-    osroot_infdir = case_insensitive_to_sensitive(fs, osroot_windir, 'inf')
-    osroot_sysdir = case_insensitive_to_sensitive(fs, osroot_windir, 'system')
-    osroot_vmm32dir = case_insensitive_to_sensitive(fs, osroot_sysdir, 'vmm32')
-    osroot_iosubsysdir = case_insensitive_to_sensitive(fs, osroot_sysdir, 'iosubsys')
-
-    if osroot_windir is None:
+    # The PCI ID index goes next to DRIVER.866 so the installer can pick drivers for the detected hardware
+    for input_dir in input_directories:
+        index_file = os.path.join(input_dir, DRIVER_INDEX_FILE)
+        if os.path.exists(index_file):
+            shutil.copy(index_file, os.path.join(output_osroot, DRIVER_INDEX_FILE))
+
+# FATtools volumes opened by this (worker) process, one per OS root image
+worker_volumes = dict()
+
+# Set up a worker process of the sysprep process pool
+def init_worker(verbose: bool):
+    global global_stdout
+    if verbose:
+        global_stdout = None
+
+# Open an OS root image, or get the volume this process already opened for it
+def open_osroot(osroot: str) -> FAT.Dirtable:
+    if osroot not in worker_volumes:
+        root = Volume.vopen(osroot, 'r+b', what='partition0')
+        worker_volumes[osroot] = Volume.openvolume(root)
+    return worker_volumes[osroot]
+
+# Find out where things are in an OS root image and what OS it is.
+# Runs in a worker process, returns a dict with the results and the time it took.
+def scan_osroot(osroot: str):
+    start = time.perf_counter()
+    fs = open_osroot(osroot)
+    info = dict()
+
+    info['windir'] = get_win_dir(fs)
+    info['cabdir'] = get_cab_dir(fs)
+
+    if info['windir'] is None:
         raise ValueError("Could not find WIN.COM in directory tree")
 
-    if osroot_cabdir is None:
+    if info['cabdir'] is None:
         raise ValueError("Could not find CAB files in directory tree")
 
-    print(f'Windows directory: {osroot_windir}')
-    print(f'Windows CAB directory: {osroot_cabdir}')
+    info['infdir'] = case_insensitive_to_sensitive(fs, info['windir'], 'inf')
+    info['sysdir'] = case_insensitive_to_sensitive(fs, info['windir'], 'system')
+    info['vmm32dir'] = case_insensitive_to_sensitive(fs, info['sysdir'], 'vmm32')
+    info['iosubsysdir'] = case_insensitive_to_sensitive(fs, info['sysdir'], 'iosubsys')
+
+    print(f'{osroot}: Windows directory: {info["windir"]}')
+    print(f'{osroot}: Windows CAB directory: {info["cabdir"]}')
 
     # Check OS type
     if find_recursive_and_get_parent(fs, 'WIN98_60.CAB') and not find_recursive_and_get_parent(fs, 'WIN_22.CAB'):
-        print('OS is Windows 98 (SE)')
-        is_win_me = False
+        print(f'{osroot}: OS is Windows 98 (SE)')
+        info['is_win_me'] = False
     elif find_recursive_and_get_parent(fs, 'WIN_22.CAB') and not find_recursive_and_get_parent(fs, 'WIN98_60.CAB'):
-        print('OS is Windows Millennium Edition (you poor soul)')
-        is_win_me = True
+        print(f'{osroot}: OS is Windows Millennium Edition (you poor soul)')
+        info['is_win_me'] = True
     else:
         raise Exception(f'Cannot determine OS type (98 / ME)!')
-    
-    # Process registry
-    fastpnp_reg = os.path.join(script_dir, 'registry', 'fastpnp.reg')
-    fastpnp_866 = os.path.join(output_osroot, 'FASTPNP.866')
-    slowpnp_reg = os.path.join(script_dir, 'registry', 'slowpnp.reg')
-    slowpnp_866 = os.path.join(output_osroot, 'SLOWPNP.866')
 
-    registry_add_reg(fs, osroot_windir, slowpnp_reg, slowpnp_866)
-    registry_add_reg(fs, osroot_windir, fastpnp_reg, fastpnp_866)
+    return info, time.perf_counter() - start
+
+# Build one of the files for an OS root (see the artifact list in main) in temp_dir.
+# Runs in a worker process, returns the time it took.
+def build_osroot_artifact(kind: str, osroot: str, info: dict, output_866_file: str, temp_dir: str, registry_editor: str):
+    start = time.perf_counter()
+    fs = open_osroot(osroot)
+
+    if kind == 'registry':
+        produce_registry_files(fs, info['windir'], os.path.join(script_base_path, 'registry'), output_866_file,
+                               os.path.join(os.path.dirname(output_866_file), 'SLOWPNP.DIF'), temp_dir, registry_editor)
+    elif kind == 'cregfix':
+        produce_cregfix_files(fs, info['windir'], info['sysdir'], output_866_file, temp_dir)
+    elif kind == 'lba64':
+        produce_lba64_files(fs, info['iosubsysdir'], output_866_file, info['is_win_me'], temp_dir)
+    elif kind == 'full':
+        produce_full_files(fs, info['windir'], info['infdir'], info['sysdir'], info['vmm32dir'], info['iosubsysdir'],
+                           os.path.join(script_base_path, '_OEMINFO_'), os.path.join(script_base_path, 'postsetup'),
+                           temp_dir, output_866_file)
+    elif kind == 'driver':
+        finalize_drivers_for_osroot(None, os.path.dirname(output_866_file), info['cabdir'], info['is_win_me'], temp_dir)
+    else:
+        raise ValueError(f'Unknown OS root artifact {kind}')
 
-    # Process CREGFIX
-    cregfix_866 = os.path.join(output_osroot, 'CREGFIX.866')
-    produce_cregfix_files(fs, osroot_windir, osroot_sysdir, cregfix_866)
+    delete_recursive(temp_dir)
+    return time.perf_counter() - start
 
-    # Process LBA64/GPT drivers
-    lba64_866 = os.path.join(output_osroot, 'LBA64.866')
-    produce_lba64_files(fs, osroot_iosubsysdir, lba64_866, is_win_me)
+# Add time spent on a stage to the timing summary
+def add_stage_time(stage_times: dict, stage: str, seconds: float):
+    jobs, total = stage_times.get(stage, (0, 0.0))
+    stage_times[stage] = (jobs + 1, total + seconds)
 
-    # Get a list of all the files in the image
-    osroot_files, osroot_dirs = get_full_files_and_dirs_list(fs)
+def print_stage_times(stage_times: dict, total_seconds: float):
+    print('Stage timings (stages done in parallel are summed up over all their jobs):')
+    for stage, (jobs, seconds) in stage_times.items():
+        print(f'  {stage:<28} {seconds:8.1f}s' + (f' ({jobs} jobs)' if jobs > 1 else ''))
+    print(f'  {"Total (wall clock)":<28} {total_seconds:8.1f}s')
 
-    print(osroot_dirs)
+#############################################################################
+#
+# MAIN FUNCTION STARTS HERE!!!
+#
+#############################################################################
 
-    remove_from_file_list_if_present(osroot_files, [osroot_infdir], 'mdm*.inf', ['mdmgen.inf'])
-    remove_from_file_list_if_present(osroot_files, [osroot_infdir], 'wdma_*.inf', ['wdma_usb.inf'])
+def main():
+    global global_stdout
+
+    start_time = time.perf_counter()
+    stage_times = dict()
+
+    # create an argument parser with options, parse and extract them
+    parser = argparse.ArgumentParser(description='Windows 98 QuickInstall Image Creation Script', formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+    parser.add_argument('--iso', type=str, help='Target filename for output ISO file')
+    parser.add_argument('--usb', type=str, help='Target filename for output USB image file')
+    parser.add_argument('--osroot',nargs=2, metavar=('PATH', 'LABEL'), action='append', required=True,
+        help='Path to an OS root image and its label (can be specified multiple times)')
+    parser.add_argument('--extra', type=str, action='append', help='Path to extra files to be added to the output image\'s "extras" directory (can be specified multiple times)', default=['_EXTRA_CD_FILES_'])
+    parser.add_argument('--drivers', type=str, help='Path to base drivers to slipstream.', default='_DRIVER_')
+    parser.add_argument('--extradrivers', type=str, help='Path to drivers to be added to the output image\'s "driver.ex" directory. These are *NOT* slipstreamed.', default='_EXTRA_DRIVER_')
+    parser.add_argument('--verbose', type=bool, help='Be verbose (show output of subprocesses)', default=False)
+    parser.add_argument('--no-cache', action='store_true', help='Build everything from scratch, without using or updating the build cache')
+    parser.add_argument('--registry-editor', choices=['regedit', 'creg', 'compare'], default='regedit',
+        help='How to apply the .reg files to SYSTEM.DAT: regedit, creg.py, or both, failing if their results differ. '
+             'creg.py is not the default until its hives have been boot tested on real Windows 98/ME installations')
+    parser.add_argument('--jobs', type=int, help='Number of worker processes', default=os.cpu_count())
+
+    args = parser.parse_args()
+
+    # extract the values of the command-line options
+    output_image_iso = args.iso
+    output_image_usb = args.usb
+
+    if output_image_iso is not None:
+        output_image_iso = os.path.abspath(output_image_iso)
+
+    if output_image_usb is not None:
+        output_image_usb = os.path.abspath(output_image_usb)
+
+    input_osroots = args.osroot
+    input_extras = args.extra
+    input_drivers_base = os.path.abspath(args.drivers)
+    input_drivers_extra = os.path.abspath(args.extradrivers)
+
+    if args.verbose:
+        global_stdout = None
+
+    # add the default value to the extras list if it's not already there
+    if '_EXTRA_CD_FILES_' not in input_extras:
+        input_extras.append('_EXTRA_CD_FILES_')
+
+    script_dir = os.path.dirname(os.path.abspath(__file__))
+    output_base = os.path.join(script_dir, '_OUTPUT_')
+    output_osroots_base = os.path.join(output_base, 'osroots')
+    output_temp = os.path.join(script_dir, '.tmp')
+    output_extras = os.path.join(output_base, 'extras')
+    input_cdromroot = os.path.join(script_dir, 'cdromroot')
+    input_oeminfo = os.path.join(script_dir, '_OEMINFO_')
+    input_postsetup = os.path.join(script_dir, 'postsetup')
+    input_regedit = os.path.join(script_dir, 'registry', 'regedit.exe')
+    input_msdos = os.path.join(script_dir, 'registry', 'msdos.exe')
+    cache_dir = os.path.join(script_dir, '.cache')
+
+    print('Output root directory: ' + str(output_base))
+    print('Output image ISO: ' + str(output_image_iso))
+    print('Output image USB: ' + str(output_image_usb))
+    print('Input OS roots: ' + str(input_osroots))
+    print('Input Extra files: ' + str(input_extras))
+    print('Input Base Drivers: ' + str(input_drivers_base))
+    print('Input Extra Drivers: ' + str(input_drivers_extra))
+
+    shutil.rmtree(output_base, ignore_errors=True)
+    delete_recursive(output_temp)
+
+    mkdir(output_base)
+    mkdir(output_temp)
+
+    # Everything that is produced gets cached, keyed by the digests of its inputs and of the scripts producing it
+    stage_start = time.perf_counter()
+    cache = BuildCache(cache_dir, [os.path.join(script_dir, f) for f in ['sysprep.py', 'mercypak.py', 'drivercopy.py', 'buildcache.py', 'creg.py', 'blockdiff.py']],
+                       enabled=not args.no_cache)
+
+    drivers_base_digest = cache.tree_digest(input_drivers_base)
+    regedit_digest = cache.key('regedit', cache.file_digest(input_regedit), cache.file_digest(input_msdos))
+
+    # Find out what needs to be built for the OSroots, restore the rest from the cache.
+    osroots = []
+
+    for osroot_idx, (osroot, osroot_name) in enumerate(input_osroots, 1):
+        osroot = os.path.realpath(osroot)
+        output_osroot = os.path.join(output_osroots_base, str(osroot_idx))
+        mkdir(output_osroot)
+
+        # Give the OSRoot a name for the installer menu
+        with open(os.path.join(output_osroot, 'win98qi.inf'), 'w', newline='\n') as labelFile:
+            labelFile.write(f'{osroot_name}\n')
+
+        slowpnp_reg = os.path.join(script_dir, 'registry', 'slowpnp.reg')
+        fastpnp_reg = os.path.join(script_dir, 'registry', 'fastpnp.reg')
+
+        # Everything the image is used for, as (label, cache key, outputs). Things derived from the image, like
+        # its Windows directory or OS type, are covered by its digest, so none of this needs the image opened.
+        # The first output is the one built by build_osroot_artifact, it also names the stage in the timing summary.
+        osroot_digest = cache.file_digest(osroot)
+        osroot_artifacts = {
+            'registry': (f'Registry for "{osroot_name}"',
+                         cache.key('FASTPNP.866', osroot_digest, regedit_digest, args.registry_editor, cache.file_digest(fastpnp_reg),
+                                   cache.file_digest(slowpnp_reg)),
+                         [os.path.join(output_osroot, 'FASTPNP.866'), os.path.join(output_osroot, 'SLOWPNP.DIF')]),
+            'cregfix': (f'CREGFIX.866 for "{osroot_name}"',
+                        cache.key('CREGFIX.866', osroot_digest, cache.tree_digest('cregfix')),
+                        [os.path.join(output_osroot, 'CREGFIX.866')]),
+            'lba64':   (f'LBA64.866 for "{osroot_name}"',
+                        cache.key('LBA64.866', osroot_digest, cache.tree_digest('lba64')),
+                        [os.path.join(output_osroot, 'LBA64.866')]),
+            'full':    (f'FULL.866 for "{osroot_name}"',
+                        cache.key('FULL.866', osroot_digest, cache.tree_digest(input_oeminfo),
+                                  cache.file_digest(os.path.join(input_postsetup, 'qisetup.exe'))),
+                        [os.path.join(output_osroot, 'FULL.866')]),
+            'driver':  (f'DRIVER.866 for "{osroot_name}"',
+                        cache.key('DRIVER.866', osroot_digest, drivers_base_digest),
+                        [os.path.join(output_osroot, 'DRIVER.866'), os.path.join(output_osroot, DRIVER_INDEX_FILE)]),
+        }
+
+        osroot_missing = [name for name, (label, key, outputs) in osroot_artifacts.items() if not cache.restore(label, key, outputs)]
+        osroots.append((osroot_idx, osroot, osroot_artifacts, osroot_missing))
+
+    add_stage_time(stage_times, 'Cache lookup', time.perf_counter() - stage_start)
+
+    # Everything that takes a while runs in a process pool. Every worker opens the OS root images itself.
+    with ProcessPoolExecutor(max_workers=max(1, args.jobs), initializer=init_worker, initargs=(args.verbose,)) as pool:
+
+        scan_jobs = []
+
+        for osroot_idx, osroot, osroot_artifacts, osroot_missing in osroots:
+            if osroot_missing:
+                print(f'Processing OS Root image file: "{osroot}"')
+                scan_jobs.append(pool.submit(scan_osroot, osroot))
+            else:
+                scan_jobs.append(None)
 
-    remove_from_file_list_if_present(osroot_files, [osroot_windir], 'logow.sys')
-    remove_from_file_list_if_present(osroot_files, [osroot_windir], 'wininit.bak')
-    remove_from_file_list_if_present(osroot_files, [osroot_windir], 'hwinfo.dat')
+        # The drivers are needed for DRIVER.866, they are preprocessed while the images are scanned
+        stage_start = time.perf_counter()
+        preprocess_drivers(cache, output_base, input_drivers_base, input_drivers_extra, drivers_base_digest, pool)
+        add_stage_time(stage_times, 'Driver preprocessing', time.perf_counter() - stage_start)
 
-    remove_from_file_list_if_present(osroot_files, [osroot_windir], 'win386.swp')
-    remove_from_file_list_if_present(osroot_files, [osroot_windir], 'ndislog.txt')
-    remove_from_file_list_if_present(osroot_files, [osroot_windir], '*.log')
-    remove_from_file_list_if_present(osroot_files, [osroot_infdir], 'drv*.bin')
+        # Build all missing OSroot files in parallel
+        build_jobs = []
 
-    remove_from_file_list_if_present(osroot_files, [osroot_sysdir], 'license.txt')  # UNICOWS artifact
-    remove_from_file_list_if_present(osroot_files, [osroot_sysdir], 'redist.txt')   # UNICOWS artifact
-    remove_from_file_list_if_present(osroot_files, [osroot_sysdir], 'unicows.pdb')  # UNICOWS artifact
+        for (osroot_idx, osroot, osroot_artifacts, osroot_missing), scan_job in zip(osroots, scan_jobs):
+            if not scan_job:
+                continue
 
-    remove_from_file_list_if_present(osroot_files, [osroot_sysdir], '*.bak')        # Patch artifacts
-    remove_from_file_list_if_present(osroot_files, [osroot_vmm32dir], '*.bak')
-    remove_from_file_list_if_present(osroot_files, [osroot_iosubsysdir], '*.bak')
-    remove_from_file_list_if_present(osroot_files, [osroot_iosubsysdir], '*.b_k')
-    remove_from_file_list_if_present(osroot_files, [osroot_iosubsysdir], '*.bk')
-    
-    remove_from_file_list_if_present(osroot_files, [], 'logo.sys')
-    remove_from_file_list_if_present(osroot_files, [], 'win386.swp')
-    remove_from_file_list_if_present(osroot_files, [], 'bootlog.*')
-    remove_from_file_list_if_present(osroot_files, [], 'frunlog.txt')
-    remove_from_file_list_if_present(osroot_files, [], 'detlog.txt')
-    remove_from_file_list_if_present(osroot_files, [], 'setuplog.txt')
-    remove_from_file_list_if_present(osroot_files, [], 'scandisk.log')
-    remove_from_file_list_if_present(osroot_files, [], 'netlog.txt')
-    remove_from_file_list_if_present(osroot_files, [], 'suhdlog.dat')
-    remove_from_file_list_if_present(osroot_files, [], 'msdos.---')
-    remove_from_file_list_if_present(osroot_files, [], 'config.bak')
-    remove_from_file_list_if_present(osroot_files, [], 'autoexec.bak')
-    remove_from_file_list_if_present(osroot_files, [], 'io.bak')
-    remove_from_file_list_if_present(osroot_files, [], 'command.dos')
-    remove_from_file_list_if_present(osroot_files, [], 'videorom.bin')
+            info, seconds = scan_job.result()
+            add_stage_time(stage_times, 'OS root scan', seconds)
 
-    # No need to pack the registry, it's already included in SLOWPNP and FASTPNP
-    remove_from_file_list_if_present(osroot_files, [osroot_windir], 'system.dat')
+            for kind in osroot_missing:
+                label, key, outputs = osroot_artifacts[kind]
+                temp_dir = os.path.join(output_temp, f'{osroot_idx}.{kind}')
+                build_jobs.append((key, outputs, pool.submit(build_osroot_artifact, kind, osroot, info, outputs[0], temp_dir,
+                                                                         args.registry_editor)))
 
+        for key, outputs, build_job in build_jobs:
+            add_stage_time(stage_times, os.path.basename(outputs[0]), build_job.result())
+            cache.store(key, outputs)
 
-    remove_tree_if_present(osroot_files, None, [osroot_windir, 'recent'])
-    remove_tree_if_present(osroot_files, None, [osroot_windir, 'temp'])
-    remove_tree_if_present(osroot_files, None, [osroot_windir, 'applog'])
-    remove_tree_if_present(osroot_files, None, [osroot_windir, 'sysbckup'])
-    remove_tree_if_present(osroot_files, None, [osroot_windir, 'other'])
+    delete_recursive(output_temp)
 
-    remove_tree_if_present(osroot_files, None, ['recycled'])
+    # The variants usually have most of their files in common, their FULL.866 files share one content pool.
+    # This works on the output files, the cache keeps the FULL.866 files as they were built.
+    if len(osroots) > 1:
+        stage_start = time.perf_counter()
+        print('Pooling the file data of all OS roots...')
+        mercypak_pool([os.path.join(output_osroots_base, str(osroot_idx), 'FULL.866') for osroot_idx, *_ in osroots],
+                      os.path.join(output_osroots_base, 'POOL.866'))
+        add_stage_time(stage_times, 'Content pool', time.perf_counter() - stage_start)
 
-    remove_tree_if_present(osroot_files, None, [osroot_windir, 'temporary internet files'])
-    remove_tree_if_present(osroot_files, None, [osroot_windir, 'history'])
-    
-    # in case vhd was mounted in windows
-    remove_tree_if_present(osroot_files, osroot_dirs, ['system volume information'])
-    remove_tree_if_present(osroot_files, osroot_dirs, ['$recycle.bin'])
+    # Copy CDROM Root stuff
+    stage_start = time.perf_counter()
+    print('Copying installation image base files...')
+    shutil.copytree(input_cdromroot, output_base, dirs_exist_ok=True)
 
-    tmp_system_dir = os.path.join(output_oemtmp, osroot_sysdir)
-    mkdir(tmp_system_dir)
+    # Copy extra CD files.
+    print('Copying extra CD files...')
 
-    # Copy oeminfo
-    if os.path.exists(input_oeminfo):
-        shutil.copy2(os.path.join(input_oeminfo, 'oeminfo.ini'), tmp_system_dir)
-        shutil.copy2(os.path.join(input_oeminfo, 'oemlogo.bmp'), tmp_system_dir)
+    for extradir in input_extras:
+        shutil.copytree(extradir, output_extras, dirs_exist_ok=True)
 
-    # Copy post setup handler
-    shutil.copy2(os.path.join(input_postsetup, 'qisetup.exe'), output_oemtmp)
+    # Ship manifests for the plain file trees, so the installer can copy them without scanning
+    print('Writing file tree manifests...')
 
-    output_osroot_full866 = os.path.join(output_osroot, 'FULL.866')
-    mercypak_pack(output_osroot_full866, fs, osroot_files, osroot_dirs, local_files=output_oemtmp, mercypak_v2=True)
-    
-    if not os.path.exists(output_osroot_full866):
-        raise Exception('There was an error. The required OSROOT pack file was not created ("FULL.866")')
+    for tree in ['driver.ex', 'extras']:
+        tree_dir = os.path.join(output_base, tree)
+        if os.path.isdir(tree_dir):
+            write_tree_manifest(tree_dir, tree_dir + '.lst')
 
-    finalize_drivers_for_osroot(output_base, output_osroot, osroot_cabdir, is_win_me)
+    add_stage_time(stage_times, 'Extra files', time.perf_counter() - stage_start)
 
-    osroot_idx += 1
+    cache.finish()
 
-# Copy CDROM Root stuff
-print('Copying installation image base files...')
-shutil.copytree(input_cdromroot, output_base, dirs_exist_ok=True)
+    print(f'Sysprep complete, output is in "{output_base}"')
 
-# Copy extra CD files.
-print('Copying extra CD files...')
+    # Create output images
 
-for extradir in input_extras:
-    shutil.copytree(extradir, output_extras, dirs_exist_ok=True)
+    # The installer reads the .866 files one after another, the images keep them together in that order
+    layout_order = getLayoutOrder(output_base)
 
-print(f'Sysprep complete, output is in "{output_base}"')
+    label = None
+    if output_image_iso is not None:
+        if label is None:
+            label = 'QuickInstall'
+        stage_start = time.perf_counter()
+        makeIso(output_base, output_image_iso, 'cdrom.img', label, layout_order)
+        add_stage_time(stage_times, 'ISO image', time.perf_counter() - stage_start)
 
-# Create output images
+    if output_image_usb is not None:
+        stage_start = time.perf_counter()
+        makeUsb(output_base, output_image_usb, layout_order)
+        add_stage_time(stage_times, 'USB image', time.perf_counter() - stage_start)
 
-label = None
-if output_image_iso is not None:
-    if label is None:
-        label = 'QuickInstall'
-    makeIso(output_base, output_image_iso, 'cdrom.img', label)
+    print_stage_times(stage_times, time.perf_counter() - start_time)
 
-if output_image_usb is not None:
-    makeUsb(output_base, output_image_usb)
+# The process pool's workers import this script too, they must not run it
+if __name__ == '__main__':
+    main()